@@ -0,0 +1,48 @@
+# Writes the kernel file INPUT into OUTPUT as the C string NAME, with every #include "name" line replaced by the file it names.
+# cmake -DINPUT=<kernel file> -DOUTPUT=<C file> -DNAME=<symbol> -P embed_kernel.cmake
+
+set(MAX_KERNEL_INCLUDE_DEPTH 16)
+
+# Included names are relative to the file including them, the same as read_kernel_file
+function(expand_kernel_includes path depth result)
+  if(depth GREATER MAX_KERNEL_INCLUDE_DEPTH)
+    message(FATAL_ERROR "Kernel includes nested too deep in ${path}")
+  endif()
+
+  get_filename_component(dir "${path}" DIRECTORY)
+  file(READ "${path}" text)
+
+  # Only a directive at the start of a line, after blanks, is expanded, as read_kernel_file does.
+  # ^ only matches at the start of the text, so the newline before the line is part of the match and is kept.
+  string(REGEX MATCHALL "(^|\n)[ \t]*#include[ \t]+\"[^\"\n]+\"[^\n]*" includes "${text}")
+  foreach(include IN LISTS includes)
+    set(line_start "")
+    if(include MATCHES "^\n")
+      set(line_start "\n")
+    endif()
+    string(REGEX REPLACE "^\n?[ \t]*#include[ \t]+\"([^\"\n]+)\".*$" "\\1" name "${include}")
+    math(EXPR next_depth "${depth} + 1")
+    expand_kernel_includes("${dir}/${name}" ${next_depth} included)
+    # the line's own newline follows the match
+    string(REGEX REPLACE "\n$" "" included "${included}")
+    string(REPLACE "${include}" "${line_start}${included}" text "${text}")
+  endforeach()
+
+  set(${result} "${text}" PARENT_SCOPE)
+endfunction()
+
+expand_kernel_includes("${INPUT}" 0 kernel_src)
+
+# hex bytes instead of a string literal, so no escaping and no limit on the length of a literal
+file(WRITE "${OUTPUT}.cl" "${kernel_src}")
+file(READ "${OUTPUT}.cl" hex HEX)
+file(REMOVE "${OUTPUT}.cl")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+# sixteen bytes a line, the regular expressions of cmake have no {n}
+set(row "")
+foreach(i RANGE 15)
+  set(row "${row}0x[0-9a-f][0-9a-f],")
+endforeach()
+string(REGEX REPLACE "(${row})" "\\1\n  " hex "${hex}")
+
+file(WRITE "${OUTPUT}" "// Generated from ${INPUT} by embed_kernel.cmake\n\nconst char ${NAME}[] = {\n  ${hex}0x00\n};\n")
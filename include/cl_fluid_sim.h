@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #ifdef __APPLE__
   #include <OpenCL/opencl.h>
@@ -16,19 +17,70 @@
 //  #include <GL/glut.h>
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The kernel sources compiled into the library by cmake/embed_kernel.cmake, with their includes expanded
+extern const char fluid_kernel_src[];
+extern const char fluid_kernel_3d_src[];
+
 #define KB 1024
-#define MAX_KERNEL_FILE_SIZE (20 * KB)
+// How deep kernel files may #include each other
+#define MAX_KERNEL_INCLUDE_DEPTH 16
 #define MAX_DENSITY 1
 #define RUN_BAD_DIFFUSE 0
 #define MAX_NUM_SIMULTANEOUS_EVENTS 10
 #define MAX_DT 0.05f
+// Frames enqueued but not done before the host waits for the oldest one
+#define MAX_FRAMES_IN_FLIGHT 2
 
 #define PREV 0
 #define CUR 1
 
 #define NUM_SAMPLES 10
 
+// Obstacles are tracked per tile of OBSTACLE_TILE_SIZE x OBSTACLE_TILE_SIZE cells so kernels can skip the mask where it does not matter
+#define OBSTACLE_TILE_SIZE 32
+
+// In sparse mode only tiles of ACTIVE_TILE_SIZE x ACTIVE_TILE_SIZE cells that hold some fluid are simulated
+#define ACTIVE_TILE_SIZE 16
+#define DEFAULT_DENSITY_THRESHOLD 0.0001f
+#define DEFAULT_VELOCITY_THRESHOLD 0.0001f
+
+// In single dispatch mode one work-group runs the whole frame, which only pays off while launches cost more than the work.
+// It is used while the grid has at most this many cells per work item of the largest group simulate_frame can run,
+// so 256 x 256 with 1024 work items.
+#define MAX_SINGLE_DISPATCH_CELLS_PER_ITEM 64
+
+// A relaxation stops once its residual is below the tolerance, checked after sweeps 1, 2, 4, 8... and the last one.
+// The residual of a diffusion is the largest change of a cell in a sweep, and that of the pressure the largest divergence left,
+// in the units of the divergence view. A tolerance of 0 always runs every sweep.
+#define DEFAULT_DIFFUSE_TOLERANCE 1e-5f
+#define DEFAULT_PROJECT_TOLERANCE 1e-2f
+
+// Entries of the buffer each relaxation keeps its progress in
+#define SOLVE_DONE 0
+#define SOLVE_RESIDUAL 1
+#define SOLVE_SWEEPS 2
+// the largest change in the last checked sweep, as float bits
+#define SOLVE_LAST_RESIDUAL 3
+#define SOLVE_ENTRIES 4
+
+// Entries of the per-frame measures, see get_fluid_measures
+#define MEASURE_MASS 0
+#define MEASURE_ENERGY 1
+#define MEASURE_DIVERGENCE 2
+#define NUM_MEASURES 3
+
+// Pooled buffers are rounded up to one of POOL_BUCKET_STEPS sizes between each power of two
+#define POOL_MIN_BUFFER_SIZE 256
+#define POOL_BUCKET_STEPS 4
+#define NUM_POOL_BUCKETS (48 * POOL_BUCKET_STEPS)
+
 #define check_error(err, str) check_for_error(err, str, __FILE__, __LINE__)
+// Keeps the first failure of fluid->err in fluid->status instead of exiting
+#define check_fluid_error(fluid, str) record_fluid_error(fluid, str, __FILE__, __LINE__)
 
 typedef enum FLAGS
 {
@@ -36,6 +88,16 @@ typedef enum FLAGS
   F_USE_CPU = 0b0010,
   F_USE_GPU = 0b0100,
   F_DEBUG   = 0b1000,
+  F_SPARSE  = 0b10000,
+  F_SINGLE_DISPATCH = 0b100000,
+  F_OWN_QUEUES = 0b1000000,
+  F_FP64 = 0b10000000,
+  F_MEASURE = 0b100000000,
+  // the velocity runs on a grid of half or a quarter the size and is upsampled for the density
+  F_HALF_VELOCITY = 0b1000000000,
+  F_QUARTER_VELOCITY = 0b10000000000,
+  // every edge wraps around and the stencils read across it, so the relaxations need no set_bnd between sweeps
+  F_PERIODIC = 0b100000000000,
 } FLAGS;
 
 typedef enum VEC_TYPE
@@ -46,9 +108,134 @@ typedef enum VEC_TYPE
   IS_VELOCITY,
   IS_U_VELOCITY,
   IS_V_VELOCITY,
+  IS_W_VELOCITY,
   IS_NONE
 } VEC_TYPE;
 
+typedef enum OBSTACLE_TILE
+{
+  TILE_FLUID, // no solid cells in the tile or next to it
+  TILE_MIXED,
+  TILE_SOLID, // every cell in the tile is solid
+} OBSTACLE_TILE;
+
+// What the framebuffer shows, everything but the default two density colours goes through the view LUT
+typedef enum VIEW_FIELD
+{
+  VIEW_DENSITY_COLORS,
+  VIEW_DENSITY, // both densities added together
+  VIEW_SPEED,
+  VIEW_VORTICITY,
+  VIEW_DIVERGENCE,
+} VIEW_FIELD;
+
+// The Gauss-Seidel relaxations of a frame, each one converges at its own pace
+typedef enum RELAXATION
+{
+  RELAX_VELOCITY_DIFFUSE,
+  RELAX_PRESSURE,
+  RELAX_ADVECTED_PRESSURE, // the projection after the velocity is advected
+  RELAX_DENSITY_DIFFUSE,
+  NUM_RELAXATIONS,
+} RELAXATION;
+
+// The markers a frame is timed between on the device while metrics are exported
+typedef enum FRAME_MARKER
+{
+  MARK_FRAME_BEGIN,
+  MARK_VELOCITY_DONE, // only with the velocity and density steps as separate launches
+  MARK_DENSITY_ADVECTED,
+  MARK_FRAME_DONE,
+  NUM_FRAME_MARKERS,
+} FRAME_MARKER;
+
+typedef enum ADVECTION_SCHEME
+{
+  ADVECT_SEMI_LAGRANGIAN,
+  ADVECT_MACCORMACK,
+  ADVECT_BFECC,
+} ADVECTION_SCHEME;
+
+// How the coarse velocity grid is sampled for the density, see F_HALF_VELOCITY
+typedef enum UPSAMPLING
+{
+  UPSAMPLE_BILINEAR,
+  UPSAMPLE_BICUBIC, // Catmull-Rom
+} UPSAMPLING;
+
+// What lies past an edge of the grid, see set_boundaries
+typedef enum BOUNDARY
+{
+  BOUNDARY_WALL, // reflects the velocity
+  BOUNDARY_PERIODIC, // wraps around to the opposite edge, which has to be periodic too
+  BOUNDARY_OUTFLOW, // zero gradient with no pressure, lets the flow out or, next to a source, in
+} BOUNDARY;
+
+typedef enum EDGE
+{
+  EDGE_LEFT,
+  EDGE_RIGHT,
+  EDGE_TOP,
+  EDGE_BOTTOM,
+  NUM_EDGES,
+} EDGE;
+
+// How the tracer particles are moved along the velocity
+typedef enum PARTICLE_INTEGRATOR
+{
+  INTEGRATE_RK2, // midpoint
+  INTEGRATE_RK4,
+} PARTICLE_INTEGRATOR;
+
+typedef struct pooled_buffer_t
+{
+  cl_mem mem;
+  struct pooled_buffer_t * next;
+} PooledBuffer;
+
+typedef struct fluid_program_t
+{
+  char * options;
+  cl_program program;
+  struct fluid_program_t * next;
+} FluidProgram;
+
+// The parts of a simulation that are worth keeping between simulations: the context and queue,
+// the program built for each simulation size and a pool of free buffers
+typedef struct fluid_context_t
+{
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue command_queue;
+  cl_command_queue density_queue;
+
+  char * kernel_src;
+  size_t kernel_src_size;
+  FluidProgram * programs;
+
+  int is_using_opengl;
+  int is_host_unified;
+  // device is a sub-device made for this context, see create_fluid_context_in_domain
+  int owns_device;
+
+  // free buffers by size bucket
+  PooledBuffer * free_buffers[NUM_POOL_BUCKETS];
+
+  size_t pool_hits;
+  size_t pool_misses;
+  size_t allocated_bytes;
+  size_t peak_allocated_bytes;
+
+  // guards the programs and the pool, simulations in one context can run on different threads
+  pthread_mutex_t lock;
+} FluidContext;
+
+// see frame_encoder.h
+struct frame_encoder_t;
+
+// see metrics_exporter.h
+struct metrics_exporter_t;
+
 typedef struct source_event_list_t
 {
   cl_int x[MAX_NUM_SIMULTANEOUS_EVENTS];
@@ -60,61 +247,230 @@ typedef struct source_event_list_t
 
 typedef struct fluid_sim_t
 {
+  // shared with other simulations unless owns_shared is set
+  FluidContext * shared;
+  int owns_shared;
+
   cl_context context;
+  // the queues of the shared context unless owns_queues is set
   cl_command_queue command_queue;
+  cl_command_queue density_queue;
+  int owns_queues;
+  // the queue the steps enqueue on, command_queue for velocity and density_queue for density
+  cl_command_queue queue;
   cl_program program;
 
+  // the result of the last OpenCL call, and the first one that failed
+  cl_int err;
+  cl_int status;
+
   cl_kernel add_event_sources_kernel;
   cl_kernel add_source_kernel;
+  cl_kernel add_forces_kernel;
   cl_kernel set_bnd_kernel;
   cl_kernel diffuse_bad_kernel;
   cl_kernel diffuse_kernel;
   cl_kernel advect_kernel;
+  cl_kernel advect_maccormack_kernel;
+  cl_kernel advect_bfecc_kernel;
+  cl_kernel advect_clamped_kernel;
   cl_kernel project_a_kernel;
+  cl_kernel advect_project_a_kernel;
   cl_kernel project_b_kernel;
   cl_kernel project_c_kernel;
-  cl_kernel make_framebuffer_kernel;
+  cl_kernel render_view_kernel;
+  cl_kernel add_source_tiled_kernel;
+  cl_kernel diffuse_tiled_kernel;
+  cl_kernel advect_tiled_kernel;
+  cl_kernel advect_maccormack_tiled_kernel;
+  cl_kernel advect_bfecc_tiled_kernel;
+  cl_kernel advect_clamped_tiled_kernel;
+  cl_kernel make_framebuffer_tiled_kernel;
+  cl_kernel render_view_rgba_kernel;
+  cl_kernel make_framebuffer_rgba_tiled_kernel;
+  cl_kernel mark_active_tiles_kernel;
+  cl_kernel compact_active_tiles_kernel;
+  cl_kernel simulate_frame_kernel;
+  cl_kernel check_residual_kernel;
+  cl_kernel set_bnd_sweep_kernel;
+  cl_kernel measure_fields_kernel;
+  cl_kernel sum_measures_kernel;
+  cl_kernel upsample_velocity_kernel;
+  cl_kernel downsample_density_kernel;
+  cl_kernel emit_particles_kernel;
+  cl_kernel advect_particles_kernel;
+  cl_kernel count_particles_kernel;
+  cl_kernel scan_particle_cells_kernel;
+  cl_kernel scatter_particles_kernel;
+  cl_kernel draw_particles_kernel;
+  cl_kernel draw_particles_rgba_kernel;
 
   int profile;
   int is_using_opengl;
+  int is_sparse;
+  int is_single_dispatch;
+  // the fields hold doubles with F_FP64, real_size is the size of one value
+  int is_fp64;
+  size_t real_size;
+  int is_measuring;
+
+  // The BOUNDARY of each edge, packed two bits an edge in EDGE order for the set_bnd kernel.
+  // With is_periodic the stencils wrap around and the set_bnd of each relaxation sweep is skipped.
+  BOUNDARY boundaries[NUM_EDGES];
+  cl_int boundary_modes;
+  int is_periodic;
+
+  // With a coarse velocity grid the velocity step runs on velocity_sim, which is velocity_scale times smaller,
+  // and velocity_mem holds its velocity upsampled to this grid for the density, the views and the measures.
+  struct fluid_sim_t * velocity_sim;
+  int velocity_scale;
+  UPSAMPLING velocity_upsampling;
 
   cl_event add_event_sources_event;
   cl_event add_source_event;
+  cl_event add_forces_event;
   cl_event set_bnd_event;
   cl_event diffuse_bad_event;
   cl_event diffuse_event;
   cl_event advect_event;
+  cl_event advect_maccormack_event;
+  cl_event advect_bfecc_event;
+  cl_event advect_clamped_event;
   cl_event project_a_event;
+  cl_event advect_project_a_event;
   cl_event project_b_event;
   cl_event project_c_event;
   cl_event make_framebuffer_event;
+  cl_event mark_active_tiles_event;
+  cl_event compact_active_tiles_event;
+  cl_event simulate_frame_event;
+  cl_event check_residual_event;
+  cl_event set_bnd_sweep_event;
+  cl_event measure_fields_event;
+  cl_event sum_measures_event;
+  cl_event upsample_velocity_event;
+  cl_event downsample_density_event;
+  cl_event emit_particles_event;
+  cl_event advect_particles_event;
+  cl_event count_particles_event;
+  cl_event scan_particle_cells_event;
+  cl_event scatter_particles_event;
+  cl_event draw_particles_event;
+
+  // Orders the two queues. Each frame the density queue waits for the sources and then for the velocity before advecting,
+  // and the next frame's sources wait for the density to be advected and drawn.
+  cl_event sources_added_event;
+  cl_event velocity_done_event;
+  cl_event density_advected_event;
+  cl_event frame_done_event;
+  // frame_done_event of the last MAX_FRAMES_IN_FLIGHT frames, the oldest at next_frame_slot
+  cl_event frames_in_flight[MAX_FRAMES_IN_FLIGHT];
+  int next_frame_slot;
 
   size_t calls_to_add_event_sources;
   size_t calls_to_add_source;
+  size_t calls_to_add_forces;
   size_t calls_to_set_bnd;
   size_t calls_to_diffuse_bad;
   size_t calls_to_diffuse;
   size_t calls_to_advect;
+  size_t calls_to_advect_maccormack;
+  size_t calls_to_advect_bfecc;
+  size_t calls_to_advect_clamped;
   size_t calls_to_project_a;
+  size_t calls_to_advect_project_a;
   size_t calls_to_project_b;
   size_t calls_to_project_c;
   size_t calls_to_make_framebuffer;
+  size_t calls_to_mark_active_tiles;
+  size_t calls_to_compact_active_tiles;
+  size_t calls_to_simulate_frame;
+  size_t calls_to_check_residual;
+  size_t calls_to_set_bnd_sweep;
+  size_t calls_to_measure_fields;
+  size_t calls_to_sum_measures;
+  size_t calls_to_upsample_velocity;
+  size_t calls_to_downsample_density;
+  size_t calls_to_emit_particles;
+  size_t calls_to_advect_particles;
+  size_t calls_to_sort_particles;
+  size_t calls_to_draw_particles;
 
   size_t cur_sample;
   cl_ulong add_event_sources_samples[NUM_SAMPLES];
   cl_ulong add_source_samples[NUM_SAMPLES];
+  cl_ulong add_forces_samples[NUM_SAMPLES];
   cl_ulong set_bnd_samples[NUM_SAMPLES];
   cl_ulong diffuse_bad_samples[NUM_SAMPLES];
   cl_ulong diffuse_samples[NUM_SAMPLES];
   cl_ulong advect_samples[NUM_SAMPLES];
+  cl_ulong advect_maccormack_samples[NUM_SAMPLES];
+  cl_ulong advect_bfecc_samples[NUM_SAMPLES];
+  cl_ulong advect_clamped_samples[NUM_SAMPLES];
   cl_ulong project_a_samples[NUM_SAMPLES];
+  cl_ulong advect_project_a_samples[NUM_SAMPLES];
   cl_ulong project_b_samples[NUM_SAMPLES];
   cl_ulong project_c_samples[NUM_SAMPLES];
   cl_ulong make_framebuffer_samples[NUM_SAMPLES];
+  cl_ulong mark_active_tiles_samples[NUM_SAMPLES];
+  cl_ulong compact_active_tiles_samples[NUM_SAMPLES];
+  cl_ulong simulate_frame_samples[NUM_SAMPLES];
+  cl_ulong check_residual_samples[NUM_SAMPLES];
+  cl_ulong set_bnd_sweep_samples[NUM_SAMPLES];
+  cl_ulong measure_fields_samples[NUM_SAMPLES];
+  cl_ulong sum_measures_samples[NUM_SAMPLES];
+  cl_ulong upsample_velocity_samples[NUM_SAMPLES];
+  cl_ulong downsample_density_samples[NUM_SAMPLES];
+  cl_ulong emit_particles_samples[NUM_SAMPLES];
+  cl_ulong advect_particles_samples[NUM_SAMPLES];
+  cl_ulong count_particles_samples[NUM_SAMPLES];
+  cl_ulong scan_particle_cells_samples[NUM_SAMPLES];
+  cl_ulong scatter_particles_samples[NUM_SAMPLES];
+  cl_ulong draw_particles_samples[NUM_SAMPLES];
 
   cl_mem density_mem[2];
   cl_mem velocity_mem[2];
+  // scratch field for the extra passes of the higher order advection schemes
+  cl_mem advect_mem;
   cl_mem framebuffer;
+  size_t framebuffer_width;
+  size_t framebuffer_height;
+
+  // the view is drawn at the size of the framebuffer or encoder, whatever the simulation size
+  VIEW_FIELD view_field;
+  cl_mem view_lut_mem;
+  float view_min;
+  float view_max;
+
+  // off-screen frames are rendered into frame_mem and read back for the encoder
+  struct frame_encoder_t * encoder;
+  cl_mem frame_mem;
+
+  // Counters for the metrics exporter, NULL unless one is set. One frame at a time keeps its markers
+  // until it has run, the frames simulated in the meantime go untimed so reading them never waits.
+  struct metrics_exporter_t * metrics;
+  cl_event frame_markers[NUM_FRAME_MARKERS];
+
+  // one bit per interior cell, packed along x
+  cl_mem obstacle_mem;
+  // one OBSTACLE_TILE per tile
+  cl_mem obstacle_tiles_mem;
+  // host copies so updates only upload what changed
+  cl_uint * obstacle_bits;
+  cl_uchar * obstacle_tiles;
+  size_t obstacle_words;
+  size_t num_obstacle_tiles;
+
+  // one flag per tile, set when the tile holds fluid
+  cl_mem active_mem;
+  // compacted list of the tiles to simulate this frame and its length
+  cl_mem active_tiles_mem;
+  cl_mem num_active_tiles_mem;
+  cl_uint num_active_tiles;
+  size_t active_tiles_per_row;
+  size_t tile_local_size[2];
+  float density_threshold;
+  float velocity_threshold;
 
   cl_mem source_x;
   cl_mem source_y;
@@ -129,6 +485,7 @@ typedef struct fluid_sim_t
   size_t full_local_size;
   size_t set_bnd_global_size;
   size_t set_bnd_local_size;
+  size_t single_dispatch_local_size;
 
   size_t buffer_size;
 
@@ -137,19 +494,162 @@ typedef struct fluid_sim_t
   SourceEventList u_velocity_events;
   SourceEventList v_velocity_events;
 
-  int num_relaxation_steps;
+  // add_event_sources uploads a copy of each list without waiting, so enqueue_event can refill the list straight away.
+  // The copies of a VEC_TYPE take turns, and one is only overwritten once its last upload has completed.
+  SourceEventList staged_events[IS_NONE][MAX_FRAMES_IN_FLIGHT];
+  cl_event staged_uploads[IS_NONE][MAX_FRAMES_IN_FLIGHT];
+  int next_staged_events[IS_NONE];
+
+  // the most sweeps each relaxation may take, see set_relaxation
+  int max_diffuse_steps;
+  int max_project_steps;
+  float diffuse_tolerance;
+  float project_tolerance;
+
+  // Each relaxation reads its progress back without waiting, and the sweeps past convergence return straight away.
+  // solve_budgets is how many sweeps the next one enqueues: a run that did not converge doubles it up to the cap,
+  // and one that did lowers it by a sweep per run towards half as many again as it took.
+  cl_mem solve_mem[NUM_RELAXATIONS];
+  cl_uint solve_results[NUM_RELAXATIONS][SOLVE_ENTRIES];
+  cl_event solve_read_events[NUM_RELAXATIONS];
+  int solve_sweeps[NUM_RELAXATIONS];
+  int solve_converged[NUM_RELAXATIONS];
+  int solve_budgets[NUM_RELAXATIONS];
+  float solve_residuals[NUM_RELAXATIONS];
+
+  // With F_MEASURE each frame sums the density and the kinetic energy and finds the largest divergence after the projection.
+  // Every work-group reduces its cells into NUM_MEASURES reals of measure_partials_mem, and one more group folds those
+  // into measures_mem, which is read back into measure_results without waiting. measure_results holds floats unless is_fp64.
+  cl_mem measure_partials_mem;
+  cl_mem measures_mem;
+  size_t num_measure_partials;
+  size_t measure_local_size;
+  cl_double measure_results[NUM_MEASURES];
+  cl_event measures_read_event;
+
+  // Tracer particles, see set_particles. particle_mem[CUR] holds the particles and num_particles_mem their count.
+  // Once a frame the live ones are counting sorted by cell into particle_mem[PREV] and the buffers swap, which drops the dead.
+  // The count is read back without waiting, and the launches cover particle_bound, the last count read plus what was emitted since.
+  size_t max_particles;
+  int particles_per_event;
+  float particle_lifetime;
+  PARTICLE_INTEGRATOR particle_integrator;
+  cl_mem particle_mem[2];
+  cl_mem num_particles_mem;
+  // the live particles in each cell, the slot each cell starts at and the rank of each particle in its cell
+  cl_mem particle_counts_mem;
+  cl_mem particle_starts_mem;
+  cl_mem particle_ranks_mem;
+  size_t particle_scan_local_size;
+  size_t particle_bound;
+  size_t particles_emitted_since_read;
+  cl_uint particle_count;
+  cl_event particle_count_read_event;
+  cl_uint particle_seed;
 
   float diffusion_rate;
   float viscosity;
+
+  ADVECTION_SCHEME density_advection;
+  ADVECTION_SCHEME velocity_advection;
+
+  float vorticity_confinement;
+  float buoyancy;
 } FluidSim;
 
+// Builds the kernels embedded in the library, or those in kernel_filename if it is not NULL.
+// Returns NULL if no device, context or queue could be made
+FluidContext * create_fluid_context(const char * kernel_filename, int use_opengl, FLAGS flags);
+
+// How many NUMA domains the device picked by flags can be split into with clCreateSubDevices, 0 if it cannot be
+cl_uint count_fluid_domains(FLAGS flags);
+
+// Like create_fluid_context, on the sub-device of one NUMA domain of the device. The kernels of the simulations in it
+// only run on the cores of that domain, so the buffers they touch first stay in its memory. Returns NULL if there is no such domain.
+FluidContext * create_fluid_context_in_domain(const char * kernel_filename, FLAGS flags, cl_uint domain);
+
+void destroy_fluid_context(FluidContext * shared);
+
+cl_program get_fluid_program(FluidContext * shared, const char * options);
+
+// Buffers come back at least size bytes long and keep whatever they held before
+cl_mem acquire_buffer(FluidContext * shared, size_t size, cl_int * status);
+
+void release_buffer(FluidContext * shared, cl_mem mem);
+
+// Releases every free buffer in the pool
+void trim_buffer_pool(FluidContext * shared);
+
+void print_buffer_pool_stats(FluidContext * shared);
+
 FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags);
 
+// A simulation with a context of its own on one NUMA domain of the device, see create_fluid_context_in_domain
+FluidSim * create_fluid_sim_in_domain(cl_uint domain, const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags);
+
+// window_texture can only be used if shared was created for OpenGL. With F_OWN_QUEUES the simulation makes queues of its own,
+// so simulations in one context can each be driven by their own thread. Returns NULL if it could not be created.
+FluidSim * create_fluid_sim_in_context(FluidContext * shared, GLuint window_texture, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags);
+
 void destroy_fluid_sim(FluidSim * fluid);
 
-void enqueue_event(FluidSim * fluid, float x, float y, float s, float max_r, VEC_TYPE vec_type);
+cl_int set_advection_scheme(FluidSim * fluid, VEC_TYPE vec_type, ADVECTION_SCHEME scheme);
+
+// Reads SL, MAC or BFECC into scheme, returns 0 for any other name
+int parse_advection_scheme(const char * str, ADVECTION_SCHEME * scheme);
+
+void set_forces(FluidSim * fluid, float vorticity_confinement, float buoyancy);
+
+// Only has an effect with F_HALF_VELOCITY or F_QUARTER_VELOCITY
+cl_int set_velocity_upsampling(FluidSim * fluid, UPSAMPLING upsampling);
+
+// Caps the sweeps of the diffusions and the pressure projections, which start out at num_r_steps,
+// and sets the residual at which each stops early, see DEFAULT_PROJECT_TOLERANCE
+void set_relaxation(FluidSim * fluid, int max_diffuse_steps, int max_project_steps, float diffuse_tolerance, float project_tolerance);
+
+// Sets what lies past each edge, walls to start with or periodic with F_PERIODIC.
+// Periodic edges come in opposite pairs, and with F_PERIODIC every edge stays periodic.
+cl_int set_boundaries(FluidSim * fluid, BOUNDARY left, BOUNDARY right, BOUNDARY top, BOUNDARY bottom);
+
+cl_int set_obstacles(FluidSim * fluid, const unsigned char * mask);
+
+cl_int update_obstacles(FluidSim * fluid, size_t x, size_t y, size_t width, size_t height, const unsigned char * mask);
+
+void set_activity_thresholds(FluidSim * fluid, float density_threshold, float velocity_threshold);
+
+// Shows field mapped through lut, lut_size RGBA colours spread evenly from min_value to max_value.
+// A NULL lut keeps the last one, which starts out as black to white.
+cl_int set_view(FluidSim * fluid, VIEW_FIELD field, const cl_float * lut, size_t lut_size, float min_value, float max_value);
+
+cl_int enqueue_event(FluidSim * fluid, float x, float y, float s, float max_r, VEC_TYPE vec_type);
+
+// Makes room for max_particles tracers, which the velocity carries after every step and which are drawn over the view.
+// Each density event emits particles_per_event of them spread over its radius, and they live for lifetime seconds.
+// Drops the particles there were, and a max_particles of 0 turns them off.
+cl_int set_particles(FluidSim * fluid, size_t max_particles, int particles_per_event, float lifetime, PARTICLE_INTEGRATOR integrator);
+
+// Copies up to max_particles of the live particles of the last frame, sorted by cell, and sets num_particles to how many.
+// Each is the position in cells, with the interior from 0.5 to sim_size + 0.5, the seconds it has left and its density channel.
+cl_int read_particles(FluidSim * fluid, cl_float4 * particles, size_t max_particles, size_t * num_particles);
+
+// Maps the current density or velocity field into host memory, two interleaved channels per cell with a one cell border.
+// This never copies on a unified memory device. Unmap it before simulating the next frame. NULL with F_FP64, the fields hold doubles.
+// With a coarse velocity grid the velocity is the upsampled copy, and writes to it do not reach the simulation.
+cl_float * map_field(FluidSim * fluid, VEC_TYPE vec_type, cl_map_flags map_flags);
+
+cl_int unmap_field(FluidSim * fluid, VEC_TYPE vec_type, cl_float * field);
 
-void simulate_next_frame(FluidSim * fluid, float dt);
+// The calls below that return a cl_int return CL_SUCCESS or the first error of the simulation.
+// Once a call fails the simulation stops and keeps returning that error.
+
+// One step of dt, clamped to MAX_DT, and draws it
+cl_int simulate_next_frame(FluidSim * fluid, float dt);
+
+// Adds the queued sources and runs num_substeps steps of step_dt without drawing them
+cl_int simulate_substeps(FluidSim * fluid, int num_substeps, float step_dt);
+
+// Draws the last step, dt is the wallclock time since the last frame for the profiler
+cl_int present_frame(FluidSim * fluid, float dt);
 
 void copy_to_framebuffer(FluidSim * fluid, cl_mem * dest);
 
@@ -157,24 +657,71 @@ void density_step(FluidSim * fluid, float dt);
 
 void velocity_step(FluidSim * fluid, float dt);
 
+// Fills vel from the velocity of the coarse grid
+void upsample_velocity(FluidSim * fluid, cl_mem * vel, cl_mem * coarse);
+
+// Averages dens onto the coarse grid, for the buoyancy of the velocity step
+void downsample_density(FluidSim * fluid, cl_mem * coarse, cl_mem * dens);
+
+// Adds the particles of num_events events queued in the source buffers
+void emit_particles(FluidSim * fluid, cl_int num_events, cl_int channel);
+
+void advect_particles(FluidSim * fluid, float dt);
+
+// Drops the dead particles and sorts the rest by cell, so neighbouring particles sample neighbouring velocities
+void sort_particles(FluidSim * fluid);
+
+// Draws the particles over the window texture, or over the off-screen frame of the encoder
+void draw_particles(FluidSim * fluid, int is_offscreen);
+
+// velocity_step and density_step in a single launch, only used in single dispatch mode
+void simulate_frame(FluidSim * fluid, float dt);
+
 void diffuse(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_float a, VEC_TYPE vec_type);
 
-void advect(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type);
+void advect(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type, ADVECTION_SCHEME scheme);
+
+void project(FluidSim * fluid, cl_mem * vel, cl_mem * tmp, RELAXATION relaxation);
 
-void project(FluidSim * fluid, cl_mem * vel, cl_mem * tmp);
+// Semi-Lagrangian advection of the velocity fused with project, tmp must not be src or vel
+void advect_project(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_mem * tmp, cl_float dt);
 
 void set_bnd(FluidSim * fluid, cl_mem * dest, VEC_TYPE vec_type);
 
 void add_source(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_float dt);
 
-void add_event_sources(FluidSim * fluid, cl_mem * dest, SourceEventList * events, cl_int vec_type);
+void add_forces(FluidSim * fluid, cl_mem * dest, cl_mem * vel, cl_mem * dens, cl_float dt);
+
+void add_event_sources(FluidSim * fluid, cl_mem * dest, SourceEventList * events, cl_int vec_type, cl_float dt);
+
+void update_active_tiles(FluidSim * fluid);
 
 void swap_dens_buffers(FluidSim * fluid);
 
 void swap_vel_buffers(FluidSim * fluid);
 
+cl_device_id choose_device(FLAGS flags, cl_platform_id * platform);
+
+// Reads a kernel file with its #include "name" lines replaced by the files they name, NULL if one could not be read
+char * read_kernel_file(const char * kernel_filename, size_t * kernel_src_size);
+
+// A copy of embedded_src, or the kernel file if kernel_filename is not NULL
+char * load_kernel_source(const char * kernel_filename, const char * embedded_src, size_t * kernel_src_size);
+
 float profile_event(cl_event event, size_t times_run, cl_ulong samples[NUM_SAMPLES], size_t cur_sample, size_t n, int entries, const char * str);
 
 void check_for_error(cl_int err, const char * str, const char * file, int line_number);
 
+void record_fluid_error(FluidSim * fluid, const char * str, const char * file, int line_number);
+
+// CL_SUCCESS, or the first error the simulation ran into
+cl_int get_fluid_status(FluidSim * fluid);
+
+// The MEASURE_* entries of the last frame presented, waiting for them if need be. Needs F_MEASURE.
+cl_int get_fluid_measures(FluidSim * fluid, cl_double measures[NUM_MEASURES]);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
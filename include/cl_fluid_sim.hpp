@@ -0,0 +1,386 @@
+#ifndef __CL_FLUID_SIM_HPP
+#define __CL_FLUID_SIM_HPP
+
+#include <cstddef>
+#include <utility>
+
+#include "cl_fluid_sim.h"
+
+// C++ ownership for the C API. Every type here is move-only and frees what it owns when it goes out of scope.
+// Nothing allocates on the host once a simulation is created, a frame is the same calls the C API makes.
+namespace clfluid
+{
+
+template <typename T>
+struct HandleTraits;
+
+template <>
+struct HandleTraits<cl_mem>
+{
+  static cl_int retain(cl_mem mem) { return clRetainMemObject(mem); }
+  static cl_int release(cl_mem mem) { return clReleaseMemObject(mem); }
+};
+
+template <>
+struct HandleTraits<cl_kernel>
+{
+  static cl_int retain(cl_kernel kernel) { return clRetainKernel(kernel); }
+  static cl_int release(cl_kernel kernel) { return clReleaseKernel(kernel); }
+};
+
+template <>
+struct HandleTraits<cl_event>
+{
+  static cl_int retain(cl_event event) { return clRetainEvent(event); }
+  static cl_int release(cl_event event) { return clReleaseEvent(event); }
+};
+
+template <>
+struct HandleTraits<cl_program>
+{
+  static cl_int retain(cl_program program) { return clRetainProgram(program); }
+  static cl_int release(cl_program program) { return clReleaseProgram(program); }
+};
+
+template <>
+struct HandleTraits<cl_command_queue>
+{
+  static cl_int retain(cl_command_queue queue) { return clRetainCommandQueue(queue); }
+  static cl_int release(cl_command_queue queue) { return clReleaseCommandQueue(queue); }
+};
+
+// Holds one reference to an OpenCL object
+template <typename T>
+class Handle
+{
+public:
+  Handle() noexcept : handle_(nullptr) {}
+
+  // Takes over the reference the caller holds
+  explicit Handle(T handle) noexcept : handle_(handle) {}
+
+  // Adds a reference of its own, for objects that stay owned by someone else
+  static Handle retain(T handle) noexcept
+  {
+    if (handle)
+    {
+      HandleTraits<T>::retain(handle);
+    }
+    return Handle(handle);
+  }
+
+  ~Handle() { reset(); }
+
+  Handle(const Handle &) = delete;
+  Handle & operator=(const Handle &) = delete;
+
+  Handle(Handle && other) noexcept : handle_(other.release()) {}
+
+  Handle & operator=(Handle && other) noexcept
+  {
+    if (this != &other)
+    {
+      reset(other.release());
+    }
+    return *this;
+  }
+
+  T get() const noexcept { return handle_; }
+
+  explicit operator bool() const noexcept { return handle_ != nullptr; }
+
+  // Gives the reference back to the caller
+  T release() noexcept
+  {
+    T handle = handle_;
+    handle_ = nullptr;
+    return handle;
+  }
+
+  void reset(T handle = nullptr) noexcept
+  {
+    if (handle_)
+    {
+      HandleTraits<T>::release(handle_);
+    }
+    handle_ = handle;
+  }
+
+private:
+  T handle_;
+};
+
+typedef Handle<cl_mem> Mem;
+typedef Handle<cl_kernel> Kernel;
+typedef Handle<cl_event> Event;
+typedef Handle<cl_program> Program;
+typedef Handle<cl_command_queue> Queue;
+
+// A pointer and a length, for C++ versions without std::span
+template <typename T>
+class Span
+{
+public:
+  Span() noexcept : data_(nullptr), size_(0) {}
+  Span(T * data, size_t size) noexcept : data_(data), size_(size) {}
+
+  T * data() const noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return size_ == 0; }
+
+  T * begin() const noexcept { return data_; }
+  T * end() const noexcept { return data_ + size_; }
+
+  T & operator[](size_t i) const noexcept { return data_[i]; }
+
+private:
+  T * data_;
+  size_t size_;
+};
+
+// A density or velocity field mapped into host memory, unmapped again when it goes out of scope.
+// Cells hold two interleaved channels and the grid has a one cell border, so it is 2 * stride() * stride() floats.
+class FieldView
+{
+public:
+  FieldView() noexcept : fluid_(nullptr), vec_type_(IS_NONE), data_(nullptr), stride_(0) {}
+
+  FieldView(FluidSim * fluid, VEC_TYPE vec_type, cl_map_flags map_flags) noexcept
+    : fluid_(fluid), vec_type_(vec_type), data_(map_field(fluid, vec_type, map_flags)), stride_(fluid->sim_size + 2)
+  {
+  }
+
+  ~FieldView() { unmap(); }
+
+  FieldView(const FieldView &) = delete;
+  FieldView & operator=(const FieldView &) = delete;
+
+  FieldView(FieldView && other) noexcept
+    : fluid_(other.fluid_), vec_type_(other.vec_type_), data_(other.data_), stride_(other.stride_)
+  {
+    other.data_ = nullptr;
+  }
+
+  FieldView & operator=(FieldView && other) noexcept
+  {
+    if (this != &other)
+    {
+      unmap();
+      fluid_ = other.fluid_;
+      vec_type_ = other.vec_type_;
+      data_ = other.data_;
+      stride_ = other.stride_;
+      other.data_ = nullptr;
+    }
+    return *this;
+  }
+
+  // False if the map failed, the simulation status says why
+  explicit operator bool() const noexcept { return data_ != nullptr; }
+
+  size_t stride() const noexcept { return stride_; }
+
+  Span<cl_float> data() const noexcept { return Span<cl_float>(data_, 2 * stride_ * stride_); }
+
+  // Both channels of row y, border cells included
+  Span<cl_float> row(size_t y) const noexcept { return Span<cl_float>(data_ + 2 * stride_ * y, 2 * stride_); }
+
+  cl_float & at(size_t x, size_t y, int c) const noexcept { return data_[2 * (x + stride_ * y) + c]; }
+
+  // Unmaps before the view goes out of scope, which must happen before the next frame is simulated
+  cl_int unmap() noexcept
+  {
+    cl_int status = CL_SUCCESS;
+    if (data_)
+    {
+      status = unmap_field(fluid_, vec_type_, data_);
+      data_ = nullptr;
+    }
+    return status;
+  }
+
+private:
+  FluidSim * fluid_;
+  VEC_TYPE vec_type_;
+  cl_float * data_;
+  size_t stride_;
+};
+
+// Owns a FluidContext, it must outlive the simulations created in it
+class Context
+{
+public:
+  Context() noexcept : shared_(nullptr) {}
+
+  // Takes ownership of shared
+  explicit Context(FluidContext * shared) noexcept : shared_(shared) {}
+
+  // A NULL kernel_filename builds the kernels embedded in the library. Empty if no device could be set up.
+  static Context create(const char * kernel_filename, int flags, bool use_opengl = false) noexcept
+  {
+    return Context(create_fluid_context(kernel_filename, use_opengl ? 1 : 0, (FLAGS)flags));
+  }
+
+  // On one NUMA domain of the device, empty if it has no such domain. See count_fluid_domains.
+  static Context create_in_domain(const char * kernel_filename, int flags, cl_uint domain) noexcept
+  {
+    return Context(create_fluid_context_in_domain(kernel_filename, (FLAGS)flags, domain));
+  }
+
+  ~Context() { reset(); }
+
+  Context(const Context &) = delete;
+  Context & operator=(const Context &) = delete;
+
+  Context(Context && other) noexcept : shared_(other.shared_) { other.shared_ = nullptr; }
+
+  Context & operator=(Context && other) noexcept
+  {
+    if (this != &other)
+    {
+      reset();
+      shared_ = other.shared_;
+      other.shared_ = nullptr;
+    }
+    return *this;
+  }
+
+  explicit operator bool() const noexcept { return shared_ != nullptr; }
+
+  FluidContext * get() const noexcept { return shared_; }
+
+  cl_context context() const noexcept { return shared_->context; }
+
+  cl_device_id device() const noexcept { return shared_->device; }
+
+  void trim() noexcept { trim_buffer_pool(shared_); }
+
+  void reset() noexcept
+  {
+    if (shared_)
+    {
+      destroy_fluid_context(shared_);
+      shared_ = nullptr;
+    }
+  }
+
+private:
+  FluidContext * shared_;
+};
+
+// Owns a FluidSim. The calls return CL_SUCCESS or the first error of the simulation, like the C API.
+class Simulation
+{
+public:
+  Simulation() noexcept : fluid_(nullptr) {}
+
+  // Takes ownership of fluid
+  explicit Simulation(FluidSim * fluid) noexcept : fluid_(fluid) {}
+
+  // Empty if the simulation could not be created
+  static Simulation create(Context & context, size_t sim_size, float diff, float visc, int num_r_steps, int flags) noexcept
+  {
+    return Simulation(create_fluid_sim_in_context(context.get(), 0, sim_size, diff, visc, num_r_steps, (FLAGS)flags));
+  }
+
+  ~Simulation() { reset(); }
+
+  Simulation(const Simulation &) = delete;
+  Simulation & operator=(const Simulation &) = delete;
+
+  Simulation(Simulation && other) noexcept : fluid_(other.fluid_) { other.fluid_ = nullptr; }
+
+  Simulation & operator=(Simulation && other) noexcept
+  {
+    if (this != &other)
+    {
+      reset();
+      fluid_ = other.fluid_;
+      other.fluid_ = nullptr;
+    }
+    return *this;
+  }
+
+  explicit operator bool() const noexcept { return fluid_ != nullptr; }
+
+  FluidSim * get() const noexcept { return fluid_; }
+
+  size_t size() const noexcept { return fluid_->sim_size; }
+
+  cl_int status() const noexcept { return get_fluid_status(fluid_); }
+
+  // The MEASURE_* entries of the last frame, needs F_MEASURE
+  cl_int measures(cl_double values[NUM_MEASURES]) noexcept { return get_fluid_measures(fluid_, values); }
+
+  cl_int add_source(float x, float y, float strength, float max_radius, VEC_TYPE vec_type) noexcept
+  {
+    return enqueue_event(fluid_, x, y, strength, max_radius, vec_type);
+  }
+
+  cl_int step(float dt) noexcept { return simulate_next_frame(fluid_, dt); }
+
+  cl_int substeps(int num_substeps, float step_dt) noexcept { return simulate_substeps(fluid_, num_substeps, step_dt); }
+
+  cl_int present(float dt) noexcept { return present_frame(fluid_, dt); }
+
+  cl_int set_advection(VEC_TYPE vec_type, ADVECTION_SCHEME scheme) noexcept { return set_advection_scheme(fluid_, vec_type, scheme); }
+
+  void set_forces(float vorticity_confinement, float buoyancy) noexcept { ::set_forces(fluid_, vorticity_confinement, buoyancy); }
+
+  // Only has an effect with F_HALF_VELOCITY or F_QUARTER_VELOCITY
+  cl_int set_upsampling(UPSAMPLING upsampling) noexcept { return set_velocity_upsampling(fluid_, upsampling); }
+
+  // Periodic edges come in opposite pairs, with F_PERIODIC every edge stays periodic
+  cl_int set_boundaries(BOUNDARY left, BOUNDARY right, BOUNDARY top, BOUNDARY bottom) noexcept
+  {
+    return ::set_boundaries(fluid_, left, right, top, bottom);
+  }
+
+  cl_int set_particles(size_t max_particles, int particles_per_event, float lifetime, PARTICLE_INTEGRATOR integrator = INTEGRATE_RK2) noexcept
+  {
+    return ::set_particles(fluid_, max_particles, particles_per_event, lifetime, integrator);
+  }
+
+  // Copies as many live particles as fit in particles, num_particles says how many
+  cl_int read_particles(Span<cl_float4> particles, size_t & num_particles) noexcept
+  {
+    return ::read_particles(fluid_, particles.data(), particles.size(), &num_particles);
+  }
+
+  // lut holds four floats per RGBA colour
+  cl_int set_view(VIEW_FIELD field, Span<const cl_float> lut, float min_value, float max_value) noexcept
+  {
+    return ::set_view(fluid_, field, lut.data(), lut.size() / 4, min_value, max_value);
+  }
+
+  // Maps the current density or velocity field, waiting for the last frame
+  FieldView map(VEC_TYPE vec_type, cl_map_flags map_flags = CL_MAP_READ) noexcept { return FieldView(fluid_, vec_type, map_flags); }
+
+  // The buffer of the current density or velocity field for kernels of the caller's own.
+  // The buffers swap every frame, so take it again after each one.
+  Mem field_buffer(VEC_TYPE vec_type) const noexcept
+  {
+    return Mem::retain((vec_type == IS_VELOCITY) ? fluid_->velocity_mem[CUR] : fluid_->density_mem[CUR]);
+  }
+
+  // Completes once the last frame is drawn, empty before the first one
+  Event frame_done() const noexcept { return Event::retain(fluid_->frame_done_event); }
+
+  cl_command_queue queue() const noexcept { return fluid_->command_queue; }
+
+  void reset() noexcept
+  {
+    if (fluid_)
+    {
+      destroy_fluid_sim(fluid_);
+      fluid_ = nullptr;
+    }
+  }
+
+private:
+  FluidSim * fluid_;
+};
+
+}
+
+#endif
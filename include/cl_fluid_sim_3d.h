@@ -0,0 +1,134 @@
+#ifndef __CL_FLUID_SIM_3D
+#define __CL_FLUID_SIM_3D
+
+#include "cl_fluid_sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct source_event_list_3d_t
+{
+  cl_int x[MAX_NUM_SIMULTANEOUS_EVENTS];
+  cl_int y[MAX_NUM_SIMULTANEOUS_EVENTS];
+  cl_int z[MAX_NUM_SIMULTANEOUS_EVENTS];
+  cl_float strength[MAX_NUM_SIMULTANEOUS_EVENTS];
+  cl_int max_radius_sqrd[MAX_NUM_SIMULTANEOUS_EVENTS];
+  cl_int num_events;
+} SourceEventList3D;
+
+// Fields are stored one channel after another, each a (sim_size + 2)^3 block with x changing fastest
+typedef struct fluid_sim_3d_t
+{
+  cl_context context;
+  cl_command_queue command_queue;
+  cl_program program;
+
+  cl_kernel add_event_sources_kernel;
+  cl_kernel add_source_kernel;
+  cl_kernel set_bnd_kernel;
+  cl_kernel set_bnd_edges_kernel;
+  cl_kernel diffuse_kernel;
+  cl_kernel advect_kernel;
+  cl_kernel project_a_kernel;
+  cl_kernel project_b_kernel;
+  cl_kernel project_c_kernel;
+
+  int profile;
+
+  cl_event add_event_sources_event;
+  cl_event add_source_event;
+  cl_event set_bnd_event;
+  cl_event set_bnd_edges_event;
+  cl_event diffuse_event;
+  cl_event advect_event;
+  cl_event project_a_event;
+  cl_event project_b_event;
+  cl_event project_c_event;
+
+  size_t calls_to_add_event_sources;
+  size_t calls_to_add_source;
+  size_t calls_to_set_bnd;
+  size_t calls_to_set_bnd_edges;
+  size_t calls_to_diffuse;
+  size_t calls_to_advect;
+  size_t calls_to_project_a;
+  size_t calls_to_project_b;
+  size_t calls_to_project_c;
+
+  size_t cur_sample;
+  cl_ulong add_event_sources_samples[NUM_SAMPLES];
+  cl_ulong add_source_samples[NUM_SAMPLES];
+  cl_ulong set_bnd_samples[NUM_SAMPLES];
+  cl_ulong set_bnd_edges_samples[NUM_SAMPLES];
+  cl_ulong diffuse_samples[NUM_SAMPLES];
+  cl_ulong advect_samples[NUM_SAMPLES];
+  cl_ulong project_a_samples[NUM_SAMPLES];
+  cl_ulong project_b_samples[NUM_SAMPLES];
+  cl_ulong project_c_samples[NUM_SAMPLES];
+
+  // density has one channel, velocity has three
+  cl_mem density_mem[2];
+  cl_mem velocity_mem[2];
+
+  cl_mem source_x;
+  cl_mem source_y;
+  cl_mem source_z;
+  cl_mem source_strength;
+  cl_mem source_max_radius_sqrd;
+
+  size_t sim_size;
+  size_t stride;
+  size_t volume;
+
+  size_t global_size[3];
+  size_t local_size[3];
+  size_t face_global_size[2];
+  size_t face_local_size[2];
+  size_t edge_global_size;
+
+  SourceEventList3D density_events;
+  SourceEventList3D u_velocity_events;
+  SourceEventList3D v_velocity_events;
+  SourceEventList3D w_velocity_events;
+
+  int num_relaxation_steps;
+
+  float diffusion_rate;
+  float viscosity;
+} FluidSim3D;
+
+// Builds the embedded kernels, or those in kernel_filename if it is not NULL
+FluidSim3D * create_fluid_sim_3d(const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags);
+
+void destroy_fluid_sim_3d(FluidSim3D * fluid);
+
+void enqueue_event_3d(FluidSim3D * fluid, float x, float y, float z, float s, float max_r, VEC_TYPE vec_type);
+
+void simulate_next_frame_3d(FluidSim3D * fluid, float dt);
+
+void density_step_3d(FluidSim3D * fluid, float dt);
+
+void velocity_step_3d(FluidSim3D * fluid, float dt);
+
+void diffuse_3d(FluidSim3D * fluid, cl_mem * dest, cl_mem * src, cl_float a, VEC_TYPE vec_type);
+
+void advect_3d(FluidSim3D * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type);
+
+void project_3d(FluidSim3D * fluid, cl_mem * vel, cl_mem * tmp);
+
+void set_bnd_3d(FluidSim3D * fluid, cl_mem * dest, VEC_TYPE vec_type);
+
+void add_source_3d(FluidSim3D * fluid, cl_mem * dest, cl_mem * src, cl_float dt, VEC_TYPE vec_type);
+
+void add_event_sources_3d(FluidSim3D * fluid, cl_mem * dest, SourceEventList3D * events, cl_int vec_type, cl_float dt);
+
+void swap_dens_buffers_3d(FluidSim3D * fluid);
+
+void swap_vel_buffers_3d(FluidSim3D * fluid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __FLUID_SCHEDULER
+#define __FLUID_SCHEDULER
+
+#include <pthread.h>
+
+#include "cl_fluid_sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Weight of the newest measurement in the running cost of a substep
+#define SUBSTEP_COST_SMOOTHING 0.2
+
+// Runs a simulation at a fixed timestep, independent of how often it is drawn.
+// Real time is banked and paid out in whole steps of step_dt. When the steps owed for a frame
+// do not fit in frame_budget, or go over max_substeps, the rest is dropped and counted in dropped_seconds
+// instead of silently stretching the timestep.
+typedef struct fluid_scheduler_t
+{
+  FluidSim * fluid;
+
+  float step_dt;
+  int max_substeps;
+  float frame_budget;
+
+  // real time not yet simulated, always less than one step after advancing
+  double accumulator;
+  // running device time of one substep, 0 until measured
+  double substep_seconds;
+  // markers around the last batch of substeps whose cost is not counted yet, NULL when none is
+  cl_event batch_begin_event;
+  cl_event batch_end_event;
+  int batch_substeps;
+  int last_substeps;
+  double dropped_seconds;
+
+  // the simulation thread, see start_fluid_scheduler
+  int is_running;
+  // set while the thread enqueues substeps without holding the lock
+  int is_enqueueing;
+  size_t frames_simulated;
+  size_t frames_presented;
+  double present_time;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} FluidScheduler;
+
+// step_dt is the fixed timestep, at most MAX_DT. frame_budget is the wallclock time the substeps of one frame may take.
+// NULL if step_dt or max_substeps are out of range.
+FluidScheduler * create_fluid_scheduler(FluidSim * fluid, float step_dt, int max_substeps, float frame_budget);
+
+// Stops the simulation thread if it runs
+void destroy_fluid_scheduler(FluidScheduler * scheduler);
+
+// Banks elapsed seconds of real time and enqueues the whole steps they pay for, without waiting for the device to run them.
+// Returns the number of substeps enqueued. The caller draws the result with present_frame.
+int advance_fluid_scheduler(FluidScheduler * scheduler, float elapsed);
+
+// Simulates on a thread of its own that sleeps until the next step is owed, at most MAX_FRAMES_IN_FLIGHT frames ahead of the drawing.
+// Every other call on the simulation must then hold the lock, the thread that owns the GL context draws with wait_for_fluid_frame.
+// The thread does not hold the lock while the device runs the substeps, only while it enqueues them.
+void start_fluid_scheduler(FluidScheduler * scheduler);
+
+void stop_fluid_scheduler(FluidScheduler * scheduler);
+
+void lock_fluid_scheduler(FluidScheduler * scheduler);
+
+void unlock_fluid_scheduler(FluidScheduler * scheduler);
+
+// Waits at most timeout seconds for a step that has not been drawn yet and draws it.
+// Returns 1 if a frame was drawn.
+int wait_for_fluid_frame(FluidScheduler * scheduler, float timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef __FRAME_ENCODER
+#define __FRAME_ENCODER
+
+#include <pthread.h>
+
+#include "cl_fluid_sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frames waiting to be encoded, the simulation stalls once all of them are in use
+#define NUM_ENCODER_SLOTS 4
+
+typedef enum ENCODER_FORMAT
+{
+  ENCODE_Y4M, // one YUV 4:4:4 stream
+  ENCODE_PNG, // one file per frame
+  ENCODE_RAW, // RGBA8 frames one after another
+} ENCODER_FORMAT;
+
+// Encodes RGBA8 frames of width x height pixels on its own thread.
+// A frame is handed over together with the event of the read that fills it, so the readback is never waited on by the simulation.
+typedef struct frame_encoder_t
+{
+  ENCODER_FORMAT format;
+  size_t width;
+  size_t height;
+
+  // the open stream, or NULL when writing a PNG sequence
+  FILE * file;
+  char * path;
+
+  unsigned char * slots[NUM_ENCODER_SLOTS];
+  cl_event slot_events[NUM_ENCODER_SLOTS];
+  // the next slot to encode and how many are waiting or being encoded
+  size_t first_slot;
+  size_t num_queued;
+
+  // plane or row scratch for the current frame
+  unsigned char * scratch;
+  size_t frames_written;
+  // set once a write came up short, every frame after it is dropped
+  int has_failed;
+  int is_closing;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} FrameEncoder;
+
+// path is the output file, or the prefix of the numbered files of a PNG sequence
+FrameEncoder * create_frame_encoder(const char * path, ENCODER_FORMAT format, size_t width, size_t height, int fps);
+
+// Encodes every frame still queued first. Returns 0 if any frame could not be written.
+int destroy_frame_encoder(FrameEncoder * encoder);
+
+// Returns a free width x height x 4 byte frame, waiting for the encoder if every slot is taken.
+// The slot is only taken by submit_frame, so a frame that is never submitted leaves it free.
+unsigned char * acquire_frame_slot(FrameEncoder * encoder);
+
+// Queues the frame returned by the last acquire_frame_slot, it is encoded once ready completes. Takes ownership of ready.
+void submit_frame(FrameEncoder * encoder, cl_event ready);
+
+// Renders each frame off-screen into encoder, scaled to its size. NULL stops it.
+cl_int set_frame_encoder(FluidSim * fluid, FrameEncoder * encoder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __METRICS_EXPORTER
+#define __METRICS_EXPORTER
+
+#include <pthread.h>
+
+#include "cl_fluid_sim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Longest path of a Unix socket
+#define MAX_METRICS_PATH 108
+// Room for the text of one snapshot
+#define METRICS_TEXT_SIZE (16 * KB)
+
+typedef enum METRICS_OUTPUT
+{
+  METRICS_FILE, // replaced whole every interval, so a reader never sees half a snapshot
+  METRICS_SOCKET, // a Unix socket that answers every connection with the latest snapshot
+} METRICS_OUTPUT;
+
+// Parts of a frame timed on the device from the markers between them
+typedef enum FRAME_STAGE
+{
+  STAGE_VELOCITY, // the sources and the velocity substeps, not timed when a step runs as one dispatch
+  STAGE_SIMULATE, // every substep up to the advected density
+  STAGE_PRESENT, // measuring and drawing
+  NUM_FRAME_STAGES,
+} FRAME_STAGE;
+
+// Counters of a simulation since the exporter was set. The gauges hold the last value seen.
+typedef struct fluid_metrics_t
+{
+  size_t frames;
+  size_t substeps;
+  // host wallclock time between presented frames
+  double frame_seconds;
+  double frame_seconds_total;
+
+  double stage_seconds[NUM_FRAME_STAGES];
+  double stage_seconds_total[NUM_FRAME_STAGES];
+  size_t stage_samples[NUM_FRAME_STAGES];
+
+  int relaxation_sweeps[NUM_RELAXATIONS];
+  int relaxation_converged[NUM_RELAXATIONS];
+  float relaxation_residuals[NUM_RELAXATIONS];
+  size_t relaxation_sweeps_total[NUM_RELAXATIONS];
+
+  size_t bytes_uploaded;
+  // by VEC_TYPE, only the densities and velocities that take sources are used
+  size_t events_injected[IS_NONE];
+} FluidMetrics;
+
+// Publishes the metrics of one simulation in the OpenMetrics text format from its own thread.
+// The simulation thread only writes current and copies it into published at the end of each frame.
+// Neither side takes a lock for that: sequence is odd while the copy is being made, and the exporter
+// copies the snapshot again until sequence is even and did not change while it read.
+typedef struct metrics_exporter_t
+{
+  METRICS_OUTPUT output;
+  char path[MAX_METRICS_PATH];
+  // seconds between snapshots written to a file, or the longest a connection waits to be answered
+  double interval;
+
+  // the listening socket in METRICS_SOCKET mode
+  int socket;
+
+  // owned by the simulation thread
+  FluidMetrics current;
+  double last_present_time;
+
+  FluidMetrics published;
+  unsigned sequence;
+
+  size_t snapshots_written;
+  char * text;
+
+  int is_closing;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} MetricsExporter;
+
+// path is the file to write or the socket to listen on, an old socket file at path is replaced. NULL if it cannot be opened.
+MetricsExporter * create_metrics_exporter(const char * path, METRICS_OUTPUT output, double interval);
+
+// A file gets the last snapshot written once more, a socket file is removed
+void destroy_metrics_exporter(MetricsExporter * exporter);
+
+// Ends a frame of the simulation thread and publishes current
+void publish_frame_metrics(MetricsExporter * exporter);
+
+// Copies the last published snapshot into metrics, from any thread
+void read_metrics(MetricsExporter * exporter, FluidMetrics * metrics);
+
+// Writes a snapshot of metrics into text, returns its length
+size_t format_metrics(const FluidMetrics * metrics, char * text, size_t text_size);
+
+// Starts counting the frames of fluid into exporter, and of its velocity grid. NULL stops it.
+// The exporter serves one simulation at a time and must outlive it, or be unset first.
+cl_int set_metrics_exporter(FluidSim * fluid, MetricsExporter * exporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
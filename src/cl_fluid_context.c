@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cl_fluid_sim.h"
+
+// Releases device if it is a sub-device made for a context that could not be created
+static void release_context_device(cl_device_id device, int owns_device)
+{
+  if (owns_device)
+  {
+    clReleaseDevice(device);
+  }
+}
+
+// Sets up a context on device, which it releases again on destruction if owns_device is set
+static FluidContext * create_context_on_device(const char * kernel_filename, int use_opengl, FLAGS flags, cl_device_id device, cl_platform_id fluid_platform, int owns_device)
+{
+  FluidContext * shared = (FluidContext *)calloc(1, sizeof(FluidContext));
+
+  shared->kernel_src = load_kernel_source(kernel_filename, fluid_kernel_src, &shared->kernel_src_size);
+  if (!shared->kernel_src)
+  {
+    release_context_device(device, owns_device);
+    free(shared);
+    return NULL;
+  }
+
+  shared->is_using_opengl = use_opengl;
+  pthread_mutex_init(&shared->lock, NULL);
+
+  cl_int err;
+
+  shared->device = device;
+  shared->owns_device = owns_device;
+
+  // CPUs and integrated GPUs see host memory directly
+  cl_bool host_unified_memory = CL_FALSE;
+  clGetDeviceInfo(shared->device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &host_unified_memory, NULL);
+  shared->is_host_unified = (host_unified_memory == CL_TRUE) ? 1 : 0;
+  if (flags & F_DEBUG)
+  {
+    fprintf(stdout, "Host unified memory: %s\n", shared->is_host_unified ? "yes" : "no");
+  }
+
+  if (shared->is_using_opengl) {
+#ifdef __APPLE__
+    CGLContextObj gl_context = CGLGetCurrentContext();
+    CGLShareGroupObj gl_share_group = CGLGetShareGroup(gl_context);
+
+    cl_context_properties properties[] = {
+      CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)gl_share_group,
+      0
+    };
+#elif __linux__
+    cl_context_properties properties[] = {
+      CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
+      CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
+      CL_CONTEXT_PLATFORM, (cl_context_properties)fluid_platform,
+      0
+    };
+#endif
+    // Create OpenCL context
+    shared->context = clCreateContext(properties, 1, &shared->device, NULL, NULL, &err);
+  }
+  else {
+    shared->context = clCreateContext(NULL, 1, &shared->device, NULL, NULL, &err);
+  }
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to create cl context: %d\n", (int)err);
+    release_context_device(device, owns_device);
+    pthread_mutex_destroy(&shared->lock);
+    free(shared->kernel_src);
+    free(shared);
+    return NULL;
+  }
+
+  // commands are executed in-order
+  shared->command_queue = clCreateCommandQueue(shared->context, shared->device, CL_QUEUE_PROFILING_ENABLE, &err);
+  if (err == CL_SUCCESS)
+  {
+    // the density step runs here next to the velocity step, ordered against it with events
+    shared->density_queue = clCreateCommandQueue(shared->context, shared->device, CL_QUEUE_PROFILING_ENABLE, &err);
+  }
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to create command queue: %d\n", (int)err);
+    destroy_fluid_context(shared);
+    return NULL;
+  }
+
+  return shared;
+}
+
+FluidContext * create_fluid_context(const char * kernel_filename, int use_opengl, FLAGS flags)
+{
+  cl_platform_id fluid_platform;
+  cl_device_id device = choose_device(flags, &fluid_platform);
+  if (!device)
+  {
+    return NULL;
+  }
+
+  return create_context_on_device(kernel_filename, use_opengl, flags, device, fluid_platform, 0);
+}
+
+static const cl_device_partition_property numa_partition[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+
+// How many NUMA domains device splits into, 0 if it cannot be split by them
+static cl_uint count_device_domains(cl_device_id device)
+{
+  cl_device_affinity_domain domains = 0;
+  cl_int err = clGetDeviceInfo(device, CL_DEVICE_PARTITION_AFFINITY_DOMAIN, sizeof(cl_device_affinity_domain), &domains, NULL);
+  if (err != CL_SUCCESS || !(domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA))
+  {
+    return 0;
+  }
+
+  cl_uint num_domains = 0;
+  err = clCreateSubDevices(device, numa_partition, 0, NULL, &num_domains);
+  return (err == CL_SUCCESS) ? num_domains : 0;
+}
+
+cl_uint count_fluid_domains(FLAGS flags)
+{
+  cl_platform_id fluid_platform;
+  cl_device_id device = choose_device(flags, &fluid_platform);
+  return (device) ? count_device_domains(device) : 0;
+}
+
+FluidContext * create_fluid_context_in_domain(const char * kernel_filename, FLAGS flags, cl_uint domain)
+{
+  cl_platform_id fluid_platform;
+  cl_device_id device = choose_device(flags, &fluid_platform);
+  if (!device)
+  {
+    return NULL;
+  }
+
+  cl_uint num_domains = count_device_domains(device);
+  if (domain >= num_domains)
+  {
+    fprintf(stderr, "Unable to find NUMA domain %u, the device splits into %u\n", domain, num_domains);
+    return NULL;
+  }
+
+  // the runtime only hands out every domain at once, the others are released straight away
+  cl_device_id sub_devices[num_domains];
+  cl_int err = clCreateSubDevices(device, numa_partition, num_domains, sub_devices, NULL);
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to create sub-devices: %d\n", (int)err);
+    return NULL;
+  }
+  for (cl_uint i = 0; i < num_domains; i++)
+  {
+    if (i != domain)
+    {
+      clReleaseDevice(sub_devices[i]);
+    }
+  }
+
+  if (flags & F_DEBUG)
+  {
+    cl_uint num_compute_units = 0;
+    clGetDeviceInfo(sub_devices[domain], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &num_compute_units, NULL);
+    fprintf(stdout, "NUMA domain %u of %u: %u compute units\n", domain, num_domains, num_compute_units);
+  }
+
+  return create_context_on_device(kernel_filename, 0, flags, sub_devices[domain], fluid_platform, 1);
+}
+
+void destroy_fluid_context(FluidContext * shared)
+{
+  trim_buffer_pool(shared);
+
+  FluidProgram * program = shared->programs;
+  while (program)
+  {
+    FluidProgram * next = program->next;
+    clReleaseProgram(program->program);
+    free(program->options);
+    free(program);
+    program = next;
+  }
+
+  if (shared->density_queue)
+  {
+    clReleaseCommandQueue(shared->density_queue);
+  }
+  clReleaseCommandQueue(shared->command_queue);
+  clReleaseContext(shared->context);
+  if (shared->owns_device)
+  {
+    clReleaseDevice(shared->device);
+  }
+  pthread_mutex_destroy(&shared->lock);
+
+  free(shared->kernel_src);
+  free(shared);
+}
+
+cl_program get_fluid_program(FluidContext * shared, const char * options)
+{
+  // simulations on other threads build at the same time
+  pthread_mutex_lock(&shared->lock);
+
+  // the options hold every size dependent definition, so equal options give an identical program
+  for (FluidProgram * program = shared->programs; program; program = program->next)
+  {
+    if (strcmp(program->options, options) == 0)
+    {
+      pthread_mutex_unlock(&shared->lock);
+      return program->program;
+    }
+  }
+
+  cl_int err;
+  cl_program new_program = clCreateProgramWithSource(shared->context, 1, (const char **)&shared->kernel_src, (const size_t *)&shared->kernel_src_size, &err);
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to create program with source: %d\n", (int)err);
+    pthread_mutex_unlock(&shared->lock);
+    return NULL;
+  }
+
+  err = clBuildProgram(new_program, 1, &shared->device, options, NULL, NULL);
+  const size_t max_log_length = 16384;
+  char log[max_log_length];
+  clGetProgramBuildInfo(new_program, shared->device, CL_PROGRAM_BUILD_LOG, max_log_length, log, NULL);
+  fprintf(stderr, "%s", log);
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to build program: %d\n", (int)err);
+    clReleaseProgram(new_program);
+    pthread_mutex_unlock(&shared->lock);
+    return NULL;
+  }
+
+  FluidProgram * program = (FluidProgram *)malloc(sizeof(FluidProgram));
+  program->options = strdup(options);
+  program->program = new_program;
+  program->next = shared->programs;
+  shared->programs = program;
+
+  pthread_mutex_unlock(&shared->lock);
+  return new_program;
+}
+
+// Each power of two is split into POOL_BUCKET_STEPS sizes, so a buffer is never more than a quarter larger than asked for
+static size_t pool_bucket(size_t size, size_t * bucket_size)
+{
+  size = (size < POOL_MIN_BUFFER_SIZE) ? POOL_MIN_BUFFER_SIZE : size;
+
+  size_t power = 0;
+  while (((size_t)2 << power) <= size)
+  {
+    power++;
+  }
+
+  size_t base = (size_t)1 << power;
+  size_t step = base / POOL_BUCKET_STEPS;
+  size_t sub = (size - base + step - 1) / step;
+
+  *bucket_size = base + sub * step;
+  return power * POOL_BUCKET_STEPS + sub;
+}
+
+static void CL_CALLBACK free_pool_host_ptr(cl_mem mem, void * host_ptr)
+{
+  free(host_ptr);
+}
+
+// On a device that shares memory with the host the buffer lives in page aligned host memory that the device uses in place,
+// so mapping it never copies. The pages are first touched here, by the thread creating the buffer, which places them
+// on that thread's NUMA node.
+static cl_mem create_pool_buffer(FluidContext * shared, size_t size, cl_int * status)
+{
+  if (!shared->is_host_unified)
+  {
+    return clCreateBuffer(shared->context, CL_MEM_READ_WRITE, size, NULL, status);
+  }
+
+  // zero-copy also wants the size to be a whole number of cache lines, a whole number of pages covers that
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t host_size = (size + page_size - 1) / page_size * page_size;
+  void * host_ptr;
+  if (posix_memalign(&host_ptr, page_size, host_size) != 0)
+  {
+    // let the runtime find host memory for it instead
+    return clCreateBuffer(shared->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, status);
+  }
+  memset(host_ptr, 0, host_size);
+
+  cl_mem mem = clCreateBuffer(shared->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, host_ptr, status);
+  if (*status != CL_SUCCESS)
+  {
+    // no buffer was made, so nothing else can be using the memory
+    free(host_ptr);
+    return mem;
+  }
+
+  // the runtime may still touch the memory after the last release, so it is freed once the buffer is really gone
+  *status = clSetMemObjectDestructorCallback(mem, free_pool_host_ptr, host_ptr);
+  if (*status != CL_SUCCESS)
+  {
+    // without the callback there is no safe point to free it, losing the pages beats freeing them under the device
+    clReleaseMemObject(mem);
+    return NULL;
+  }
+  return mem;
+}
+
+cl_mem acquire_buffer(FluidContext * shared, size_t size, cl_int * status)
+{
+  size_t bucket_size;
+  size_t bucket = pool_bucket(size, &bucket_size);
+  if (bucket >= NUM_POOL_BUCKETS)
+  {
+    *status = CL_INVALID_BUFFER_SIZE;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&shared->lock);
+  PooledBuffer * pooled = shared->free_buffers[bucket];
+  if (pooled)
+  {
+    shared->free_buffers[bucket] = pooled->next;
+    shared->pool_hits++;
+    pthread_mutex_unlock(&shared->lock);
+
+    cl_mem mem = pooled->mem;
+    free(pooled);
+
+    *status = CL_SUCCESS;
+    return mem;
+  }
+  pthread_mutex_unlock(&shared->lock);
+
+  // creating the buffer can take a while, the pool is free for other threads meanwhile
+  cl_mem mem = create_pool_buffer(shared, bucket_size, status);
+  if (*status == CL_SUCCESS)
+  {
+    pthread_mutex_lock(&shared->lock);
+    shared->pool_misses++;
+    shared->allocated_bytes += bucket_size;
+    shared->peak_allocated_bytes = fmax(shared->peak_allocated_bytes, shared->allocated_bytes);
+    pthread_mutex_unlock(&shared->lock);
+  }
+  return mem;
+}
+
+void release_buffer(FluidContext * shared, cl_mem mem)
+{
+  // a simulation that failed half way releases buffers it never got
+  if (!mem)
+  {
+    return;
+  }
+
+  size_t size;
+  clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+
+  size_t bucket_size;
+  size_t bucket = pool_bucket(size, &bucket_size);
+
+  PooledBuffer * pooled = (PooledBuffer *)malloc(sizeof(PooledBuffer));
+  pooled->mem = mem;
+
+  pthread_mutex_lock(&shared->lock);
+  pooled->next = shared->free_buffers[bucket];
+  shared->free_buffers[bucket] = pooled;
+  pthread_mutex_unlock(&shared->lock);
+}
+
+void trim_buffer_pool(FluidContext * shared)
+{
+  // a buffer can go back to the pool while commands using it are still queued,
+  // simulations with queues of their own finish them before releasing their buffers
+  clFinish(shared->command_queue);
+  if (shared->density_queue)
+  {
+    clFinish(shared->density_queue);
+  }
+
+  pthread_mutex_lock(&shared->lock);
+  for (size_t i = 0; i < NUM_POOL_BUCKETS; i++)
+  {
+    while (shared->free_buffers[i])
+    {
+      PooledBuffer * pooled = shared->free_buffers[i];
+      shared->free_buffers[i] = pooled->next;
+
+      size_t size;
+      clGetMemObjectInfo(pooled->mem, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+      // host memory behind a CL_MEM_USE_HOST_PTR buffer is freed by its destructor callback
+      clReleaseMemObject(pooled->mem);
+
+      shared->allocated_bytes -= size;
+      free(pooled);
+    }
+  }
+  pthread_mutex_unlock(&shared->lock);
+}
+
+void print_buffer_pool_stats(FluidContext * shared)
+{
+  fprintf(stdout, "Buffer pool: %zu hits, %zu misses, %.2f MB allocated, %.2f MB peak\n",
+          shared->pool_hits, shared->pool_misses, shared->allocated_bytes / (float)(KB * KB), shared->peak_allocated_bytes / (float)(KB * KB));
+}
@@ -1,59 +1,22 @@
-#include "cl_fluid_sim.h"
+#include <stdlib.h>
 
-cl_int err;
+#include "cl_fluid_sim.h"
+#include "frame_encoder.h"
+#include "metrics_exporter.h"
 
-FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags)
+// Picks the first platform and the last device on it of the type asked for in flags, NULL if there is none
+cl_device_id choose_device(FLAGS flags, cl_platform_id * platform)
 {
-  FluidSim * fluid = (FluidSim *)malloc(sizeof(FluidSim));
-
-  fluid->profile = (flags & F_PROFILE) ? 1 : 0;
-
-  // zero is always an invalid texture
-  fluid->is_using_opengl = (window_texture) ? 1 : 0;
-
-  // Read kernel file
-  FILE * kernel_file = fopen(kernel_filename, "r");
-  if (!kernel_file)
-  {
-    perror("Failed to open kernel file");
-    return NULL;
-  }
-
-  char * kernel_src = (char *)malloc(MAX_KERNEL_FILE_SIZE);
-  size_t kernel_src_size = fread(kernel_src, 1, MAX_KERNEL_FILE_SIZE, kernel_file);
-  kernel_src[kernel_src_size] = '\0';
-
-  fclose(kernel_file);
-
-  fluid->sim_size = sim_size;
-  fluid->stride = sim_size + 2;
-  fluid->num_relaxation_steps = num_r_steps;
-  fluid->diffusion_rate = diff;
-  fluid->viscosity = visc;
-
-  fluid->global_size[0] = fluid->sim_size;
-  fluid->global_size[1] = fluid->sim_size;
-  // TODO: be smarter about setting these values
-  fluid->local_size[0] = 32;
-  fluid->local_size[1] = 32;
-  fluid->buffer_size = 2 * (fluid->sim_size + 2) * (fluid->sim_size + 2);
-  fluid->full_local_size = 8;
-  fluid->set_bnd_global_size = (fluid->sim_size + 1);
-  fluid->set_bnd_local_size = 1;
-
-  fluid->a_density_events.num_events = 0;
-  fluid->b_density_events.num_events = 0;
-  fluid->u_velocity_events.num_events = 0;
-  fluid->v_velocity_events.num_events = 0;
-
-  fluid->cur_sample = 0;
-
   cl_uint num_available_platforms = -1;
   cl_uint num_available_devices = -1;
 
   // Get Platform and Device Info
-  err = clGetPlatformIDs(1, NULL, &num_available_platforms);
-  check_error(err, "Unable to get the number of platform IDs");
+  cl_int err = clGetPlatformIDs(1, NULL, &num_available_platforms);
+  if (err != CL_SUCCESS || num_available_platforms == 0)
+  {
+    fprintf(stderr, "Unable to get the number of platform IDs: %d\n", (int)err);
+    return NULL;
+  }
   if (flags & F_DEBUG)
   {
     fprintf(stdout, "%d platform(s) available\n", num_available_platforms);
@@ -62,7 +25,11 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
   cl_platform_id platforms[num_available_platforms];
 
   err = clGetPlatformIDs(num_available_platforms, platforms, NULL);
-  check_error(err, "Unable to get platform IDs");
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to get platform IDs: %d\n", (int)err);
+    return NULL;
+  }
 
   char name[100];
 
@@ -76,10 +43,14 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
   }
 
   // TODO: Be smarter about picking a platform
-  cl_platform_id fluid_platform = platforms[0];
+  *platform = platforms[0];
 
-  err = clGetDeviceIDs(fluid_platform, CL_DEVICE_TYPE_ALL, 0, NULL, &num_available_devices);
-  check_error(err, "Unable to get the number of device IDs");
+  err = clGetDeviceIDs(*platform, CL_DEVICE_TYPE_ALL, 0, NULL, &num_available_devices);
+  if (err != CL_SUCCESS || num_available_devices == 0)
+  {
+    fprintf(stderr, "Unable to get the number of device IDs: %d\n", (int)err);
+    return NULL;
+  }
   if (flags & F_DEBUG)
   {
     fprintf(stdout, "%d device(s) available\n", num_available_devices);
@@ -87,8 +58,12 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
 
   cl_device_id devices[num_available_devices];
 
-  err = clGetDeviceIDs(fluid_platform, CL_DEVICE_TYPE_ALL, num_available_devices, devices, NULL);
-  check_error(err, "Unable to get device IDs");
+  err = clGetDeviceIDs(*platform, CL_DEVICE_TYPE_ALL, num_available_devices, devices, NULL);
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to get device IDs: %d\n", (int)err);
+    return NULL;
+  }
 
   cl_device_id fluid_device = NULL;
   cl_device_type device_type;
@@ -126,7 +101,8 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
 
   if (fluid_device == NULL)
   {
-    check_error(-1, "Unable to find device");
+    fprintf(stderr, "Unable to find device\n");
+    return NULL;
   }
 
   if (flags & F_DEBUG)
@@ -135,6 +111,321 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
     fprintf(stdout, "Chosen device: %s\n", name);
   }
 
+  return fluid_device;
+}
+
+// Appends kernel_filename to src, replacing each #include "name" line with the named file read from the same directory
+static int append_kernel_file(const char * kernel_filename, char ** src, size_t * src_size, size_t * capacity, int depth)
+{
+  if (depth > MAX_KERNEL_INCLUDE_DEPTH)
+  {
+    fprintf(stderr, "Kernel includes nested too deep in %s\n", kernel_filename);
+    return 0;
+  }
+
+  FILE * kernel_file = fopen(kernel_filename, "r");
+  if (!kernel_file)
+  {
+    perror("Failed to open kernel file");
+    return 0;
+  }
+
+  // included names are relative to the file including them
+  const char * dir_end = strrchr(kernel_filename, '/');
+  size_t dir_length = (dir_end) ? (size_t)(dir_end - kernel_filename + 1) : 0;
+
+  char line[1024];
+  int is_ok = 1;
+  while (is_ok && fgets(line, sizeof(line), kernel_file))
+  {
+    const char * directive = line + strspn(line, " \t");
+    char name[256];
+    if (sscanf(directive, "#include \"%255[^\"]\"", name) == 1)
+    {
+      char * include_filename = (char *)malloc(dir_length + strlen(name) + 1);
+      memcpy(include_filename, kernel_filename, dir_length);
+      strcpy(include_filename + dir_length, name);
+      is_ok = append_kernel_file(include_filename, src, src_size, capacity, depth + 1);
+      free(include_filename);
+      continue;
+    }
+
+    size_t length = strlen(line);
+    if (*src_size + length + 1 > *capacity)
+    {
+      *capacity = 2 * (*src_size + length + 1);
+      *src = (char *)realloc(*src, *capacity);
+    }
+    memcpy(*src + *src_size, line, length + 1);
+    *src_size += length;
+  }
+  fclose(kernel_file);
+
+  return is_ok;
+}
+
+char * read_kernel_file(const char * kernel_filename, size_t * kernel_src_size)
+{
+  size_t capacity = 4096;
+  char * kernel_src = (char *)malloc(capacity);
+  kernel_src[0] = '\0';
+  *kernel_src_size = 0;
+
+  if (!append_kernel_file(kernel_filename, &kernel_src, kernel_src_size, &capacity, 0))
+  {
+    free(kernel_src);
+    return NULL;
+  }
+
+  return kernel_src;
+}
+
+char * load_kernel_source(const char * kernel_filename, const char * embedded_src, size_t * kernel_src_size)
+{
+  if (kernel_filename)
+  {
+    return read_kernel_file(kernel_filename, kernel_src_size);
+  }
+
+  *kernel_src_size = strlen(embedded_src);
+  return strdup(embedded_src);
+}
+
+// Two bits an edge in EDGE order, as the set_bnd kernel reads them
+static cl_int pack_boundaries(const BOUNDARY boundaries[NUM_EDGES])
+{
+  cl_int modes = 0;
+  for (int edge = 0; edge < NUM_EDGES; edge++)
+  {
+    modes |= boundaries[edge] << (2 * edge);
+  }
+  return modes;
+}
+
+static int is_walled(FluidSim * fluid)
+{
+  for (int edge = 0; edge < NUM_EDGES; edge++)
+  {
+    if (fluid->boundaries[edge] != BOUNDARY_WALL)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// project_C and advect_project_A fill in the velocity walls themselves, as long as they reflect or all wrap with F_PERIODIC
+static int writes_velocity_walls(FluidSim * fluid)
+{
+  return fluid->is_periodic || is_walled(fluid);
+}
+
+static void reset_call_counts(FluidSim * fluid)
+{
+  fluid->calls_to_add_event_sources = 0;
+  fluid->calls_to_add_source = 0;
+  fluid->calls_to_add_forces = 0;
+  fluid->calls_to_set_bnd = 0;
+  fluid->calls_to_diffuse_bad = 0;
+  fluid->calls_to_diffuse = 0;
+  fluid->calls_to_advect = 0;
+  fluid->calls_to_advect_maccormack = 0;
+  fluid->calls_to_advect_bfecc = 0;
+  fluid->calls_to_advect_clamped = 0;
+  fluid->calls_to_project_a = 0;
+  fluid->calls_to_advect_project_a = 0;
+  fluid->calls_to_project_b = 0;
+  fluid->calls_to_project_c = 0;
+  fluid->calls_to_make_framebuffer = 0;
+  fluid->calls_to_mark_active_tiles = 0;
+  fluid->calls_to_compact_active_tiles = 0;
+  fluid->calls_to_simulate_frame = 0;
+  fluid->calls_to_check_residual = 0;
+  fluid->calls_to_set_bnd_sweep = 0;
+  fluid->calls_to_measure_fields = 0;
+  fluid->calls_to_sum_measures = 0;
+  fluid->calls_to_upsample_velocity = 0;
+  fluid->calls_to_downsample_density = 0;
+  fluid->calls_to_emit_particles = 0;
+  fluid->calls_to_advect_particles = 0;
+  fluid->calls_to_sort_particles = 0;
+  fluid->calls_to_draw_particles = 0;
+}
+
+FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags)
+{
+  // zero is always an invalid texture
+  FluidContext * shared = create_fluid_context(kernel_filename, (window_texture) ? 1 : 0, flags);
+  if (!shared)
+  {
+    return NULL;
+  }
+
+  FluidSim * fluid = create_fluid_sim_in_context(shared, window_texture, sim_size, diff, visc, num_r_steps, flags);
+  if (!fluid)
+  {
+    destroy_fluid_context(shared);
+    return NULL;
+  }
+  fluid->owns_shared = 1;
+
+  return fluid;
+}
+
+FluidSim * create_fluid_sim_in_domain(cl_uint domain, const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags)
+{
+  FluidContext * shared = create_fluid_context_in_domain(kernel_filename, flags, domain);
+  if (!shared)
+  {
+    return NULL;
+  }
+
+  FluidSim * fluid = create_fluid_sim_in_context(shared, 0, sim_size, diff, visc, num_r_steps, flags);
+  if (!fluid)
+  {
+    destroy_fluid_context(shared);
+    return NULL;
+  }
+  fluid->owns_shared = 1;
+
+  return fluid;
+}
+
+FluidSim * create_fluid_sim_in_context(FluidContext * shared, GLuint window_texture, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags)
+{
+  // everything not set below starts out NULL, so a simulation that fails half way can be destroyed
+  FluidSim * fluid = (FluidSim *)calloc(1, sizeof(FluidSim));
+
+  fluid->shared = shared;
+  fluid->owns_shared = 0;
+  fluid->context = shared->context;
+  fluid->status = CL_SUCCESS;
+
+  fluid->owns_queues = (flags & F_OWN_QUEUES) ? 1 : 0;
+  if (fluid->owns_queues)
+  {
+    fluid->command_queue = clCreateCommandQueue(fluid->context, shared->device, CL_QUEUE_PROFILING_ENABLE, &fluid->err);
+    check_fluid_error(fluid, "Unable to create command queue");
+    fluid->density_queue = clCreateCommandQueue(fluid->context, shared->device, CL_QUEUE_PROFILING_ENABLE, &fluid->err);
+    check_fluid_error(fluid, "Unable to create command queue");
+  }
+  else {
+    fluid->command_queue = shared->command_queue;
+    fluid->density_queue = shared->density_queue;
+  }
+  fluid->queue = fluid->command_queue;
+  fluid->sources_added_event = NULL;
+  fluid->velocity_done_event = NULL;
+  fluid->density_advected_event = NULL;
+  fluid->frame_done_event = NULL;
+  for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+  {
+    fluid->frames_in_flight[i] = NULL;
+  }
+  fluid->next_frame_slot = 0;
+  for (int i = 0; i < IS_NONE; i++)
+  {
+    for (int j = 0; j < MAX_FRAMES_IN_FLIGHT; j++)
+    {
+      fluid->staged_uploads[i][j] = NULL;
+    }
+    fluid->next_staged_events[i] = 0;
+  }
+
+  fluid->profile = (flags & F_PROFILE) ? 1 : 0;
+
+  // zero is always an invalid texture
+  fluid->is_using_opengl = (window_texture) ? 1 : 0;
+  if (fluid->is_using_opengl && !shared->is_using_opengl)
+  {
+    fluid->err = CL_INVALID_CONTEXT;
+    check_fluid_error(fluid, "Context was not created for OpenGL");
+  }
+
+  // the fp64 build checks the float kernels for drift, it needs doubles on the device
+  fluid->is_fp64 = (flags & F_FP64) ? 1 : 0;
+  fluid->real_size = (fluid->is_fp64) ? sizeof(cl_double) : sizeof(cl_float);
+  fluid->is_measuring = (flags & F_MEASURE) ? 1 : 0;
+  if (fluid->is_fp64)
+  {
+    size_t extensions_size = 0;
+    clGetDeviceInfo(shared->device, CL_DEVICE_EXTENSIONS, 0, NULL, &extensions_size);
+    char * extensions = (char *)calloc(extensions_size + 1, sizeof(char));
+    clGetDeviceInfo(shared->device, CL_DEVICE_EXTENSIONS, extensions_size, extensions, NULL);
+    if (!strstr(extensions, "cl_khr_fp64"))
+    {
+      fluid->err = CL_INVALID_DEVICE;
+      check_fluid_error(fluid, "Device does not support cl_khr_fp64");
+    }
+    free(extensions);
+  }
+  if (fluid->status != CL_SUCCESS)
+  {
+    destroy_fluid_sim(fluid);
+    return NULL;
+  }
+
+  // tiles have to cover the grid exactly
+  fluid->is_sparse = ((flags & F_SPARSE) && sim_size % ACTIVE_TILE_SIZE == 0) ? 1 : 0;
+  if ((flags & F_SPARSE) && !fluid->is_sparse)
+  {
+    fprintf(stderr, "Sparse mode needs a simulation size that is a multiple of %d, running the full grid\n", ACTIVE_TILE_SIZE);
+  }
+
+  // the coarse velocity grid has to cover the grid exactly
+  fluid->velocity_scale = (flags & F_QUARTER_VELOCITY) ? 4 : ((flags & F_HALF_VELOCITY) ? 2 : 1);
+  if (sim_size % fluid->velocity_scale != 0)
+  {
+    fprintf(stderr, "A coarse velocity grid needs a simulation size that is a multiple of %d, running the velocity at full resolution\n", fluid->velocity_scale);
+    fluid->velocity_scale = 1;
+  }
+
+  // edges are walls until set_boundaries, or wrap around for good with F_PERIODIC
+  fluid->is_periodic = (flags & F_PERIODIC) ? 1 : 0;
+  for (int edge = 0; edge < NUM_EDGES; edge++)
+  {
+    fluid->boundaries[edge] = (fluid->is_periodic) ? BOUNDARY_PERIODIC : BOUNDARY_WALL;
+  }
+  fluid->boundary_modes = pack_boundaries(fluid->boundaries);
+
+  fluid->sim_size = sim_size;
+  fluid->stride = sim_size + 2;
+  fluid->max_diffuse_steps = num_r_steps;
+  fluid->max_project_steps = num_r_steps;
+  fluid->diffuse_tolerance = DEFAULT_DIFFUSE_TOLERANCE;
+  fluid->project_tolerance = DEFAULT_PROJECT_TOLERANCE;
+  fluid->diffusion_rate = diff;
+  fluid->viscosity = visc;
+  fluid->density_advection = ADVECT_SEMI_LAGRANGIAN;
+  fluid->velocity_advection = ADVECT_SEMI_LAGRANGIAN;
+  fluid->vorticity_confinement = 0;
+  fluid->buoyancy = 0;
+
+  fluid->global_size[0] = fluid->sim_size;
+  fluid->global_size[1] = fluid->sim_size;
+  // TODO: be smarter about setting these values
+  fluid->local_size[0] = 32;
+  fluid->local_size[1] = 32;
+  fluid->buffer_size = 2 * (fluid->sim_size + 2) * (fluid->sim_size + 2);
+  fluid->full_local_size = 8;
+  fluid->set_bnd_global_size = (fluid->sim_size + 1);
+  fluid->set_bnd_local_size = 1;
+  fluid->obstacle_words = (fluid->sim_size + 31) / 32;
+  fluid->num_obstacle_tiles = (fluid->sim_size + OBSTACLE_TILE_SIZE - 1) / OBSTACLE_TILE_SIZE;
+  fluid->active_tiles_per_row = fluid->sim_size / ACTIVE_TILE_SIZE;
+  fluid->num_active_tiles = 0;
+  fluid->density_threshold = DEFAULT_DENSITY_THRESHOLD;
+  fluid->velocity_threshold = DEFAULT_VELOCITY_THRESHOLD;
+
+  fluid->a_density_events.num_events = 0;
+  fluid->b_density_events.num_events = 0;
+  fluid->u_velocity_events.num_events = 0;
+  fluid->v_velocity_events.num_events = 0;
+
+  fluid->cur_sample = 0;
+
+  cl_device_id fluid_device = shared->device;
+
   size_t max_work_item_dimensions;
   clGetDeviceInfo(fluid_device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(size_t), &max_work_item_dimensions, NULL);
 
@@ -148,42 +439,19 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
     fprintf(stdout, "Max work item size (%zu, %zu)\nlocal work size (%zu, %zu)\n", max_work_item_size[0], max_work_item_size[1], fluid->local_size[0], fluid->local_size[1]);
   }
 
-  if (fluid->is_using_opengl) {
-#ifdef __APPLE__
-    CGLContextObj gl_context = CGLGetCurrentContext();
-    CGLShareGroupObj gl_share_group = CGLGetShareGroup(gl_context);
-
-    cl_context_properties properties[] = {
-      CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)gl_share_group,
-      0
-    };
-#elif __linux__
-    cl_context_properties properties[] = {
-      CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
-      CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
-      CL_CONTEXT_PLATFORM, (cl_context_properties)fluid_platform,
-      0
-    };
-#endif
-    // Create OpenCL context
-    fluid->context = clCreateContext(properties, 1, &fluid_device, NULL, NULL, &err);
-    check_error(err, "Unable to create cl context");
-  }
-  else {
-    fluid->context = clCreateContext(NULL, 1, &fluid_device, NULL, NULL, &err);
-    check_error(err, "Unable to create cl context");
-  }
-
-  // commands are executed in-order
-  fluid->command_queue = clCreateCommandQueue(fluid->context, fluid_device, CL_QUEUE_PROFILING_ENABLE, &err);
-  check_error(err, "Unable to create command queue");
+  // a work group of a tiled launch covers whole rows of one tile
+  size_t max_work_group_size;
+  clGetDeviceInfo(fluid_device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_work_group_size, NULL);
 
-  fluid->program = clCreateProgramWithSource(fluid->context, 1, (const char **)&kernel_src, (const size_t *)&kernel_src_size, &err);
-  free(kernel_src);
-  check_error(err, "Unable to create program with source");
+  fluid->tile_local_size[0] = ACTIVE_TILE_SIZE;
+  fluid->tile_local_size[1] = ACTIVE_TILE_SIZE;
+  while (fluid->tile_local_size[1] > 1 && (fluid->tile_local_size[0] * fluid->tile_local_size[1] > max_work_group_size || fluid->tile_local_size[1] > max_work_item_size[1]))
+  {
+    fluid->tile_local_size[1] /= 2;
+  }
 
-  char * kernel_definitions = malloc(256);
-  snprintf(kernel_definitions, 256, "-D SIM_SIZE=%zu "
+  char * kernel_definitions = malloc(1024);
+  snprintf(kernel_definitions, 1024, "-D SIM_SIZE=%zu "
                                     "-D STRIDE=%zu "
                                     "-D DOUBLE_STRIDE=%zu "
                                     "-D MAX_DENSITY=%d "
@@ -193,354 +461,2146 @@ FluidSim * create_fluid_sim(GLuint window_texture, const char * kernel_filename,
                                     "-D IS_VELOCITY=%d "
                                     "-D IS_U_VELOCITY=%d "
                                     "-D IS_V_VELOCITY=%d "
-                                    , fluid->sim_size, fluid->stride, 2 * fluid->stride, MAX_DENSITY, IS_DENSITY, IS_A_DENSITY, IS_B_DENSITY, IS_VELOCITY, IS_U_VELOCITY, IS_V_VELOCITY);
-
-  err = clBuildProgram(fluid->program, 1, &fluid_device, kernel_definitions, NULL, NULL);
+                                    "-D IS_NONE=%d "
+                                    "-D OBSTACLE_WORDS=%zu "
+                                    "-D OBSTACLE_TILE_SIZE=%d "
+                                    "-D NUM_OBSTACLE_TILES=%zu "
+                                    "-D TILE_FLUID=%d "
+                                    "-D TILE_MIXED=%d "
+                                    "-D TILE_SOLID=%d "
+                                    "-D ACTIVE_TILE_SIZE=%d "
+                                    "-D NUM_ACTIVE_TILES=%zu "
+                                    "-D VIEW_DENSITY_COLORS=%d "
+                                    "-D VIEW_DENSITY=%d "
+                                    "-D VIEW_SPEED=%d "
+                                    "-D VIEW_VORTICITY=%d "
+                                    "-D SOLVE_DONE=%d "
+                                    "-D SOLVE_RESIDUAL=%d "
+                                    "-D SOLVE_SWEEPS=%d "
+                                    "-D SOLVE_LAST_RESIDUAL=%d "
+                                    "-D MEASURE_MASS=%d "
+                                    "-D MEASURE_ENERGY=%d "
+                                    "-D MEASURE_DIVERGENCE=%d "
+                                    "-D NUM_MEASURES=%d "
+                                    "-D VELOCITY_SCALE=%d "
+                                    "-D VELOCITY_SIZE=%zu "
+                                    "-D VELOCITY_STRIDE=%zu "
+                                    "-D BOUNDARY_WALL=%d "
+                                    "-D BOUNDARY_PERIODIC=%d "
+                                    "-D BOUNDARY_OUTFLOW=%d "
+                                    "%s"
+                                    "%s"
+                                    , fluid->sim_size, fluid->stride, 2 * fluid->stride, MAX_DENSITY, IS_DENSITY, IS_A_DENSITY, IS_B_DENSITY, IS_VELOCITY, IS_U_VELOCITY, IS_V_VELOCITY, IS_NONE,
+                                    fluid->obstacle_words, OBSTACLE_TILE_SIZE, fluid->num_obstacle_tiles, TILE_FLUID, TILE_MIXED, TILE_SOLID,
+                                    ACTIVE_TILE_SIZE, fluid->active_tiles_per_row, VIEW_DENSITY_COLORS, VIEW_DENSITY, VIEW_SPEED, VIEW_VORTICITY,
+                                    SOLVE_DONE, SOLVE_RESIDUAL, SOLVE_SWEEPS, SOLVE_LAST_RESIDUAL, MEASURE_MASS, MEASURE_ENERGY, MEASURE_DIVERGENCE, NUM_MEASURES,
+                                    fluid->velocity_scale, fluid->sim_size / fluid->velocity_scale, fluid->sim_size / fluid->velocity_scale + 2,
+                                    BOUNDARY_WALL, BOUNDARY_PERIODIC, BOUNDARY_OUTFLOW,
+                                    (fluid->is_periodic) ? "-D PERIODIC " : "", (fluid->is_fp64) ? "-D USE_FP64 " : "");
+
+  fluid->program = get_fluid_program(shared, kernel_definitions);
   free(kernel_definitions);
-  const size_t max_log_length = 16384;
-  char log[max_log_length];
-  clGetProgramBuildInfo(fluid->program, fluid_device, CL_PROGRAM_BUILD_LOG, max_log_length, log, NULL);
-  fprintf(stderr, "%s", log);
-  check_error(err, "Unable to build program");
-
-  fluid->set_bnd_kernel = clCreateKernel(fluid->program, "set_bnd", &err);
-  check_error(err, "Unable to create set_bnd");
-  fluid->add_event_sources_kernel = clCreateKernel(fluid->program, "add_event_sources", &err);
-  check_error(err, "Unable to create make_area");
-  fluid->add_source_kernel = clCreateKernel(fluid->program, "add_source", &err);
-  check_error(err, "Unable to create add_source");
-  fluid->diffuse_bad_kernel = clCreateKernel(fluid->program, "diffuse_bad", &err);
-  check_error(err, "Unable to create diffuse_bad");
-  fluid->diffuse_kernel = clCreateKernel(fluid->program, "diffuse", &err);
-  check_error(err, "Unable to create diffuse");
-  fluid->advect_kernel = clCreateKernel(fluid->program, "advect", &err);
-  check_error(err, "Unable to create advect");
-  fluid->project_a_kernel = clCreateKernel(fluid->program, "project_A", &err);
-  check_error(err, "Unable to create project_A");
-  fluid->project_b_kernel = clCreateKernel(fluid->program, "project_B", &err);
-  check_error(err, "Unable to create project_B");
-  fluid->project_c_kernel = clCreateKernel(fluid->program, "project_C", &err);
-  check_error(err, "Unable to create project_C");
-  fluid->make_framebuffer_kernel = clCreateKernel(fluid->program, "make_framebuffer", &err);
-  check_error(err, "Unable to create make_framebuffer");
-
-  fluid->density_mem[0] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, fluid->buffer_size * sizeof(cl_float), NULL, &err);
-  check_error(err, "Unable to create buffer");
-  fluid->density_mem[1] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, fluid->buffer_size * sizeof(cl_float), NULL, &err);
-  check_error(err, "Unable to create buffer");
-  fluid->velocity_mem[0] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, fluid->buffer_size * sizeof(cl_float), NULL, &err);
-  check_error(err, "Unable to create buffer");
-  fluid->velocity_mem[1] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, fluid->buffer_size * sizeof(cl_float), NULL, &err);
-  check_error(err, "Unable to create buffer");
+
+  fluid->set_bnd_kernel = clCreateKernel(fluid->program, "set_bnd", &fluid->err);
+  check_fluid_error(fluid, "Unable to create set_bnd");
+  fluid->add_event_sources_kernel = clCreateKernel(fluid->program, "add_event_sources", &fluid->err);
+  check_fluid_error(fluid, "Unable to create make_area");
+  fluid->add_source_kernel = clCreateKernel(fluid->program, "add_source", &fluid->err);
+  check_fluid_error(fluid, "Unable to create add_source");
+  fluid->add_forces_kernel = clCreateKernel(fluid->program, "add_forces", &fluid->err);
+  check_fluid_error(fluid, "Unable to create add_forces");
+  fluid->diffuse_bad_kernel = clCreateKernel(fluid->program, "diffuse_bad", &fluid->err);
+  check_fluid_error(fluid, "Unable to create diffuse_bad");
+  fluid->diffuse_kernel = clCreateKernel(fluid->program, "diffuse", &fluid->err);
+  check_fluid_error(fluid, "Unable to create diffuse");
+  fluid->advect_kernel = clCreateKernel(fluid->program, "advect", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect");
+  fluid->advect_maccormack_kernel = clCreateKernel(fluid->program, "advect_maccormack", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_maccormack");
+  fluid->advect_bfecc_kernel = clCreateKernel(fluid->program, "advect_bfecc", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_bfecc");
+  fluid->advect_clamped_kernel = clCreateKernel(fluid->program, "advect_clamped", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_clamped");
+  fluid->project_a_kernel = clCreateKernel(fluid->program, "project_A", &fluid->err);
+  check_fluid_error(fluid, "Unable to create project_A");
+  fluid->advect_project_a_kernel = clCreateKernel(fluid->program, "advect_project_A", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_project_A");
+  fluid->project_b_kernel = clCreateKernel(fluid->program, "project_B", &fluid->err);
+  check_fluid_error(fluid, "Unable to create project_B");
+  fluid->project_c_kernel = clCreateKernel(fluid->program, "project_C", &fluid->err);
+  check_fluid_error(fluid, "Unable to create project_C");
+  fluid->render_view_kernel = clCreateKernel(fluid->program, "render_view", &fluid->err);
+  check_fluid_error(fluid, "Unable to create render_view");
+  fluid->add_source_tiled_kernel = clCreateKernel(fluid->program, "add_source_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create add_source_tiled");
+  fluid->diffuse_tiled_kernel = clCreateKernel(fluid->program, "diffuse_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create diffuse_tiled");
+  fluid->advect_tiled_kernel = clCreateKernel(fluid->program, "advect_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_tiled");
+  fluid->advect_maccormack_tiled_kernel = clCreateKernel(fluid->program, "advect_maccormack_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_maccormack_tiled");
+  fluid->advect_bfecc_tiled_kernel = clCreateKernel(fluid->program, "advect_bfecc_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_bfecc_tiled");
+  fluid->advect_clamped_tiled_kernel = clCreateKernel(fluid->program, "advect_clamped_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_clamped_tiled");
+  fluid->make_framebuffer_tiled_kernel = clCreateKernel(fluid->program, "make_framebuffer_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create make_framebuffer_tiled");
+  fluid->render_view_rgba_kernel = clCreateKernel(fluid->program, "render_view_rgba", &fluid->err);
+  check_fluid_error(fluid, "Unable to create render_view_rgba");
+  fluid->make_framebuffer_rgba_tiled_kernel = clCreateKernel(fluid->program, "make_framebuffer_rgba_tiled", &fluid->err);
+  check_fluid_error(fluid, "Unable to create make_framebuffer_rgba_tiled");
+  fluid->mark_active_tiles_kernel = clCreateKernel(fluid->program, "mark_active_tiles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create mark_active_tiles");
+  fluid->compact_active_tiles_kernel = clCreateKernel(fluid->program, "compact_active_tiles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create compact_active_tiles");
+  fluid->simulate_frame_kernel = clCreateKernel(fluid->program, "simulate_frame", &fluid->err);
+  check_fluid_error(fluid, "Unable to create simulate_frame");
+  fluid->check_residual_kernel = clCreateKernel(fluid->program, "check_residual", &fluid->err);
+  check_fluid_error(fluid, "Unable to create check_residual");
+  fluid->set_bnd_sweep_kernel = clCreateKernel(fluid->program, "set_bnd_sweep", &fluid->err);
+  check_fluid_error(fluid, "Unable to create set_bnd_sweep");
+  fluid->measure_fields_kernel = clCreateKernel(fluid->program, "measure_fields", &fluid->err);
+  check_fluid_error(fluid, "Unable to create measure_fields");
+  fluid->sum_measures_kernel = clCreateKernel(fluid->program, "sum_measures", &fluid->err);
+  check_fluid_error(fluid, "Unable to create sum_measures");
+  fluid->upsample_velocity_kernel = clCreateKernel(fluid->program, "upsample_velocity", &fluid->err);
+  check_fluid_error(fluid, "Unable to create upsample_velocity");
+  fluid->downsample_density_kernel = clCreateKernel(fluid->program, "downsample_density", &fluid->err);
+  check_fluid_error(fluid, "Unable to create downsample_density");
+  fluid->emit_particles_kernel = clCreateKernel(fluid->program, "emit_particles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create emit_particles");
+  fluid->advect_particles_kernel = clCreateKernel(fluid->program, "advect_particles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create advect_particles");
+  fluid->count_particles_kernel = clCreateKernel(fluid->program, "count_particles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create count_particles");
+  fluid->scan_particle_cells_kernel = clCreateKernel(fluid->program, "scan_particle_cells", &fluid->err);
+  check_fluid_error(fluid, "Unable to create scan_particle_cells");
+  fluid->scatter_particles_kernel = clCreateKernel(fluid->program, "scatter_particles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create scatter_particles");
+  fluid->draw_particles_kernel = clCreateKernel(fluid->program, "draw_particles", &fluid->err);
+  check_fluid_error(fluid, "Unable to create draw_particles");
+  fluid->draw_particles_rgba_kernel = clCreateKernel(fluid->program, "draw_particles_rgba", &fluid->err);
+  check_fluid_error(fluid, "Unable to create draw_particles_rgba");
+
+  // the whole frame runs in one work-group, as large as the kernel allows
+  fluid->err = clGetKernelWorkGroupInfo(fluid->simulate_frame_kernel, fluid_device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &fluid->single_dispatch_local_size, NULL);
+  check_fluid_error(fluid, "Unable to get kernel work-group size");
+  if (flags & F_DEBUG)
+  {
+    fprintf(stdout, "Single dispatch work-group size %zu\n", fluid->single_dispatch_local_size);
+  }
+
+  // a single work-group cannot skip tiles, and once each of its work items walks more than a few cells per pass
+  // the launches it saves cost less than the device it leaves idle
+  size_t max_single_dispatch_cells = fluid->single_dispatch_local_size * MAX_SINGLE_DISPATCH_CELLS_PER_ITEM;
+  fluid->is_single_dispatch = ((flags & F_SINGLE_DISPATCH) && !fluid->is_sparse && fluid->velocity_scale == 1 && (size_t)sim_size * sim_size <= max_single_dispatch_cells) ? 1 : 0;
+  if ((flags & F_SINGLE_DISPATCH) && !fluid->is_single_dispatch)
+  {
+    fprintf(stderr, "Single dispatch mode needs a full resolution grid of at most %zu cells on this device, launching every step\n", max_single_dispatch_cells);
+  }
+
+  // so is the scan of the particle sort
+  fluid->err = clGetKernelWorkGroupInfo(fluid->scan_particle_cells_kernel, fluid_device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &fluid->particle_scan_local_size, NULL);
+  check_fluid_error(fluid, "Unable to get kernel work-group size");
+
+  fluid->density_mem[0] = acquire_buffer(shared, fluid->buffer_size * fluid->real_size, &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->density_mem[1] = acquire_buffer(shared, fluid->buffer_size * fluid->real_size, &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->velocity_mem[0] = acquire_buffer(shared, fluid->buffer_size * fluid->real_size, &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->velocity_mem[1] = acquire_buffer(shared, fluid->buffer_size * fluid->real_size, &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->advect_mem = acquire_buffer(shared, fluid->buffer_size * fluid->real_size, &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->encoder = NULL;
+  reset_call_counts(fluid);
+  fluid->framebuffer_width = fluid->sim_size;
+  fluid->framebuffer_height = fluid->sim_size;
+
+  const cl_float grey_lut[] = {0, 0, 0, 1, 1, 1, 1, 1};
+  fluid->view_lut_mem = NULL;
+  set_view(fluid, VIEW_DENSITY_COLORS, grey_lut, 2, 0, 1);
   if (fluid->is_using_opengl)
   {
-    fluid->framebuffer = clCreateFromGLTexture(fluid->context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, window_texture, &err);
-    check_error(err, "Unable to create cl/gl texture");
+    fluid->framebuffer = clCreateFromGLTexture(fluid->context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, window_texture, &fluid->err);
+    check_fluid_error(fluid, "Unable to create cl/gl texture");
+
+    clGetImageInfo(fluid->framebuffer, CL_IMAGE_WIDTH, sizeof(size_t), &fluid->framebuffer_width, NULL);
+    clGetImageInfo(fluid->framebuffer, CL_IMAGE_HEIGHT, sizeof(size_t), &fluid->framebuffer_height, NULL);
+  }
+
+  // everything starts out as fluid
+  fluid->obstacle_bits = (cl_uint *)calloc(fluid->sim_size * fluid->obstacle_words, sizeof(cl_uint));
+  fluid->obstacle_tiles = (cl_uchar *)calloc(fluid->num_obstacle_tiles * fluid->num_obstacle_tiles, sizeof(cl_uchar));
+  fluid->obstacle_mem = acquire_buffer(shared, fluid->sim_size * fluid->obstacle_words * sizeof(cl_uint), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->obstacle_tiles_mem = acquire_buffer(shared, fluid->num_obstacle_tiles * fluid->num_obstacle_tiles * sizeof(cl_uchar), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->err = clEnqueueWriteBuffer(fluid->command_queue, fluid->obstacle_mem, CL_FALSE, 0, fluid->sim_size * fluid->obstacle_words * sizeof(cl_uint), fluid->obstacle_bits, 0, NULL, NULL);
+  fluid->err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->obstacle_tiles_mem, CL_FALSE, 0, fluid->num_obstacle_tiles * fluid->num_obstacle_tiles * sizeof(cl_uchar), fluid->obstacle_tiles, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to write to buffer");
+
+  if (fluid->is_sparse)
+  {
+    size_t num_tiles = fluid->active_tiles_per_row * fluid->active_tiles_per_row;
+    fluid->active_mem = acquire_buffer(shared, num_tiles * sizeof(cl_uint), &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+    fluid->active_tiles_mem = acquire_buffer(shared, num_tiles * sizeof(cl_uint), &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+    fluid->num_active_tiles_mem = acquire_buffer(shared, sizeof(cl_uint), &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+  }
+
+  fluid->source_x = acquire_buffer(shared, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->source_y = acquire_buffer(shared, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->source_strength = acquire_buffer(shared, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_float), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->source_max_radius_sqrd = acquire_buffer(shared, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+
+  // until a relaxation has been read back it runs every sweep
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    fluid->solve_mem[i] = acquire_buffer(shared, SOLVE_ENTRIES * sizeof(cl_uint), &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+    fluid->solve_read_events[i] = NULL;
+    fluid->solve_sweeps[i] = 0;
+    fluid->solve_converged[i] = 0;
+    fluid->solve_budgets[i] = 0;
+  }
+
+  // one partial per work-group of the interior, summed by a single work-group as large as the kernel
+  // and the local memory holding its NUM_MEASURES reals per work item allow
+  fluid->measures_read_event = NULL;
+  if (fluid->is_measuring)
+  {
+    fluid->num_measure_partials = (fluid->global_size[0] / fluid->local_size[0]) * (fluid->global_size[1] / fluid->local_size[1]);
+    size_t sum_measures_size;
+    fluid->err = clGetKernelWorkGroupInfo(fluid->sum_measures_kernel, fluid_device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &sum_measures_size, NULL);
+    check_fluid_error(fluid, "Unable to get kernel work-group size");
+    cl_ulong local_mem_size;
+    fluid->err = clGetDeviceInfo(fluid_device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+    check_fluid_error(fluid, "Unable to get device local memory size");
+    cl_ulong kernel_local_mem_size;
+    fluid->err = clGetKernelWorkGroupInfo(fluid->sum_measures_kernel, fluid_device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &kernel_local_mem_size, NULL);
+    check_fluid_error(fluid, "Unable to get kernel local memory size");
+    size_t scratch_items = local_mem_size > kernel_local_mem_size ? (local_mem_size - kernel_local_mem_size) / (NUM_MEASURES * fluid->real_size) : 1;
+    fluid->measure_local_size = fmin(fluid->num_measure_partials, fmin(fmin(sum_measures_size, max_work_item_size[0]), scratch_items));
+    if (fluid->measure_local_size < 1)
+      fluid->measure_local_size = 1;
+
+    fluid->measure_partials_mem = acquire_buffer(shared, NUM_MEASURES * fluid->num_measure_partials * fluid->real_size, &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+    fluid->measures_mem = acquire_buffer(shared, NUM_MEASURES * fluid->real_size, &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+  }
+  memset(fluid->measure_results, 0, sizeof(fluid->measure_results));
+
+  // no particles until set_particles makes room for them
+  fluid->max_particles = 0;
+  fluid->particle_bound = 0;
+  fluid->particle_count_read_event = NULL;
+  fluid->particle_seed = 0;
+
+  // start from still, empty fluid, sparse mode never touches quiet tiles again
+  cl_float pattern = 0;
+  fluid->err = clEnqueueFillBuffer(fluid->command_queue, fluid->density_mem[PREV], (void *)&pattern, sizeof(cl_float), 0, fluid->buffer_size * fluid->real_size, 0, NULL, NULL);
+  fluid->err |= clEnqueueFillBuffer(fluid->command_queue, fluid->density_mem[CUR], (void *)&pattern, sizeof(cl_float), 0, fluid->buffer_size * fluid->real_size, 0, NULL, NULL);
+  fluid->err |= clEnqueueFillBuffer(fluid->command_queue, fluid->velocity_mem[PREV], (void *)&pattern, sizeof(cl_float), 0, fluid->buffer_size * fluid->real_size, 0, NULL, NULL);
+  fluid->err |= clEnqueueFillBuffer(fluid->command_queue, fluid->velocity_mem[CUR], (void *)&pattern, sizeof(cl_float), 0, fluid->buffer_size * fluid->real_size, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to clear buffers");
+
+  // the velocity step runs in a simulation of its own on the coarse grid, on the same queues
+  fluid->velocity_sim = NULL;
+  fluid->velocity_upsampling = UPSAMPLE_BILINEAR;
+  if (fluid->velocity_scale > 1)
+  {
+    FLAGS velocity_flags = flags & (F_PROFILE | F_USE_CPU | F_USE_GPU | F_DEBUG | F_FP64 | F_PERIODIC);
+    fluid->velocity_sim = create_fluid_sim_in_context(shared, 0, fluid->sim_size / fluid->velocity_scale, diff, visc, num_r_steps, velocity_flags);
+    if (fluid->velocity_sim)
+    {
+      fluid->velocity_sim->command_queue = fluid->command_queue;
+      fluid->velocity_sim->density_queue = fluid->density_queue;
+      fluid->velocity_sim->queue = fluid->command_queue;
+    }
+    else {
+      fluid->err = CL_OUT_OF_RESOURCES;
+      check_fluid_error(fluid, "Unable to create the velocity grid");
+    }
   }
-  fluid->source_x = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
-  check_error(err, "Unable to create buffer");
-  fluid->source_y = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
-  check_error(err, "Unable to create buffer");
-  fluid->source_strength = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_float), NULL, &err);
-  check_error(err, "Unable to create buffer");
-  fluid->source_max_radius_sqrd = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
-  check_error(err, "Unable to create buffer");
 
   // err = clFlush(fluid->command_queue);
-  err = clFinish(fluid->command_queue);
-  check_error(err, "Unable to finish queue");
+  fluid->err = clFinish(fluid->command_queue);
+  check_fluid_error(fluid, "Unable to finish queue");
+
+  if (fluid->status != CL_SUCCESS)
+  {
+    destroy_fluid_sim(fluid);
+    return NULL;
+  }
 
   return fluid;
 }
 
+// Returns the particle buffers to the pool, the queues must be finished
+static void release_particles(FluidSim * fluid)
+{
+  if (fluid->particle_count_read_event)
+  {
+    clReleaseEvent(fluid->particle_count_read_event);
+    fluid->particle_count_read_event = NULL;
+  }
+  if (fluid->max_particles)
+  {
+    release_buffer(fluid->shared, fluid->particle_mem[0]);
+    release_buffer(fluid->shared, fluid->particle_mem[1]);
+    release_buffer(fluid->shared, fluid->num_particles_mem);
+    release_buffer(fluid->shared, fluid->particle_counts_mem);
+    release_buffer(fluid->shared, fluid->particle_starts_mem);
+    release_buffer(fluid->shared, fluid->particle_ranks_mem);
+  }
+  fluid->max_particles = 0;
+  fluid->particle_bound = 0;
+}
+
 void destroy_fluid_sim(FluidSim * fluid)
 {
   //clFlush(fluid->command_queue);
   clFinish(fluid->command_queue);
+  clFinish(fluid->density_queue);
 
-  clReleaseMemObject(fluid->density_mem[0]);
-  clReleaseMemObject(fluid->density_mem[1]);
-  clReleaseMemObject(fluid->velocity_mem[0]);
-  clReleaseMemObject(fluid->velocity_mem[1]);
-  clReleaseMemObject(fluid->framebuffer);
-  clReleaseMemObject(fluid->source_x);
-  clReleaseMemObject(fluid->source_y);
-  clReleaseMemObject(fluid->source_strength);
-  clReleaseMemObject(fluid->source_max_radius_sqrd);
+  FluidContext * shared = fluid->shared;
 
-  clReleaseKernel(fluid->set_bnd_kernel);
-  clReleaseKernel(fluid->add_event_sources_kernel);
+  cl_event frame_events[] = {fluid->sources_added_event, fluid->velocity_done_event, fluid->density_advected_event, fluid->frame_done_event};
+  for (int i = 0; i < 4; i++)
+  {
+    if (frame_events[i])
+    {
+      clReleaseEvent(frame_events[i]);
+    }
+  }
+  for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+  {
+    if (fluid->frames_in_flight[i])
+    {
+      clReleaseEvent(fluid->frames_in_flight[i]);
+    }
+  }
+  for (int i = 0; i < IS_NONE; i++)
+  {
+    for (int j = 0; j < MAX_FRAMES_IN_FLIGHT; j++)
+    {
+      if (fluid->staged_uploads[i][j])
+      {
+        clReleaseEvent(fluid->staged_uploads[i][j]);
+      }
+    }
+  }
+  for (int i = 0; i < NUM_FRAME_MARKERS; i++)
+  {
+    if (fluid->frame_markers[i])
+    {
+      clReleaseEvent(fluid->frame_markers[i]);
+    }
+  }
+
+  release_buffer(shared, fluid->density_mem[0]);
+  release_buffer(shared, fluid->density_mem[1]);
+  release_buffer(shared, fluid->velocity_mem[0]);
+  release_buffer(shared, fluid->velocity_mem[1]);
+  release_buffer(shared, fluid->advect_mem);
+  if (fluid->is_using_opengl)
+  {
+    clReleaseMemObject(fluid->framebuffer);
+  }
+  clReleaseMemObject(fluid->view_lut_mem);
+  if (fluid->encoder)
+  {
+    release_buffer(shared, fluid->frame_mem);
+  }
+  release_buffer(shared, fluid->obstacle_mem);
+  release_buffer(shared, fluid->obstacle_tiles_mem);
+  if (fluid->is_sparse)
+  {
+    release_buffer(shared, fluid->active_mem);
+    release_buffer(shared, fluid->active_tiles_mem);
+    release_buffer(shared, fluid->num_active_tiles_mem);
+  }
+  release_buffer(shared, fluid->source_x);
+  release_buffer(shared, fluid->source_y);
+  release_buffer(shared, fluid->source_strength);
+  release_buffer(shared, fluid->source_max_radius_sqrd);
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    if (fluid->solve_read_events[i])
+    {
+      clReleaseEvent(fluid->solve_read_events[i]);
+    }
+    release_buffer(shared, fluid->solve_mem[i]);
+  }
+  if (fluid->measures_read_event)
+  {
+    clReleaseEvent(fluid->measures_read_event);
+  }
+  if (fluid->is_measuring)
+  {
+    release_buffer(shared, fluid->measure_partials_mem);
+    release_buffer(shared, fluid->measures_mem);
+  }
+  release_particles(fluid);
+
+  clReleaseKernel(fluid->set_bnd_kernel);
+  clReleaseKernel(fluid->add_event_sources_kernel);
   clReleaseKernel(fluid->add_source_kernel);
+  clReleaseKernel(fluid->add_forces_kernel);
   clReleaseKernel(fluid->diffuse_bad_kernel);
   clReleaseKernel(fluid->diffuse_kernel);
   clReleaseKernel(fluid->advect_kernel);
+  clReleaseKernel(fluid->advect_maccormack_kernel);
+  clReleaseKernel(fluid->advect_bfecc_kernel);
+  clReleaseKernel(fluid->advect_clamped_kernel);
   clReleaseKernel(fluid->project_a_kernel);
+  clReleaseKernel(fluid->advect_project_a_kernel);
   clReleaseKernel(fluid->project_b_kernel);
   clReleaseKernel(fluid->project_c_kernel);
-  if (fluid->is_using_opengl)
+  clReleaseKernel(fluid->add_source_tiled_kernel);
+  clReleaseKernel(fluid->diffuse_tiled_kernel);
+  clReleaseKernel(fluid->advect_tiled_kernel);
+  clReleaseKernel(fluid->advect_maccormack_tiled_kernel);
+  clReleaseKernel(fluid->advect_bfecc_tiled_kernel);
+  clReleaseKernel(fluid->advect_clamped_tiled_kernel);
+  clReleaseKernel(fluid->make_framebuffer_tiled_kernel);
+  clReleaseKernel(fluid->render_view_rgba_kernel);
+  clReleaseKernel(fluid->render_view_kernel);
+  clReleaseKernel(fluid->make_framebuffer_rgba_tiled_kernel);
+  clReleaseKernel(fluid->mark_active_tiles_kernel);
+  clReleaseKernel(fluid->compact_active_tiles_kernel);
+  clReleaseKernel(fluid->simulate_frame_kernel);
+  clReleaseKernel(fluid->check_residual_kernel);
+  clReleaseKernel(fluid->set_bnd_sweep_kernel);
+  clReleaseKernel(fluid->measure_fields_kernel);
+  clReleaseKernel(fluid->sum_measures_kernel);
+  clReleaseKernel(fluid->upsample_velocity_kernel);
+  clReleaseKernel(fluid->downsample_density_kernel);
+  clReleaseKernel(fluid->emit_particles_kernel);
+  clReleaseKernel(fluid->advect_particles_kernel);
+  clReleaseKernel(fluid->count_particles_kernel);
+  clReleaseKernel(fluid->scan_particle_cells_kernel);
+  clReleaseKernel(fluid->scatter_particles_kernel);
+  clReleaseKernel(fluid->draw_particles_kernel);
+  clReleaseKernel(fluid->draw_particles_rgba_kernel);
+
+  // runs on the queues released below
+  if (fluid->velocity_sim)
+  {
+    destroy_fluid_sim(fluid->velocity_sim);
+  }
+
+  if (fluid->owns_queues)
+  {
+    clReleaseCommandQueue(fluid->command_queue);
+    clReleaseCommandQueue(fluid->density_queue);
+  }
+
+  // the program, queue and context belong to the shared context
+  if (fluid->owns_shared)
+  {
+    destroy_fluid_context(shared);
+  }
+
+  free(fluid->obstacle_bits);
+  free(fluid->obstacle_tiles);
+  free(fluid);
+}
+
+// Replaces event with one that completes once everything enqueued on queue so far has
+static void mark_queue(FluidSim * fluid, cl_command_queue queue, cl_event * event)
+{
+  if (*event)
   {
-    clReleaseKernel(fluid->make_framebuffer_kernel);
+    clReleaseEvent(*event);
   }
 
-  clReleaseProgram(fluid->program);
-  clReleaseCommandQueue(fluid->command_queue);
-  clReleaseContext(fluid->context);
+  fluid->err = clEnqueueMarkerWithWaitList(queue, 0, NULL, event);
+  check_fluid_error(fluid, "Unable to enqueue marker");
+}
+
+// Holds back everything enqueued on queue after this until event completes, there is nothing to wait for before the first frame
+static void wait_for_event(FluidSim * fluid, cl_command_queue queue, cl_event event)
+{
+  if (event)
+  {
+    fluid->err = clEnqueueBarrierWithWaitList(queue, 1, &event, NULL);
+    check_fluid_error(fluid, "Unable to enqueue barrier");
+  }
+}
+
+static void collect_relaxation(FluidSim * fluid, RELAXATION relaxation);
+
+// The queues have been finished, so the progress of the last relaxations has been read back
+static void print_relaxation_sweeps(FluidSim * fluid)
+{
+  const char * names[NUM_RELAXATIONS] = {"velocity diffuse", "pressure", "advected pressure", "density diffuse"};
+  const int max_steps[NUM_RELAXATIONS] = {fluid->max_diffuse_steps, fluid->max_project_steps, fluid->max_project_steps, fluid->max_diffuse_steps};
+
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    collect_relaxation(fluid, i);
+    if (fluid->solve_sweeps[i])
+    {
+      fprintf(stdout, "%d of %d sweeps for %s, residual %g%s\n", fluid->solve_sweeps[i], max_steps[i], names[i], fluid->solve_residuals[i], (fluid->solve_converged[i]) ? "" : " (did not converge)");
+    }
+  }
+}
+
+// Adds the device time between the ends of two markers of the timed frame to stage
+static void time_stage(FluidSim * fluid, FRAME_STAGE stage, FRAME_MARKER first, FRAME_MARKER last)
+{
+  cl_ulong start, end;
+  cl_int err = clGetEventProfilingInfo(fluid->frame_markers[first], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &start, NULL);
+  err |= clGetEventProfilingInfo(fluid->frame_markers[last], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+
+  // some devices do not time markers, the stage is left out then
+  if (err == CL_SUCCESS && end >= start)
+  {
+    FluidMetrics * metrics = &fluid->metrics->current;
+    metrics->stage_seconds[stage] = (end - start) / 1e9;
+    metrics->stage_seconds_total[stage] += metrics->stage_seconds[stage];
+    metrics->stage_samples[stage]++;
+  }
+}
+
+// Takes in the stages of the timed frame once it has run, a frame that was never presented is dropped
+static void collect_frame_timing(FluidSim * fluid)
+{
+  cl_event done = fluid->frame_markers[MARK_FRAME_DONE];
+  if (done)
+  {
+    cl_int status;
+    fluid->err = clGetEventInfo(done, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+    check_fluid_error(fluid, "Unable to get event info");
+    if (status > CL_COMPLETE)
+    {
+      return;
+    }
+
+    if (status == CL_COMPLETE)
+    {
+      if (fluid->frame_markers[MARK_VELOCITY_DONE])
+      {
+        time_stage(fluid, STAGE_VELOCITY, MARK_FRAME_BEGIN, MARK_VELOCITY_DONE);
+      }
+      time_stage(fluid, STAGE_SIMULATE, MARK_FRAME_BEGIN, MARK_DENSITY_ADVECTED);
+      time_stage(fluid, STAGE_PRESENT, MARK_DENSITY_ADVECTED, MARK_FRAME_DONE);
+    }
+  }
+
+  for (int i = 0; i < NUM_FRAME_MARKERS; i++)
+  {
+    if (fluid->frame_markers[i])
+    {
+      clReleaseEvent(fluid->frame_markers[i]);
+      fluid->frame_markers[i] = NULL;
+    }
+  }
+}
+
+// Keeps another reference to event as marker of the timed frame
+static void keep_frame_marker(FluidSim * fluid, FRAME_MARKER marker, cl_event event)
+{
+  clRetainEvent(event);
+  fluid->frame_markers[marker] = event;
+}
+
+// The speed, vorticity and divergence views and the measures read the velocity on the density queue after the last density step
+static int presents_velocity(FluidSim * fluid)
+{
+  return fluid->view_field == VIEW_SPEED || fluid->view_field == VIEW_VORTICITY || fluid->view_field == VIEW_DIVERGENCE || fluid->is_measuring;
+}
+
+cl_int simulate_next_frame(FluidSim * fluid, float dt)
+{
+  simulate_substeps(fluid, 1, fmin(dt, MAX_DT));
+  return present_frame(fluid, dt);
+}
+
+cl_int simulate_substeps(FluidSim * fluid, int num_substeps, float step_dt)
+{
+  // nothing more is enqueued once something failed
+  if (fluid->status != CL_SUCCESS)
+  {
+    return fluid->status;
+  }
+
+  // the queues only get flushed, so without this the host could enqueue frames far ahead of the device
+  if (fluid->frames_in_flight[fluid->next_frame_slot])
+  {
+    fluid->err = clWaitForEvents(1, &fluid->frames_in_flight[fluid->next_frame_slot]);
+    check_fluid_error(fluid, "Unable to wait for frame");
+  }
+
+  // markers cost next to nothing, the kernels are not timed one by one
+  int is_timed = 0;
+  if (fluid->metrics)
+  {
+    collect_frame_timing(fluid);
+    is_timed = !fluid->frame_markers[MARK_FRAME_BEGIN];
+    if (is_timed)
+    {
+      mark_queue(fluid, fluid->command_queue, &fluid->frame_markers[MARK_FRAME_BEGIN]);
+    }
+    fluid->metrics->current.substeps += num_substeps;
+  }
+
+  // The sources go straight into the current fields, which saves clearing and adding a whole source field every frame.
+  // They go in once before the first substep, scaled by the time of all of them.
+  // The velocity is read until the last step's density is advected, or until it is drawn or measured, and the density until it is drawn.
+  float sources_dt = num_substeps * step_dt;
+  FluidSim * velocity_grid = (fluid->velocity_sim) ? fluid->velocity_sim : fluid;
+  wait_for_event(fluid, fluid->command_queue, (presents_velocity(fluid)) ? fluid->frame_done_event : fluid->density_advected_event);
+  add_event_sources(velocity_grid, &velocity_grid->velocity_mem[CUR], &velocity_grid->u_velocity_events, IS_U_VELOCITY, sources_dt);
+  add_event_sources(velocity_grid, &velocity_grid->velocity_mem[CUR], &velocity_grid->v_velocity_events, IS_V_VELOCITY, sources_dt);
+  wait_for_event(fluid, fluid->command_queue, fluid->frame_done_event);
+  add_event_sources(fluid, &fluid->density_mem[CUR], &fluid->a_density_events, IS_A_DENSITY, sources_dt);
+  add_event_sources(fluid, &fluid->density_mem[CUR], &fluid->b_density_events, IS_B_DENSITY, sources_dt);
+
+  int is_split = 0;
+  for (int i = 0; i < num_substeps; i++)
+  {
+    if (i > 0)
+    {
+      wait_for_event(fluid, fluid->command_queue, fluid->density_advected_event);
+    }
+
+    if (fluid->is_sparse)
+    {
+      update_active_tiles(fluid);
+    }
+
+    // the forces and the higher order advection schemes only exist as separate launches
+    if (fluid->is_single_dispatch && fluid->vorticity_confinement == 0 && fluid->buoyancy == 0 && is_walled(fluid)
+        && fluid->velocity_advection == ADVECT_SEMI_LAGRANGIAN && fluid->density_advection == ADVECT_SEMI_LAGRANGIAN)
+    {
+      simulate_frame(fluid, step_dt);
+    }
+    else {
+      mark_queue(fluid, fluid->command_queue, &fluid->sources_added_event);
+      velocity_step(fluid, step_dt);
+      mark_queue(fluid, fluid->command_queue, &fluid->velocity_done_event);
+      is_split = 1;
+
+      // the density only depends on the velocity in advect, so its diffusion runs next to the velocity step
+      fluid->queue = fluid->density_queue;
+      wait_for_event(fluid, fluid->queue, fluid->sources_added_event);
+      density_step(fluid, step_dt);
+    }
+
+    // the particles follow the velocity of this step on the queue that advects the density, and the dead ones go once a frame
+    if (fluid->max_particles)
+    {
+      advect_particles(fluid, step_dt);
+      if (i == num_substeps - 1)
+      {
+        sort_particles(fluid);
+      }
+    }
+    mark_queue(fluid, fluid->queue, &fluid->density_advected_event);
+
+    fluid->queue = fluid->command_queue;
+  }
+
+  if (is_timed && fluid->status == CL_SUCCESS)
+  {
+    if (is_split)
+    {
+      keep_frame_marker(fluid, MARK_VELOCITY_DONE, fluid->velocity_done_event);
+    }
+    keep_frame_marker(fluid, MARK_DENSITY_ADVECTED, fluid->density_advected_event);
+  }
+
+  fluid->err = clFlush(fluid->command_queue);
+  fluid->err |= clFlush(fluid->density_queue);
+  check_fluid_error(fluid, "Unable to flush queue");
+
+  return fluid->status;
+}
+
+// Reduces the fields of the last step to the MEASURE_* entries and reads them back without waiting
+static void measure_frame(FluidSim * fluid)
+{
+  size_t num_items = fluid->local_size[0] * fluid->local_size[1];
+  cl_int num_partials = fluid->num_measure_partials;
+
+  //__kernel void measure_fields(__global real * partials, __global real * dens, __global real * vel, __local real * scratch)
+  fluid->err = clSetKernelArg(fluid->measure_fields_kernel, 0, sizeof(cl_mem), &fluid->measure_partials_mem);
+  fluid->err |= clSetKernelArg(fluid->measure_fields_kernel, 1, sizeof(cl_mem), &fluid->density_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->measure_fields_kernel, 2, sizeof(cl_mem), &fluid->velocity_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->measure_fields_kernel, 3, NUM_MEASURES * num_items * fluid->real_size, NULL);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue measure_fields
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->measure_fields_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->measure_fields_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_measure_fields++;
+
+  //__kernel void sum_measures(__global real * measures, __global real * partials, int num_groups, __local real * scratch)
+  fluid->err = clSetKernelArg(fluid->sum_measures_kernel, 0, sizeof(cl_mem), &fluid->measures_mem);
+  fluid->err |= clSetKernelArg(fluid->sum_measures_kernel, 1, sizeof(cl_mem), &fluid->measure_partials_mem);
+  fluid->err |= clSetKernelArg(fluid->sum_measures_kernel, 2, sizeof(cl_int), &num_partials);
+  fluid->err |= clSetKernelArg(fluid->sum_measures_kernel, 3, NUM_MEASURES * fluid->measure_local_size * fluid->real_size, NULL);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue sum_measures
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->sum_measures_kernel, 1, NULL, &fluid->measure_local_size, &fluid->measure_local_size, 0, NULL, &fluid->sum_measures_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_sum_measures++;
+
+  // the queue is in order, so this read lands after the last one
+  if (fluid->measures_read_event)
+  {
+    clReleaseEvent(fluid->measures_read_event);
+    fluid->measures_read_event = NULL;
+  }
+  fluid->err = clEnqueueReadBuffer(fluid->queue, fluid->measures_mem, CL_FALSE, 0, NUM_MEASURES * fluid->real_size, fluid->measure_results, 0, NULL, &fluid->measures_read_event);
+  check_fluid_error(fluid, "Unable to read buffer");
+}
+
+// Prints the kernels run since the last frame and returns their total runtime in ms
+static float print_profile(FluidSim * fluid)
+{
+  float total_ms = 0;
+  if (fluid->calls_to_add_event_sources)
+  {
+    total_ms += profile_event(fluid->add_event_sources_event, fluid->calls_to_add_event_sources, fluid->add_event_sources_samples, fluid->cur_sample, fluid->sim_size, 1, "add_event_sources");
+  }
+  if (fluid->is_sparse)
+  {
+    total_ms += profile_event(fluid->mark_active_tiles_event, fluid->calls_to_mark_active_tiles, fluid->mark_active_tiles_samples, fluid->cur_sample, fluid->sim_size, 8, "mark_active_tiles");
+    total_ms += profile_event(fluid->compact_active_tiles_event, fluid->calls_to_compact_active_tiles, fluid->compact_active_tiles_samples, fluid->cur_sample, fluid->active_tiles_per_row, 10, "compact_active_tiles");
+    fprintf(stdout, "%u of %zu tiles active\n", fluid->num_active_tiles, fluid->active_tiles_per_row * fluid->active_tiles_per_row);
+  }
+  if (fluid->calls_to_add_source)
+  {
+    total_ms += profile_event(fluid->add_source_event, fluid->calls_to_add_source, fluid->add_event_sources_samples, fluid->cur_sample, fluid->sim_size, 2, "add_source");
+  }
+  if (fluid->calls_to_add_forces)
+  {
+    total_ms += profile_event(fluid->add_forces_event, fluid->calls_to_add_forces, fluid->add_forces_samples, fluid->cur_sample, fluid->sim_size, 16, "add_forces");
+  }
+  if (fluid->calls_to_simulate_frame)
+  {
+    // the entries of two diffuse and project_b loops, two project_a and project_c and two advects
+    int frame_entries = 20 * fluid->max_diffuse_steps + 10 * fluid->max_project_steps + 40;
+    total_ms += profile_event(fluid->simulate_frame_event, fluid->calls_to_simulate_frame, fluid->simulate_frame_samples, fluid->cur_sample, fluid->sim_size, frame_entries, "simulate_frame");
+  }
+  if (fluid->calls_to_set_bnd)
+  {
+    total_ms += profile_event(fluid->set_bnd_event, fluid->calls_to_set_bnd, fluid->set_bnd_samples, fluid->cur_sample, 1, fluid->sim_size * 8, "set_bnd");
+  }
+  if (RUN_BAD_DIFFUSE)
+  {
+    total_ms += profile_event(fluid->diffuse_bad_event, fluid->calls_to_diffuse_bad, fluid->diffuse_bad_samples, fluid->cur_sample, fluid->sim_size, 10, "diffuse_bad");
+  }
+  else if (fluid->calls_to_diffuse) {
+    total_ms += profile_event(fluid->diffuse_event, fluid->calls_to_diffuse, fluid->diffuse_samples, fluid->cur_sample, fluid->sim_size, 10, "diffuse");
+  }
+  if (fluid->calls_to_advect)
+  {
+    total_ms += profile_event(fluid->advect_event, fluid->calls_to_advect, fluid->advect_samples, fluid->cur_sample, fluid->sim_size, 10, "advect");
+  }
+  if (fluid->calls_to_advect_maccormack)
+  {
+    total_ms += profile_event(fluid->advect_maccormack_event, fluid->calls_to_advect_maccormack, fluid->advect_maccormack_samples, fluid->cur_sample, fluid->sim_size, 16, "advect_maccormack");
+  }
+  if (fluid->calls_to_advect_bfecc)
+  {
+    total_ms += profile_event(fluid->advect_bfecc_event, fluid->calls_to_advect_bfecc, fluid->advect_bfecc_samples, fluid->cur_sample, fluid->sim_size, 6, "advect_bfecc");
+    total_ms += profile_event(fluid->advect_clamped_event, fluid->calls_to_advect_clamped, fluid->advect_clamped_samples, fluid->cur_sample, fluid->sim_size, 20, "advect_clamped");
+  }
+  if (fluid->calls_to_project_a)
+  {
+    total_ms += profile_event(fluid->project_a_event, fluid->calls_to_project_a, fluid->project_a_samples, fluid->cur_sample, fluid->sim_size, 4, "project_a");
+  }
+  if (fluid->calls_to_advect_project_a)
+  {
+    total_ms += profile_event(fluid->advect_project_a_event, fluid->calls_to_advect_project_a, fluid->advect_project_a_samples, fluid->cur_sample, fluid->sim_size, 14, "advect_project_a");
+  }
+  if (fluid->calls_to_project_b)
+  {
+    total_ms += profile_event(fluid->project_b_event, fluid->calls_to_project_b, fluid->project_b_samples, fluid->cur_sample, fluid->sim_size, 5, "project_b");
+    total_ms += profile_event(fluid->project_c_event, fluid->calls_to_project_c, fluid->project_c_samples, fluid->cur_sample, fluid->sim_size, 6, "project_c");
+  }
+  if (fluid->calls_to_check_residual)
+  {
+    total_ms += profile_event(fluid->check_residual_event, fluid->calls_to_check_residual, fluid->check_residual_samples, fluid->cur_sample, 1, 3, "check_residual");
+    if (fluid->calls_to_set_bnd_sweep)
+    {
+      total_ms += profile_event(fluid->set_bnd_sweep_event, fluid->calls_to_set_bnd_sweep, fluid->set_bnd_sweep_samples, fluid->cur_sample, 1, fluid->sim_size * 8 + 1, "set_bnd_sweep");
+    }
+    print_relaxation_sweeps(fluid);
+  }
+  if (fluid->calls_to_measure_fields)
+  {
+    total_ms += profile_event(fluid->measure_fields_event, fluid->calls_to_measure_fields, fluid->measure_fields_samples, fluid->cur_sample, fluid->sim_size, 8, "measure_fields");
+    total_ms += profile_event(fluid->sum_measures_event, fluid->calls_to_sum_measures, fluid->sum_measures_samples, fluid->cur_sample, 1, NUM_MEASURES * fluid->num_measure_partials, "sum_measures");
+  }
+  if (fluid->calls_to_upsample_velocity)
+  {
+    total_ms += profile_event(fluid->upsample_velocity_event, fluid->calls_to_upsample_velocity, fluid->upsample_velocity_samples, fluid->cur_sample, fluid->sim_size, 8, "upsample_velocity");
+  }
+  if (fluid->calls_to_downsample_density)
+  {
+    total_ms += profile_event(fluid->downsample_density_event, fluid->calls_to_downsample_density, fluid->downsample_density_samples, fluid->cur_sample, fluid->sim_size, 2, "downsample_density");
+  }
+  if (fluid->calls_to_emit_particles)
+  {
+    total_ms += profile_event(fluid->emit_particles_event, fluid->calls_to_emit_particles, fluid->emit_particles_samples, fluid->cur_sample, 1, 4 * fluid->particles_per_event, "emit_particles");
+  }
+  if (fluid->calls_to_advect_particles)
+  {
+    // a float4 in and out and two or four bilinear velocity samples per particle
+    int velocity_entries = (fluid->particle_integrator == INTEGRATE_RK4) ? 32 : 16;
+    total_ms += profile_event(fluid->advect_particles_event, fluid->calls_to_advect_particles, fluid->advect_particles_samples, fluid->cur_sample, 1, fluid->particle_bound * (8 + velocity_entries), "advect_particles");
+  }
+  if (fluid->calls_to_sort_particles)
+  {
+    fprintf(stdout, "%zu particles at most\n", fluid->particle_bound);
+    total_ms += profile_event(fluid->count_particles_event, fluid->calls_to_sort_particles, fluid->count_particles_samples, fluid->cur_sample, 1, fluid->particle_bound * 6, "count_particles");
+    total_ms += profile_event(fluid->scan_particle_cells_event, fluid->calls_to_sort_particles, fluid->scan_particle_cells_samples, fluid->cur_sample, fluid->sim_size, 4, "scan_particle_cells");
+    total_ms += profile_event(fluid->scatter_particles_event, fluid->calls_to_sort_particles, fluid->scatter_particles_samples, fluid->cur_sample, 1, fluid->particle_bound * 10, "scatter_particles");
+  }
+  if (fluid->calls_to_draw_particles)
+  {
+    total_ms += profile_event(fluid->draw_particles_event, fluid->calls_to_draw_particles, fluid->draw_particles_samples, fluid->cur_sample, 1, fluid->particle_bound * 5, "draw_particles");
+  }
+  if (fluid->calls_to_make_framebuffer)
+  {
+    total_ms += profile_event(fluid->make_framebuffer_event, fluid->calls_to_make_framebuffer, fluid->make_framebuffer_samples, fluid->cur_sample, fluid->sim_size, 2, "make_framebuffer");
+  }
+
+  return total_ms;
+}
+
+cl_int present_frame(FluidSim * fluid, float dt)
+{
+  if (fluid->status != CL_SUCCESS)
+  {
+    return fluid->status;
+  }
+
+  // drawn on the density queue, behind the last density step
+  fluid->queue = fluid->density_queue;
+  wait_for_event(fluid, fluid->queue, fluid->density_advected_event);
+  if (fluid->is_measuring)
+  {
+    measure_frame(fluid);
+  }
+  copy_to_framebuffer(fluid, &fluid->density_mem[CUR]);
+  mark_queue(fluid, fluid->queue, &fluid->frame_done_event);
+
+  // the next frame after MAX_FRAMES_IN_FLIGHT waits for this one to be done
+  cl_event * slot = &fluid->frames_in_flight[fluid->next_frame_slot];
+  if (*slot)
+  {
+    clReleaseEvent(*slot);
+    *slot = NULL;
+  }
+  if (fluid->status == CL_SUCCESS)
+  {
+    clRetainEvent(fluid->frame_done_event);
+    *slot = fluid->frame_done_event;
+  }
+  fluid->next_frame_slot = (fluid->next_frame_slot + 1) % MAX_FRAMES_IN_FLIGHT;
+
+  if (fluid->frame_markers[MARK_DENSITY_ADVECTED] && !fluid->frame_markers[MARK_FRAME_DONE] && fluid->status == CL_SUCCESS)
+  {
+    keep_frame_marker(fluid, MARK_FRAME_DONE, fluid->frame_done_event);
+  }
+
+  fluid->queue = fluid->command_queue;
+
+  // the next step waits on the events above, so only the profiler has to wait here
+  if (fluid->profile)
+  {
+    fluid->err = clFinish(fluid->command_queue);
+    fluid->err |= clFinish(fluid->density_queue);
+    check_fluid_error(fluid, "Unable to finish queue");
+  }
+  else {
+    fluid->err = clFlush(fluid->command_queue);
+    fluid->err |= clFlush(fluid->density_queue);
+    check_fluid_error(fluid, "Unable to flush queue");
+  }
+
+  if (fluid->profile)
+  {
+    float total_ms = print_profile(fluid);
+    if (fluid->velocity_sim)
+    {
+      fprintf(stdout, "Velocity grid of %zu:\n", fluid->velocity_sim->sim_size);
+      total_ms += print_profile(fluid->velocity_sim);
+    }
+
+    fprintf(stdout, "Total GPU runtime: %.3f ms\nTotal wallclock time: %.0f ms\n\n", total_ms, 1000.f * dt);
+    //fprintf(stdout, "%.3f\n%0.f\n\n", total_ms, 1000.f * dt);
+    fluid->cur_sample = (fluid->cur_sample + 1) % NUM_SAMPLES;
+  }
+
+  if (fluid->metrics)
+  {
+    publish_frame_metrics(fluid->metrics);
+  }
+
+  // the profile covers every substep since the last frame
+  reset_call_counts(fluid);
+  if (fluid->velocity_sim)
+  {
+    fluid->velocity_sim->cur_sample = fluid->cur_sample;
+    reset_call_counts(fluid->velocity_sim);
+  }
+
+  return fluid->status;
+}
+
+// Launches kernel over every interior cell, or only over the active tiles in sparse mode.
+// The tiled kernels take the active tile list as argument tiled_arg. Returns the number of launches.
+static int enqueue_interior(FluidSim * fluid, cl_kernel kernel, cl_uint tiled_arg, cl_event * event)
+{
+  if (!fluid->is_sparse)
+  {
+    fluid->err = clEnqueueNDRangeKernel(fluid->queue, kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, event);
+    check_fluid_error(fluid, "Unable to enqueue kernel");
+    return 1;
+  }
+
+  if (fluid->num_active_tiles == 0)
+  {
+    return 0;
+  }
+
+  size_t tiled_global_size[2] = {ACTIVE_TILE_SIZE, ACTIVE_TILE_SIZE * fluid->num_active_tiles};
+
+  fluid->err = clSetKernelArg(kernel, tiled_arg, sizeof(cl_mem), &fluid->active_tiles_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, kernel, 2, NULL, tiled_global_size, fluid->tile_local_size, 0, NULL, event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  return 1;
+}
+
+void velocity_step(FluidSim * fluid, float dt)
+{
+  // the coarse grid runs the whole step, the density is advected by its upsampled velocity
+  if (fluid->velocity_sim)
+  {
+    FluidSim * velocity_sim = fluid->velocity_sim;
+    velocity_sim->queue = fluid->queue;
+    if (velocity_sim->buoyancy != 0)
+    {
+      downsample_density(fluid, &velocity_sim->density_mem[CUR], &fluid->density_mem[CUR]);
+    }
+
+    velocity_step(velocity_sim, dt);
+    fluid->err = velocity_sim->status;
+    check_fluid_error(fluid, "Unable to step the velocity grid");
+
+    upsample_velocity(fluid, &fluid->velocity_mem[CUR], &velocity_sim->velocity_mem[CUR]);
+    set_bnd(fluid, &fluid->velocity_mem[CUR], IS_VELOCITY);
+    return;
+  }
+
+  // the sources were already added to CUR by add_event_sources
+  if (fluid->vorticity_confinement != 0 || fluid->buoyancy != 0)
+  {
+    // The forces read the neighbours of CUR, so the result goes straight into PREV instead of swapping afterwards
+    add_forces(fluid, &fluid->velocity_mem[PREV], &fluid->velocity_mem[CUR], &fluid->density_mem[CUR], dt);
+  }
+  else {
+    swap_vel_buffers(fluid);
+  }
+
+  diffuse(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], dt * fluid->viscosity * fluid->sim_size * fluid->sim_size, IS_VELOCITY);
+
+  project(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], RELAX_PRESSURE);
+
+  swap_vel_buffers(fluid);
+
+  if (fluid->velocity_advection == ADVECT_SEMI_LAGRANGIAN && !fluid->is_sparse && writes_velocity_walls(fluid))
+  {
+    // PREV is still being advected from, so the pressure goes in the scratch field
+    advect_project(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], &fluid->velocity_mem[PREV], &fluid->advect_mem, dt);
+  }
+  else {
+    advect(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], &fluid->velocity_mem[PREV], dt, IS_VELOCITY, fluid->velocity_advection);
+
+    project(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], RELAX_ADVECTED_PRESSURE);
+  }
+}
+
+void simulate_frame(FluidSim * fluid, float dt)
+{
+  //__kernel void simulate_frame(__global real * dens_prev, __global real * dens, __global real * vel_prev, __global real * vel, float dt, float viscosity, float diffusion_rate, int num_diffuse_steps, int num_project_steps, __global uint * obstacles, __global uchar * tiles)
+  fluid->err = clSetKernelArg(fluid->simulate_frame_kernel, 0, sizeof(cl_mem), &fluid->density_mem[PREV]);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 1, sizeof(cl_mem), &fluid->density_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 2, sizeof(cl_mem), &fluid->velocity_mem[PREV]);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 3, sizeof(cl_mem), &fluid->velocity_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 4, sizeof(cl_float), &dt);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 5, sizeof(cl_float), &fluid->viscosity);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 6, sizeof(cl_float), &fluid->diffusion_rate);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 7, sizeof(cl_int), &fluid->max_diffuse_steps);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 8, sizeof(cl_int), &fluid->max_project_steps);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 9, sizeof(cl_mem), &fluid->obstacle_mem);
+  fluid->err |= clSetKernelArg(fluid->simulate_frame_kernel, 10, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue simulate_frame, the global size is one work-group
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->simulate_frame_kernel, 1, NULL, &fluid->single_dispatch_local_size, &fluid->single_dispatch_local_size, 0, NULL, &fluid->simulate_frame_event);
+  check_fluid_error(fluid, "Unable to enqueue simulate_frame");
+  fluid->calls_to_simulate_frame++;
+}
+
+void density_step(FluidSim * fluid, float dt)
+{
+  // the sources were already added to CUR by add_event_sources
+  swap_dens_buffers(fluid);
+
+  diffuse(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], dt * fluid->diffusion_rate * fluid->sim_size * fluid->sim_size, IS_DENSITY);
+
+  swap_dens_buffers(fluid);
+
+  // advect reads the velocity, which is done on the other queue
+  wait_for_event(fluid, fluid->queue, fluid->velocity_done_event);
+
+  advect(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], &fluid->velocity_mem[CUR], dt, IS_DENSITY, fluid->density_advection);
+}
+
+// Takes in the progress of the last run of relaxation once its readback has arrived
+static void collect_relaxation(FluidSim * fluid, RELAXATION relaxation)
+{
+  cl_event read = fluid->solve_read_events[relaxation];
+  if (!read)
+  {
+    return;
+  }
+
+  cl_int status;
+  fluid->err = clGetEventInfo(read, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+  check_fluid_error(fluid, "Unable to get event info");
+  if (status > CL_COMPLETE)
+  {
+    return;
+  }
+  fluid->err = status;
+  check_fluid_error(fluid, "Unable to read relaxation progress");
+
+  clReleaseEvent(read);
+  fluid->solve_read_events[relaxation] = NULL;
+  fluid->solve_sweeps[relaxation] = fluid->solve_results[relaxation][SOLVE_SWEEPS];
+  fluid->solve_converged[relaxation] = fluid->solve_results[relaxation][SOLVE_DONE];
+  memcpy(&fluid->solve_residuals[relaxation], &fluid->solve_results[relaxation][SOLVE_LAST_RESIDUAL], sizeof(cl_float));
+
+  // Growing at once and shrinking a sweep at a time keeps a frame that needs a few more sweeps than the last
+  // from stopping short, without the budget swinging between the cap and the bare minimum
+  int * budget = &fluid->solve_budgets[relaxation];
+  int wanted = fluid->solve_sweeps[relaxation] + fluid->solve_sweeps[relaxation] / 2 + 1;
+  if (!fluid->solve_converged[relaxation])
+  {
+    *budget = 2 * fluid->solve_sweeps[relaxation];
+  }
+  else if (wanted > *budget)
+  {
+    *budget = wanted;
+  }
+  else if (wanted < *budget)
+  {
+    (*budget)--;
+  }
+
+  if (fluid->metrics)
+  {
+    FluidMetrics * metrics = &fluid->metrics->current;
+    metrics->relaxation_sweeps[relaxation] = fluid->solve_sweeps[relaxation];
+    metrics->relaxation_converged[relaxation] = fluid->solve_converged[relaxation];
+    metrics->relaxation_residuals[relaxation] = fluid->solve_residuals[relaxation];
+    metrics->relaxation_sweeps_total[relaxation] += fluid->solve_sweeps[relaxation];
+  }
+}
+
+// Clears the progress of relaxation and returns how many sweeps to enqueue for it
+static int begin_relaxation(FluidSim * fluid, RELAXATION relaxation, int max_steps)
+{
+  collect_relaxation(fluid, relaxation);
+
+  cl_uint pattern = 0;
+  fluid->err = clEnqueueFillBuffer(fluid->queue, fluid->solve_mem[relaxation], (void *)&pattern, sizeof(cl_uint), 0, SOLVE_ENTRIES * sizeof(cl_uint), 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to clear buffer");
+
+  // until a run has been read back it may take every sweep
+  int * budget = &fluid->solve_budgets[relaxation];
+  if (*budget <= 0 || *budget > max_steps)
+  {
+    *budget = max_steps;
+  }
+  return *budget;
+}
+
+// The residual is checked after sweeps 1, 2, 4, 8... and after the last one, which records how far the relaxation got
+static cl_int is_checked_sweep(int sweep, int num_sweeps, float tolerance)
+{
+  return (tolerance > 0 && (sweep & (sweep - 1)) == 0) || sweep == num_sweeps;
+}
+
+static void check_relaxation(FluidSim * fluid, RELAXATION relaxation, cl_int sweep, cl_float tolerance)
+{
+  size_t num_work_items = 1;
+
+  //__kernel void check_residual(__global uint * solve, int sweep, float tolerance)
+  fluid->err = clSetKernelArg(fluid->check_residual_kernel, 0, sizeof(cl_mem), &fluid->solve_mem[relaxation]);
+  fluid->err |= clSetKernelArg(fluid->check_residual_kernel, 1, sizeof(cl_int), &sweep);
+  fluid->err |= clSetKernelArg(fluid->check_residual_kernel, 2, sizeof(cl_float), &tolerance);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue check_residual
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->check_residual_kernel, 1, NULL, &num_work_items, &num_work_items, 0, NULL, &fluid->check_residual_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_check_residual++;
+}
+
+// set_bnd between the sweeps of relaxation, which the device skips once the relaxation has ended
+static void set_bnd_sweep(FluidSim * fluid, cl_mem * dest, VEC_TYPE vec_type, RELAXATION relaxation)
+{
+  //__kernel void set_bnd_sweep(__global real * dest, int vec_type, int boundaries, __global uint * solve)
+  fluid->err = clSetKernelArg(fluid->set_bnd_sweep_kernel, 0, sizeof(cl_mem), dest);
+  fluid->err |= clSetKernelArg(fluid->set_bnd_sweep_kernel, 1, sizeof(cl_int), &vec_type);
+  fluid->err |= clSetKernelArg(fluid->set_bnd_sweep_kernel, 2, sizeof(cl_int), &fluid->boundary_modes);
+  fluid->err |= clSetKernelArg(fluid->set_bnd_sweep_kernel, 3, sizeof(cl_mem), &fluid->solve_mem[relaxation]);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue set_bnd_sweep
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->set_bnd_sweep_kernel, 1, NULL, &fluid->set_bnd_global_size, &fluid->set_bnd_local_size, 0, NULL, &fluid->set_bnd_sweep_event);
+  check_fluid_error(fluid, "Unable to enqueue set_bnd_sweep");
+  fluid->calls_to_set_bnd_sweep++;
+}
+
+// Reads the progress back without waiting, unless the read of the last run has not arrived yet
+static void end_relaxation(FluidSim * fluid, RELAXATION relaxation)
+{
+  if (!fluid->solve_read_events[relaxation])
+  {
+    fluid->err = clEnqueueReadBuffer(fluid->queue, fluid->solve_mem[relaxation], CL_FALSE, 0, SOLVE_ENTRIES * sizeof(cl_uint), fluid->solve_results[relaxation], 0, NULL, &fluid->solve_read_events[relaxation]);
+    check_fluid_error(fluid, "Unable to read buffer");
+  }
+}
+
+// local memory for one float per work item of kernels launched by enqueue_interior
+static size_t interior_scratch_size(FluidSim * fluid)
+{
+  size_t * local_size = (fluid->is_sparse) ? fluid->tile_local_size : fluid->local_size;
+  return local_size[0] * local_size[1] * sizeof(cl_float);
+}
+
+void diffuse(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_float a, VEC_TYPE vec_type)
+{
+  if (RUN_BAD_DIFFUSE)
+  {
+    //__kernel void diffuse_bad(__global real * dest, __global real * src, float a)
+    fluid->err = clSetKernelArg(fluid->diffuse_bad_kernel, 0, sizeof(cl_mem), dest);
+    fluid->err |= clSetKernelArg(fluid->diffuse_bad_kernel, 1, sizeof(cl_mem), src);
+    fluid->err |= clSetKernelArg(fluid->diffuse_bad_kernel, 2, sizeof(cl_float), &a);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue diffuse_bad
+    fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->diffuse_bad_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->diffuse_bad_event);
+    check_fluid_error(fluid, "Unable to enqueue kernel");
+    fluid->calls_to_diffuse_bad++;
+  }
+  else {
+
+    cl_float denominator = 1 / (1 + 4 * a);
+    // velocity is reflected at obstacles, density is not
+    cl_float solid_sign = (vec_type == IS_VELOCITY) ? -1 : 1;
+
+    RELAXATION relaxation = (vec_type == IS_VELOCITY) ? RELAX_VELOCITY_DIFFUSE : RELAX_DENSITY_DIFFUSE;
+    int num_sweeps = begin_relaxation(fluid, relaxation, fluid->max_diffuse_steps);
+
+    for (int k = 0; k < num_sweeps; k++)
+    {
+      cl_kernel kernel = (fluid->is_sparse) ? fluid->diffuse_tiled_kernel : fluid->diffuse_kernel;
+      cl_int check = is_checked_sweep(k + 1, num_sweeps, fluid->diffuse_tolerance);
+
+      //__kernel void diffuse(__global real * dest, __global real * src, float a, float denominator, float solid_sign, __global uint * obstacles, __global uchar * tiles, __global uint * solve, int check, __local float * scratch)
+      fluid->err = clSetKernelArg(kernel, 0, sizeof(cl_mem), dest);
+      fluid->err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), src);
+      fluid->err |= clSetKernelArg(kernel, 2, sizeof(cl_float), &a);
+      fluid->err |= clSetKernelArg(kernel, 3, sizeof(cl_float), &denominator);
+      fluid->err |= clSetKernelArg(kernel, 4, sizeof(cl_float), &solid_sign);
+      fluid->err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &fluid->obstacle_mem);
+      fluid->err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+      fluid->err |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &fluid->solve_mem[relaxation]);
+      fluid->err |= clSetKernelArg(kernel, 8, sizeof(cl_int), &check);
+      fluid->err |= clSetKernelArg(kernel, 9, interior_scratch_size(fluid), NULL);
+      check_fluid_error(fluid, "Unable to set args");
+
+      // enqueue diffuse
+      fluid->calls_to_diffuse += enqueue_interior(fluid, kernel, 10, &fluid->diffuse_event);
+
+      // periodic sweeps read across the edges, so the walls only need to be filled in once at the end
+      if (!fluid->is_periodic)
+      {
+        set_bnd_sweep(fluid, dest, vec_type, relaxation);
+      }
+
+      if (check)
+      {
+        check_relaxation(fluid, relaxation, k + 1, fluid->diffuse_tolerance);
+      }
+    }
+
+    end_relaxation(fluid, relaxation);
+
+    if (fluid->is_periodic)
+    {
+      set_bnd(fluid, dest, vec_type);
+    }
+  }
+}
+
+static void advect_pass(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type)
+{
+  cl_kernel kernel = (fluid->is_sparse) ? fluid->advect_tiled_kernel : fluid->advect_kernel;
+
+  //__kernel void advect(__global real * dest, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
+  fluid->err = clSetKernelArg(kernel, 0, sizeof(cl_mem), dest);
+  fluid->err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), src);
+  fluid->err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), vel);
+  fluid->err |= clSetKernelArg(kernel, 3, sizeof(cl_float), &dt);
+  fluid->err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &fluid->obstacle_mem);
+  fluid->err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+  fluid->err |= clSetKernelArg(kernel, 6, sizeof(cl_int), &fluid->boundary_modes);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue advect
+  fluid->calls_to_advect += enqueue_interior(fluid, kernel, 7, &fluid->advect_event);
+
+  set_bnd(fluid, dest, vec_type);
+}
+
+void advect(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type, ADVECTION_SCHEME scheme)
+{
+  cl_float back_dt = dt * fluid->sim_size;
+
+  dt = -dt * fluid->sim_size;
+
+  if (scheme == ADVECT_SEMI_LAGRANGIAN)
+  {
+    advect_pass(fluid, dest, src, vel, dt, vec_type);
+    return;
+  }
+
+  // Both schemes start with a forward pass into the scratch field and advect it back into dest
+  advect_pass(fluid, &fluid->advect_mem, src, vel, dt, vec_type);
+  advect_pass(fluid, dest, &fluid->advect_mem, vel, back_dt, vec_type);
+
+  if (scheme == ADVECT_MACCORMACK)
+  {
+    cl_kernel kernel = (fluid->is_sparse) ? fluid->advect_maccormack_tiled_kernel : fluid->advect_maccormack_kernel;
+
+    //__kernel void advect_maccormack(__global real * dest, __global real * fwd, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
+    fluid->err = clSetKernelArg(kernel, 0, sizeof(cl_mem), dest);
+    fluid->err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &fluid->advect_mem);
+    fluid->err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), src);
+    fluid->err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), vel);
+    fluid->err |= clSetKernelArg(kernel, 4, sizeof(cl_float), &dt);
+    fluid->err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &fluid->obstacle_mem);
+    fluid->err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+    fluid->err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &fluid->boundary_modes);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue advect_maccormack
+    fluid->calls_to_advect_maccormack += enqueue_interior(fluid, kernel, 8, &fluid->advect_maccormack_event);
+  }
+  else {
+    cl_kernel kernel = (fluid->is_sparse) ? fluid->advect_bfecc_tiled_kernel : fluid->advect_bfecc_kernel;
+
+    //__kernel void advect_bfecc(__global real * dest, __global real * src, __global real * back, __global uint * obstacles, __global uchar * tiles)
+    fluid->err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &fluid->advect_mem);
+    fluid->err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), src);
+    fluid->err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), dest);
+    fluid->err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &fluid->obstacle_mem);
+    fluid->err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue advect_bfecc
+    fluid->calls_to_advect_bfecc += enqueue_interior(fluid, kernel, 5, &fluid->advect_bfecc_event);
+
+    set_bnd(fluid, &fluid->advect_mem, vec_type);
+
+    kernel = (fluid->is_sparse) ? fluid->advect_clamped_tiled_kernel : fluid->advect_clamped_kernel;
+
+    //__kernel void advect_clamped(__global real * dest, __global real * src, __global real * vel, float dt, __global real * limit, __global uint * obstacles, __global uchar * tiles, int boundaries)
+    fluid->err = clSetKernelArg(kernel, 0, sizeof(cl_mem), dest);
+    fluid->err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &fluid->advect_mem);
+    fluid->err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), vel);
+    fluid->err |= clSetKernelArg(kernel, 3, sizeof(cl_float), &dt);
+    fluid->err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), src);
+    fluid->err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &fluid->obstacle_mem);
+    fluid->err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+    fluid->err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &fluid->boundary_modes);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue advect_clamped
+    fluid->calls_to_advect_clamped += enqueue_interior(fluid, kernel, 8, &fluid->advect_clamped_event);
+  }
+
+  set_bnd(fluid, dest, vec_type);
+}
+
+// Relaxes the pressure in tmp and subtracts its gradient from vel, project_C sets the velocity walls itself
+static void solve_pressure(FluidSim * fluid, cl_mem * vel, cl_mem * tmp, RELAXATION relaxation)
+{
+  int num_sweeps = begin_relaxation(fluid, relaxation, fluid->max_project_steps);
+
+  for (int k = 0; k < num_sweeps; k++)
+  {
+    cl_int check = is_checked_sweep(k + 1, num_sweeps, fluid->project_tolerance);
+
+    //__kernel void project_B(__global real * tmp, __global uint * obstacles, __global uchar * tiles, __global uint * solve, int check, __local float * scratch)
+    fluid->err = clSetKernelArg(fluid->project_b_kernel, 0, sizeof(cl_mem), tmp);
+    fluid->err |= clSetKernelArg(fluid->project_b_kernel, 1, sizeof(cl_mem), &fluid->obstacle_mem);
+    fluid->err |= clSetKernelArg(fluid->project_b_kernel, 2, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+    fluid->err |= clSetKernelArg(fluid->project_b_kernel, 3, sizeof(cl_mem), &fluid->solve_mem[relaxation]);
+    fluid->err |= clSetKernelArg(fluid->project_b_kernel, 4, sizeof(cl_int), &check);
+    fluid->err |= clSetKernelArg(fluid->project_b_kernel, 5, fluid->local_size[0] * fluid->local_size[1] * sizeof(cl_float), NULL);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue project_b
+    fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->project_b_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_b_event);
+    check_fluid_error(fluid, "Unable to enqueue kernel");
+    fluid->calls_to_project_b++;
+
+    // project_C reads the pressure across periodic edges too, so it never needs the walls
+    if (!fluid->is_periodic)
+    {
+      set_bnd_sweep(fluid, tmp, IS_NONE, relaxation);
+    }
+
+    if (check)
+    {
+      check_relaxation(fluid, relaxation, k + 1, fluid->project_tolerance);
+    }
+  }
+
+  end_relaxation(fluid, relaxation);
+
+  cl_float h = 0.5f * fluid->sim_size;
+
+  //__kernel void project_C(__global real * vel, __global real * tmp, float h, __global uint * obstacles, __global uchar * tiles)
+  fluid->err = clSetKernelArg(fluid->project_c_kernel, 0, sizeof(cl_mem), vel);
+  fluid->err |= clSetKernelArg(fluid->project_c_kernel, 1, sizeof(cl_mem), tmp);
+  fluid->err |= clSetKernelArg(fluid->project_c_kernel, 2, sizeof(cl_float), &h);
+  fluid->err |= clSetKernelArg(fluid->project_c_kernel, 3, sizeof(cl_mem), &fluid->obstacle_mem);
+  fluid->err |= clSetKernelArg(fluid->project_c_kernel, 4, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue project_c
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->project_c_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_c_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_project_c++;
+
+  if (!writes_velocity_walls(fluid))
+  {
+    set_bnd(fluid, vel, IS_VELOCITY);
+  }
+}
+
+void project(FluidSim * fluid, cl_mem * vel, cl_mem * tmp, RELAXATION relaxation)
+{
+  cl_float h = 0.5f / fluid->sim_size;
+
+  //__kernel void project_A(__global real * tmp, __global real * vel, float h, __global uint * obstacles, __global uchar * tiles)
+  fluid->err = clSetKernelArg(fluid->project_a_kernel, 0, sizeof(cl_mem), tmp);
+  fluid->err |= clSetKernelArg(fluid->project_a_kernel, 1, sizeof(cl_mem), vel);
+  fluid->err |= clSetKernelArg(fluid->project_a_kernel, 2, sizeof(cl_float), &h);
+  fluid->err |= clSetKernelArg(fluid->project_a_kernel, 3, sizeof(cl_mem), &fluid->obstacle_mem);
+  fluid->err |= clSetKernelArg(fluid->project_a_kernel, 4, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue project_a
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->project_a_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_a_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_project_a++;
+
+  // project_A also clears the pressure on the walls
+  solve_pressure(fluid, vel, tmp, relaxation);
+}
+
+void advect_project(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_mem * tmp, cl_float dt)
+{
+  dt = -dt * fluid->sim_size;
+  cl_float h = 0.5f / fluid->sim_size;
+
+  //__kernel void advect_project_A(__global real * dest, __global real * tmp, __global real * src, __global real * vel, float dt, float h, __global uint * obstacles, __global uchar * tiles, int boundaries)
+  fluid->err = clSetKernelArg(fluid->advect_project_a_kernel, 0, sizeof(cl_mem), dest);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 1, sizeof(cl_mem), tmp);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 2, sizeof(cl_mem), src);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 3, sizeof(cl_mem), vel);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 4, sizeof(cl_float), &dt);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 5, sizeof(cl_float), &h);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 6, sizeof(cl_mem), &fluid->obstacle_mem);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 7, sizeof(cl_mem), &fluid->obstacle_tiles_mem);
+  fluid->err |= clSetKernelArg(fluid->advect_project_a_kernel, 8, sizeof(cl_int), &fluid->boundary_modes);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue advect_project_A
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->advect_project_a_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->advect_project_a_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_advect_project_a++;
+
+  // the walls of dest are only read by project_A, which has been done, and project_C sets them
+  solve_pressure(fluid, dest, tmp, RELAX_ADVECTED_PRESSURE);
+}
+
+void add_source(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_float dt)
+{
+  cl_kernel kernel = (fluid->is_sparse) ? fluid->add_source_tiled_kernel : fluid->add_source_kernel;
+
+  //__kernel void add_source(__global real * dest, __global real * src, float dt)
+  fluid->err = clSetKernelArg(kernel, 0, sizeof(cl_mem), dest);
+  fluid->err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), src);
+  fluid->err |= clSetKernelArg(kernel, 2, sizeof(cl_float), &dt);
+  check_fluid_error(fluid, "Unable to set args");
+
+  if (fluid->is_sparse)
+  {
+    fluid->calls_to_add_source += enqueue_interior(fluid, kernel, 3, &fluid->add_source_event);
+  }
+  else {
+    // enqueue add_source
+    fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->add_source_kernel, 1, NULL, &fluid->buffer_size, &fluid->full_local_size, 0, NULL, &fluid->add_source_event);
+    check_fluid_error(fluid, "Unable to enqueue add_source");
+    fluid->calls_to_add_source++;
+  }
+}
+
+void add_forces(FluidSim * fluid, cl_mem * dest, cl_mem * vel, cl_mem * dens, cl_float dt)
+{
+  //__kernel void add_forces(__global real * dest, __global real * vel, __global real * dens, float dt, float vorticity, float buoyancy)
+  fluid->err = clSetKernelArg(fluid->add_forces_kernel, 0, sizeof(cl_mem), dest);
+  fluid->err |= clSetKernelArg(fluid->add_forces_kernel, 1, sizeof(cl_mem), vel);
+  fluid->err |= clSetKernelArg(fluid->add_forces_kernel, 2, sizeof(cl_mem), dens);
+  fluid->err |= clSetKernelArg(fluid->add_forces_kernel, 3, sizeof(cl_float), &dt);
+  fluid->err |= clSetKernelArg(fluid->add_forces_kernel, 4, sizeof(cl_float), &fluid->vorticity_confinement);
+  fluid->err |= clSetKernelArg(fluid->add_forces_kernel, 5, sizeof(cl_float), &fluid->buoyancy);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue add_forces
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->add_forces_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->add_forces_event);
+  check_fluid_error(fluid, "Unable to enqueue add_forces");
+  fluid->calls_to_add_forces++;
+}
+
+void upsample_velocity(FluidSim * fluid, cl_mem * vel, cl_mem * coarse)
+{
+  cl_int bicubic = (fluid->velocity_upsampling == UPSAMPLE_BICUBIC) ? 1 : 0;
+
+  //__kernel void upsample_velocity(__global real * vel, __global real * coarse, int bicubic, int boundaries)
+  fluid->err = clSetKernelArg(fluid->upsample_velocity_kernel, 0, sizeof(cl_mem), vel);
+  fluid->err |= clSetKernelArg(fluid->upsample_velocity_kernel, 1, sizeof(cl_mem), coarse);
+  fluid->err |= clSetKernelArg(fluid->upsample_velocity_kernel, 2, sizeof(cl_int), &bicubic);
+  fluid->err |= clSetKernelArg(fluid->upsample_velocity_kernel, 3, sizeof(cl_int), &fluid->boundary_modes);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue upsample_velocity
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->upsample_velocity_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->upsample_velocity_event);
+  check_fluid_error(fluid, "Unable to enqueue upsample_velocity");
+  fluid->calls_to_upsample_velocity++;
+}
+
+void downsample_density(FluidSim * fluid, cl_mem * coarse, cl_mem * dens)
+{
+  //__kernel void downsample_density(__global real * coarse, __global real * dens)
+  fluid->err = clSetKernelArg(fluid->downsample_density_kernel, 0, sizeof(cl_mem), coarse);
+  fluid->err |= clSetKernelArg(fluid->downsample_density_kernel, 1, sizeof(cl_mem), dens);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue downsample_density, one work item per coarse cell
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->downsample_density_kernel, 2, NULL, fluid->velocity_sim->global_size, fluid->velocity_sim->local_size, 0, NULL, &fluid->downsample_density_event);
+  check_fluid_error(fluid, "Unable to enqueue downsample_density");
+  fluid->calls_to_downsample_density++;
+}
+
+void emit_particles(FluidSim * fluid, cl_int num_events, cl_int channel)
+{
+  cl_uint max_particles = fluid->max_particles;
+  cl_uint seed = fluid->particle_seed++;
+  size_t num_emitted = (size_t)num_events * fluid->particles_per_event;
+
+  //__kernel void emit_particles(__global float4 * particles, __global uint * num_particles, uint max_particles, __constant int * x, __constant int * y, __constant int * max_radius_sqrd, int particles_per_event, float lifetime, int channel, uint seed)
+  fluid->err = clSetKernelArg(fluid->emit_particles_kernel, 0, sizeof(cl_mem), &fluid->particle_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 1, sizeof(cl_mem), &fluid->num_particles_mem);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 2, sizeof(cl_uint), &max_particles);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 3, sizeof(cl_mem), &fluid->source_x);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 4, sizeof(cl_mem), &fluid->source_y);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 5, sizeof(cl_mem), &fluid->source_max_radius_sqrd);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 6, sizeof(cl_int), &fluid->particles_per_event);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 7, sizeof(cl_float), &fluid->particle_lifetime);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 8, sizeof(cl_int), &channel);
+  fluid->err |= clSetKernelArg(fluid->emit_particles_kernel, 9, sizeof(cl_uint), &seed);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue emit_particles next to add_event_sources, which reads the same source buffers
+  fluid->err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->emit_particles_kernel, 1, NULL, &num_emitted, NULL, 0, NULL, &fluid->emit_particles_event);
+  check_fluid_error(fluid, "Unable to enqueue emit_particles");
+  fluid->calls_to_emit_particles++;
+
+  fluid->particle_bound = fmin(fluid->particle_bound + num_emitted, fluid->max_particles);
+  fluid->particles_emitted_since_read += num_emitted;
+}
+
+void advect_particles(FluidSim * fluid, float dt)
+{
+  if (fluid->particle_bound == 0)
+  {
+    return;
+  }
+
+  cl_uint max_particles = fluid->max_particles;
+  cl_float dt_cells = dt * fluid->sim_size;
+  cl_int rk4 = (fluid->particle_integrator == INTEGRATE_RK4) ? 1 : 0;
+
+  //__kernel void advect_particles(__global float4 * particles, __global uint * num_particles, uint max_particles, __global real * vel, float dt, float dt_cells, int rk4, __global uint * obstacles, int boundaries)
+  fluid->err = clSetKernelArg(fluid->advect_particles_kernel, 0, sizeof(cl_mem), &fluid->particle_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 1, sizeof(cl_mem), &fluid->num_particles_mem);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 2, sizeof(cl_uint), &max_particles);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 3, sizeof(cl_mem), &fluid->velocity_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 4, sizeof(cl_float), &dt);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 5, sizeof(cl_float), &dt_cells);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 6, sizeof(cl_int), &rk4);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 7, sizeof(cl_mem), &fluid->obstacle_mem);
+  fluid->err |= clSetKernelArg(fluid->advect_particles_kernel, 8, sizeof(cl_int), &fluid->boundary_modes);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue advect_particles
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->advect_particles_kernel, 1, NULL, &fluid->particle_bound, NULL, 0, NULL, &fluid->advect_particles_event);
+  check_fluid_error(fluid, "Unable to enqueue advect_particles");
+  fluid->calls_to_advect_particles++;
+}
+
+// Takes in the particle count once its readback has arrived, the particles emitted since then may be live as well
+static void collect_particle_count(FluidSim * fluid)
+{
+  cl_event read = fluid->particle_count_read_event;
+  if (!read)
+  {
+    return;
+  }
+
+  cl_int status;
+  fluid->err = clGetEventInfo(read, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+  check_fluid_error(fluid, "Unable to get event info");
+  if (status > CL_COMPLETE)
+  {
+    return;
+  }
+  fluid->err = status;
+  check_fluid_error(fluid, "Unable to read particle count");
+
+  clReleaseEvent(read);
+  fluid->particle_count_read_event = NULL;
+  fluid->particle_bound = fmin(fluid->particle_count + fluid->particles_emitted_since_read, fluid->max_particles);
+}
+
+void sort_particles(FluidSim * fluid)
+{
+  collect_particle_count(fluid);
+  if (fluid->particle_bound == 0)
+  {
+    return;
+  }
+
+  cl_uint max_particles = fluid->max_particles;
+  size_t num_cells = fluid->sim_size * fluid->sim_size;
+
+  //__kernel void count_particles(__global uint * cell_counts, __global uint * ranks, __global float4 * particles, __global uint * num_particles, uint max_particles)
+  fluid->err = clSetKernelArg(fluid->count_particles_kernel, 0, sizeof(cl_mem), &fluid->particle_counts_mem);
+  fluid->err |= clSetKernelArg(fluid->count_particles_kernel, 1, sizeof(cl_mem), &fluid->particle_ranks_mem);
+  fluid->err |= clSetKernelArg(fluid->count_particles_kernel, 2, sizeof(cl_mem), &fluid->particle_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->count_particles_kernel, 3, sizeof(cl_mem), &fluid->num_particles_mem);
+  fluid->err |= clSetKernelArg(fluid->count_particles_kernel, 4, sizeof(cl_uint), &max_particles);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue count_particles
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->count_particles_kernel, 1, NULL, &fluid->particle_bound, NULL, 0, NULL, &fluid->count_particles_event);
+  check_fluid_error(fluid, "Unable to enqueue count_particles");
+
+  //__kernel void scan_particle_cells(__global uint * cell_starts, __global uint * cell_counts, __local uint * scratch)
+  fluid->err = clSetKernelArg(fluid->scan_particle_cells_kernel, 0, sizeof(cl_mem), &fluid->particle_starts_mem);
+  fluid->err |= clSetKernelArg(fluid->scan_particle_cells_kernel, 1, sizeof(cl_mem), &fluid->particle_counts_mem);
+  fluid->err |= clSetKernelArg(fluid->scan_particle_cells_kernel, 2, fluid->particle_scan_local_size * sizeof(cl_uint), NULL);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue scan_particle_cells, the global size is one work-group
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->scan_particle_cells_kernel, 1, NULL, &fluid->particle_scan_local_size, &fluid->particle_scan_local_size, 0, NULL, &fluid->scan_particle_cells_event);
+  check_fluid_error(fluid, "Unable to enqueue scan_particle_cells");
+
+  //__kernel void scatter_particles(__global float4 * dest, __global float4 * particles, __global uint * num_particles, uint max_particles, __global uint * cell_starts, __global uint * ranks)
+  fluid->err = clSetKernelArg(fluid->scatter_particles_kernel, 0, sizeof(cl_mem), &fluid->particle_mem[PREV]);
+  fluid->err |= clSetKernelArg(fluid->scatter_particles_kernel, 1, sizeof(cl_mem), &fluid->particle_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->scatter_particles_kernel, 2, sizeof(cl_mem), &fluid->num_particles_mem);
+  fluid->err |= clSetKernelArg(fluid->scatter_particles_kernel, 3, sizeof(cl_uint), &max_particles);
+  fluid->err |= clSetKernelArg(fluid->scatter_particles_kernel, 4, sizeof(cl_mem), &fluid->particle_starts_mem);
+  fluid->err |= clSetKernelArg(fluid->scatter_particles_kernel, 5, sizeof(cl_mem), &fluid->particle_ranks_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue scatter_particles
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->scatter_particles_kernel, 1, NULL, &fluid->particle_bound, NULL, 0, NULL, &fluid->scatter_particles_event);
+  check_fluid_error(fluid, "Unable to enqueue scatter_particles");
+  fluid->calls_to_sort_particles++;
+
+  // the live count follows the cell starts
+  fluid->err = clEnqueueCopyBuffer(fluid->queue, fluid->particle_starts_mem, fluid->num_particles_mem, num_cells * sizeof(cl_uint), 0, sizeof(cl_uint), 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to copy buffer");
+
+  cl_mem tmp = fluid->particle_mem[CUR];
+  fluid->particle_mem[CUR] = fluid->particle_mem[PREV];
+  fluid->particle_mem[PREV] = tmp;
+
+  if (!fluid->particle_count_read_event)
+  {
+    fluid->err = clEnqueueReadBuffer(fluid->queue, fluid->num_particles_mem, CL_FALSE, 0, sizeof(cl_uint), &fluid->particle_count, 0, NULL, &fluid->particle_count_read_event);
+    check_fluid_error(fluid, "Unable to read buffer");
+    fluid->particles_emitted_since_read = 0;
+  }
+}
+
+void draw_particles(FluidSim * fluid, int is_offscreen)
+{
+  if (fluid->particle_bound == 0)
+  {
+    return;
+  }
+
+  cl_uint max_particles = fluid->max_particles;
+
+  if (is_offscreen)
+  {
+    cl_int width = fluid->encoder->width;
+    cl_int height = fluid->encoder->height;
+
+    //__kernel void draw_particles_rgba(__global uchar4 * dest, int width, int height, __global float4 * particles, __global uint * num_particles, uint max_particles)
+    fluid->err = clSetKernelArg(fluid->draw_particles_rgba_kernel, 0, sizeof(cl_mem), &fluid->frame_mem);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_rgba_kernel, 1, sizeof(cl_int), &width);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_rgba_kernel, 2, sizeof(cl_int), &height);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_rgba_kernel, 3, sizeof(cl_mem), &fluid->particle_mem[CUR]);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_rgba_kernel, 4, sizeof(cl_mem), &fluid->num_particles_mem);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_rgba_kernel, 5, sizeof(cl_uint), &max_particles);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue draw_particles_rgba
+    fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->draw_particles_rgba_kernel, 1, NULL, &fluid->particle_bound, NULL, 0, NULL, &fluid->draw_particles_event);
+    check_fluid_error(fluid, "Unable to enqueue draw_particles_rgba");
+  }
+  else {
+    //__kernel void draw_particles(write_only image2d_t dest, __global float4 * particles, __global uint * num_particles, uint max_particles)
+    fluid->err = clSetKernelArg(fluid->draw_particles_kernel, 0, sizeof(cl_mem), &fluid->framebuffer);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_kernel, 1, sizeof(cl_mem), &fluid->particle_mem[CUR]);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_kernel, 2, sizeof(cl_mem), &fluid->num_particles_mem);
+    fluid->err |= clSetKernelArg(fluid->draw_particles_kernel, 3, sizeof(cl_uint), &max_particles);
+    check_fluid_error(fluid, "Unable to set args");
+
+    // enqueue draw_particles
+    fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->draw_particles_kernel, 1, NULL, &fluid->particle_bound, NULL, 0, NULL, &fluid->draw_particles_event);
+    check_fluid_error(fluid, "Unable to enqueue draw_particles");
+  }
+  fluid->calls_to_draw_particles++;
+}
+
+void set_bnd(FluidSim * fluid, cl_mem * dest, VEC_TYPE vec_type)
+{
+  //__kernel void set_bnd(__global real * dest, int vec_type, int boundaries)
+  fluid->err = clSetKernelArg(fluid->set_bnd_kernel, 0, sizeof(cl_mem), dest);
+  fluid->err |= clSetKernelArg(fluid->set_bnd_kernel, 1, sizeof(cl_int), &vec_type);
+  fluid->err |= clSetKernelArg(fluid->set_bnd_kernel, 2, sizeof(cl_int), &fluid->boundary_modes);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue set_bnd
+  fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->set_bnd_kernel, 1, NULL, &fluid->set_bnd_global_size, &fluid->set_bnd_local_size, 0, NULL, &fluid->set_bnd_event);
+  check_fluid_error(fluid, "Unable to enqueue set_bnd");
+  fluid->calls_to_set_bnd++;
+}
+
+// The tiled kernels only draw the default view at the size of the simulation
+static int can_draw_tiles(FluidSim * fluid, size_t width, size_t height)
+{
+  return fluid->is_sparse && fluid->view_field == VIEW_DENSITY_COLORS && width == fluid->sim_size && height == fluid->sim_size;
+}
 
-  free(fluid);
+// Sets the arguments every view kernel ends with, from first_arg on
+static void set_view_args(FluidSim * fluid, cl_kernel kernel, cl_uint first_arg, cl_mem * src)
+{
+  cl_int field = fluid->view_field;
+  cl_float inv_range = 1.f / (fluid->view_max - fluid->view_min);
+
+  fluid->err = clSetKernelArg(kernel, first_arg, sizeof(cl_mem), src);
+  fluid->err |= clSetKernelArg(kernel, first_arg + 1, sizeof(cl_mem), &fluid->velocity_mem[CUR]);
+  fluid->err |= clSetKernelArg(kernel, first_arg + 2, sizeof(cl_mem), &fluid->view_lut_mem);
+  fluid->err |= clSetKernelArg(kernel, first_arg + 3, sizeof(cl_int), &field);
+  fluid->err |= clSetKernelArg(kernel, first_arg + 4, sizeof(cl_float), &fluid->view_min);
+  fluid->err |= clSetKernelArg(kernel, first_arg + 5, sizeof(cl_float), &inv_range);
+  check_fluid_error(fluid, "Unable to set args");
 }
 
-void simulate_next_frame(FluidSim * fluid, float dt)
+void copy_to_framebuffer(FluidSim * fluid, cl_mem * src)
 {
-  fluid->calls_to_add_event_sources = 0;
-  fluid->calls_to_add_source = 0;
-  fluid->calls_to_set_bnd = 0;
-  fluid->calls_to_diffuse_bad = 0;
-  fluid->calls_to_diffuse = 0;
-  fluid->calls_to_advect = 0;
-  fluid->calls_to_project_a = 0;
-  fluid->calls_to_project_b = 0;
-  fluid->calls_to_project_c = 0;
-  fluid->calls_to_make_framebuffer = 0;
+  if (fluid->is_using_opengl)
+  {
+    glFinish();
 
-  cl_float pattern = 0;
-  err = clEnqueueFillBuffer(fluid->command_queue, fluid->density_mem[PREV], (void *)&pattern, sizeof(cl_float), 0, fluid->buffer_size * sizeof(cl_float), 0, NULL, NULL);
-  err |= clEnqueueFillBuffer(fluid->command_queue, fluid->velocity_mem[PREV], (void *)&pattern, sizeof(cl_float), 0, fluid->buffer_size * sizeof(cl_float), 0, NULL, NULL);
-  check_error(err, "Unable to clear buffers");
+    fluid->err = clEnqueueAcquireGLObjects(fluid->queue, 1, &fluid->framebuffer, 0, 0, NULL);
+    check_fluid_error(fluid, "Unable to acquire texture");
 
-  add_event_sources(fluid, &fluid->density_mem[PREV], &fluid->a_density_events, IS_A_DENSITY);
-  add_event_sources(fluid, &fluid->density_mem[PREV], &fluid->b_density_events, IS_B_DENSITY);
-  add_event_sources(fluid, &fluid->velocity_mem[PREV], &fluid->u_velocity_events, IS_U_VELOCITY);
-  add_event_sources(fluid, &fluid->velocity_mem[PREV], &fluid->v_velocity_events, IS_V_VELOCITY);
+    if (can_draw_tiles(fluid, fluid->framebuffer_width, fluid->framebuffer_height))
+    {
+      //__kernel void make_framebuffer_tiled(write_only image2d_t dest, __global real * src, __global uint * active_tiles)
+      fluid->err = clSetKernelArg(fluid->make_framebuffer_tiled_kernel, 0, sizeof(cl_mem), &fluid->framebuffer);
+      fluid->err |= clSetKernelArg(fluid->make_framebuffer_tiled_kernel, 1, sizeof(cl_mem), src);
+      check_fluid_error(fluid, "Unable to set args");
 
-  float sim_dt = fmin(dt, MAX_DT);
-  velocity_step(fluid, sim_dt);
-  density_step(fluid, sim_dt);
+      //enqueue make_framebuffer_tiled
+      fluid->calls_to_make_framebuffer += enqueue_interior(fluid, fluid->make_framebuffer_tiled_kernel, 2, &fluid->make_framebuffer_event);
+    }
+    else {
+      //__kernel void render_view(write_only image2d_t dest, __global real * dens, __global real * vel, read_only image1d_t lut, int field, float min_value, float inv_range)
+      fluid->err = clSetKernelArg(fluid->render_view_kernel, 0, sizeof(cl_mem), &fluid->framebuffer);
+      check_fluid_error(fluid, "Unable to set args");
+      set_view_args(fluid, fluid->render_view_kernel, 1, src);
+
+      //enqueue render_view
+      size_t view_size[2] = {fluid->framebuffer_width, fluid->framebuffer_height};
+      fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->render_view_kernel, 2, NULL, view_size, NULL, 0, NULL, &fluid->make_framebuffer_event);
+      check_fluid_error(fluid, "Unable to enqueue render_view");
+      fluid->calls_to_make_framebuffer++;
+    }
 
-  copy_to_framebuffer(fluid, &fluid->density_mem[CUR]);
+    if (fluid->max_particles)
+    {
+      draw_particles(fluid, 0);
+    }
 
-  //err = clFlush(fluid->command_queue);
-  err = clFinish(fluid->command_queue);
-  check_error(err, "Unable to finish queue");
+    //fluid->err = clFlush(fluid->queue);
+    fluid->err = clFinish(fluid->queue);
+    check_fluid_error(fluid, "Unable to finish queue");
 
-  if (fluid->profile)
+    fluid->err = clEnqueueReleaseGLObjects(fluid->queue, 1, &fluid->framebuffer, 0, 0, NULL);
+    check_fluid_error(fluid, "Unable to release texture");
+  }
+
+  if (fluid->encoder)
   {
-    float total_ms = profile_event(fluid->add_event_sources_event, fluid->calls_to_add_event_sources, fluid->add_event_sources_samples, fluid->cur_sample, fluid->sim_size, 1, "add_event_sources");
-    total_ms += profile_event(fluid->add_source_event, fluid->calls_to_add_source, fluid->add_event_sources_samples, fluid->cur_sample, fluid->sim_size, 2, "add_source");
-    total_ms += profile_event(fluid->set_bnd_event, fluid->calls_to_set_bnd, fluid->set_bnd_samples, fluid->cur_sample, 1, fluid->sim_size * 8, "set_bnd");
-    if (RUN_BAD_DIFFUSE)
+    FrameEncoder * encoder = fluid->encoder;
+
+    if (can_draw_tiles(fluid, encoder->width, encoder->height))
     {
-      total_ms += profile_event(fluid->diffuse_bad_event, fluid->calls_to_diffuse_bad, fluid->diffuse_bad_samples, fluid->cur_sample, fluid->sim_size, 10, "diffuse_bad");
+      //__kernel void make_framebuffer_rgba_tiled(__global uchar4 * dest, __global real * src, __global uint * active_tiles)
+      fluid->err = clSetKernelArg(fluid->make_framebuffer_rgba_tiled_kernel, 0, sizeof(cl_mem), &fluid->frame_mem);
+      fluid->err |= clSetKernelArg(fluid->make_framebuffer_rgba_tiled_kernel, 1, sizeof(cl_mem), src);
+      check_fluid_error(fluid, "Unable to set args");
+
+      //enqueue make_framebuffer_rgba_tiled
+      fluid->calls_to_make_framebuffer += enqueue_interior(fluid, fluid->make_framebuffer_rgba_tiled_kernel, 2, &fluid->make_framebuffer_event);
     }
     else {
-      total_ms += profile_event(fluid->diffuse_event, fluid->calls_to_diffuse, fluid->diffuse_samples, fluid->cur_sample, fluid->sim_size, 10, "diffuse");
+      cl_int width = encoder->width;
+      cl_int height = encoder->height;
+
+      //__kernel void render_view_rgba(__global uchar4 * dest, int width, int height, __global real * dens, __global real * vel, read_only image1d_t lut, int field, float min_value, float inv_range)
+      fluid->err = clSetKernelArg(fluid->render_view_rgba_kernel, 0, sizeof(cl_mem), &fluid->frame_mem);
+      fluid->err |= clSetKernelArg(fluid->render_view_rgba_kernel, 1, sizeof(cl_int), &width);
+      fluid->err |= clSetKernelArg(fluid->render_view_rgba_kernel, 2, sizeof(cl_int), &height);
+      check_fluid_error(fluid, "Unable to set args");
+      set_view_args(fluid, fluid->render_view_rgba_kernel, 3, src);
+
+      //enqueue render_view_rgba
+      size_t view_size[2] = {encoder->width, encoder->height};
+      fluid->err = clEnqueueNDRangeKernel(fluid->queue, fluid->render_view_rgba_kernel, 2, NULL, view_size, NULL, 0, NULL, &fluid->make_framebuffer_event);
+      check_fluid_error(fluid, "Unable to enqueue render_view_rgba");
+      fluid->calls_to_make_framebuffer++;
     }
-    total_ms += profile_event(fluid->advect_event, fluid->calls_to_advect, fluid->advect_samples, fluid->cur_sample, fluid->sim_size, 10, "advect");
-    total_ms += profile_event(fluid->project_a_event, fluid->calls_to_project_a, fluid->project_a_samples, fluid->cur_sample, fluid->sim_size, 4, "project_a");
-    total_ms += profile_event(fluid->project_b_event, fluid->calls_to_project_b, fluid->project_b_samples, fluid->cur_sample, fluid->sim_size, 5, "project_b");
-    total_ms += profile_event(fluid->project_c_event, fluid->calls_to_project_c, fluid->project_c_samples, fluid->cur_sample, fluid->sim_size, 6, "project_c");
-    if (fluid->is_using_opengl)
+
+    if (fluid->max_particles)
     {
-      total_ms += profile_event(fluid->make_framebuffer_event, fluid->calls_to_make_framebuffer, fluid->make_framebuffer_samples, fluid->cur_sample, fluid->sim_size, 2, "make_framebuffer");
+      draw_particles(fluid, 1);
     }
 
-    fprintf(stdout, "Total GPU runtime: %.3f ms\nTotal wallclock time: %.0f ms\n\n", total_ms, 1000.f * dt);
-    //fprintf(stdout, "%.3f\n%0.f\n\n", total_ms, 1000.f * dt);
-    fluid->cur_sample = (fluid->cur_sample + 1) % NUM_SAMPLES;
+    // the encoder thread waits for the read, so the next frame can be simulated while this one is copied and encoded
+    unsigned char * frame = acquire_frame_slot(encoder);
+    cl_event frame_read_event;
+    fluid->err = clEnqueueReadBuffer(fluid->queue, fluid->frame_mem, CL_FALSE, 0, 4 * encoder->width * encoder->height, frame, 0, NULL, &frame_read_event);
+    // without a read there is no event to wait for, and the slot stays free for the next frame
+    if (fluid->err == CL_SUCCESS)
+    {
+      submit_frame(encoder, frame_read_event);
+    }
+    check_fluid_error(fluid, "Unable to read buffer");
   }
 }
 
-void velocity_step(FluidSim * fluid, float dt)
+cl_int set_view(FluidSim * fluid, VIEW_FIELD field, const cl_float * lut, size_t lut_size, float min_value, float max_value)
 {
-  add_source(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], dt);
+  if (max_value <= min_value)
+  {
+    return CL_INVALID_VALUE;
+  }
 
-  swap_vel_buffers(fluid);
+  fluid->view_field = field;
+  fluid->view_min = min_value;
+  fluid->view_max = max_value;
 
-  diffuse(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], dt * fluid->viscosity * fluid->sim_size * fluid->sim_size, IS_VELOCITY);
+  if (lut)
+  {
+    // a frame may still be drawing with the old LUT
+    fluid->err = clFinish(fluid->density_queue);
+    check_fluid_error(fluid, "Unable to finish queue");
 
-  project(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV]);
+    if (fluid->view_lut_mem)
+    {
+      clReleaseMemObject(fluid->view_lut_mem);
+    }
 
-  swap_vel_buffers(fluid);
+    cl_image_format lut_format = {CL_RGBA, CL_FLOAT};
+    cl_image_desc lut_desc = {0};
+    lut_desc.image_type = CL_MEM_OBJECT_IMAGE1D;
+    lut_desc.image_width = lut_size;
 
-  advect(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], &fluid->velocity_mem[PREV], dt, IS_VELOCITY);
+    fluid->view_lut_mem = clCreateImage(fluid->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &lut_format, &lut_desc, (void *)lut, &fluid->err);
+    check_fluid_error(fluid, "Unable to create view LUT");
+  }
 
-  project(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV]);
+  return fluid->status;
 }
 
-void density_step(FluidSim * fluid, float dt)
+cl_int set_frame_encoder(FluidSim * fluid, FrameEncoder * encoder)
 {
-  add_source(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], dt);
+  // the last frame may still be drawn into frame_mem
+  fluid->err = clFinish(fluid->density_queue);
+  check_fluid_error(fluid, "Unable to finish queue");
 
-  swap_dens_buffers(fluid);
+  if (fluid->encoder)
+  {
+    release_buffer(fluid->shared, fluid->frame_mem);
+  }
 
-  diffuse(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], dt * fluid->diffusion_rate * fluid->sim_size * fluid->sim_size, IS_DENSITY);
+  fluid->encoder = encoder;
 
-  swap_dens_buffers(fluid);
+  if (fluid->encoder)
+  {
+    fluid->frame_mem = acquire_buffer(fluid->shared, 4 * encoder->width * encoder->height, &fluid->err);
+    check_fluid_error(fluid, "Unable to create buffer");
+
+    // sparse mode only draws the active tiles
+    cl_uint pattern = 0;
+    fluid->err = clEnqueueFillBuffer(fluid->command_queue, fluid->frame_mem, (void *)&pattern, sizeof(cl_uint), 0, 4 * encoder->width * encoder->height, 0, NULL, NULL);
+    check_fluid_error(fluid, "Unable to clear buffer");
+  }
 
-  advect(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], &fluid->velocity_mem[CUR], dt, IS_DENSITY);
+  return fluid->status;
 }
 
-void diffuse(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_float a, VEC_TYPE vec_type)
+cl_int set_metrics_exporter(FluidSim * fluid, MetricsExporter * exporter)
 {
-  if (RUN_BAD_DIFFUSE)
+  // the markers of a frame in flight were kept for the last exporter
+  for (int i = 0; i < NUM_FRAME_MARKERS; i++)
   {
-    //__kernel void diffuse_bad(__global float * dest, __global float * src, float a)
-    err = clSetKernelArg(fluid->diffuse_bad_kernel, 0, sizeof(cl_mem), dest);
-    err |= clSetKernelArg(fluid->diffuse_bad_kernel, 1, sizeof(cl_mem), src);
-    err |= clSetKernelArg(fluid->diffuse_bad_kernel, 2, sizeof(cl_float), &a);
-    check_error(err, "Unable to set args");
-
-    // enqueue diffuse_bad
-    err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->diffuse_bad_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->diffuse_bad_event);
-    check_error(err, "Unable to enqueue kernel");
-    fluid->calls_to_diffuse_bad++;
+    if (fluid->frame_markers[i])
+    {
+      clReleaseEvent(fluid->frame_markers[i]);
+      fluid->frame_markers[i] = NULL;
+    }
   }
-  else {
 
-    cl_float denominator = 1 / (1 + 4 * a);
+  fluid->metrics = exporter;
 
-    for (int k = 0; k < fluid->num_relaxation_steps; k++)
-    {
-      //__kernel void diffuse(__global float * dest, __global float * src, float a, float denominator)
-      err = clSetKernelArg(fluid->diffuse_kernel, 0, sizeof(cl_mem), dest);
-      err |= clSetKernelArg(fluid->diffuse_kernel, 1, sizeof(cl_mem), src);
-      err |= clSetKernelArg(fluid->diffuse_kernel, 2, sizeof(cl_float), &a);
-      err |= clSetKernelArg(fluid->diffuse_kernel, 3, sizeof(cl_float), &denominator);
-      check_error(err, "Unable to set args");
+  // the velocity grid counts its relaxations and sources into the same exporter
+  if (fluid->velocity_sim)
+  {
+    fluid->velocity_sim->metrics = exporter;
+  }
 
-      // enqueue diffuse
-      err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->diffuse_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->diffuse_event);
-      check_error(err, "Unable to enqueue kernel");
-      fluid->calls_to_diffuse++;
+  return fluid->status;
+}
 
-      set_bnd(fluid, dest, vec_type);
-    }
+cl_int set_advection_scheme(FluidSim * fluid, VEC_TYPE vec_type, ADVECTION_SCHEME scheme)
+{
+  switch (vec_type) {
+    case IS_DENSITY:
+      fluid->density_advection = scheme;
+      break;
+    case IS_VELOCITY:
+      fluid->velocity_advection = scheme;
+      if (fluid->velocity_sim)
+      {
+        fluid->velocity_sim->velocity_advection = scheme;
+      }
+      break;
+    default:
+      return CL_INVALID_VALUE;
   }
+  return CL_SUCCESS;
 }
 
-void advect(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type)
+int parse_advection_scheme(const char * str, ADVECTION_SCHEME * scheme)
 {
+  if (strcmp(str, "SL") == 0)
+  {
+    *scheme = ADVECT_SEMI_LAGRANGIAN;
+  }
+  else if (strcmp(str, "MAC") == 0)
+  {
+    *scheme = ADVECT_MACCORMACK;
+  }
+  else if (strcmp(str, "BFECC") == 0)
+  {
+    *scheme = ADVECT_BFECC;
+  }
+  else {
+    return 0;
+  }
+  return 1;
+}
 
-  dt = -dt * fluid->sim_size;
-
-  //__kernel void advect(__global float * dest, __global float * src, __global float * vel, float dt)
-  err = clSetKernelArg(fluid->advect_kernel, 0, sizeof(cl_mem), dest);
-  err |= clSetKernelArg(fluid->advect_kernel, 1, sizeof(cl_mem), src);
-  err |= clSetKernelArg(fluid->advect_kernel, 2, sizeof(cl_mem), vel);
-  err |= clSetKernelArg(fluid->advect_kernel, 3, sizeof(cl_float), &dt);
-  check_error(err, "Unable to set args");
-
-  // enqueue advect
-  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->advect_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->advect_event);
-  check_error(err, "Unable to enqueue kernel");
-  fluid->calls_to_advect++;
+void set_forces(FluidSim * fluid, float vorticity_confinement, float buoyancy)
+{
+  fluid->vorticity_confinement = vorticity_confinement;
+  fluid->buoyancy = buoyancy;
+  if (fluid->velocity_sim)
+  {
+    set_forces(fluid->velocity_sim, vorticity_confinement, buoyancy);
+  }
+}
 
-  set_bnd(fluid, dest, vec_type);
+cl_int set_velocity_upsampling(FluidSim * fluid, UPSAMPLING upsampling)
+{
+  if (upsampling != UPSAMPLE_BILINEAR && upsampling != UPSAMPLE_BICUBIC)
+  {
+    return CL_INVALID_VALUE;
+  }
+  fluid->velocity_upsampling = upsampling;
+  return CL_SUCCESS;
 }
 
-void project(FluidSim * fluid, cl_mem * vel, cl_mem * tmp)
+cl_int set_boundaries(FluidSim * fluid, BOUNDARY left, BOUNDARY right, BOUNDARY top, BOUNDARY bottom)
 {
-  cl_float h = 0.5f / fluid->sim_size;
+  BOUNDARY boundaries[NUM_EDGES] = {left, right, top, bottom};
+  for (int edge = 0; edge < NUM_EDGES; edge++)
+  {
+    if (boundaries[edge] != BOUNDARY_WALL && boundaries[edge] != BOUNDARY_PERIODIC && boundaries[edge] != BOUNDARY_OUTFLOW)
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (fluid->is_periodic && boundaries[edge] != BOUNDARY_PERIODIC)
+    {
+      return CL_INVALID_VALUE;
+    }
+  }
+  // a periodic edge copies the one across from it
+  if ((left == BOUNDARY_PERIODIC) != (right == BOUNDARY_PERIODIC) || (top == BOUNDARY_PERIODIC) != (bottom == BOUNDARY_PERIODIC))
+  {
+    return CL_INVALID_VALUE;
+  }
 
-  //__kernel void project_A(__global float * tmp, __global float * vel, float h)
-  err = clSetKernelArg(fluid->project_a_kernel, 0, sizeof(cl_mem), tmp);
-  err |= clSetKernelArg(fluid->project_a_kernel, 1, sizeof(cl_mem), vel);
-  err |= clSetKernelArg(fluid->project_a_kernel, 2, sizeof(cl_float), &h);
-  check_error(err, "Unable to set args");
+  memcpy(fluid->boundaries, boundaries, sizeof(boundaries));
+  fluid->boundary_modes = pack_boundaries(boundaries);
+  if (fluid->velocity_sim)
+  {
+    set_boundaries(fluid->velocity_sim, left, right, top, bottom);
+  }
+  return CL_SUCCESS;
+}
 
-  // enqueue project_a
-  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->project_a_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_a_event);
-  check_error(err, "Unable to enqueue kernel");
-  fluid->calls_to_project_a++;
+void set_relaxation(FluidSim * fluid, int max_diffuse_steps, int max_project_steps, float diffuse_tolerance, float project_tolerance)
+{
+  fluid->max_diffuse_steps = max_diffuse_steps;
+  fluid->max_project_steps = max_project_steps;
+  fluid->diffuse_tolerance = diffuse_tolerance;
+  fluid->project_tolerance = project_tolerance;
+  if (fluid->velocity_sim)
+  {
+    set_relaxation(fluid->velocity_sim, max_diffuse_steps, max_project_steps, diffuse_tolerance, project_tolerance);
+  }
+}
 
-  set_bnd(fluid, tmp, IS_NONE);
+static int is_obstacle(FluidSim * fluid, size_t x, size_t y)
+{
+  return (fluid->obstacle_bits[y * fluid->obstacle_words + x / 32] >> (x % 32)) & 1;
+}
 
-  for (int k = 0; k < fluid->num_relaxation_steps; k++)
+// Reclassifies the tiles from (first_x, first_y) to (last_x, last_y) inclusive and uploads them
+static void update_obstacle_tiles(FluidSim * fluid, size_t first_x, size_t first_y, size_t last_x, size_t last_y)
+{
+  for (size_t tile_y = first_y; tile_y <= last_y; tile_y++)
   {
-    //__kernel void project_B(__global float * tmp)
-    err = clSetKernelArg(fluid->project_b_kernel, 0, sizeof(cl_mem), tmp);
-    check_error(err, "Unable to set args");
+    for (size_t tile_x = first_x; tile_x <= last_x; tile_x++)
+    {
+      size_t x0 = tile_x * OBSTACLE_TILE_SIZE;
+      size_t y0 = tile_y * OBSTACLE_TILE_SIZE;
+      size_t x1 = fmin(x0 + OBSTACLE_TILE_SIZE, fluid->sim_size);
+      size_t y1 = fmin(y0 + OBSTACLE_TILE_SIZE, fluid->sim_size);
+
+      size_t num_solid = 0;
+      for (size_t y = y0; y < y1; y++)
+      {
+        for (size_t x = x0; x < x1; x++)
+        {
+          num_solid += is_obstacle(fluid, x, y);
+        }
+      }
 
-    // enqueue project_b
-    err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->project_b_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_b_event);
-    check_error(err, "Unable to enqueue kernel");
-    fluid->calls_to_project_b++;
+      // a tile of fluid still needs the mask if its border touches a solid cell
+      int touches_solid = 0;
+      for (size_t y = (y0 > 0) ? y0 - 1 : 0; y < fmin(y1 + 1, fluid->sim_size) && !touches_solid; y++)
+      {
+        for (size_t x = (x0 > 0) ? x0 - 1 : 0; x < fmin(x1 + 1, fluid->sim_size); x++)
+        {
+          if (is_obstacle(fluid, x, y))
+          {
+            touches_solid = 1;
+            break;
+          }
+        }
+      }
+
+      OBSTACLE_TILE state = TILE_MIXED;
+      if (num_solid == (x1 - x0) * (y1 - y0))
+      {
+        state = TILE_SOLID;
+      }
+      else if (!touches_solid)
+      {
+        state = TILE_FLUID;
+      }
+      fluid->obstacle_tiles[tile_y * fluid->num_obstacle_tiles + tile_x] = state;
+    }
 
-    set_bnd(fluid, tmp, IS_NONE);
+    size_t offset = tile_y * fluid->num_obstacle_tiles + first_x;
+    fluid->err = clEnqueueWriteBuffer(fluid->command_queue, fluid->obstacle_tiles_mem, CL_FALSE, offset * sizeof(cl_uchar), (last_x - first_x + 1) * sizeof(cl_uchar), &fluid->obstacle_tiles[offset], 0, NULL, NULL);
+    check_fluid_error(fluid, "Unable to write to buffer");
   }
 
-  h = 0.5f * fluid->sim_size;
-
-  //__kernel void project_C(__global float * vel, __global float * tmp, float h)
-  err = clSetKernelArg(fluid->project_c_kernel, 0, sizeof(cl_mem), vel);
-  err |= clSetKernelArg(fluid->project_c_kernel, 1, sizeof(cl_mem), tmp);
-  err |= clSetKernelArg(fluid->project_c_kernel, 2, sizeof(cl_float), &h);
-  check_error(err, "Unable to set args");
-
-  // enqueue project_c
-  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->project_c_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_c_event);
-  check_error(err, "Unable to enqueue kernel");
-  fluid->calls_to_project_c++;
-
-  set_bnd(fluid, vel, IS_VELOCITY);
+  if (fluid->metrics)
+  {
+    fluid->metrics->current.bytes_uploaded += (last_y - first_y + 1) * (last_x - first_x + 1) * sizeof(cl_uchar);
+  }
 }
 
-void add_source(FluidSim * fluid, cl_mem * dest, cl_mem * src, cl_float dt)
+cl_int set_obstacles(FluidSim * fluid, const unsigned char * mask)
 {
-  //__kernel void add_source(__global float * dest, __global float * src, float dt)
-  err = clSetKernelArg(fluid->add_source_kernel, 0, sizeof(cl_mem), dest);
-  err |= clSetKernelArg(fluid->add_source_kernel, 1, sizeof(cl_mem), src);
-  err |= clSetKernelArg(fluid->add_source_kernel, 2, sizeof(cl_float), &dt);
-  check_error(err, "Unable to set args");
-
-  // enqueue add_source
-  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->add_source_kernel, 1, NULL, &fluid->buffer_size, &fluid->full_local_size, 0, NULL, &fluid->add_source_event);
-  check_error(err, "Unable to enqueue add_source");
-  fluid->calls_to_add_source++;
+  return update_obstacles(fluid, 0, 0, fluid->sim_size, fluid->sim_size, mask);
 }
 
-void set_bnd(FluidSim * fluid, cl_mem * dest, VEC_TYPE vec_type)
+// A coarse cell is solid if any of its cells is, so walls thinner than a coarse cell still stop the flow
+static void update_velocity_obstacles(FluidSim * fluid, size_t x, size_t y, size_t width, size_t height)
 {
-  //__kernel void set_bnd(__global float * dest, int vec_type)
-  err = clSetKernelArg(fluid->set_bnd_kernel, 0, sizeof(cl_mem), dest);
-  err |= clSetKernelArg(fluid->set_bnd_kernel, 1, sizeof(cl_int), &vec_type);
-  check_error(err, "Unable to set args");
+  size_t scale = fluid->velocity_scale;
+  size_t coarse_x = x / scale;
+  size_t coarse_y = y / scale;
+  size_t coarse_width = (x + width + scale - 1) / scale - coarse_x;
+  size_t coarse_height = (y + height + scale - 1) / scale - coarse_y;
+
+  unsigned char * coarse_mask = (unsigned char *)calloc(coarse_width * coarse_height, sizeof(unsigned char));
+  for (size_t j = 0; j < coarse_height; j++)
+  {
+    for (size_t i = 0; i < coarse_width; i++)
+    {
+      for (size_t fine_y = (coarse_y + j) * scale; fine_y < (coarse_y + j + 1) * scale; fine_y++)
+      {
+        for (size_t fine_x = (coarse_x + i) * scale; fine_x < (coarse_x + i + 1) * scale; fine_x++)
+        {
+          coarse_mask[j * coarse_width + i] |= is_obstacle(fluid, fine_x, fine_y);
+        }
+      }
+    }
+  }
 
-  // enqueue set_bnd
-  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->set_bnd_kernel, 1, NULL, &fluid->set_bnd_global_size, &fluid->set_bnd_local_size, 0, NULL, &fluid->set_bnd_event);
-  check_error(err, "Unable to enqueue set_bnd");
-  fluid->calls_to_set_bnd++;
+  fluid->err = update_obstacles(fluid->velocity_sim, coarse_x, coarse_y, coarse_width, coarse_height, coarse_mask);
+  check_fluid_error(fluid, "Unable to update the velocity grid obstacles");
+  free(coarse_mask);
 }
 
-void copy_to_framebuffer(FluidSim * fluid, cl_mem * src)
+cl_int update_obstacles(FluidSim * fluid, size_t x, size_t y, size_t width, size_t height, const unsigned char * mask)
 {
-  if (fluid->is_using_opengl)
+  if (width == 0 || height == 0 || x + width > fluid->sim_size || y + height > fluid->sim_size)
   {
-    glFinish();
+    return CL_INVALID_VALUE;
+  }
+  if (fluid->status != CL_SUCCESS)
+  {
+    return fluid->status;
+  }
+
+  for (size_t j = 0; j < height; j++)
+  {
+    for (size_t i = 0; i < width; i++)
+    {
+      cl_uint * word = &fluid->obstacle_bits[(y + j) * fluid->obstacle_words + (x + i) / 32];
+      cl_uint bit = 1u << ((x + i) % 32);
+      *word = (mask[j * width + i]) ? (*word | bit) : (*word & ~bit);
+    }
+  }
 
-    err = clEnqueueAcquireGLObjects(fluid->command_queue, 1, &fluid->framebuffer, 0, 0, NULL);
-    check_error(err, "Unable to acquire texture");
+  // the last frame may still be reading the obstacles on the density queue
+  wait_for_event(fluid, fluid->command_queue, fluid->frame_done_event);
 
-    //__kernel void make_framebuffer(write_only image2d_t dest, __global float * src)
-    err = clSetKernelArg(fluid->make_framebuffer_kernel, 0, sizeof(cl_mem), &fluid->framebuffer);
-    err |= clSetKernelArg(fluid->make_framebuffer_kernel, 1, sizeof(cl_mem), src);
-    check_error(err, "Unable to set args");
+  // only upload the words that hold the region
+  size_t first_word = x / 32;
+  size_t num_words = (x + width - 1) / 32 - first_word + 1;
+  for (size_t j = y; j < y + height; j++)
+  {
+    size_t offset = j * fluid->obstacle_words + first_word;
+    fluid->err = clEnqueueWriteBuffer(fluid->command_queue, fluid->obstacle_mem, CL_FALSE, offset * sizeof(cl_uint), num_words * sizeof(cl_uint), &fluid->obstacle_bits[offset], 0, NULL, NULL);
+    check_fluid_error(fluid, "Unable to write to buffer");
+  }
+
+  if (fluid->metrics)
+  {
+    fluid->metrics->current.bytes_uploaded += height * num_words * sizeof(cl_uint);
+  }
 
-    //enqueue make_framebuffer
-    err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->make_framebuffer_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->make_framebuffer_event);
-    check_error(err, "Unable to enque make_framebuffer");
-    fluid->calls_to_make_framebuffer++;
+  // tiles next to the region can change from fluid to mixed as well
+  size_t first_x = (x > 0) ? (x - 1) / OBSTACLE_TILE_SIZE : 0;
+  size_t first_y = (y > 0) ? (y - 1) / OBSTACLE_TILE_SIZE : 0;
+  size_t last_x = fmin(x + width, fluid->sim_size - 1) / OBSTACLE_TILE_SIZE;
+  size_t last_y = fmin(y + height, fluid->sim_size - 1) / OBSTACLE_TILE_SIZE;
+  update_obstacle_tiles(fluid, first_x, first_y, last_x, last_y);
 
-    //err = clFlush(fluid->command_queue);
-    err = clFinish(fluid->command_queue);
-    check_error(err, "Unable to finish queue");
+  // the writes above read from the host copies, which are not touched again until the next update
+  fluid->err = clFinish(fluid->command_queue);
+  check_fluid_error(fluid, "Unable to finish queue");
 
-    err = clEnqueueReleaseGLObjects(fluid->command_queue, 1, &fluid->framebuffer, 0, 0, NULL);
-    check_error(err, "Unable to release texture");
+  if (fluid->velocity_sim)
+  {
+    update_velocity_obstacles(fluid, x, y, width, height);
   }
+
+  return fluid->status;
+}
+
+void set_activity_thresholds(FluidSim * fluid, float density_threshold, float velocity_threshold)
+{
+  fluid->density_threshold = density_threshold;
+  fluid->velocity_threshold = velocity_threshold;
 }
 
-void enqueue_event(FluidSim * fluid, float x, float y, float s, float max_r, VEC_TYPE vec_type)
+cl_int enqueue_event(FluidSim * fluid, float x, float y, float s, float max_r, VEC_TYPE vec_type)
 {
+  // the velocity sources go into the grid the velocity runs on
+  if (fluid->velocity_sim && (vec_type == IS_U_VELOCITY || vec_type == IS_V_VELOCITY))
+  {
+    return enqueue_event(fluid->velocity_sim, x, y, s, max_r, vec_type);
+  }
+
   SourceEventList * source_event = NULL;
 
   switch (vec_type) {
@@ -557,48 +2617,257 @@ void enqueue_event(FluidSim * fluid, float x, float y, float s, float max_r, VEC
       source_event = &fluid->v_velocity_events;
       break;
     default:
-      check_error(1, "Invalid vec type");
-      break;
+      return CL_INVALID_VALUE;
+  }
+
+  // the event is dropped, the ones already queued still go in
+  if (source_event->num_events == MAX_NUM_SIMULTANEOUS_EVENTS)
+  {
+    return CL_OUT_OF_RESOURCES;
+  }
+
+  source_event->x[source_event->num_events] = x * fluid->sim_size;
+  source_event->y[source_event->num_events] = y * fluid->sim_size;
+  source_event->strength[source_event->num_events] = s;
+  source_event->max_radius_sqrd[source_event->num_events++] = max_r * max_r * fluid->sim_size * fluid->sim_size;
+  return CL_SUCCESS;
+}
+
+cl_int set_particles(FluidSim * fluid, size_t max_particles, int particles_per_event, float lifetime, PARTICLE_INTEGRATOR integrator)
+{
+  if (max_particles > CL_UINT_MAX || particles_per_event < 0 || lifetime < 0 || (integrator != INTEGRATE_RK2 && integrator != INTEGRATE_RK4))
+  {
+    return CL_INVALID_VALUE;
+  }
+  if (fluid->status != CL_SUCCESS)
+  {
+    return fluid->status;
+  }
+
+  // the last frame may still be moving or drawing the old particles
+  fluid->err = clFinish(fluid->command_queue);
+  fluid->err |= clFinish(fluid->density_queue);
+  check_fluid_error(fluid, "Unable to finish queue");
+  release_particles(fluid);
+
+  fluid->particles_per_event = particles_per_event;
+  fluid->particle_lifetime = lifetime;
+  fluid->particle_integrator = integrator;
+  fluid->particles_emitted_since_read = 0;
+  if (max_particles == 0)
+  {
+    return fluid->status;
+  }
+
+  FluidContext * shared = fluid->shared;
+  size_t num_cells = fluid->sim_size * fluid->sim_size;
+
+  fluid->max_particles = max_particles;
+  fluid->particle_mem[0] = acquire_buffer(shared, max_particles * sizeof(cl_float4), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->particle_mem[1] = acquire_buffer(shared, max_particles * sizeof(cl_float4), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->num_particles_mem = acquire_buffer(shared, sizeof(cl_uint), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->particle_counts_mem = acquire_buffer(shared, num_cells * sizeof(cl_uint), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->particle_starts_mem = acquire_buffer(shared, (num_cells + 1) * sizeof(cl_uint), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+  fluid->particle_ranks_mem = acquire_buffer(shared, max_particles * sizeof(cl_uint), &fluid->err);
+  check_fluid_error(fluid, "Unable to create buffer");
+
+  // every sort clears the counts it read, so they only start out cleared here
+  cl_uint pattern = 0;
+  fluid->err = clEnqueueFillBuffer(fluid->command_queue, fluid->num_particles_mem, (void *)&pattern, sizeof(cl_uint), 0, sizeof(cl_uint), 0, NULL, NULL);
+  fluid->err |= clEnqueueFillBuffer(fluid->command_queue, fluid->particle_counts_mem, (void *)&pattern, sizeof(cl_uint), 0, num_cells * sizeof(cl_uint), 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to clear buffers");
+
+  return fluid->status;
+}
+
+cl_int read_particles(FluidSim * fluid, cl_float4 * particles, size_t max_particles, size_t * num_particles)
+{
+  if (!fluid->max_particles)
+  {
+    return CL_INVALID_VALUE;
+  }
+  if (fluid->status != CL_SUCCESS)
+  {
+    return fluid->status;
+  }
+
+  // the last frame may still be running on the density queue
+  wait_for_event(fluid, fluid->command_queue, fluid->frame_done_event);
+
+  cl_uint count = 0;
+  fluid->err = clEnqueueReadBuffer(fluid->command_queue, fluid->num_particles_mem, CL_TRUE, 0, sizeof(cl_uint), &count, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to read buffer");
+
+  *num_particles = fmin(fmin(count, fluid->max_particles), max_particles);
+  if (*num_particles > 0)
+  {
+    fluid->err = clEnqueueReadBuffer(fluid->command_queue, fluid->particle_mem[CUR], CL_TRUE, 0, *num_particles * sizeof(cl_float4), particles, 0, NULL, NULL);
+    check_fluid_error(fluid, "Unable to read buffer");
+  }
+
+  return fluid->status;
+}
+
+cl_float * map_field(FluidSim * fluid, VEC_TYPE vec_type, cl_map_flags map_flags)
+{
+  if (fluid->is_fp64)
+  {
+    return NULL;
   }
 
-  if (source_event->num_events < MAX_NUM_SIMULTANEOUS_EVENTS)
+  cl_mem field = (vec_type == IS_VELOCITY) ? fluid->velocity_mem[CUR] : fluid->density_mem[CUR];
+
+  // the last frame may still be running on the density queue
+  wait_for_event(fluid, fluid->command_queue, fluid->frame_done_event);
+
+  cl_float * host_field = (cl_float *)clEnqueueMapBuffer(fluid->command_queue, field, CL_TRUE, map_flags, 0, fluid->buffer_size * sizeof(cl_float), 0, NULL, NULL, &fluid->err);
+  check_fluid_error(fluid, "Unable to map buffer");
+
+  return (fluid->err == CL_SUCCESS) ? host_field : NULL;
+}
+
+cl_int unmap_field(FluidSim * fluid, VEC_TYPE vec_type, cl_float * field)
+{
+  cl_mem field_mem = (vec_type == IS_VELOCITY) ? fluid->velocity_mem[CUR] : fluid->density_mem[CUR];
+
+  fluid->err = clEnqueueUnmapMemObject(fluid->command_queue, field_mem, field, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to unmap buffer");
+
+  return fluid->status;
+}
+
+// Copies events into the next staging copy of vec_type, which the upload reads from until it completes, and returns its slot
+static int stage_events(FluidSim * fluid, const SourceEventList * events, cl_int vec_type)
+{
+  int slot = fluid->next_staged_events[vec_type];
+  fluid->next_staged_events[vec_type] = (slot + 1) % MAX_FRAMES_IN_FLIGHT;
+
+  // the frames in flight have normally finished this upload long ago
+  cl_event * upload = &fluid->staged_uploads[vec_type][slot];
+  if (*upload)
   {
-    source_event->x[source_event->num_events] = x * fluid->sim_size;
-    source_event->y[source_event->num_events] = y * fluid->sim_size;
-    source_event->strength[source_event->num_events] = s;
-    source_event->max_radius_sqrd[source_event->num_events++] = max_r * max_r * fluid->sim_size * fluid->sim_size;
+    fluid->err = clWaitForEvents(1, upload);
+    check_fluid_error(fluid, "Unable to wait for upload");
+    clReleaseEvent(*upload);
+    *upload = NULL;
   }
-  else {check_error(source_event->num_events, "Too many events");}
+
+  memcpy(&fluid->staged_events[vec_type][slot], events, sizeof(SourceEventList));
+  return slot;
 }
 
-void add_event_sources(FluidSim * fluid, cl_mem * dest, SourceEventList * events, cl_int vec_type)
+void add_event_sources(FluidSim * fluid, cl_mem * dest, SourceEventList * events, cl_int vec_type, cl_float dt)
 {
   if (events->num_events > 0)
   {
-    err = clEnqueueWriteBuffer(fluid->command_queue, fluid->source_x, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->x, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_y, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->y, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_strength, CL_TRUE, 0, events->num_events * sizeof(cl_float), events->strength, 0, NULL, NULL);
-    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_max_radius_sqrd, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->max_radius_sqrd, 0, NULL, NULL);
-    check_error(err, "Unable to write to buffer");
+    // only visit the interior cells that some event reaches
+    int first[2] = {fluid->sim_size, fluid->sim_size};
+    int last[2] = {1, 1};
+    for (int i = 0; i < events->num_events; i++)
+    {
+      int radius = ceil(sqrt(events->max_radius_sqrd[i]));
+      first[0] = fmin(first[0], events->x[i] - radius);
+      first[1] = fmin(first[1], events->y[i] - radius);
+      last[0] = fmax(last[0], events->x[i] + radius);
+      last[1] = fmax(last[1], events->y[i] + radius);
+    }
+    first[0] = fmax(first[0], 1);
+    first[1] = fmax(first[1], 1);
+    last[0] = fmin(last[0], fluid->sim_size);
+    last[1] = fmin(last[1], fluid->sim_size);
+
+    // The uploads queue up behind the barriers of the frames still running instead of blocking the host.
+    // The queue is in order, so the last write completes after the others, and the buffers are not rewritten before the kernels that read them ran.
+    int slot = stage_events(fluid, events, vec_type);
+    SourceEventList * staged = &fluid->staged_events[vec_type][slot];
+    fluid->err = clEnqueueWriteBuffer(fluid->command_queue, fluid->source_x, CL_FALSE, 0, staged->num_events * sizeof(cl_int), staged->x, 0, NULL, NULL);
+    fluid->err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_y, CL_FALSE, 0, staged->num_events * sizeof(cl_int), staged->y, 0, NULL, NULL);
+    fluid->err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_strength, CL_FALSE, 0, staged->num_events * sizeof(cl_float), staged->strength, 0, NULL, NULL);
+    fluid->err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_max_radius_sqrd, CL_FALSE, 0, staged->num_events * sizeof(cl_int), staged->max_radius_sqrd, 0, NULL, &fluid->staged_uploads[vec_type][slot]);
+    check_fluid_error(fluid, "Unable to write to buffer");
+
+    if (fluid->metrics)
+    {
+      fluid->metrics->current.bytes_uploaded += events->num_events * (3 * sizeof(cl_int) + sizeof(cl_float));
+      fluid->metrics->current.events_injected[vec_type] += events->num_events;
+    }
 
-    //__kernel void add_event_sources(__global float * dest, __constant int * x, __constant int * y, __constant float * strength, __constant int * max_radius_sqrd, int num_events, int vec_type)
-    err = clSetKernelArg(fluid->add_event_sources_kernel, 0, sizeof(cl_mem), dest);
-    err |= clSetKernelArg(fluid->add_event_sources_kernel, 1, sizeof(cl_mem), &fluid->source_x);
-    err |= clSetKernelArg(fluid->add_event_sources_kernel, 2, sizeof(cl_mem), &fluid->source_y);
-    err |= clSetKernelArg(fluid->add_event_sources_kernel, 3, sizeof(cl_mem), &fluid->source_strength);
-    err |= clSetKernelArg(fluid->add_event_sources_kernel, 4, sizeof(cl_mem), &fluid->source_max_radius_sqrd);
-    err |= clSetKernelArg(fluid->add_event_sources_kernel, 5, sizeof(cl_int), &events->num_events);
-    err |= clSetKernelArg(fluid->add_event_sources_kernel, 6, sizeof(cl_int), &vec_type);
-    check_error(err, "Unable to set add_event_sources args");
+    //__kernel void add_event_sources(__global real * dest, __constant int * x, __constant int * y, __constant float * strength, __constant int * max_radius_sqrd, int num_events, int vec_type, float dt)
+    fluid->err = clSetKernelArg(fluid->add_event_sources_kernel, 0, sizeof(cl_mem), dest);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 1, sizeof(cl_mem), &fluid->source_x);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 2, sizeof(cl_mem), &fluid->source_y);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 3, sizeof(cl_mem), &fluid->source_strength);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 4, sizeof(cl_mem), &fluid->source_max_radius_sqrd);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 5, sizeof(cl_int), &events->num_events);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 6, sizeof(cl_int), &vec_type);
+    fluid->err |= clSetKernelArg(fluid->add_event_sources_kernel, 7, sizeof(cl_float), &dt);
+    check_fluid_error(fluid, "Unable to set add_event_sources args");
+
+    // the kernel adds one to the global id to skip the border
+    size_t offset[2] = {first[0] - 1, first[1] - 1};
+    size_t global_size[2] = {last[0] - first[0] + 1, last[1] - first[1] + 1};
+
+    if (last[0] >= first[0] && last[1] >= first[1])
+    {
+      fluid->err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->add_event_sources_kernel, 2, offset, global_size, NULL, 0, NULL, &fluid->add_event_sources_event);
+      check_fluid_error(fluid, "Unable to enqueue add_event_sources");
+      fluid->calls_to_add_event_sources++;
+    }
 
-    err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->add_event_sources_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->add_event_sources_event);
-    check_error(err, "Unable to enqueue add_event_sources");
-    fluid->calls_to_add_event_sources++;
+    if (fluid->max_particles && fluid->particles_per_event > 0 && (vec_type == IS_A_DENSITY || vec_type == IS_B_DENSITY))
+    {
+      emit_particles(fluid, events->num_events, (vec_type == IS_A_DENSITY) ? 0 : 1);
+    }
   }
 
   events->num_events = 0;
 }
 
+void update_active_tiles(FluidSim * fluid)
+{
+  cl_uint pattern = 0;
+  fluid->err = clEnqueueFillBuffer(fluid->command_queue, fluid->active_mem, (void *)&pattern, sizeof(cl_uint), 0, fluid->active_tiles_per_row * fluid->active_tiles_per_row * sizeof(cl_uint), 0, NULL, NULL);
+  fluid->err |= clEnqueueFillBuffer(fluid->command_queue, fluid->num_active_tiles_mem, (void *)&pattern, sizeof(cl_uint), 0, sizeof(cl_uint), 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to clear buffers");
+
+  //__kernel void mark_active_tiles(__global uint * active, __global real * dens, __global real * dens_prev, __global real * vel, __global real * vel_prev, float density_threshold, float velocity_threshold, __global real * scratch)
+  fluid->err = clSetKernelArg(fluid->mark_active_tiles_kernel, 0, sizeof(cl_mem), &fluid->active_mem);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 1, sizeof(cl_mem), &fluid->density_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 2, sizeof(cl_mem), &fluid->density_mem[PREV]);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 3, sizeof(cl_mem), &fluid->velocity_mem[CUR]);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 4, sizeof(cl_mem), &fluid->velocity_mem[PREV]);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 5, sizeof(cl_float), &fluid->density_threshold);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 6, sizeof(cl_float), &fluid->velocity_threshold);
+  fluid->err |= clSetKernelArg(fluid->mark_active_tiles_kernel, 7, sizeof(cl_mem), &fluid->advect_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue mark_active_tiles
+  fluid->err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->mark_active_tiles_kernel, 2, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->mark_active_tiles_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_mark_active_tiles++;
+
+  //__kernel void compact_active_tiles(__global uint * active_tiles, __global uint * num_active_tiles, __global uint * active)
+  fluid->err = clSetKernelArg(fluid->compact_active_tiles_kernel, 0, sizeof(cl_mem), &fluid->active_tiles_mem);
+  fluid->err |= clSetKernelArg(fluid->compact_active_tiles_kernel, 1, sizeof(cl_mem), &fluid->num_active_tiles_mem);
+  fluid->err |= clSetKernelArg(fluid->compact_active_tiles_kernel, 2, sizeof(cl_mem), &fluid->active_mem);
+  check_fluid_error(fluid, "Unable to set args");
+
+  // enqueue compact_active_tiles
+  size_t tiles_global_size[2] = {fluid->active_tiles_per_row, fluid->active_tiles_per_row};
+  fluid->err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->compact_active_tiles_kernel, 2, NULL, tiles_global_size, NULL, 0, NULL, &fluid->compact_active_tiles_event);
+  check_fluid_error(fluid, "Unable to enqueue kernel");
+  fluid->calls_to_compact_active_tiles++;
+
+  // OpenCL has no indirect launches, so the tile count comes back to size the tiled launches
+  fluid->err = clEnqueueReadBuffer(fluid->command_queue, fluid->num_active_tiles_mem, CL_TRUE, 0, sizeof(cl_uint), &fluid->num_active_tiles, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to read buffer");
+}
+
 void swap_dens_buffers(FluidSim * fluid)
 {
   cl_mem tmp = fluid->density_mem[CUR];
@@ -617,9 +2886,13 @@ float profile_event(cl_event event, size_t times_run, cl_ulong samples[NUM_SAMPL
 {
   cl_ulong time_start, time_end;
 
-  err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+  cl_int err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
   err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
-  check_error(err, "Unable to get profiling info");
+  if (err != CL_SUCCESS)
+  {
+    fprintf(stderr, "Unable to get profiling info for %s: %d\n", str, (int)err);
+    return 0;
+  }
 
   samples[cur_sample] = time_end - time_start;
 
@@ -647,3 +2920,41 @@ void check_for_error(cl_int err, const char * str, const char * file, int line_n
     exit(0);
   }
 }
+
+void record_fluid_error(FluidSim * fluid, const char * str, const char * file, int line_number)
+{
+  if (fluid->err != CL_SUCCESS)
+  {
+    fprintf(stderr, "<%s>:%d %s: %d\n", file, line_number, str, (int)fluid->err);
+    if (fluid->status == CL_SUCCESS)
+    {
+      fluid->status = fluid->err;
+    }
+  }
+}
+
+cl_int get_fluid_status(FluidSim * fluid)
+{
+  return fluid->status;
+}
+
+cl_int get_fluid_measures(FluidSim * fluid, cl_double measures[NUM_MEASURES])
+{
+  if (!fluid->is_measuring || !fluid->measures_read_event)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  fluid->err = clWaitForEvents(1, &fluid->measures_read_event);
+  check_fluid_error(fluid, "Unable to wait for measures");
+  if (fluid->status != CL_SUCCESS)
+  {
+    return fluid->status;
+  }
+
+  for (int i = 0; i < NUM_MEASURES; i++)
+  {
+    measures[i] = (fluid->is_fp64) ? fluid->measure_results[i] : ((cl_float *)fluid->measure_results)[i];
+  }
+  return CL_SUCCESS;
+}
@@ -0,0 +1,508 @@
+#include "cl_fluid_sim_3d.h"
+
+static cl_int err;
+
+FluidSim3D * create_fluid_sim_3d(const char * kernel_filename, size_t sim_size, float diff, float visc, int num_r_steps, FLAGS flags)
+{
+  FluidSim3D * fluid = (FluidSim3D *)malloc(sizeof(FluidSim3D));
+
+  fluid->profile = (flags & F_PROFILE) ? 1 : 0;
+
+  size_t kernel_src_size;
+  char * kernel_src = load_kernel_source(kernel_filename, fluid_kernel_3d_src, &kernel_src_size);
+  if (!kernel_src)
+  {
+    return NULL;
+  }
+
+  fluid->sim_size = sim_size;
+  fluid->stride = sim_size + 2;
+  fluid->volume = fluid->stride * fluid->stride * fluid->stride;
+  fluid->num_relaxation_steps = num_r_steps;
+  fluid->diffusion_rate = diff;
+  fluid->viscosity = visc;
+
+  fluid->global_size[0] = fluid->sim_size;
+  fluid->global_size[1] = fluid->sim_size;
+  fluid->global_size[2] = fluid->sim_size;
+  // wide along x for coalescing, a few rows and slices deep so the y and z neighbours are reused from cache
+  fluid->local_size[0] = 32;
+  fluid->local_size[1] = 4;
+  fluid->local_size[2] = 2;
+  fluid->face_global_size[0] = fluid->sim_size;
+  fluid->face_global_size[1] = fluid->sim_size;
+  fluid->edge_global_size = fluid->sim_size + 1;
+
+  fluid->density_events.num_events = 0;
+  fluid->u_velocity_events.num_events = 0;
+  fluid->v_velocity_events.num_events = 0;
+  fluid->w_velocity_events.num_events = 0;
+
+  fluid->cur_sample = 0;
+
+  cl_platform_id fluid_platform;
+  cl_device_id fluid_device = choose_device(flags, &fluid_platform);
+
+  size_t max_work_group_size;
+  clGetDeviceInfo(fluid_device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_work_group_size, NULL);
+
+  size_t max_work_item_dimensions;
+  clGetDeviceInfo(fluid_device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(size_t), &max_work_item_dimensions, NULL);
+
+  size_t max_work_item_size[max_work_item_dimensions];
+  clGetDeviceInfo(fluid_device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t[max_work_item_dimensions]), max_work_item_size, NULL);
+
+  for (int i = 0; i < 3; i++)
+  {
+    fluid->local_size[i] = fmin(fluid->sim_size, fmin(fluid->local_size[i], max_work_item_size[i]));
+  }
+  // give up depth before width
+  for (int i = 2; i >= 0 && fluid->local_size[0] * fluid->local_size[1] * fluid->local_size[2] > max_work_group_size; i--)
+  {
+    while (fluid->local_size[i] > 1 && fluid->local_size[0] * fluid->local_size[1] * fluid->local_size[2] > max_work_group_size)
+    {
+      fluid->local_size[i] /= 2;
+    }
+  }
+  fluid->face_local_size[0] = fluid->local_size[0];
+  fluid->face_local_size[1] = fmin(fluid->sim_size, fluid->local_size[1] * fluid->local_size[2]);
+  if (flags & F_DEBUG)
+  {
+    fprintf(stdout, "local work size (%zu, %zu, %zu)\n", fluid->local_size[0], fluid->local_size[1], fluid->local_size[2]);
+  }
+
+  fluid->context = clCreateContext(NULL, 1, &fluid_device, NULL, NULL, &err);
+  check_error(err, "Unable to create cl context");
+
+  // commands are executed in-order
+  fluid->command_queue = clCreateCommandQueue(fluid->context, fluid_device, CL_QUEUE_PROFILING_ENABLE, &err);
+  check_error(err, "Unable to create command queue");
+
+  fluid->program = clCreateProgramWithSource(fluid->context, 1, (const char **)&kernel_src, (const size_t *)&kernel_src_size, &err);
+  free(kernel_src);
+  check_error(err, "Unable to create program with source");
+
+  char * kernel_definitions = malloc(256);
+  snprintf(kernel_definitions, 256, "-D SIM_SIZE=%zu "
+                                    "-D STRIDE=%zu "
+                                    "-D VOLUME=%zu "
+                                    "-D IS_VELOCITY=%d "
+                                    , fluid->sim_size, fluid->stride, fluid->volume, IS_VELOCITY);
+
+  err = clBuildProgram(fluid->program, 1, &fluid_device, kernel_definitions, NULL, NULL);
+  free(kernel_definitions);
+  const size_t max_log_length = 16384;
+  char log[max_log_length];
+  clGetProgramBuildInfo(fluid->program, fluid_device, CL_PROGRAM_BUILD_LOG, max_log_length, log, NULL);
+  fprintf(stderr, "%s", log);
+  check_error(err, "Unable to build program");
+
+  fluid->set_bnd_kernel = clCreateKernel(fluid->program, "set_bnd_3d", &err);
+  check_error(err, "Unable to create set_bnd_3d");
+  fluid->set_bnd_edges_kernel = clCreateKernel(fluid->program, "set_bnd_edges_3d", &err);
+  check_error(err, "Unable to create set_bnd_edges_3d");
+  fluid->add_event_sources_kernel = clCreateKernel(fluid->program, "add_event_sources_3d", &err);
+  check_error(err, "Unable to create add_event_sources_3d");
+  fluid->add_source_kernel = clCreateKernel(fluid->program, "add_source_3d", &err);
+  check_error(err, "Unable to create add_source_3d");
+  fluid->diffuse_kernel = clCreateKernel(fluid->program, "diffuse_3d", &err);
+  check_error(err, "Unable to create diffuse_3d");
+  fluid->advect_kernel = clCreateKernel(fluid->program, "advect_3d", &err);
+  check_error(err, "Unable to create advect_3d");
+  fluid->project_a_kernel = clCreateKernel(fluid->program, "project_A_3d", &err);
+  check_error(err, "Unable to create project_A_3d");
+  fluid->project_b_kernel = clCreateKernel(fluid->program, "project_B_3d", &err);
+  check_error(err, "Unable to create project_B_3d");
+  fluid->project_c_kernel = clCreateKernel(fluid->program, "project_C_3d", &err);
+  check_error(err, "Unable to create project_C_3d");
+
+  fluid->density_mem[0] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, fluid->volume * sizeof(cl_float), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->density_mem[1] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, fluid->volume * sizeof(cl_float), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->velocity_mem[0] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, 3 * fluid->volume * sizeof(cl_float), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->velocity_mem[1] = clCreateBuffer(fluid->context, CL_MEM_READ_WRITE, 3 * fluid->volume * sizeof(cl_float), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->source_x = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->source_y = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->source_z = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->source_strength = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_float), NULL, &err);
+  check_error(err, "Unable to create buffer");
+  fluid->source_max_radius_sqrd = clCreateBuffer(fluid->context, CL_MEM_READ_ONLY, MAX_NUM_SIMULTANEOUS_EVENTS * sizeof(cl_int), NULL, &err);
+  check_error(err, "Unable to create buffer");
+
+  cl_float pattern = 0;
+  err = clEnqueueFillBuffer(fluid->command_queue, fluid->density_mem[CUR], (void *)&pattern, sizeof(cl_float), 0, fluid->volume * sizeof(cl_float), 0, NULL, NULL);
+  err |= clEnqueueFillBuffer(fluid->command_queue, fluid->velocity_mem[CUR], (void *)&pattern, sizeof(cl_float), 0, 3 * fluid->volume * sizeof(cl_float), 0, NULL, NULL);
+  check_error(err, "Unable to clear buffers");
+
+  err = clFinish(fluid->command_queue);
+  check_error(err, "Unable to finish queue");
+
+  return fluid;
+}
+
+void destroy_fluid_sim_3d(FluidSim3D * fluid)
+{
+  clFinish(fluid->command_queue);
+
+  clReleaseMemObject(fluid->density_mem[0]);
+  clReleaseMemObject(fluid->density_mem[1]);
+  clReleaseMemObject(fluid->velocity_mem[0]);
+  clReleaseMemObject(fluid->velocity_mem[1]);
+  clReleaseMemObject(fluid->source_x);
+  clReleaseMemObject(fluid->source_y);
+  clReleaseMemObject(fluid->source_z);
+  clReleaseMemObject(fluid->source_strength);
+  clReleaseMemObject(fluid->source_max_radius_sqrd);
+
+  clReleaseKernel(fluid->set_bnd_kernel);
+  clReleaseKernel(fluid->set_bnd_edges_kernel);
+  clReleaseKernel(fluid->add_event_sources_kernel);
+  clReleaseKernel(fluid->add_source_kernel);
+  clReleaseKernel(fluid->diffuse_kernel);
+  clReleaseKernel(fluid->advect_kernel);
+  clReleaseKernel(fluid->project_a_kernel);
+  clReleaseKernel(fluid->project_b_kernel);
+  clReleaseKernel(fluid->project_c_kernel);
+
+  clReleaseProgram(fluid->program);
+  clReleaseCommandQueue(fluid->command_queue);
+  clReleaseContext(fluid->context);
+
+  free(fluid);
+}
+
+void simulate_next_frame_3d(FluidSim3D * fluid, float dt)
+{
+  fluid->calls_to_add_event_sources = 0;
+  fluid->calls_to_add_source = 0;
+  fluid->calls_to_set_bnd = 0;
+  fluid->calls_to_set_bnd_edges = 0;
+  fluid->calls_to_diffuse = 0;
+  fluid->calls_to_advect = 0;
+  fluid->calls_to_project_a = 0;
+  fluid->calls_to_project_b = 0;
+  fluid->calls_to_project_c = 0;
+
+  float sim_dt = fmin(dt, MAX_DT);
+
+  // the sources go straight into the current fields, like in the 2-D simulation
+  add_event_sources_3d(fluid, &fluid->density_mem[CUR], &fluid->density_events, IS_DENSITY, sim_dt);
+  add_event_sources_3d(fluid, &fluid->velocity_mem[CUR], &fluid->u_velocity_events, IS_U_VELOCITY, sim_dt);
+  add_event_sources_3d(fluid, &fluid->velocity_mem[CUR], &fluid->v_velocity_events, IS_V_VELOCITY, sim_dt);
+  add_event_sources_3d(fluid, &fluid->velocity_mem[CUR], &fluid->w_velocity_events, IS_W_VELOCITY, sim_dt);
+
+  velocity_step_3d(fluid, sim_dt);
+  density_step_3d(fluid, sim_dt);
+
+  err = clFinish(fluid->command_queue);
+  check_error(err, "Unable to finish queue");
+
+  if (fluid->profile)
+  {
+    // profile_event counts n * n cells, so hand it the side of a square with as many cells as the volume
+    size_t n = sqrt((double)fluid->sim_size * fluid->sim_size * fluid->sim_size);
+    size_t face_n = fluid->sim_size;
+
+    float total_ms = 0;
+    if (fluid->calls_to_add_event_sources)
+    {
+      total_ms += profile_event(fluid->add_event_sources_event, fluid->calls_to_add_event_sources, fluid->add_event_sources_samples, fluid->cur_sample, n, 1, "add_event_sources_3d");
+    }
+    if (fluid->calls_to_add_source)
+    {
+      total_ms += profile_event(fluid->add_source_event, fluid->calls_to_add_source, fluid->add_source_samples, fluid->cur_sample, n, 3, "add_source_3d");
+    }
+    total_ms += profile_event(fluid->set_bnd_event, fluid->calls_to_set_bnd, fluid->set_bnd_samples, fluid->cur_sample, face_n, 12, "set_bnd_3d");
+    total_ms += profile_event(fluid->set_bnd_edges_event, fluid->calls_to_set_bnd_edges, fluid->set_bnd_edges_samples, fluid->cur_sample, 1, fluid->sim_size * 36, "set_bnd_edges_3d");
+    total_ms += profile_event(fluid->diffuse_event, fluid->calls_to_diffuse, fluid->diffuse_samples, fluid->cur_sample, n, 16, "diffuse_3d");
+    total_ms += profile_event(fluid->advect_event, fluid->calls_to_advect, fluid->advect_samples, fluid->cur_sample, n, 23, "advect_3d");
+    total_ms += profile_event(fluid->project_a_event, fluid->calls_to_project_a, fluid->project_a_samples, fluid->cur_sample, n, 8, "project_a_3d");
+    total_ms += profile_event(fluid->project_b_event, fluid->calls_to_project_b, fluid->project_b_samples, fluid->cur_sample, n, 8, "project_b_3d");
+    total_ms += profile_event(fluid->project_c_event, fluid->calls_to_project_c, fluid->project_c_samples, fluid->cur_sample, n, 12, "project_c_3d");
+
+    fprintf(stdout, "Total GPU runtime: %.3f ms\nTotal wallclock time: %.0f ms\n\n", total_ms, 1000.f * dt);
+    fluid->cur_sample = (fluid->cur_sample + 1) % NUM_SAMPLES;
+  }
+}
+
+void velocity_step_3d(FluidSim3D * fluid, float dt)
+{
+  // the sources were already added to CUR by add_event_sources_3d
+  swap_vel_buffers_3d(fluid);
+
+  diffuse_3d(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], dt * fluid->viscosity * fluid->sim_size * fluid->sim_size, IS_VELOCITY);
+
+  project_3d(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV]);
+
+  swap_vel_buffers_3d(fluid);
+
+  advect_3d(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], &fluid->velocity_mem[PREV], dt, IS_VELOCITY);
+
+  project_3d(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV]);
+}
+
+void density_step_3d(FluidSim3D * fluid, float dt)
+{
+  // the sources were already added to CUR by add_event_sources_3d
+  swap_dens_buffers_3d(fluid);
+
+  diffuse_3d(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], dt * fluid->diffusion_rate * fluid->sim_size * fluid->sim_size, IS_DENSITY);
+
+  swap_dens_buffers_3d(fluid);
+
+  advect_3d(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], &fluid->velocity_mem[CUR], dt, IS_DENSITY);
+}
+
+// density has one channel, velocity three and the projection scratch field two
+static cl_int num_channels(VEC_TYPE vec_type)
+{
+  return (vec_type == IS_VELOCITY) ? 3 : (vec_type == IS_NONE) ? 2 : 1;
+}
+
+void diffuse_3d(FluidSim3D * fluid, cl_mem * dest, cl_mem * src, cl_float a, VEC_TYPE vec_type)
+{
+  cl_float denominator = 1 / (1 + 6 * a);
+  cl_int channels = num_channels(vec_type);
+
+  for (int k = 0; k < fluid->num_relaxation_steps; k++)
+  {
+    //__kernel void diffuse_3d(__global float * dest, __global float * src, float a, float denominator, int channels)
+    err = clSetKernelArg(fluid->diffuse_kernel, 0, sizeof(cl_mem), dest);
+    err |= clSetKernelArg(fluid->diffuse_kernel, 1, sizeof(cl_mem), src);
+    err |= clSetKernelArg(fluid->diffuse_kernel, 2, sizeof(cl_float), &a);
+    err |= clSetKernelArg(fluid->diffuse_kernel, 3, sizeof(cl_float), &denominator);
+    err |= clSetKernelArg(fluid->diffuse_kernel, 4, sizeof(cl_int), &channels);
+    check_error(err, "Unable to set args");
+
+    // enqueue diffuse_3d
+    err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->diffuse_kernel, 3, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->diffuse_event);
+    check_error(err, "Unable to enqueue kernel");
+    fluid->calls_to_diffuse++;
+
+    set_bnd_3d(fluid, dest, vec_type);
+  }
+}
+
+void advect_3d(FluidSim3D * fluid, cl_mem * dest, cl_mem * src, cl_mem * vel, cl_float dt, VEC_TYPE vec_type)
+{
+  dt = -dt * fluid->sim_size;
+  cl_int channels = num_channels(vec_type);
+
+  //__kernel void advect_3d(__global float * dest, __global float * src, __global float * vel, float dt, int channels)
+  err = clSetKernelArg(fluid->advect_kernel, 0, sizeof(cl_mem), dest);
+  err |= clSetKernelArg(fluid->advect_kernel, 1, sizeof(cl_mem), src);
+  err |= clSetKernelArg(fluid->advect_kernel, 2, sizeof(cl_mem), vel);
+  err |= clSetKernelArg(fluid->advect_kernel, 3, sizeof(cl_float), &dt);
+  err |= clSetKernelArg(fluid->advect_kernel, 4, sizeof(cl_int), &channels);
+  check_error(err, "Unable to set args");
+
+  // enqueue advect_3d
+  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->advect_kernel, 3, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->advect_event);
+  check_error(err, "Unable to enqueue kernel");
+  fluid->calls_to_advect++;
+
+  set_bnd_3d(fluid, dest, vec_type);
+}
+
+void project_3d(FluidSim3D * fluid, cl_mem * vel, cl_mem * tmp)
+{
+  cl_float h = 0.5f / fluid->sim_size;
+
+  //__kernel void project_A_3d(__global float * tmp, __global float * vel, float h)
+  err = clSetKernelArg(fluid->project_a_kernel, 0, sizeof(cl_mem), tmp);
+  err |= clSetKernelArg(fluid->project_a_kernel, 1, sizeof(cl_mem), vel);
+  err |= clSetKernelArg(fluid->project_a_kernel, 2, sizeof(cl_float), &h);
+  check_error(err, "Unable to set args");
+
+  // enqueue project_A_3d
+  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->project_a_kernel, 3, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_a_event);
+  check_error(err, "Unable to enqueue kernel");
+  fluid->calls_to_project_a++;
+
+  set_bnd_3d(fluid, tmp, IS_NONE);
+
+  for (int k = 0; k < fluid->num_relaxation_steps; k++)
+  {
+    //__kernel void project_B_3d(__global float * tmp)
+    err = clSetKernelArg(fluid->project_b_kernel, 0, sizeof(cl_mem), tmp);
+    check_error(err, "Unable to set args");
+
+    // enqueue project_B_3d
+    err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->project_b_kernel, 3, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_b_event);
+    check_error(err, "Unable to enqueue kernel");
+    fluid->calls_to_project_b++;
+
+    set_bnd_3d(fluid, tmp, IS_NONE);
+  }
+
+  h = 0.5f * fluid->sim_size;
+
+  //__kernel void project_C_3d(__global float * vel, __global float * tmp, float h)
+  err = clSetKernelArg(fluid->project_c_kernel, 0, sizeof(cl_mem), vel);
+  err |= clSetKernelArg(fluid->project_c_kernel, 1, sizeof(cl_mem), tmp);
+  err |= clSetKernelArg(fluid->project_c_kernel, 2, sizeof(cl_float), &h);
+  check_error(err, "Unable to set args");
+
+  // enqueue project_C_3d
+  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->project_c_kernel, 3, NULL, fluid->global_size, fluid->local_size, 0, NULL, &fluid->project_c_event);
+  check_error(err, "Unable to enqueue kernel");
+  fluid->calls_to_project_c++;
+
+  set_bnd_3d(fluid, vel, IS_VELOCITY);
+}
+
+void set_bnd_3d(FluidSim3D * fluid, cl_mem * dest, VEC_TYPE vec_type)
+{
+  cl_int channels = num_channels(vec_type);
+
+  //__kernel void set_bnd_3d(__global float * dest, int vec_type, int channels)
+  err = clSetKernelArg(fluid->set_bnd_kernel, 0, sizeof(cl_mem), dest);
+  err |= clSetKernelArg(fluid->set_bnd_kernel, 1, sizeof(cl_int), &vec_type);
+  err |= clSetKernelArg(fluid->set_bnd_kernel, 2, sizeof(cl_int), &channels);
+  check_error(err, "Unable to set args");
+
+  // enqueue set_bnd_3d
+  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->set_bnd_kernel, 2, NULL, fluid->face_global_size, fluid->face_local_size, 0, NULL, &fluid->set_bnd_event);
+  check_error(err, "Unable to enqueue set_bnd_3d");
+  fluid->calls_to_set_bnd++;
+
+  //__kernel void set_bnd_edges_3d(__global float * dest, int channels)
+  err = clSetKernelArg(fluid->set_bnd_edges_kernel, 0, sizeof(cl_mem), dest);
+  err |= clSetKernelArg(fluid->set_bnd_edges_kernel, 1, sizeof(cl_int), &channels);
+  check_error(err, "Unable to set args");
+
+  // enqueue set_bnd_edges_3d
+  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->set_bnd_edges_kernel, 1, NULL, &fluid->edge_global_size, NULL, 0, NULL, &fluid->set_bnd_edges_event);
+  check_error(err, "Unable to enqueue set_bnd_edges_3d");
+  fluid->calls_to_set_bnd_edges++;
+}
+
+void add_source_3d(FluidSim3D * fluid, cl_mem * dest, cl_mem * src, cl_float dt, VEC_TYPE vec_type)
+{
+  size_t global_size = num_channels(vec_type) * fluid->volume;
+
+  //__kernel void add_source_3d(__global float * dest, __global float * src, float dt)
+  err = clSetKernelArg(fluid->add_source_kernel, 0, sizeof(cl_mem), dest);
+  err |= clSetKernelArg(fluid->add_source_kernel, 1, sizeof(cl_mem), src);
+  err |= clSetKernelArg(fluid->add_source_kernel, 2, sizeof(cl_float), &dt);
+  check_error(err, "Unable to set args");
+
+  // enqueue add_source_3d
+  err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->add_source_kernel, 1, NULL, &global_size, NULL, 0, NULL, &fluid->add_source_event);
+  check_error(err, "Unable to enqueue add_source_3d");
+  fluid->calls_to_add_source++;
+}
+
+void enqueue_event_3d(FluidSim3D * fluid, float x, float y, float z, float s, float max_r, VEC_TYPE vec_type)
+{
+  SourceEventList3D * source_event = NULL;
+
+  switch (vec_type) {
+    case IS_DENSITY:
+      source_event = &fluid->density_events;
+      break;
+    case IS_U_VELOCITY:
+      source_event = &fluid->u_velocity_events;
+      break;
+    case IS_V_VELOCITY:
+      source_event = &fluid->v_velocity_events;
+      break;
+    case IS_W_VELOCITY:
+      source_event = &fluid->w_velocity_events;
+      break;
+    default:
+      check_error(1, "Invalid vec type");
+      break;
+  }
+
+  if (source_event->num_events < MAX_NUM_SIMULTANEOUS_EVENTS)
+  {
+    source_event->x[source_event->num_events] = x * fluid->sim_size;
+    source_event->y[source_event->num_events] = y * fluid->sim_size;
+    source_event->z[source_event->num_events] = z * fluid->sim_size;
+    source_event->strength[source_event->num_events] = s;
+    source_event->max_radius_sqrd[source_event->num_events++] = max_r * max_r * fluid->sim_size * fluid->sim_size;
+  }
+  else {check_error(source_event->num_events, "Too many events");}
+}
+
+void add_event_sources_3d(FluidSim3D * fluid, cl_mem * dest, SourceEventList3D * events, cl_int vec_type, cl_float dt)
+{
+  if (events->num_events > 0)
+  {
+    cl_int channel = (vec_type == IS_V_VELOCITY) ? 1 : (vec_type == IS_W_VELOCITY) ? 2 : 0;
+
+    // only visit the interior cells that some event reaches
+    int first[3] = {fluid->sim_size, fluid->sim_size, fluid->sim_size};
+    int last[3] = {1, 1, 1};
+    for (int i = 0; i < events->num_events; i++)
+    {
+      int radius = ceil(sqrt(events->max_radius_sqrd[i]));
+      int center[3] = {events->x[i], events->y[i], events->z[i]};
+      for (int d = 0; d < 3; d++)
+      {
+        first[d] = fmin(first[d], center[d] - radius);
+        last[d] = fmax(last[d], center[d] + radius);
+      }
+    }
+
+    size_t offset[3];
+    size_t global_size[3];
+    for (int d = 0; d < 3; d++)
+    {
+      first[d] = fmax(first[d], 1);
+      last[d] = fmin(last[d], fluid->sim_size);
+      // the kernel adds one to the global id to skip the border
+      offset[d] = first[d] - 1;
+      global_size[d] = (last[d] >= first[d]) ? last[d] - first[d] + 1 : 0;
+    }
+
+    err = clEnqueueWriteBuffer(fluid->command_queue, fluid->source_x, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->x, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_y, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->y, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_z, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->z, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_strength, CL_TRUE, 0, events->num_events * sizeof(cl_float), events->strength, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->source_max_radius_sqrd, CL_TRUE, 0, events->num_events * sizeof(cl_int), events->max_radius_sqrd, 0, NULL, NULL);
+    check_error(err, "Unable to write to buffer");
+
+    //__kernel void add_event_sources_3d(__global float * dest, __constant int * x, __constant int * y, __constant int * z, __constant float * strength, __constant int * max_radius_sqrd, int num_events, int channel, float dt)
+    err = clSetKernelArg(fluid->add_event_sources_kernel, 0, sizeof(cl_mem), dest);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 1, sizeof(cl_mem), &fluid->source_x);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 2, sizeof(cl_mem), &fluid->source_y);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 3, sizeof(cl_mem), &fluid->source_z);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 4, sizeof(cl_mem), &fluid->source_strength);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 5, sizeof(cl_mem), &fluid->source_max_radius_sqrd);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 6, sizeof(cl_int), &events->num_events);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 7, sizeof(cl_int), &channel);
+    err |= clSetKernelArg(fluid->add_event_sources_kernel, 8, sizeof(cl_float), &dt);
+    check_error(err, "Unable to set add_event_sources_3d args");
+
+    if (global_size[0] && global_size[1] && global_size[2])
+    {
+      err = clEnqueueNDRangeKernel(fluid->command_queue, fluid->add_event_sources_kernel, 3, offset, global_size, NULL, 0, NULL, &fluid->add_event_sources_event);
+      check_error(err, "Unable to enqueue add_event_sources_3d");
+      fluid->calls_to_add_event_sources++;
+    }
+  }
+
+  events->num_events = 0;
+}
+
+void swap_dens_buffers_3d(FluidSim3D * fluid)
+{
+  cl_mem tmp = fluid->density_mem[CUR];
+  fluid->density_mem[CUR] = fluid->density_mem[PREV];
+  fluid->density_mem[PREV] = tmp;
+}
+
+void swap_vel_buffers_3d(FluidSim3D * fluid)
+{
+  cl_mem tmp = fluid->velocity_mem[CUR];
+  fluid->velocity_mem[CUR] = fluid->velocity_mem[PREV];
+  fluid->velocity_mem[PREV] = tmp;
+}
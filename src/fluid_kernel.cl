@@ -1,6 +1,56 @@
+// The fields are real, which is float unless the simulation was created with F_FP64 to check the float kernels against.
+// Kernel arguments and the rendering stay float either way.
+#ifdef USE_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double2 real2;
+#define convert_real2 convert_double2
+#else
+typedef float real;
+typedef float2 real2;
+#define convert_real2 convert_float2
+#endif
+
 #define IDX(x, y, c) (2 * ((x) + (STRIDE) * (y)) + (c))
 
-__kernel void diffuse_bad(__global float * dest, __global float * src, float a)
+// State of the obstacle tile holding interior cell (x, y)
+#define TILE_STATE(tiles, x, y) ((tiles)[(((y) - 1) / OBSTACLE_TILE_SIZE) * NUM_OBSTACLE_TILES + ((x) - 1) / OBSTACLE_TILE_SIZE])
+
+// Maps a work item of a tiled launch to its interior cell, the launch is ACTIVE_TILE_SIZE wide and ACTIVE_TILE_SIZE rows per active tile
+inline int2 active_cell(__global uint * active_tiles)
+{
+  uint tile = active_tiles[get_global_id(1) / ACTIVE_TILE_SIZE];
+
+  return (int2)((tile % NUM_ACTIVE_TILES) * ACTIVE_TILE_SIZE + get_global_id(0) + 1, (tile / NUM_ACTIVE_TILES) * ACTIVE_TILE_SIZE + get_global_id(1) % ACTIVE_TILE_SIZE + 1);
+}
+
+// With PERIODIC the neighbours of the edge cells are the cells at the opposite edge, so the stencils never read the walls
+#ifdef PERIODIC
+#define WRAP(x) (((x) < 1) ? SIM_SIZE : (((x) > SIM_SIZE) ? 1 : (x)))
+#define IS_PERIODIC 1
+#else
+#define WRAP(x) (x)
+#define IS_PERIODIC 0
+#endif
+
+// boundaries packs the BOUNDARY of each edge in two bits, in EDGE order: left, right, top then bottom
+#define EDGE_BOUNDARY(boundaries, edge) (((boundaries) >> (2 * (edge))) & 3)
+// Whether positions wrap around along x (axis 0) or y (axis 1), whose edges are periodic in pairs
+#define WRAPS_AXIS(boundaries, axis) (IS_PERIODIC || EDGE_BOUNDARY(boundaries, 2 * (axis)) == BOUNDARY_PERIODIC)
+
+// Obstacles are one bit per interior cell, walls are handled by set_bnd
+inline int is_solid(__global uint * obstacles, int x, int y)
+{
+  x = WRAP(x);
+  y = WRAP(y);
+  if (x < 1 || x > SIM_SIZE || y < 1 || y > SIM_SIZE)
+  {
+    return 0;
+  }
+  return (obstacles[(y - 1) * OBSTACLE_WORDS + ((x - 1) >> 5)] >> ((x - 1) & 31)) & 1;
+}
+
+__kernel void diffuse_bad(__global real * dest, __global real * src, float a)
 {
   int gid_x = get_global_id(0) + 1;
   int gid_y = get_global_id(1) + 1;
@@ -17,210 +67,1434 @@ __kernel void diffuse_bad(__global float * dest, __global float * src, float a)
   int down_id_a = center_id_a + DOUBLE_STRIDE;
   int down_id_b = down_id_a + 1;
 
-  float center_src_a = src[center_id_a];
-  float center_src_b = src[center_id_b];
+  real center_src_a = src[center_id_a];
+  real center_src_b = src[center_id_b];
 
   dest[center_id_a] = center_src_a + a * (src[left_id_a] + src[right_id_a] + src[up_id_a] + src[down_id_a] - 4 * center_src_a);
   dest[center_id_b] = center_src_b + a * (src[left_id_b] + src[right_id_b] + src[up_id_b] + src[down_id_b] - 4 * center_src_b);
 }
 
-__kernel void diffuse(__global float * dest, __global float * src, float a, float denominator)
+// Folds the largest residual of a sweep in the work-group into solve[SOLVE_RESIDUAL].
+// Non-negative floats order like their bits, so one atomic_max per group finds the largest.
+inline void reduce_residual(float change, __global uint * solve, __local float * scratch)
 {
-  int gid_x = get_global_id(0) + 1;
-  int gid_y = get_global_id(1) + 1;
+  int lid = get_local_id(0) + get_local_size(0) * get_local_id(1);
+
+  scratch[lid] = change;
+  barrier(CLK_LOCAL_MEM_FENCE);
 
+  // the full grid launches with up to 32 x 32 items, which need not be a power of two
+  for (int n = get_local_size(0) * get_local_size(1); n > 1; n = (n + 1) / 2)
+  {
+    int offset = (n + 1) / 2;
+    if (lid + offset < n)
+    {
+      scratch[lid] = fmax(scratch[lid], scratch[lid + offset]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0)
+  {
+    atomic_max(&solve[SOLVE_RESIDUAL], as_uint(scratch[0]));
+  }
+}
+
+// Ends a relaxation once every residual of its last sweep is below tolerance, the sweeps after it return straight away
+__kernel void check_residual(__global uint * solve, int sweep, float tolerance)
+{
+  if (!solve[SOLVE_DONE])
+  {
+    solve[SOLVE_DONE] = as_float(solve[SOLVE_RESIDUAL]) < tolerance;
+    solve[SOLVE_SWEEPS] = sweep;
+    solve[SOLVE_LAST_RESIDUAL] = solve[SOLVE_RESIDUAL];
+    solve[SOLVE_RESIDUAL] = 0;
+  }
+}
+
+// Solid cells are held at zero and solid neighbours mirror the center cell scaled by solid_sign.
+// Returns how much the cell changed.
+inline float diffuse_cell(int gid_x, int gid_y, __global real * dest, __global real * src, float a, float denominator, float solid_sign, __global uint * obstacles, __global uchar * tiles)
+{
   int center_id_a = IDX(gid_x, gid_y, 0);
   int center_id_b = center_id_a + 1;
 
-  int right_id_a = center_id_a + 2;
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+
+  if (tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y)))
+  {
+    dest[center_id_a] = 0;
+    dest[center_id_b] = 0;
+    return 0;
+  }
+
+  int right_id_a = IDX(WRAP(gid_x + 1), gid_y, 0);
   int right_id_b = right_id_a + 1;
-  int left_id_a = center_id_a - 2;
+  int left_id_a = IDX(WRAP(gid_x - 1), gid_y, 0);
   int left_id_b = left_id_a + 1;
-  int up_id_a = center_id_a - DOUBLE_STRIDE;
+  int up_id_a = IDX(gid_x, WRAP(gid_y - 1), 0);
   int up_id_b = up_id_a + 1;
-  int down_id_a = center_id_a + DOUBLE_STRIDE;
+  int down_id_a = IDX(gid_x, WRAP(gid_y + 1), 0);
   int down_id_b = down_id_a + 1;
 
-  dest[center_id_a] = (src[center_id_a] + a * (dest[left_id_a] + dest[right_id_a] + dest[up_id_a] + dest[down_id_a])) * denominator;
-  dest[center_id_b] = (src[center_id_b] + a * (dest[left_id_b] + dest[right_id_b] + dest[up_id_b] + dest[down_id_b])) * denominator;
+  real2 left = (real2)(dest[left_id_a], dest[left_id_b]);
+  real2 right = (real2)(dest[right_id_a], dest[right_id_b]);
+  real2 up = (real2)(dest[up_id_a], dest[up_id_b]);
+  real2 down = (real2)(dest[down_id_a], dest[down_id_b]);
+
+  if (tile == TILE_MIXED)
+  {
+    real2 mirror = solid_sign * (real2)(dest[center_id_a], dest[center_id_b]);
+    left = is_solid(obstacles, gid_x - 1, gid_y) ? mirror : left;
+    right = is_solid(obstacles, gid_x + 1, gid_y) ? mirror : right;
+    up = is_solid(obstacles, gid_x, gid_y - 1) ? mirror : up;
+    down = is_solid(obstacles, gid_x, gid_y + 1) ? mirror : down;
+  }
+
+  real2 neighbours = left + right + up + down;
+
+  real2 old_value = (real2)(dest[center_id_a], dest[center_id_b]);
+  real2 value = ((real2)(src[center_id_a], src[center_id_b]) + a * neighbours) * denominator;
+
+  dest[center_id_a] = value.x;
+  dest[center_id_b] = value.y;
+
+  real2 change = fabs(value - old_value);
+  return fmax(change.x, change.y);
 }
 
-__kernel void advect(__global float * dest, __global float * src, __global float * vel, float dt)
+// check asks for the residual of this sweep, scratch holds a float per work item
+__kernel void diffuse(__global real * dest, __global real * src, float a, float denominator, float solid_sign, __global uint * obstacles, __global uchar * tiles, __global uint * solve, int check, __local float * scratch)
 {
-  int gid_x = get_global_id(0) + 1;
-  int gid_y = get_global_id(1) + 1;
+  if (solve[SOLVE_DONE])
+  {
+    return;
+  }
+
+  float change = diffuse_cell(get_global_id(0) + 1, get_global_id(1) + 1, dest, src, a, denominator, solid_sign, obstacles, tiles);
+  if (check)
+  {
+    reduce_residual(change, solve, scratch);
+  }
+}
+
+__kernel void diffuse_tiled(__global real * dest, __global real * src, float a, float denominator, float solid_sign, __global uint * obstacles, __global uchar * tiles, __global uint * solve, int check, __local float * scratch, __global uint * active_tiles)
+{
+  if (solve[SOLVE_DONE])
+  {
+    return;
+  }
+
+  int2 cell = active_cell(active_tiles);
+  float change = diffuse_cell(cell.x, cell.y, dest, src, a, denominator, solid_sign, obstacles, tiles);
+  if (check)
+  {
+    reduce_residual(change, solve, scratch);
+  }
+}
+
+// Back-traces cell (gid_x, gid_y) along vel, wrapped back into the interior along the axes with periodic edges
+// and clamped to it along the others. The walls past a periodic edge hold the opposite edge, so sampling there wraps too.
+inline real2 backtrace(__global real * vel, int gid_x, int gid_y, float dt, int boundaries)
+{
+  const real clamp_min = 0.5f;
+  const real clamp_max = SIM_SIZE + 0.5f;
 
   int idx_a = IDX(gid_x, gid_y, 0);
-  int idx_b = idx_a + 1;
 
-  const float clamp_max = SIM_SIZE + 0.5f;
+  real2 pos = (real2)(gid_x + dt * vel[idx_a], gid_y + dt * vel[idx_a + 1]);
+  real2 wrapped = pos - (real)SIM_SIZE * floor((pos - clamp_min) / (real)SIM_SIZE);
 
-  float x = clamp(gid_x + dt * vel[idx_a], 0.5f, clamp_max);
-  float y = clamp(gid_y + dt * vel[idx_b], 0.5f, clamp_max);
+  return (real2)(WRAPS_AXIS(boundaries, 0) ? wrapped.x : clamp(pos.x, clamp_min, clamp_max),
+                 WRAPS_AXIS(boundaries, 1) ? wrapped.y : clamp(pos.y, clamp_min, clamp_max));
+}
 
-  int left = (int)(x);
-  int up = (int)(y);
+// Bilinearly samples both channels of src at pos and returns the range of the four samples used
+inline real2 sample_bilinear(__global real * src, real2 pos, real2 * lo, real2 * hi)
+{
+  int left = (int)(pos.x);
+  int up = (int)(pos.y);
 
-  float s1 = x - left;
-  float s0 = 1 - s1;
-  float t1 = y - up;
-  float t0 = 1 - t1;
+  real s1 = pos.x - left;
+  real s0 = 1 - s1;
+  real t1 = pos.y - up;
+  real t0 = 1 - t1;
 
   int upper_left_a = IDX(left, up, 0);
-  int upper_left_b = upper_left_a + 1;
   int upper_right_a = upper_left_a + 2;
-  int upper_right_b = upper_right_a + 1;
   int lower_left_a = upper_left_a + DOUBLE_STRIDE;
-  int lower_left_b = lower_left_a + 1;
   int lower_right_a = lower_left_a + 2;
-  int lower_right_b = lower_right_a + 1;
 
-  dest[idx_a] = s0 * (t0 * src[upper_left_a] + t1 * src[lower_left_a]) + s1 * (t0 * src[upper_right_a] + t1 * src[lower_right_a]);
-  dest[idx_b] = s0 * (t0 * src[upper_left_b] + t1 * src[lower_left_b]) + s1 * (t0 * src[upper_right_b] + t1 * src[lower_right_b]);
+  real2 upper_left = (real2)(src[upper_left_a], src[upper_left_a + 1]);
+  real2 upper_right = (real2)(src[upper_right_a], src[upper_right_a + 1]);
+  real2 lower_left = (real2)(src[lower_left_a], src[lower_left_a + 1]);
+  real2 lower_right = (real2)(src[lower_right_a], src[lower_right_a + 1]);
+
+  *lo = min(min(upper_left, upper_right), min(lower_left, lower_right));
+  *hi = max(max(upper_left, upper_right), max(lower_left, lower_right));
+
+  return s0 * (t0 * upper_left + t1 * lower_left) + s1 * (t0 * upper_right + t1 * lower_right);
 }
 
-__kernel void project_A(__global float * tmp, __global float * vel, float h)
+// Same as sample_bilinear, but solid cells are left out and the remaining weights are renormalized
+inline real2 sample_fluid(__global real * src, __global uint * obstacles, real2 pos)
 {
-  int gid_x = get_global_id(0) + 1;
-  int gid_y = get_global_id(1) + 1;
+  int left = (int)(pos.x);
+  int up = (int)(pos.y);
 
-  int center_id_a = IDX(gid_x, gid_y, 0);
-  int center_id_b = center_id_a + 1;
+  real s1 = pos.x - left;
+  real s0 = 1 - s1;
+  real t1 = pos.y - up;
+  real t0 = 1 - t1;
 
-  int right_id_a = center_id_a + 2;
-  int left_id_a = center_id_a - 2;
-  int up_id_b = center_id_b - DOUBLE_STRIDE;
-  int down_id_b = center_id_b + DOUBLE_STRIDE;
+  real upper_left_w = s0 * t0 * !is_solid(obstacles, left, up);
+  real upper_right_w = s1 * t0 * !is_solid(obstacles, left + 1, up);
+  real lower_left_w = s0 * t1 * !is_solid(obstacles, left, up + 1);
+  real lower_right_w = s1 * t1 * !is_solid(obstacles, left + 1, up + 1);
 
-  tmp[center_id_a] = h * (vel[left_id_a] - vel[right_id_a] + vel[up_id_b] - vel[down_id_b]);
-  tmp[center_id_b] = 0;
+  real total_w = upper_left_w + upper_right_w + lower_left_w + lower_right_w;
+
+  if (total_w == 0)
+  {
+    return (real2)(0, 0);
+  }
+
+  int upper_left_a = IDX(left, up, 0);
+  int upper_right_a = upper_left_a + 2;
+  int lower_left_a = upper_left_a + DOUBLE_STRIDE;
+  int lower_right_a = lower_left_a + 2;
+
+  real2 result = upper_left_w * (real2)(src[upper_left_a], src[upper_left_a + 1])
+                + upper_right_w * (real2)(src[upper_right_a], src[upper_right_a + 1])
+                + lower_left_w * (real2)(src[lower_left_a], src[lower_left_a + 1])
+                + lower_right_w * (real2)(src[lower_right_a], src[lower_right_a + 1]);
+
+  return result / total_w;
 }
 
-__kernel void project_B(__global float * tmp)
+// Whether the four cells sample_bilinear reads at pos lie in the obstacle tile of (gid_x, gid_y) or the ring of cells around it,
+// which has no solid cell when the tile is TILE_FLUID. The ring is only checked inside the grid, so the walls never count.
+inline int samples_near_tile(int gid_x, int gid_y, real2 pos)
 {
-  int gid_x = get_global_id(0) + 1;
-  int gid_y = get_global_id(1) + 1;
+  int tile_x = (gid_x - 1) / OBSTACLE_TILE_SIZE * OBSTACLE_TILE_SIZE + 1;
+  int tile_y = (gid_y - 1) / OBSTACLE_TILE_SIZE * OBSTACLE_TILE_SIZE + 1;
+  int left = (int)(pos.x);
+  int up = (int)(pos.y);
 
-  int center_id_a = IDX(gid_x, gid_y, 0);
-  int center_id_b = center_id_a + 1;
+  return left >= max(tile_x - 1, 1) && left + 1 <= min(tile_x + OBSTACLE_TILE_SIZE, SIM_SIZE)
+      && up >= max(tile_y - 1, 1) && up + 1 <= min(tile_y + OBSTACLE_TILE_SIZE, SIM_SIZE);
+}
+
+inline real2 advect_value(int gid_x, int gid_y, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
+{
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+  if (tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y)))
+  {
+    return (real2)(0, 0);
+  }
 
-  int right_id_b = center_id_b + 2;
-  int left_id_b = center_id_b - 2;
-  int up_id_b = center_id_b - DOUBLE_STRIDE;
-  int down_id_b = center_id_b + DOUBLE_STRIDE;
+  // a fast back-trace can leave the clean ring of a fluid tile and land next to an obstacle
+  real2 pos = backtrace(vel, gid_x, gid_y, dt, boundaries);
+  if (tile == TILE_FLUID && samples_near_tile(gid_x, gid_y, pos))
+  {
+    real2 lo, hi;
+    return sample_bilinear(src, pos, &lo, &hi);
+  }
 
-  tmp[center_id_b] = 0.25f * (tmp[center_id_a] + tmp[left_id_b] + tmp[right_id_b] + tmp[up_id_b] + tmp[down_id_b]);
+  return sample_fluid(src, obstacles, pos);
 }
 
-__kernel void project_C(__global float * vel, __global float * tmp, float h)
+inline void advect_cell(int gid_x, int gid_y, __global real * dest, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
 {
-  int gid_x = get_global_id(0) + 1;
-  int gid_y = get_global_id(1) + 1;
+  int idx_a = IDX(gid_x, gid_y, 0);
 
-  int center_id_a = IDX(gid_x, gid_y, 0);
-  int center_id_b = center_id_a + 1;
+  real2 result = advect_value(gid_x, gid_y, src, vel, dt, obstacles, tiles, boundaries);
 
-  int right_id_b = center_id_b + 2;
-  int left_id_b = center_id_b - 2;
-  int up_id_b = center_id_b - DOUBLE_STRIDE;
-  int down_id_b = center_id_b + DOUBLE_STRIDE;
+  dest[idx_a] = result.x;
+  dest[idx_a + 1] = result.y;
+}
 
-  vel[center_id_a] += h * (tmp[left_id_b] - tmp[right_id_b]);
-  vel[center_id_b] += h * (tmp[up_id_b] - tmp[down_id_b]);
+__kernel void advect(__global real * dest, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
+{
+  advect_cell(get_global_id(0) + 1, get_global_id(1) + 1, dest, src, vel, dt, obstacles, tiles, boundaries);
 }
 
-__kernel void add_source(__global float * dest, __global float * src, float dt)
+__kernel void advect_tiled(__global real * dest, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries, __global uint * active_tiles)
 {
-  int gid = get_global_id(0);
-  dest[gid] += dt * src[gid];
+  int2 cell = active_cell(active_tiles);
+  advect_cell(cell.x, cell.y, dest, src, vel, dt, obstacles, tiles, boundaries);
 }
 
-__kernel void add_event_sources(__global float * dest, __constant int * x, __constant int * y, __constant float * strength, __constant int * max_radius_sqrd, int num_events, int vec_type)
+// Samples src at pos like advect_value, and returns the range of the fluid samples used.
+// Solid cells take no part in either, so a back-trace into an obstacle never pulls in what lies inside it.
+inline real2 sample_fluid_range(__global real * src, __global uint * obstacles, __global uchar * tiles, real2 pos, real2 * lo, real2 * hi)
 {
-  // should probably set full grid
-  const int gid_x = get_global_id(0) + 1;
-  const int gid_y = get_global_id(1) + 1;
+  int left = (int)(pos.x);
+  int up = (int)(pos.y);
 
-  const int channel = !(vec_type == IS_A_DENSITY || vec_type == IS_U_VELOCITY);
+  // a fluid tile has no solid cell within one cell of it, the walls past the edges are not part of that
+  if (left >= 1 && up >= 1 && left < SIM_SIZE && up < SIM_SIZE && TILE_STATE(tiles, left, up) == TILE_FLUID)
+  {
+    return sample_bilinear(src, pos, lo, hi);
+  }
 
-  float result = 0;
+  const real2 no_lo = (real2)(INFINITY, INFINITY);
+  const real2 no_hi = (real2)(-INFINITY, -INFINITY);
+  *lo = no_lo;
+  *hi = no_hi;
+  for (int j = 0; j < 2; j++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      if (!is_solid(obstacles, left + i, up + j))
+      {
+        int idx_a = IDX(left + i, up + j, 0);
+        real2 value = (real2)(src[idx_a], src[idx_a + 1]);
+        *lo = min(*lo, value);
+        *hi = max(*hi, value);
+      }
+    }
+  }
 
-  for (int i = 0; i < num_events; i++)
+  // surrounded by solid cells, sample_fluid returns 0 as well
+  if (lo->x > hi->x)
   {
-    int delta_x = gid_x - x[i];
-    int delta_y = gid_y - y[i];
+    *lo = (real2)(0, 0);
+    *hi = (real2)(0, 0);
+  }
 
-    // The distance is never less than 1 so that the added source is always less than strength[i]
-    int dist_sqrd = max((delta_x * delta_x) + (delta_y * delta_y), 1);
+  return sample_fluid(src, obstacles, pos);
+}
 
-    if (dist_sqrd < max_radius_sqrd[i])
-    {
-      result += strength[i] * rsqrt((float)dist_sqrd);
-    }
+// Solid cells are held at zero, as advect leaves them
+inline int is_solid_cell(int gid_x, int gid_y, __global uint * obstacles, __global uchar * tiles)
+{
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+  return tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y));
+}
+
+// MacCormack correction: dest holds the backward pass of fwd, and the result is limited to the source cells of the forward pass
+inline void advect_maccormack_cell(int gid_x, int gid_y, __global real * dest, __global real * fwd, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
+{
+  int idx_a = IDX(gid_x, gid_y, 0);
+  int idx_b = idx_a + 1;
+
+  if (is_solid_cell(gid_x, gid_y, obstacles, tiles))
+  {
+    dest[idx_a] = 0;
+    dest[idx_b] = 0;
+    return;
   }
 
-  dest[IDX(gid_x, gid_y, channel)] += result;
+  real2 lo, hi;
+  sample_fluid_range(src, obstacles, tiles, backtrace(vel, gid_x, gid_y, dt, boundaries), &lo, &hi);
 
-  // maybe we should cap dest[idx] to MAX_DENSITY here
+  real2 center = (real2)(src[idx_a], src[idx_b]);
+  real2 back = (real2)(dest[idx_a], dest[idx_b]);
+  real2 result = clamp((real2)(fwd[idx_a], fwd[idx_b]) + 0.5f * (center - back), lo, hi);
+
+  dest[idx_a] = result.x;
+  dest[idx_b] = result.y;
 }
 
-// TODO: clean up this function
-__kernel void set_bnd(__global float * dest, int vec_type)
+__kernel void advect_maccormack(__global real * dest, __global real * fwd, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries)
 {
-  const int gid = get_global_id(0) + 1;
+  advect_maccormack_cell(get_global_id(0) + 1, get_global_id(1) + 1, dest, fwd, src, vel, dt, obstacles, tiles, boundaries);
+}
 
-  const float vel_sign = 1 - 2 * (vec_type == IS_VELOCITY);
+__kernel void advect_maccormack_tiled(__global real * dest, __global real * fwd, __global real * src, __global real * vel, float dt, __global uint * obstacles, __global uchar * tiles, int boundaries, __global uint * active_tiles)
+{
+  int2 cell = active_cell(active_tiles);
+  advect_maccormack_cell(cell.x, cell.y, dest, fwd, src, vel, dt, obstacles, tiles, boundaries);
+}
 
-  // 1 <= gid <= width
-  // if we are on an edge
-  if (gid <= SIM_SIZE)
+// BFECC compensation: dest = src + (src - back) / 2
+inline void advect_bfecc_cell(int gid_x, int gid_y, __global real * dest, __global real * src, __global real * back, __global uint * obstacles, __global uchar * tiles)
+{
+  int idx_a = IDX(gid_x, gid_y, 0);
+  int idx_b = idx_a + 1;
+
+  int is_fluid = !is_solid_cell(gid_x, gid_y, obstacles, tiles);
+
+  dest[idx_a] = is_fluid * (1.5f * src[idx_a] - 0.5f * back[idx_a]);
+  dest[idx_b] = is_fluid * (1.5f * src[idx_b] - 0.5f * back[idx_b]);
+}
+
+__kernel void advect_bfecc(__global real * dest, __global real * src, __global real * back, __global uint * obstacles, __global uchar * tiles)
+{
+  advect_bfecc_cell(get_global_id(0) + 1, get_global_id(1) + 1, dest, src, back, obstacles, tiles);
+}
+
+__kernel void advect_bfecc_tiled(__global real * dest, __global real * src, __global real * back, __global uint * obstacles, __global uchar * tiles, __global uint * active_tiles)
+{
+  int2 cell = active_cell(active_tiles);
+  advect_bfecc_cell(cell.x, cell.y, dest, src, back, obstacles, tiles);
+}
+
+// Same as advect, but the result is limited to the range of the corresponding cells in limit
+inline void advect_clamped_cell(int gid_x, int gid_y, __global real * dest, __global real * src, __global real * vel, float dt, __global real * limit, __global uint * obstacles, __global uchar * tiles, int boundaries)
+{
+  int idx_a = IDX(gid_x, gid_y, 0);
+  int idx_b = idx_a + 1;
+
+  real2 result = (real2)(0, 0);
+  if (!is_solid_cell(gid_x, gid_y, obstacles, tiles))
   {
-    // left edge
-    dest[2 * (STRIDE * gid) + 0] = vel_sign * dest[2 * (1 + STRIDE * gid) + 0];
-    dest[2 * (STRIDE * gid) + 1] = dest[2 * (1 + STRIDE * gid) + 1];
-    // right edge
-    dest[2 * (SIM_SIZE + 1 + STRIDE * gid) + 0] = vel_sign * dest[2 * (SIM_SIZE + STRIDE * gid) + 0];
-    dest[2 * (SIM_SIZE + 1 + STRIDE * gid) + 1] = dest[2 * (SIM_SIZE + STRIDE * gid) + 1];
-    // top edge
-    dest[2 * (gid) + 0] = dest[2 * (gid + STRIDE) + 0];
-    dest[2 * (gid) + 1] = vel_sign * dest[2 * (gid + STRIDE) + 1];
-    // bottom edge
-    dest[2 * (gid + STRIDE * (SIM_SIZE + 1)) + 0] = dest[2 * (gid + STRIDE * SIM_SIZE) + 0];
-    dest[2 * (gid + STRIDE * (SIM_SIZE + 1)) + 1] = vel_sign * dest[2 * (gid + STRIDE * SIM_SIZE) + 1];
+    real2 pos = backtrace(vel, gid_x, gid_y, dt, boundaries);
+
+    real2 lo, hi, unused_lo, unused_hi;
+    sample_fluid_range(limit, obstacles, tiles, pos, &lo, &hi);
+    result = clamp(sample_fluid_range(src, obstacles, tiles, pos, &unused_lo, &unused_hi), lo, hi);
   }
-  else  { // if we are a corner
-    // top left
-    dest[0] = 0.5f * (dest[2] + dest[DOUBLE_STRIDE]);
-    dest[1] = 0.5f * (dest[3] + dest[DOUBLE_STRIDE + 1]);
-    // bottom left
-    dest[2 * (STRIDE * (SIM_SIZE + 1)) + 0] = 0.5f * (dest[2 * (1 + STRIDE * (SIM_SIZE + 1)) + 0] + dest[2 * (STRIDE * SIM_SIZE) + 0]);
-    dest[2 * (STRIDE * (SIM_SIZE + 1)) + 1] = 0.5f * (dest[2 * (1 + STRIDE * (SIM_SIZE + 1)) + 1] + dest[2 * (STRIDE * SIM_SIZE) + 1]);
-    // top right
-    dest[2 * (SIM_SIZE + 1) + 0] = 0.5f * (dest[2 * SIM_SIZE + 0] + dest[2 * (SIM_SIZE + 1 + STRIDE) + 0]);
-    dest[2 * (SIM_SIZE + 1) + 1] = 0.5f * (dest[2 * SIM_SIZE + 1] + dest[2 * (SIM_SIZE + 1 + STRIDE) + 1]);
-    // bottom right
-    dest[2 * (SIM_SIZE + 1 + STRIDE * (SIM_SIZE + 1)) + 0] = 0.5f * (dest[2 * (SIM_SIZE + STRIDE * (SIM_SIZE + 1)) + 0] + dest[2 * (SIM_SIZE + 1 + STRIDE * SIM_SIZE) + 0]);
-    dest[2 * (SIM_SIZE + 1 + STRIDE * (SIM_SIZE + 1)) + 1] = 0.5f * (dest[2 * (SIM_SIZE + STRIDE * (SIM_SIZE + 1)) + 1] + dest[2 * (SIM_SIZE + 1 + STRIDE * SIM_SIZE) + 1]);
+
+  dest[idx_a] = result.x;
+  dest[idx_b] = result.y;
+}
+
+__kernel void advect_clamped(__global real * dest, __global real * src, __global real * vel, float dt, __global real * limit, __global uint * obstacles, __global uchar * tiles, int boundaries)
+{
+  advect_clamped_cell(get_global_id(0) + 1, get_global_id(1) + 1, dest, src, vel, dt, limit, obstacles, tiles, boundaries);
+}
+
+__kernel void advect_clamped_tiled(__global real * dest, __global real * src, __global real * vel, float dt, __global real * limit, __global uint * obstacles, __global uchar * tiles, int boundaries, __global uint * active_tiles)
+{
+  int2 cell = active_cell(active_tiles);
+  advect_clamped_cell(cell.x, cell.y, dest, src, vel, dt, limit, obstacles, tiles, boundaries);
+}
+
+// Zeroes the first pressure guess of a cell, and of the walls next to it so tmp needs no set_bnd before relaxing
+inline void clear_pressure(__global real * tmp, int gid_x, int gid_y)
+{
+  tmp[IDX(gid_x, gid_y, 1)] = 0;
+
+  if (gid_x == 1)
+  {
+    tmp[IDX(0, gid_y, 1)] = 0;
+  }
+  if (gid_x == SIM_SIZE)
+  {
+    tmp[IDX(SIM_SIZE + 1, gid_y, 1)] = 0;
+  }
+  if (gid_y == 1)
+  {
+    tmp[IDX(gid_x, 0, 1)] = 0;
+  }
+  if (gid_y == SIM_SIZE)
+  {
+    tmp[IDX(gid_x, SIM_SIZE + 1, 1)] = 0;
   }
 }
 
-__kernel void make_framebuffer(write_only image2d_t dest, __global float * src)
+// Does the work of set_bnd(IS_VELOCITY) for the walls next to a cell.
+// Each wall cell only depends on the interior cell next to it and the corners always work out to zero.
+// With PERIODIC the cell is repeated past the opposite edge instead, and past the opposite corner.
+inline void set_velocity_walls(__global real * vel, int gid_x, int gid_y, real2 value)
 {
-  // Each channel should sum to no more than 1.f
-  //const float3 first_color = (float3)(1.f, 0.54f, 0.f);
-  //const float3 second_color = (float3)(0.f, 0.f, 1.f);
-  //const float3 first_color = (float3)(0.f, 0.5f, 0.f);
-  //const float3 second_color = (float3)(0.5f, 0.5f, 0.f);
-  const float3 first_color = (float3)(0.f, 1.f, 0.5f);
-  const float3 second_color = (float3)(1.f, 0.f, 0.5f);
+#ifdef PERIODIC
+  int wall_x = (gid_x == 1) ? SIM_SIZE + 1 : ((gid_x == SIM_SIZE) ? 0 : -1);
+  int wall_y = (gid_y == 1) ? SIM_SIZE + 1 : ((gid_y == SIM_SIZE) ? 0 : -1);
 
-  int gid_x = get_global_id(0);
-  int gid_y = get_global_id(1);
+  if (wall_x >= 0)
+  {
+    vel[IDX(wall_x, gid_y, 0)] = value.x;
+    vel[IDX(wall_x, gid_y, 1)] = value.y;
+  }
+  if (wall_y >= 0)
+  {
+    vel[IDX(gid_x, wall_y, 0)] = value.x;
+    vel[IDX(gid_x, wall_y, 1)] = value.y;
+  }
+  if (wall_x >= 0 && wall_y >= 0)
+  {
+    vel[IDX(wall_x, wall_y, 0)] = value.x;
+    vel[IDX(wall_x, wall_y, 1)] = value.y;
+  }
+#else
+  if (gid_x == 1)
+  {
+    vel[IDX(0, gid_y, 0)] = -value.x;
+    vel[IDX(0, gid_y, 1)] = value.y;
+  }
+  if (gid_x == SIM_SIZE)
+  {
+    vel[IDX(SIM_SIZE + 1, gid_y, 0)] = -value.x;
+    vel[IDX(SIM_SIZE + 1, gid_y, 1)] = value.y;
+  }
+  if (gid_y == 1)
+  {
+    vel[IDX(gid_x, 0, 0)] = value.x;
+    vel[IDX(gid_x, 0, 1)] = -value.y;
+  }
+  if (gid_y == SIM_SIZE)
+  {
+    vel[IDX(gid_x, SIM_SIZE + 1, 0)] = value.x;
+    vel[IDX(gid_x, SIM_SIZE + 1, 1)] = -value.y;
+  }
+  if ((gid_x == 1 || gid_x == SIM_SIZE) && (gid_y == 1 || gid_y == SIM_SIZE))
+  {
+    int corner_a = IDX((gid_x == 1) ? 0 : SIM_SIZE + 1, (gid_y == 1) ? 0 : SIM_SIZE + 1, 0);
+    vel[corner_a] = 0;
+    vel[corner_a + 1] = 0;
+  }
+#endif
+}
 
-  int idx_a = IDX(gid_x + 1, gid_y + 1, 0);
-  int idx_b = idx_a + 1;
+// Solid cells have no divergence and zero pressure
+inline void project_A_cell(int gid_x, int gid_y, __global real * tmp, __global real * vel, float h, __global uint * obstacles, __global uchar * tiles)
+{
+  int center_id_a = IDX(gid_x, gid_y, 0);
+  int center_id_b = center_id_a + 1;
+
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+
+  clear_pressure(tmp, gid_x, gid_y);
+
+  if (tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y)))
+  {
+    tmp[center_id_a] = 0;
+    return;
+  }
+
+  int right_id_a = IDX(WRAP(gid_x + 1), gid_y, 0);
+  int left_id_a = IDX(WRAP(gid_x - 1), gid_y, 0);
+  int up_id_b = IDX(gid_x, WRAP(gid_y - 1), 1);
+  int down_id_b = IDX(gid_x, WRAP(gid_y + 1), 1);
+
+  // the velocity of solid neighbours is already zero
+  tmp[center_id_a] = h * (vel[left_id_a] - vel[right_id_a] + vel[up_id_b] - vel[down_id_b]);
+}
+
+__kernel void project_A(__global real * tmp, __global real * vel, float h, __global uint * obstacles, __global uchar * tiles)
+{
+  project_A_cell(get_global_id(0) + 1, get_global_id(1) + 1, tmp, vel, h, obstacles, tiles);
+}
+
+// advect for velocity followed by project_A without writing and reading back the velocity in between.
+// The neighbours are advected again here, and the walls mirror the cell next to them like set_bnd would.
+__kernel void advect_project_A(__global real * dest, __global real * tmp, __global real * src, __global real * vel, float dt, float h, __global uint * obstacles, __global uchar * tiles, int boundaries)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+
+  int center_id_a = IDX(gid_x, gid_y, 0);
+
+  real2 center = advect_value(gid_x, gid_y, src, vel, dt, obstacles, tiles, boundaries);
+
+  dest[center_id_a] = center.x;
+  dest[center_id_a + 1] = center.y;
+
+  clear_pressure(tmp, gid_x, gid_y);
+
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+
+  if (tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y)))
+  {
+    tmp[center_id_a] = 0;
+    return;
+  }
+
+  // solid neighbours advect to zero
+  real left = (IS_PERIODIC || gid_x > 1) ? advect_value(WRAP(gid_x - 1), gid_y, src, vel, dt, obstacles, tiles, boundaries).x : -center.x;
+  real right = (IS_PERIODIC || gid_x < SIM_SIZE) ? advect_value(WRAP(gid_x + 1), gid_y, src, vel, dt, obstacles, tiles, boundaries).x : -center.x;
+  real up = (IS_PERIODIC || gid_y > 1) ? advect_value(gid_x, WRAP(gid_y - 1), src, vel, dt, obstacles, tiles, boundaries).y : -center.y;
+  real down = (IS_PERIODIC || gid_y < SIM_SIZE) ? advect_value(gid_x, WRAP(gid_y + 1), src, vel, dt, obstacles, tiles, boundaries).y : -center.y;
+
+  tmp[center_id_a] = h * (left - right + up - down);
+}
+
+// Solid neighbours take the pressure of the center cell so no flow crosses into them.
+// Returns the divergence the pressure read by this sweep leaves in the cell, which is what the relaxation drives to zero.
+inline float project_B_cell(int gid_x, int gid_y, __global real * tmp, __global uint * obstacles, __global uchar * tiles)
+{
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+
+  if (tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y)))
+  {
+    return 0;
+  }
+
+  int center_id_a = IDX(gid_x, gid_y, 0);
+  int center_id_b = center_id_a + 1;
 
-  float3 final_color = first_color * min(src[idx_a], 1.f) + second_color * min(src[idx_b], 1.f);
+  int right_id_b = IDX(WRAP(gid_x + 1), gid_y, 1);
+  int left_id_b = IDX(WRAP(gid_x - 1), gid_y, 1);
+  int up_id_b = IDX(gid_x, WRAP(gid_y - 1), 1);
+  int down_id_b = IDX(gid_x, WRAP(gid_y + 1), 1);
+
+  real left = tmp[left_id_b];
+  real right = tmp[right_id_b];
+  real up = tmp[up_id_b];
+  real down = tmp[down_id_b];
+
+  if (tile == TILE_MIXED)
+  {
+    real center = tmp[center_id_b];
+    left = is_solid(obstacles, gid_x - 1, gid_y) ? center : left;
+    right = is_solid(obstacles, gid_x + 1, gid_y) ? center : right;
+    up = is_solid(obstacles, gid_x, gid_y - 1) ? center : up;
+    down = is_solid(obstacles, gid_x, gid_y + 1) ? center : down;
+  }
+
+  // tmp holds -divergence / SIM_SIZE^2, so the residual of the Poisson equation scales back by SIM_SIZE^2
+  real sum = tmp[center_id_a] + left + right + up + down;
+  real residual = SIM_SIZE * SIM_SIZE * fabs(sum - 4 * tmp[center_id_b]);
+  tmp[center_id_b] = 0.25f * sum;
+
+  return residual;
+}
+
+__kernel void project_B(__global real * tmp, __global uint * obstacles, __global uchar * tiles, __global uint * solve, int check, __local float * scratch)
+{
+  if (solve[SOLVE_DONE])
+  {
+    return;
+  }
+
+  float residual = project_B_cell(get_global_id(0) + 1, get_global_id(1) + 1, tmp, obstacles, tiles);
+  if (check)
+  {
+    reduce_residual(residual, solve, scratch);
+  }
+}
+
+// Subtracts the pressure gradient and sets the velocity walls, so no set_bnd is needed afterwards
+inline void project_C_cell(int gid_x, int gid_y, __global real * vel, __global real * tmp, float h, __global uint * obstacles, __global uchar * tiles)
+{
+  int center_id_a = IDX(gid_x, gid_y, 0);
+  int center_id_b = center_id_a + 1;
+
+  uchar tile = TILE_STATE(tiles, gid_x, gid_y);
+
+  if (tile == TILE_SOLID || (tile == TILE_MIXED && is_solid(obstacles, gid_x, gid_y)))
+  {
+    vel[center_id_a] = 0;
+    vel[center_id_b] = 0;
+    set_velocity_walls(vel, gid_x, gid_y, (real2)(0, 0));
+    return;
+  }
+
+  int right_id_b = IDX(WRAP(gid_x + 1), gid_y, 1);
+  int left_id_b = IDX(WRAP(gid_x - 1), gid_y, 1);
+  int up_id_b = IDX(gid_x, WRAP(gid_y - 1), 1);
+  int down_id_b = IDX(gid_x, WRAP(gid_y + 1), 1);
+
+  real left = tmp[left_id_b];
+  real right = tmp[right_id_b];
+  real up = tmp[up_id_b];
+  real down = tmp[down_id_b];
+
+  if (tile == TILE_MIXED)
+  {
+    real center = tmp[center_id_b];
+    left = is_solid(obstacles, gid_x - 1, gid_y) ? center : left;
+    right = is_solid(obstacles, gid_x + 1, gid_y) ? center : right;
+    up = is_solid(obstacles, gid_x, gid_y - 1) ? center : up;
+    down = is_solid(obstacles, gid_x, gid_y + 1) ? center : down;
+  }
+
+  real2 result = (real2)(vel[center_id_a] + h * (left - right), vel[center_id_b] + h * (up - down));
+
+  vel[center_id_a] = result.x;
+  vel[center_id_b] = result.y;
+
+  set_velocity_walls(vel, gid_x, gid_y, result);
+}
+
+__kernel void project_C(__global real * vel, __global real * tmp, float h, __global uint * obstacles, __global uchar * tiles)
+{
+  project_C_cell(get_global_id(0) + 1, get_global_id(1) + 1, vel, tmp, h, obstacles, tiles);
+}
+
+__kernel void add_source(__global real * dest, __global real * src, float dt)
+{
+  int gid = get_global_id(0);
+  dest[gid] += dt * src[gid];
+}
+
+__kernel void add_source_tiled(__global real * dest, __global real * src, float dt, __global uint * active_tiles)
+{
+  int2 cell = active_cell(active_tiles);
+
+  int idx_a = IDX(cell.x, cell.y, 0);
+  int idx_b = idx_a + 1;
+
+  dest[idx_a] += dt * src[idx_a];
+  dest[idx_b] += dt * src[idx_b];
+}
+
+// z component of the curl of vel at (x, y), clamped to the interior so the stencil stays inside the grid
+inline real curl(__global real * vel, int x, int y)
+{
+  int center_id_a = IDX(clamp(x, 1, SIM_SIZE), clamp(y, 1, SIM_SIZE), 0);
+
+  // dv/dx - du/dy
+  return 0.5f * SIM_SIZE * (vel[center_id_a + 3] - vel[center_id_a - 1] - vel[center_id_a + DOUBLE_STRIDE] + vel[center_id_a - DOUBLE_STRIDE]);
+}
+
+// dest = vel + dt * (vorticity confinement + buoyancy), the sources are already in vel
+__kernel void add_forces(__global real * dest, __global real * vel, __global real * dens, float dt, float vorticity, float buoyancy)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+
+  int center_id_a = IDX(gid_x, gid_y, 0);
+  int center_id_b = center_id_a + 1;
+
+  real w = curl(vel, gid_x, gid_y);
+
+  // points towards higher vorticity, the scale of the gradient cancels out when normalizing
+  real2 grad = (real2)(fabs(curl(vel, gid_x + 1, gid_y)) - fabs(curl(vel, gid_x - 1, gid_y)), fabs(curl(vel, gid_x, gid_y + 1)) - fabs(curl(vel, gid_x, gid_y - 1)));
+  real2 n = grad * rsqrt(dot(grad, grad) + 1e-10f);
+
+  real2 force = (vorticity * w / SIM_SIZE) * (real2)(n.y, -n.x);
+
+  // y points down the screen, so a positive buoyancy makes dense fluid rise
+  force.y -= buoyancy * (dens[center_id_a] + dens[center_id_b]);
+
+  dest[center_id_a] = vel[center_id_a] + dt * force.x;
+  dest[center_id_b] = vel[center_id_b] + dt * force.y;
+}
+
+// Adds dt times the sources straight into the field, launched only over the cells the events reach
+__kernel void add_event_sources(__global real * dest, __constant int * x, __constant int * y, __constant float * strength, __constant int * max_radius_sqrd, int num_events, int vec_type, float dt)
+{
+  const int gid_x = get_global_id(0) + 1;
+  const int gid_y = get_global_id(1) + 1;
+
+  const int channel = !(vec_type == IS_A_DENSITY || vec_type == IS_U_VELOCITY);
+
+  float result = 0;
+
+  for (int i = 0; i < num_events; i++)
+  {
+    int delta_x = gid_x - x[i];
+    int delta_y = gid_y - y[i];
+
+    // The distance is never less than 1 so that the added source is always less than strength[i]
+    int dist_sqrd = max((delta_x * delta_x) + (delta_y * delta_y), 1);
+
+    if (dist_sqrd < max_radius_sqrd[i])
+    {
+      result += strength[i] * rsqrt((float)dist_sqrd);
+    }
+  }
+
+  if (result != 0)
+  {
+    dest[IDX(gid_x, gid_y, channel)] += dt * result;
+  }
+
+  // maybe we should cap dest[idx] to MAX_DENSITY here
+}
+
+// Flags the tile of every cell that holds more than the threshold in either field.
+// The tiled kernels never touch quiet tiles, so the previous fields are cleared here to keep old values from leaking back in.
+__kernel void mark_active_tiles(__global uint * active, __global real * dens, __global real * dens_prev, __global real * vel, __global real * vel_prev, float density_threshold, float velocity_threshold, __global real * scratch)
+{
+  int gid_x = get_global_id(0);
+  int gid_y = get_global_id(1);
+
+  int idx_a = IDX(gid_x + 1, gid_y + 1, 0);
+  int idx_b = idx_a + 1;
+
+  real density = max(fabs(dens[idx_a]), fabs(dens[idx_b]));
+  real velocity = max(fabs(vel[idx_a]), fabs(vel[idx_b]));
+
+  dens_prev[idx_a] = 0;
+  dens_prev[idx_b] = 0;
+  vel_prev[idx_a] = 0;
+  vel_prev[idx_b] = 0;
+  // the tiled MacCormack and BFECC passes sample the scratch field next to the active tiles too
+  scratch[idx_a] = 0;
+  scratch[idx_b] = 0;
+
+  if (density > density_threshold || velocity > velocity_threshold)
+  {
+    // every writer stores the same value, so the race is harmless
+    active[(gid_y / ACTIVE_TILE_SIZE) * NUM_ACTIVE_TILES + gid_x / ACTIVE_TILE_SIZE] = 1;
+  }
+}
+
+// Appends every flagged tile and its neighbours to active_tiles so fluid can flow into them this frame
+__kernel void compact_active_tiles(__global uint * active_tiles, __global uint * num_active_tiles, __global uint * active)
+{
+  int tile_x = get_global_id(0);
+  int tile_y = get_global_id(1);
+
+  uint is_active = 0;
+
+  for (int y = max(tile_y - 1, 0); y <= min(tile_y + 1, NUM_ACTIVE_TILES - 1); y++)
+  {
+    for (int x = max(tile_x - 1, 0); x <= min(tile_x + 1, NUM_ACTIVE_TILES - 1); x++)
+    {
+      is_active |= active[y * NUM_ACTIVE_TILES + x];
+    }
+  }
+
+  if (is_active)
+  {
+    active_tiles[atomic_inc(num_active_tiles)] = tile_y * NUM_ACTIVE_TILES + tile_x;
+  }
+}
+
+// Fills the wall cell at wall from the interior cell next to it, or from the one at the opposite edge if it is periodic.
+// normal is the channel of the velocity across the edge, which a wall reflects. Open edges hold the pressure at zero.
+inline void set_bnd_edge(__global real * dest, int wall, int inside, int opposite, int normal, int vec_type, int boundary)
+{
+  const float vel_sign = 1 - 2 * (vec_type == IS_VELOCITY);
+
+  int from = (boundary == BOUNDARY_PERIODIC) ? opposite : inside;
+
+  dest[wall + normal] = ((boundary == BOUNDARY_WALL) ? vel_sign : 1) * dest[from + normal];
+  dest[wall + 1 - normal] = dest[from + 1 - normal];
+
+  if (boundary == BOUNDARY_OUTFLOW && vec_type == IS_NONE)
+  {
+    dest[wall + 1] = 0;
+  }
+}
+
+// A corner averages the two walls next to it, or repeats the wall past the opposite end of a periodic edge
+inline void set_bnd_corner(__global real * dest, int x, int y, int boundaries)
+{
+  int inside_x = (x == 0) ? 1 : SIM_SIZE;
+  int inside_y = (y == 0) ? 1 : SIM_SIZE;
+
+  int corner_a = IDX(x, y, 0);
+  int row_a = IDX(inside_x, y, 0);
+  int column_a = IDX(x, inside_y, 0);
+
+  if (EDGE_BOUNDARY(boundaries, 0) == BOUNDARY_PERIODIC)
+  {
+    row_a = column_a = IDX(SIM_SIZE + 1 - inside_x, y, 0);
+  }
+  else if (EDGE_BOUNDARY(boundaries, 2) == BOUNDARY_PERIODIC)
+  {
+    row_a = column_a = IDX(x, SIM_SIZE + 1 - inside_y, 0);
+  }
+
+  dest[corner_a] = 0.5f * (dest[row_a] + dest[column_a]);
+  dest[corner_a + 1] = 0.5f * (dest[row_a + 1] + dest[column_a + 1]);
+}
+
+inline void set_bnd_cell(int gid, __global real * dest, int vec_type, int boundaries)
+{
+  // 1 <= gid <= width
+  // if we are on an edge
+  if (gid <= SIM_SIZE)
+  {
+    // left edge
+    set_bnd_edge(dest, IDX(0, gid, 0), IDX(1, gid, 0), IDX(SIM_SIZE, gid, 0), 0, vec_type, EDGE_BOUNDARY(boundaries, 0));
+    // right edge
+    set_bnd_edge(dest, IDX(SIM_SIZE + 1, gid, 0), IDX(SIM_SIZE, gid, 0), IDX(1, gid, 0), 0, vec_type, EDGE_BOUNDARY(boundaries, 1));
+    // top edge
+    set_bnd_edge(dest, IDX(gid, 0, 0), IDX(gid, 1, 0), IDX(gid, SIM_SIZE, 0), 1, vec_type, EDGE_BOUNDARY(boundaries, 2));
+    // bottom edge
+    set_bnd_edge(dest, IDX(gid, SIM_SIZE + 1, 0), IDX(gid, SIM_SIZE, 0), IDX(gid, 1, 0), 1, vec_type, EDGE_BOUNDARY(boundaries, 3));
+  }
+  else  { // if we are a corner
+    set_bnd_corner(dest, 0, 0, boundaries);
+    set_bnd_corner(dest, 0, SIM_SIZE + 1, boundaries);
+    set_bnd_corner(dest, SIM_SIZE + 1, 0, boundaries);
+    set_bnd_corner(dest, SIM_SIZE + 1, SIM_SIZE + 1, boundaries);
+  }
+}
+
+__kernel void set_bnd(__global real * dest, int vec_type, int boundaries)
+{
+  set_bnd_cell(get_global_id(0) + 1, dest, vec_type, boundaries);
+}
+
+// set_bnd after a relaxation sweep, which has nothing left to fill in once the relaxation has ended
+__kernel void set_bnd_sweep(__global real * dest, int vec_type, int boundaries, __global uint * solve)
+{
+  if (solve[SOLVE_DONE])
+  {
+    return;
+  }
+
+  set_bnd_cell(get_global_id(0) + 1, dest, vec_type, boundaries);
+}
+
+// A cell of the coarse velocity grid, the cells past the walls repeat the walls or, along an axis with periodic edges, wrap around
+inline real2 coarse_velocity(__global real * coarse, int x, int y, int boundaries)
+{
+  if (WRAPS_AXIS(boundaries, 0))
+  {
+    x = (x + 2 * VELOCITY_SIZE - 1) % VELOCITY_SIZE + 1;
+  }
+  if (WRAPS_AXIS(boundaries, 1))
+  {
+    y = (y + 2 * VELOCITY_SIZE - 1) % VELOCITY_SIZE + 1;
+  }
+  int idx_a = 2 * (clamp(x, 0, VELOCITY_SIZE + 1) + VELOCITY_STRIDE * clamp(y, 0, VELOCITY_SIZE + 1));
+  return (real2)(coarse[idx_a], coarse[idx_a + 1]);
+}
+
+// The four Catmull-Rom weights of the samples at -1, 0, 1 and 2 for a point t past sample 0
+inline void catmull_rom_weights(real t, real weights[4])
+{
+  weights[0] = t * (-0.5f + t * (1 - 0.5f * t));
+  weights[1] = 1 + t * t * (-2.5f + 1.5f * t);
+  weights[2] = t * (0.5f + t * (2 - 1.5f * t));
+  weights[3] = t * t * (-0.5f + 0.5f * t);
+}
+
+// Fills the velocity of every cell from the coarse grid the velocity step ran on, which is VELOCITY_SCALE times smaller.
+// Coarse cell i covers cells (i - 1) * VELOCITY_SCALE + 1 to i * VELOCITY_SCALE, and its walls hold the mirrored velocity.
+__kernel void upsample_velocity(__global real * vel, __global real * coarse, int bicubic, int boundaries)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+
+  real pos_x = (gid_x - 0.5f) / VELOCITY_SCALE + 0.5f;
+  real pos_y = (gid_y - 0.5f) / VELOCITY_SCALE + 0.5f;
+
+  int left = (int)(pos_x);
+  int up = (int)(pos_y);
+
+  real s = pos_x - left;
+  real t = pos_y - up;
+
+  real2 result = 0;
+  if (bicubic)
+  {
+    real s_w[4], t_w[4];
+    catmull_rom_weights(s, s_w);
+    catmull_rom_weights(t, t_w);
+
+    for (int j = 0; j < 4; j++)
+    {
+      real2 row = 0;
+      for (int i = 0; i < 4; i++)
+      {
+        row += s_w[i] * coarse_velocity(coarse, left - 1 + i, up - 1 + j, boundaries);
+      }
+      result += t_w[j] * row;
+    }
+  }
+  else {
+    result = (1 - s) * ((1 - t) * coarse_velocity(coarse, left, up, boundaries) + t * coarse_velocity(coarse, left, up + 1, boundaries))
+           + s * ((1 - t) * coarse_velocity(coarse, left + 1, up, boundaries) + t * coarse_velocity(coarse, left + 1, up + 1, boundaries));
+  }
+
+  int idx_a = IDX(gid_x, gid_y, 0);
+  vel[idx_a] = result.x;
+  vel[idx_a + 1] = result.y;
+}
+
+// Averages the density under each cell of the coarse velocity grid, for the buoyancy there
+__kernel void downsample_density(__global real * coarse, __global real * dens)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+
+  real2 sum = 0;
+  for (int j = 0; j < VELOCITY_SCALE; j++)
+  {
+    for (int i = 0; i < VELOCITY_SCALE; i++)
+    {
+      int idx_a = IDX((gid_x - 1) * VELOCITY_SCALE + 1 + i, (gid_y - 1) * VELOCITY_SCALE + 1 + j, 0);
+      sum += (real2)(dens[idx_a], dens[idx_a + 1]);
+    }
+  }
+
+  int coarse_a = 2 * (gid_x + VELOCITY_STRIDE * gid_y);
+  coarse[coarse_a] = sum.x / (VELOCITY_SCALE * VELOCITY_SCALE);
+  coarse[coarse_a + 1] = sum.y / (VELOCITY_SCALE * VELOCITY_SCALE);
+}
+
+// Particles are float4s of the position in cells, with the interior between 0.5 and SIM_SIZE + 0.5,
+// the seconds they have left and the density channel they were emitted with. A particle with no time left is dead.
+// Slots at or past the count never hold a particle, and the count can run past max_particles while emitting.
+
+inline uint hash_uint(uint x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+inline float particle_random(uint seed, uint i)
+{
+  return (hash_uint(seed ^ hash_uint(i)) >> 8) * (1.f / 16777216.f);
+}
+
+// Keeps pos on the interior, past a periodic edge it comes back in at the opposite edge and past any other it stops there
+inline float2 particle_inside(float2 pos, int boundaries)
+{
+  float2 wrapped = pos - (float)SIM_SIZE * floor((pos - 0.5f) / (float)SIM_SIZE);
+
+  return (float2)(WRAPS_AXIS(boundaries, 0) ? wrapped.x : clamp(pos.x, 0.5f, SIM_SIZE + 0.5f),
+                  WRAPS_AXIS(boundaries, 1) ? wrapped.y : clamp(pos.y, 0.5f, SIM_SIZE + 0.5f));
+}
+
+inline float2 particle_velocity(__global real * vel, float2 pos, int boundaries)
+{
+  real2 unused_lo, unused_hi;
+
+  return convert_float2(sample_bilinear(vel, convert_real2(particle_inside(pos, boundaries)), &unused_lo, &unused_hi));
+}
+
+// The interior cell holding pos, counted from 0 in rows
+inline int particle_cell(float2 pos)
+{
+  int x = clamp((int)(pos.x + 0.5f), 1, SIM_SIZE);
+  int y = clamp((int)(pos.y + 0.5f), 1, SIM_SIZE);
+
+  return (y - 1) * SIM_SIZE + x - 1;
+}
+
+inline int is_live_particle(__global float4 * particles, __global uint * num_particles, uint max_particles, uint i)
+{
+  return i < min(*num_particles, max_particles) && particles[i].z > 0;
+}
+
+// Appends particles_per_event particles for each event, spread evenly over the disc it reaches
+__kernel void emit_particles(__global float4 * particles, __global uint * num_particles, uint max_particles, __constant int * x, __constant int * y, __constant int * max_radius_sqrd,
+                             int particles_per_event, float lifetime, int channel, uint seed)
+{
+  uint i = get_global_id(0);
+  int event = i / particles_per_event;
+
+  uint slot = atomic_inc(num_particles);
+  if (slot >= max_particles)
+  {
+    return;
+  }
+
+  float radius = sqrt(particle_random(seed, 2 * i)) * sqrt((float)max_radius_sqrd[event]);
+  float angle = 2 * M_PI_F * particle_random(seed, 2 * i + 1);
+  float2 pos = (float2)(x[event], y[event]) + radius * (float2)(cos(angle), sin(angle));
+
+  particles[slot] = (float4)(clamp(pos, 0.5f, SIM_SIZE + 0.5f), lifetime, channel);
+}
+
+// Moves every live particle along the velocity with the midpoint rule or RK4, dt_cells is dt in cells.
+// Particles that end up inside an obstacle are dead.
+__kernel void advect_particles(__global float4 * particles, __global uint * num_particles, uint max_particles, __global real * vel, float dt, float dt_cells, int rk4, __global uint * obstacles, int boundaries)
+{
+  uint i = get_global_id(0);
+  if (!is_live_particle(particles, num_particles, max_particles, i))
+  {
+    return;
+  }
+
+  float4 particle = particles[i];
+  float2 pos = particle.xy;
+
+  float2 k1 = particle_velocity(vel, pos, boundaries);
+  if (rk4)
+  {
+    float2 k2 = particle_velocity(vel, pos + 0.5f * dt_cells * k1, boundaries);
+    float2 k3 = particle_velocity(vel, pos + 0.5f * dt_cells * k2, boundaries);
+    float2 k4 = particle_velocity(vel, pos + dt_cells * k3, boundaries);
+    pos += dt_cells / 6.f * (k1 + 2.f * k2 + 2.f * k3 + k4);
+  }
+  else {
+    pos += dt_cells * particle_velocity(vel, pos + 0.5f * dt_cells * k1, boundaries);
+  }
+
+  particle.xy = particle_inside(pos, boundaries);
+  particle.z -= dt;
+  if (is_solid(obstacles, (int)(particle.x + 0.5f), (int)(particle.y + 0.5f)))
+  {
+    particle.z = 0;
+  }
+  particles[i] = particle;
+}
+
+// The first pass of the counting sort, counts the live particles of each cell and their rank in it
+__kernel void count_particles(__global uint * cell_counts, __global uint * ranks, __global float4 * particles, __global uint * num_particles, uint max_particles)
+{
+  uint i = get_global_id(0);
+  if (!is_live_particle(particles, num_particles, max_particles, i))
+  {
+    return;
+  }
+
+  ranks[i] = atomic_inc(&cell_counts[particle_cell(particles[i].xy)]);
+}
+
+// Turns the cell counts into the slot each cell starts at, and the live count into cell_starts[SIM_SIZE * SIM_SIZE].
+// Runs as one work-group whose work items each scan a run of cells, and clears the counts for the next sort.
+__kernel void scan_particle_cells(__global uint * cell_starts, __global uint * cell_counts, __local uint * scratch)
+{
+  int lid = get_local_id(0);
+  int num_items = get_local_size(0);
+
+  const int num_cells = SIM_SIZE * SIM_SIZE;
+  int run = (num_cells + num_items - 1) / num_items;
+  int first = min(lid * run, num_cells);
+  int last = min(first + run, num_cells);
+
+  uint sum = 0;
+  for (int c = first; c < last; c++)
+  {
+    sum += cell_counts[c];
+  }
+  scratch[lid] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // inclusive scan of the run totals
+  for (int offset = 1; offset < num_items; offset *= 2)
+  {
+    uint value = (lid >= offset) ? scratch[lid - offset] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scratch[lid] += value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  uint start = scratch[lid] - sum;
+  for (int c = first; c < last; c++)
+  {
+    uint count = cell_counts[c];
+    cell_starts[c] = start;
+    cell_counts[c] = 0;
+    start += count;
+  }
+
+  if (lid == num_items - 1)
+  {
+    cell_starts[num_cells] = scratch[lid];
+  }
+}
+
+// Moves every live particle to its sorted slot in dest, which leaves the dead ones behind
+__kernel void scatter_particles(__global float4 * dest, __global float4 * particles, __global uint * num_particles, uint max_particles, __global uint * cell_starts, __global uint * ranks)
+{
+  uint i = get_global_id(0);
+  if (!is_live_particle(particles, num_particles, max_particles, i))
+  {
+    return;
+  }
+
+  float4 particle = particles[i];
+  dest[cell_starts[particle_cell(particle.xy)] + ranks[i]] = particle;
+}
+
+// Folds the num_items entries of each measure in local memory into entry 0.
+// The local size need not be a power of two: each step folds the upper half, rounded down, onto the lower one.
+inline void fold_measures(__local real * mass, __local real * energy, __local real * divergence, int lid, int num_items)
+{
+  for (int n = num_items; n > 1; n = (n + 1) / 2)
+  {
+    int offset = (n + 1) / 2;
+    if (lid + offset < n)
+    {
+      mass[lid] += mass[lid + offset];
+      energy[lid] += energy[lid + offset];
+      divergence[lid] = fmax(divergence[lid], divergence[lid + offset]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+// Sums the density and the kinetic energy and finds the largest divergence of the cells in this work-group.
+// The three values of group i go to partials[NUM_MEASURES * i], scratch holds NUM_MEASURES reals per work item.
+__kernel void measure_fields(__global real * partials, __global real * dens, __global real * vel, __local real * scratch)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+
+  int lid = get_local_id(0) + get_local_size(0) * get_local_id(1);
+  int num_items = get_local_size(0) * get_local_size(1);
+
+  __local real * mass = scratch;
+  __local real * energy = scratch + num_items;
+  __local real * divergence = scratch + 2 * num_items;
+
+  int idx_a = IDX(gid_x, gid_y, 0);
+
+  mass[lid] = dens[idx_a] + dens[idx_a + 1];
+  energy[lid] = 0.5f * (vel[idx_a] * vel[idx_a] + vel[idx_a + 1] * vel[idx_a + 1]);
+  // the same difference as the divergence view, the walls hold the mirrored velocity
+  divergence[lid] = fabs(0.5f * SIM_SIZE * (vel[idx_a + 2] - vel[idx_a - 2] + vel[idx_a + DOUBLE_STRIDE + 1] - vel[idx_a - DOUBLE_STRIDE + 1]));
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  fold_measures(mass, energy, divergence, lid, num_items);
+
+  if (lid == 0)
+  {
+    int group = get_group_id(0) + get_num_groups(0) * get_group_id(1);
+    partials[NUM_MEASURES * group + MEASURE_MASS] = mass[0];
+    partials[NUM_MEASURES * group + MEASURE_ENERGY] = energy[0];
+    partials[NUM_MEASURES * group + MEASURE_DIVERGENCE] = divergence[0];
+  }
+}
+
+// Folds the num_groups partials of measure_fields into measures, launched as a single work-group
+__kernel void sum_measures(__global real * measures, __global real * partials, int num_groups, __local real * scratch)
+{
+  int lid = get_local_id(0);
+  int num_items = get_local_size(0);
+
+  __local real * mass = scratch;
+  __local real * energy = scratch + num_items;
+  __local real * divergence = scratch + 2 * num_items;
+
+  mass[lid] = 0;
+  energy[lid] = 0;
+  divergence[lid] = 0;
+  for (int i = lid; i < num_groups; i += num_items)
+  {
+    mass[lid] += partials[NUM_MEASURES * i + MEASURE_MASS];
+    energy[lid] += partials[NUM_MEASURES * i + MEASURE_ENERGY];
+    divergence[lid] = fmax(divergence[lid], partials[NUM_MEASURES * i + MEASURE_DIVERGENCE]);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  fold_measures(mass, energy, divergence, lid, num_items);
+
+  if (lid == 0)
+  {
+    measures[MEASURE_MASS] = mass[0];
+    measures[MEASURE_ENERGY] = energy[0];
+    measures[MEASURE_DIVERGENCE] = divergence[0];
+  }
+}
+
+inline float4 density_color(float2 density)
+{
+  // Each channel should sum to no more than 1.f
+  //const float3 first_color = (float3)(1.f, 0.54f, 0.f);
+  //const float3 second_color = (float3)(0.f, 0.f, 1.f);
+  //const float3 first_color = (float3)(0.f, 0.5f, 0.f);
+  //const float3 second_color = (float3)(0.5f, 0.5f, 0.f);
+  const float3 first_color = (float3)(0.f, 1.f, 0.5f);
+  const float3 second_color = (float3)(1.f, 0.f, 0.5f);
+
+  float3 final_color = first_color * min(density.x, 1.f) + second_color * min(density.y, 1.f);
+
+  return (float4)(final_color, 1.f);
+}
+
+inline float4 framebuffer_color(int gid_x, int gid_y, __global real * src)
+{
+  int idx_a = IDX(gid_x, gid_y, 0);
+
+  return density_color(convert_float2((real2)(src[idx_a], src[idx_a + 1])));
+}
+
+// Sparse mode draws only the active tiles, for the default view at the size of the simulation
+__kernel void make_framebuffer_tiled(write_only image2d_t dest, __global real * src, __global uint * active_tiles)
+{
+  int2 cell = active_cell(active_tiles);
+
+  write_imagef(dest, cell - 1, framebuffer_color(cell.x, cell.y, src));
+}
+
+__kernel void make_framebuffer_rgba_tiled(__global uchar4 * dest, __global real * src, __global uint * active_tiles)
+{
+  int2 cell = active_cell(active_tiles);
+
+  dest[(cell.y - 1) * SIM_SIZE + cell.x - 1] = convert_uchar4_sat_rte(255.f * framebuffer_color(cell.x, cell.y, src));
+}
+
+__constant sampler_t lut_sampler = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+// Colour of the field at pos, in cells with the interior between 0.5 and SIM_SIZE + 0.5.
+// The derived fields are taken at the nearest cell, the rest is sampled bilinearly.
+inline float4 view_color(real2 pos, __global real * dens, __global real * vel, read_only image1d_t lut, int field, float min_value, float inv_range)
+{
+  real2 unused_lo, unused_hi;
+
+  if (field == VIEW_DENSITY_COLORS)
+  {
+    return density_color(convert_float2(sample_bilinear(dens, pos, &unused_lo, &unused_hi)));
+  }
+
+  int x = clamp((int)(pos.x + 0.5f), 1, SIM_SIZE);
+  int y = clamp((int)(pos.y + 0.5f), 1, SIM_SIZE);
+  int idx_a = IDX(x, y, 0);
+
+  float value;
+  if (field == VIEW_DENSITY)
+  {
+    real2 density = sample_bilinear(dens, pos, &unused_lo, &unused_hi);
+    value = density.x + density.y;
+  }
+  else if (field == VIEW_SPEED)
+  {
+    value = length(sample_bilinear(vel, pos, &unused_lo, &unused_hi));
+  }
+  else if (field == VIEW_VORTICITY)
+  {
+    value = curl(vel, x, y);
+  }
+  else {
+    // the walls hold the mirrored velocity, so the border cells need no special case
+    value = 0.5f * SIM_SIZE * (vel[idx_a + 2] - vel[idx_a - 2] + vel[idx_a + DOUBLE_STRIDE + 1] - vel[idx_a - DOUBLE_STRIDE + 1]);
+  }
+
+  // the first and last texels are reached at their centres, so the range maps onto every colour of the LUT
+  float lut_size = get_image_width(lut);
+  float t = clamp((value - min_value) * inv_range, 0.f, 1.f);
+  return read_imagef(lut, lut_sampler, (0.5f + t * (lut_size - 1)) / lut_size);
+}
+
+// Box filters the cells under output pixel (x, y) of a width x height view with bilinear taps, one tap when upsampling
+inline float4 view_pixel(int x, int y, int width, int height, __global real * dens, __global real * vel, read_only image1d_t lut, int field, float min_value, float inv_range)
+{
+  float2 scale = (float2)((float)SIM_SIZE / width, (float)SIM_SIZE / height);
+  int taps_x = max((int)ceil(scale.x), 1);
+  int taps_y = max((int)ceil(scale.y), 1);
+
+  float4 sum = 0;
+  for (int j = 0; j < taps_y; j++)
+  {
+    for (int i = 0; i < taps_x; i++)
+    {
+      float2 pos = (float2)(x + (i + 0.5f) / taps_x, y + (j + 0.5f) / taps_y) * scale + 0.5f;
+      sum += view_color(convert_real2(clamp(pos, 0.5f, SIM_SIZE + 0.5f)), dens, vel, lut, field, min_value, inv_range);
+    }
+  }
+
+  return sum / (float)(taps_x * taps_y);
+}
+
+// Draws the chosen field into a texture of any size
+__kernel void render_view(write_only image2d_t dest, __global real * dens, __global real * vel, read_only image1d_t lut, int field, float min_value, float inv_range)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  write_imagef(dest, (int2)(x, y), view_pixel(x, y, get_image_width(dest), get_image_height(dest), dens, vel, lut, field, min_value, inv_range));
+}
+
+// Off-screen version of render_view, RGBA8 pixels in rows of width
+__kernel void render_view_rgba(__global uchar4 * dest, int width, int height, __global real * dens, __global real * vel, read_only image1d_t lut, int field, float min_value, float inv_range)
+{
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  dest[y * width + x] = convert_uchar4_sat_rte(255.f * view_pixel(x, y, width, height, dens, vel, lut, field, min_value, inv_range));
+}
+
+// The pixel of a width x height view that the particle at pos falls in
+inline int2 particle_pixel(float2 pos, int width, int height)
+{
+  float2 pixel = (pos - 0.5f) * (float2)((float)width / SIM_SIZE, (float)height / SIM_SIZE);
+
+  return clamp(convert_int2(pixel), (int2)(0, 0), (int2)(width - 1, height - 1));
+}
+
+__constant float4 particle_color = (float4)(1.f, 1.f, 1.f, 1.f);
+
+// Draws every live particle as one pixel over the view, particles sharing a pixel write the same colour
+__kernel void draw_particles(write_only image2d_t dest, __global float4 * particles, __global uint * num_particles, uint max_particles)
+{
+  uint i = get_global_id(0);
+  if (!is_live_particle(particles, num_particles, max_particles, i))
+  {
+    return;
+  }
+
+  write_imagef(dest, particle_pixel(particles[i].xy, get_image_width(dest), get_image_height(dest)), particle_color);
+}
+
+// Off-screen version of draw_particles, RGBA8 pixels in rows of width
+__kernel void draw_particles_rgba(__global uchar4 * dest, int width, int height, __global float4 * particles, __global uint * num_particles, uint max_particles)
+{
+  uint i = get_global_id(0);
+  if (!is_live_particle(particles, num_particles, max_particles, i))
+  {
+    return;
+  }
+
+  int2 pixel = particle_pixel(particles[i].xy, width, height);
+  dest[pixel.y * width + pixel.x] = convert_uchar4_sat_rte(255.f * particle_color);
+}
+
+// The single dispatch mode runs every step below in one work-group, whose work items stride over the grid.
+// barrier() only syncs a work-group, so this is the one way a whole frame can run in a single launch
+// without relying on work-groups that are not guaranteed to run at the same time.
+
+// The single dispatch mode only runs with a wall on every edge, which packs to 0
+inline void group_set_bnd(__global real * dest, int vec_type)
+{
+  for (int gid = get_local_id(0) + 1; gid <= SIM_SIZE; gid += get_local_size(0))
+  {
+    set_bnd_cell(gid, dest, vec_type, 0);
+  }
+  barrier(CLK_GLOBAL_MEM_FENCE);
+
+  // the corners read the edges
+  if (get_local_id(0) == 0)
+  {
+    set_bnd_cell(SIM_SIZE + 1, dest, vec_type, 0);
+  }
+  barrier(CLK_GLOBAL_MEM_FENCE);
+}
+
+inline void group_diffuse(__global real * dest, __global real * src, float a, int vec_type, int num_relaxation_steps, __global uint * obstacles, __global uchar * tiles)
+{
+  float denominator = 1 / (1 + 4 * a);
+  float solid_sign = (vec_type == IS_VELOCITY) ? -1 : 1;
+
+  for (int k = 0; k < num_relaxation_steps; k++)
+  {
+    for (int i = get_local_id(0); i < SIM_SIZE * SIM_SIZE; i += get_local_size(0))
+    {
+      diffuse_cell(i % SIM_SIZE + 1, i / SIM_SIZE + 1, dest, src, a, denominator, solid_sign, obstacles, tiles);
+    }
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    group_set_bnd(dest, vec_type);
+  }
+}
+
+inline void group_advect(__global real * dest, __global real * src, __global real * vel, float dt, int vec_type, __global uint * obstacles, __global uchar * tiles)
+{
+  for (int i = get_local_id(0); i < SIM_SIZE * SIM_SIZE; i += get_local_size(0))
+  {
+    advect_cell(i % SIM_SIZE + 1, i / SIM_SIZE + 1, dest, src, vel, -dt * SIM_SIZE, obstacles, tiles, 0);
+  }
+  barrier(CLK_GLOBAL_MEM_FENCE);
+
+  group_set_bnd(dest, vec_type);
+}
+
+inline void group_project(__global real * vel, __global real * tmp, int num_relaxation_steps, __global uint * obstacles, __global uchar * tiles)
+{
+  for (int i = get_local_id(0); i < SIM_SIZE * SIM_SIZE; i += get_local_size(0))
+  {
+    project_A_cell(i % SIM_SIZE + 1, i / SIM_SIZE + 1, tmp, vel, 0.5f / SIM_SIZE, obstacles, tiles);
+  }
+  barrier(CLK_GLOBAL_MEM_FENCE);
+
+  for (int k = 0; k < num_relaxation_steps; k++)
+  {
+    for (int i = get_local_id(0); i < SIM_SIZE * SIM_SIZE; i += get_local_size(0))
+    {
+      project_B_cell(i % SIM_SIZE + 1, i / SIM_SIZE + 1, tmp, obstacles, tiles);
+    }
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    // pressure is not mirrored, like density
+    group_set_bnd(tmp, IS_DENSITY);
+  }
+
+  for (int i = get_local_id(0); i < SIM_SIZE * SIM_SIZE; i += get_local_size(0))
+  {
+    project_C_cell(i % SIM_SIZE + 1, i / SIM_SIZE + 1, vel, tmp, 0.5f * SIM_SIZE, obstacles, tiles);
+  }
+  barrier(CLK_GLOBAL_MEM_FENCE);
+}
+
+// velocity_step and density_step in one launch of a single work-group.
+// The buffers are swapped here as the host would, an even number of times, so the results end up in dens and vel.
+__kernel void simulate_frame(__global real * dens_prev, __global real * dens, __global real * vel_prev, __global real * vel, float dt, float viscosity, float diffusion_rate, int num_diffuse_steps, int num_project_steps, __global uint * obstacles, __global uchar * tiles)
+{
+  // the sources were already added to vel and dens
+  group_diffuse(vel_prev, vel, dt * viscosity * SIM_SIZE * SIM_SIZE, IS_VELOCITY, num_diffuse_steps, obstacles, tiles);
+  group_project(vel_prev, vel, num_project_steps, obstacles, tiles);
+  group_advect(vel, vel_prev, vel_prev, dt, IS_VELOCITY, obstacles, tiles);
+  group_project(vel, vel_prev, num_project_steps, obstacles, tiles);
 
-  write_imagef(dest, (int2)(gid_x, gid_y), (float4)(final_color, 1.f));
+  group_diffuse(dens_prev, dens, dt * diffusion_rate * SIM_SIZE * SIM_SIZE, IS_DENSITY, num_diffuse_steps, obstacles, tiles);
+  group_advect(dens, dens_prev, vel, dt, IS_DENSITY, obstacles, tiles);
 }
@@ -0,0 +1,209 @@
+// Each channel is a STRIDE^3 block with x changing fastest, so work items next to each other along x
+// read next to each other in memory and the six neighbours of a cell are one, STRIDE and PLANE floats away
+#define IDX3(x, y, z) ((x) + STRIDE * ((y) + STRIDE * (z)))
+#define PLANE (STRIDE * STRIDE)
+
+__kernel void diffuse_3d(__global float * dest, __global float * src, float a, float denominator, int channels)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+  int gid_z = get_global_id(2) + 1;
+
+  int center_id = IDX3(gid_x, gid_y, gid_z);
+
+  for (int c = 0; c < channels; c++, center_id += VOLUME)
+  {
+    float neighbours = dest[center_id - 1] + dest[center_id + 1]
+                     + dest[center_id - STRIDE] + dest[center_id + STRIDE]
+                     + dest[center_id - PLANE] + dest[center_id + PLANE];
+
+    dest[center_id] = (src[center_id] + a * neighbours) * denominator;
+  }
+}
+
+__kernel void advect_3d(__global float * dest, __global float * src, __global float * vel, float dt, int channels)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+  int gid_z = get_global_id(2) + 1;
+
+  int idx = IDX3(gid_x, gid_y, gid_z);
+
+  const float clamp_max = SIM_SIZE + 0.5f;
+
+  float x = clamp(gid_x + dt * vel[idx], 0.5f, clamp_max);
+  float y = clamp(gid_y + dt * vel[idx + VOLUME], 0.5f, clamp_max);
+  float z = clamp(gid_z + dt * vel[idx + 2 * VOLUME], 0.5f, clamp_max);
+
+  int left = (int)(x);
+  int up = (int)(y);
+  int front = (int)(z);
+
+  float s1 = x - left;
+  float s0 = 1 - s1;
+  float t1 = y - up;
+  float t0 = 1 - t1;
+  float r1 = z - front;
+  float r0 = 1 - r1;
+
+  int corner = IDX3(left, up, front);
+
+  for (int c = 0; c < channels; c++, corner += VOLUME, idx += VOLUME)
+  {
+    float front_sample = t0 * (s0 * src[corner] + s1 * src[corner + 1]) + t1 * (s0 * src[corner + STRIDE] + s1 * src[corner + STRIDE + 1]);
+    float back_sample = t0 * (s0 * src[corner + PLANE] + s1 * src[corner + PLANE + 1]) + t1 * (s0 * src[corner + PLANE + STRIDE] + s1 * src[corner + PLANE + STRIDE + 1]);
+
+    dest[idx] = r0 * front_sample + r1 * back_sample;
+  }
+}
+
+__kernel void project_A_3d(__global float * tmp, __global float * vel, float h)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+  int gid_z = get_global_id(2) + 1;
+
+  int idx = IDX3(gid_x, gid_y, gid_z);
+
+  __global float * u = vel;
+  __global float * v = vel + VOLUME;
+  __global float * w = vel + 2 * VOLUME;
+
+  // the divergence goes in the first channel and the pressure in the second
+  tmp[idx] = h * (u[idx - 1] - u[idx + 1] + v[idx - STRIDE] - v[idx + STRIDE] + w[idx - PLANE] - w[idx + PLANE]);
+  tmp[idx + VOLUME] = 0;
+}
+
+__kernel void project_B_3d(__global float * tmp)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+  int gid_z = get_global_id(2) + 1;
+
+  int idx = IDX3(gid_x, gid_y, gid_z);
+
+  __global float * p = tmp + VOLUME;
+
+  p[idx] = (1.f / 6.f) * (tmp[idx] + p[idx - 1] + p[idx + 1] + p[idx - STRIDE] + p[idx + STRIDE] + p[idx - PLANE] + p[idx + PLANE]);
+}
+
+__kernel void project_C_3d(__global float * vel, __global float * tmp, float h)
+{
+  int gid_x = get_global_id(0) + 1;
+  int gid_y = get_global_id(1) + 1;
+  int gid_z = get_global_id(2) + 1;
+
+  int idx = IDX3(gid_x, gid_y, gid_z);
+
+  __global float * p = tmp + VOLUME;
+
+  vel[idx] += h * (p[idx - 1] - p[idx + 1]);
+  vel[idx + VOLUME] += h * (p[idx - STRIDE] - p[idx + STRIDE]);
+  vel[idx + 2 * VOLUME] += h * (p[idx - PLANE] - p[idx + PLANE]);
+}
+
+__kernel void add_source_3d(__global float * dest, __global float * src, float dt)
+{
+  int gid = get_global_id(0);
+  dest[gid] += dt * src[gid];
+}
+
+// Adds dt times the sources straight into the field, launched only over the cells the events reach
+__kernel void add_event_sources_3d(__global float * dest, __constant int * x, __constant int * y, __constant int * z, __constant float * strength, __constant int * max_radius_sqrd, int num_events, int channel, float dt)
+{
+  const int gid_x = get_global_id(0) + 1;
+  const int gid_y = get_global_id(1) + 1;
+  const int gid_z = get_global_id(2) + 1;
+
+  float result = 0;
+
+  for (int i = 0; i < num_events; i++)
+  {
+    int delta_x = gid_x - x[i];
+    int delta_y = gid_y - y[i];
+    int delta_z = gid_z - z[i];
+
+    // The distance is never less than 1 so that the added source is always less than strength[i]
+    int dist_sqrd = max((delta_x * delta_x) + (delta_y * delta_y) + (delta_z * delta_z), 1);
+
+    if (dist_sqrd < max_radius_sqrd[i])
+    {
+      result += strength[i] * rsqrt((float)dist_sqrd);
+    }
+  }
+
+  if (result != 0)
+  {
+    dest[channel * VOLUME + IDX3(gid_x, gid_y, gid_z)] += dt * result;
+  }
+}
+
+// Copies the six faces from the cells inside them, launched over SIM_SIZE x SIM_SIZE.
+// For velocity the component normal to a face is flipped so nothing flows through it.
+__kernel void set_bnd_3d(__global float * dest, int vec_type, int channels)
+{
+  const int i = get_global_id(0) + 1;
+  const int j = get_global_id(1) + 1;
+
+  const int is_velocity = (vec_type == IS_VELOCITY);
+
+  for (int c = 0; c < channels; c++, dest += VOLUME)
+  {
+    const float x_sign = 1 - 2 * (is_velocity && c == 0);
+    const float y_sign = 1 - 2 * (is_velocity && c == 1);
+    const float z_sign = 1 - 2 * (is_velocity && c == 2);
+
+    // left and right faces
+    dest[IDX3(0, i, j)] = x_sign * dest[IDX3(1, i, j)];
+    dest[IDX3(SIM_SIZE + 1, i, j)] = x_sign * dest[IDX3(SIM_SIZE, i, j)];
+    // top and bottom faces
+    dest[IDX3(i, 0, j)] = y_sign * dest[IDX3(i, 1, j)];
+    dest[IDX3(i, SIM_SIZE + 1, j)] = y_sign * dest[IDX3(i, SIM_SIZE, j)];
+    // front and back faces
+    dest[IDX3(i, j, 0)] = z_sign * dest[IDX3(i, j, 1)];
+    dest[IDX3(i, j, SIM_SIZE + 1)] = z_sign * dest[IDX3(i, j, SIM_SIZE)];
+  }
+}
+
+// Averages the twelve edges and eight corners from the face cells next to them, launched over SIM_SIZE + 1.
+// Only face cells are read, so this can run right after set_bnd_3d without racing itself.
+__kernel void set_bnd_edges_3d(__global float * dest, int channels)
+{
+  const int i = get_global_id(0) + 1;
+  const int e = SIM_SIZE + 1;
+
+  for (int c = 0; c < channels; c++, dest += VOLUME)
+  {
+    if (i <= SIM_SIZE)
+    {
+      // edges along x
+      dest[IDX3(i, 0, 0)] = 0.5f * (dest[IDX3(i, 1, 0)] + dest[IDX3(i, 0, 1)]);
+      dest[IDX3(i, e, 0)] = 0.5f * (dest[IDX3(i, SIM_SIZE, 0)] + dest[IDX3(i, e, 1)]);
+      dest[IDX3(i, 0, e)] = 0.5f * (dest[IDX3(i, 1, e)] + dest[IDX3(i, 0, SIM_SIZE)]);
+      dest[IDX3(i, e, e)] = 0.5f * (dest[IDX3(i, SIM_SIZE, e)] + dest[IDX3(i, e, SIM_SIZE)]);
+      // edges along y
+      dest[IDX3(0, i, 0)] = 0.5f * (dest[IDX3(1, i, 0)] + dest[IDX3(0, i, 1)]);
+      dest[IDX3(e, i, 0)] = 0.5f * (dest[IDX3(SIM_SIZE, i, 0)] + dest[IDX3(e, i, 1)]);
+      dest[IDX3(0, i, e)] = 0.5f * (dest[IDX3(1, i, e)] + dest[IDX3(0, i, SIM_SIZE)]);
+      dest[IDX3(e, i, e)] = 0.5f * (dest[IDX3(SIM_SIZE, i, e)] + dest[IDX3(e, i, SIM_SIZE)]);
+      // edges along z
+      dest[IDX3(0, 0, i)] = 0.5f * (dest[IDX3(1, 0, i)] + dest[IDX3(0, 1, i)]);
+      dest[IDX3(e, 0, i)] = 0.5f * (dest[IDX3(SIM_SIZE, 0, i)] + dest[IDX3(e, 1, i)]);
+      dest[IDX3(0, e, i)] = 0.5f * (dest[IDX3(1, e, i)] + dest[IDX3(0, SIM_SIZE, i)]);
+      dest[IDX3(e, e, i)] = 0.5f * (dest[IDX3(SIM_SIZE, e, i)] + dest[IDX3(e, SIM_SIZE, i)]);
+    }
+    else { // corners
+      for (int k = 0; k < 8; k++)
+      {
+        int x = (k & 1) ? e : 0;
+        int y = (k & 2) ? e : 0;
+        int z = (k & 4) ? e : 0;
+        int in_x = (k & 1) ? SIM_SIZE : 1;
+        int in_y = (k & 2) ? SIM_SIZE : 1;
+        int in_z = (k & 4) ? SIM_SIZE : 1;
+
+        dest[IDX3(x, y, z)] = (1.f / 3.f) * (dest[IDX3(in_x, in_y, z)] + dest[IDX3(in_x, y, in_z)] + dest[IDX3(x, in_y, in_z)]);
+      }
+    }
+  }
+}
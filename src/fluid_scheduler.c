@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "fluid_scheduler.h"
+
+static double now_seconds(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void sleep_seconds(double seconds)
+{
+  if (seconds > 0)
+  {
+    struct timespec time;
+    time.tv_sec = (time_t)seconds;
+    time.tv_nsec = (long)((seconds - time.tv_sec) * 1e9);
+    nanosleep(&time, NULL);
+  }
+}
+
+FluidScheduler * create_fluid_scheduler(FluidSim * fluid, float step_dt, int max_substeps, float frame_budget)
+{
+  if (step_dt <= 0 || step_dt > MAX_DT || max_substeps < 1)
+  {
+    return NULL;
+  }
+
+  FluidScheduler * scheduler = (FluidScheduler *)calloc(1, sizeof(FluidScheduler));
+
+  scheduler->fluid = fluid;
+  scheduler->step_dt = step_dt;
+  scheduler->max_substeps = max_substeps;
+  scheduler->frame_budget = frame_budget;
+
+  pthread_mutex_init(&scheduler->lock, NULL);
+  pthread_cond_init(&scheduler->changed, NULL);
+
+  return scheduler;
+}
+
+void destroy_fluid_scheduler(FluidScheduler * scheduler)
+{
+  stop_fluid_scheduler(scheduler);
+
+  if (scheduler->batch_begin_event)
+  {
+    clReleaseEvent(scheduler->batch_begin_event);
+  }
+  if (scheduler->batch_end_event)
+  {
+    clReleaseEvent(scheduler->batch_end_event);
+  }
+
+  pthread_mutex_destroy(&scheduler->lock);
+  pthread_cond_destroy(&scheduler->changed);
+
+  free(scheduler);
+}
+
+static void record_substep_cost(FluidScheduler * scheduler, double cost)
+{
+  if (scheduler->substep_seconds > 0)
+  {
+    scheduler->substep_seconds += SUBSTEP_COST_SMOOTHING * (cost - scheduler->substep_seconds);
+  }
+  else {
+    scheduler->substep_seconds = cost;
+  }
+}
+
+// The steps are only paid for once the device has run them. Nothing waits for that here,
+// a batch that is still running is counted by a later call.
+static void collect_substep_cost(FluidScheduler * scheduler)
+{
+  if (!scheduler->batch_end_event)
+  {
+    return;
+  }
+
+  cl_int status;
+  cl_int err = clGetEventInfo(scheduler->batch_end_event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+  if (err == CL_SUCCESS && status > CL_COMPLETE)
+  {
+    return;
+  }
+
+  cl_ulong begin, end;
+  if (err == CL_SUCCESS && status == CL_COMPLETE)
+  {
+    err = clGetEventProfilingInfo(scheduler->batch_begin_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &begin, NULL);
+    err |= clGetEventProfilingInfo(scheduler->batch_end_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    if (err == CL_SUCCESS && end > begin)
+    {
+      record_substep_cost(scheduler, (end - begin) * 1e-9 / scheduler->batch_substeps);
+    }
+  }
+
+  clReleaseEvent(scheduler->batch_begin_event);
+  clReleaseEvent(scheduler->batch_end_event);
+  scheduler->batch_begin_event = NULL;
+  scheduler->batch_end_event = NULL;
+}
+
+// Banks elapsed and returns the substeps to run now
+static int plan_substeps(FluidScheduler * scheduler, float elapsed)
+{
+  collect_substep_cost(scheduler);
+  scheduler->accumulator += elapsed;
+
+  int num_owed = (int)(scheduler->accumulator / scheduler->step_dt);
+  int num_substeps = (num_owed < scheduler->max_substeps) ? num_owed : scheduler->max_substeps;
+
+  // at least one step, so the cost keeps being measured after a slow frame
+  if (scheduler->substep_seconds > 0)
+  {
+    int num_affordable = (int)(scheduler->frame_budget / scheduler->substep_seconds);
+    if (num_affordable < 1)
+    {
+      num_affordable = 1;
+    }
+    if (num_substeps > num_affordable)
+    {
+      num_substeps = num_affordable;
+    }
+  }
+
+  // what cannot be paid for is dropped, so a slow device falls behind real time instead of piling up work
+  scheduler->dropped_seconds += (num_owed - num_substeps) * (double)scheduler->step_dt;
+  scheduler->accumulator -= num_owed * (double)scheduler->step_dt;
+  scheduler->last_substeps = num_substeps;
+
+  return num_substeps;
+}
+
+// Enqueues the substeps between two markers whose device timestamps give their cost, while no earlier batch is still
+// being timed. The error is returned rather than kept in fluid->err, which belongs to whichever thread holds the simulation.
+static cl_int enqueue_substeps(FluidScheduler * scheduler, int num_substeps)
+{
+  FluidSim * fluid = scheduler->fluid;
+  int is_timed = !scheduler->batch_begin_event;
+  if (is_timed)
+  {
+    cl_int err = clEnqueueMarkerWithWaitList(fluid->command_queue, 0, NULL, &scheduler->batch_begin_event);
+    if (err != CL_SUCCESS)
+    {
+      scheduler->batch_begin_event = NULL;
+      return err;
+    }
+  }
+
+  cl_int err = simulate_substeps(fluid, num_substeps, scheduler->step_dt);
+
+  // the last density advection ends the batch, it waits for the velocity it follows
+  if (is_timed && err == CL_SUCCESS)
+  {
+    clRetainEvent(fluid->density_advected_event);
+    scheduler->batch_end_event = fluid->density_advected_event;
+    scheduler->batch_substeps = num_substeps;
+  }
+  else if (is_timed)
+  {
+    clReleaseEvent(scheduler->batch_begin_event);
+    scheduler->batch_begin_event = NULL;
+  }
+  return err;
+}
+
+int advance_fluid_scheduler(FluidScheduler * scheduler, float elapsed)
+{
+  int num_substeps = plan_substeps(scheduler, elapsed);
+  if (num_substeps == 0)
+  {
+    return 0;
+  }
+
+  FluidSim * fluid = scheduler->fluid;
+  cl_int err = enqueue_substeps(scheduler, num_substeps);
+  if (err != CL_SUCCESS && fluid->status == CL_SUCCESS)
+  {
+    fluid->err = err;
+    check_fluid_error(fluid, "Unable to enqueue marker");
+  }
+  if (fluid->status != CL_SUCCESS)
+  {
+    return 0;
+  }
+
+  return num_substeps;
+}
+
+// Simulates the next frame while fewer than MAX_FRAMES_IN_FLIGHT are waiting to be drawn, or sleeps until a step is owed.
+// The lock is only held to read and publish the scheduler state. While the substeps are enqueued
+// is_enqueueing keeps the other threads out of the simulation, and the device runs them with no lock held.
+static void * run_scheduler(void * arg)
+{
+  FluidScheduler * scheduler = (FluidScheduler *)arg;
+  FluidSim * fluid = scheduler->fluid;
+
+  double prev_time = now_seconds();
+
+  pthread_mutex_lock(&scheduler->lock);
+  while (scheduler->is_running)
+  {
+    if (scheduler->frames_simulated - scheduler->frames_presented >= MAX_FRAMES_IN_FLIGHT)
+    {
+      pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+      continue;
+    }
+
+    double time = now_seconds();
+    float elapsed = time - prev_time;
+    prev_time = time;
+
+    int num_substeps = plan_substeps(scheduler, elapsed);
+    int is_simulated = 0;
+    if (num_substeps > 0)
+    {
+      scheduler->is_enqueueing = 1;
+      pthread_mutex_unlock(&scheduler->lock);
+
+      cl_int err = enqueue_substeps(scheduler, num_substeps);
+
+      pthread_mutex_lock(&scheduler->lock);
+      scheduler->is_enqueueing = 0;
+      pthread_cond_broadcast(&scheduler->changed);
+      if (err == CL_SUCCESS)
+      {
+        is_simulated = 1;
+      }
+      else if (fluid->status == CL_SUCCESS)
+      {
+        fluid->err = err;
+        check_fluid_error(fluid, "Unable to enqueue marker");
+      }
+    }
+
+    if (is_simulated)
+    {
+      scheduler->frames_simulated++;
+      pthread_cond_broadcast(&scheduler->changed);
+    }
+    else {
+      double wait = scheduler->step_dt - scheduler->accumulator;
+      pthread_mutex_unlock(&scheduler->lock);
+      sleep_seconds(wait);
+      pthread_mutex_lock(&scheduler->lock);
+    }
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+
+  return NULL;
+}
+
+void start_fluid_scheduler(FluidScheduler * scheduler)
+{
+  if (!scheduler->is_running)
+  {
+    scheduler->is_running = 1;
+    scheduler->present_time = now_seconds();
+    pthread_create(&scheduler->thread, NULL, run_scheduler, scheduler);
+  }
+}
+
+void stop_fluid_scheduler(FluidScheduler * scheduler)
+{
+  pthread_mutex_lock(&scheduler->lock);
+  int was_running = scheduler->is_running;
+  scheduler->is_running = 0;
+  pthread_cond_broadcast(&scheduler->changed);
+  pthread_mutex_unlock(&scheduler->lock);
+
+  if (was_running)
+  {
+    pthread_join(scheduler->thread, NULL);
+  }
+}
+
+void lock_fluid_scheduler(FluidScheduler * scheduler)
+{
+  pthread_mutex_lock(&scheduler->lock);
+  while (scheduler->is_enqueueing)
+  {
+    pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+  }
+}
+
+void unlock_fluid_scheduler(FluidScheduler * scheduler)
+{
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+int wait_for_fluid_frame(FluidScheduler * scheduler, float timeout)
+{
+  // pthread_cond_timedwait takes a deadline on the realtime clock
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  double seconds = deadline.tv_nsec / 1e9 + timeout;
+  deadline.tv_sec += (time_t)seconds;
+  deadline.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+
+  // the thread may be enqueueing the next frame without the lock, so that has to finish before this one is drawn
+  pthread_mutex_lock(&scheduler->lock);
+  while ((scheduler->frames_simulated == scheduler->frames_presented && scheduler->is_running) || scheduler->is_enqueueing)
+  {
+    if (pthread_cond_timedwait(&scheduler->changed, &scheduler->lock, &deadline) != 0)
+    {
+      break;
+    }
+  }
+
+  int has_frame = scheduler->frames_simulated > scheduler->frames_presented && !scheduler->is_enqueueing;
+  if (has_frame)
+  {
+    double time = now_seconds();
+    present_frame(scheduler->fluid, time - scheduler->present_time);
+    scheduler->present_time = time;
+
+    scheduler->frames_presented = scheduler->frames_simulated;
+    pthread_cond_broadcast(&scheduler->changed);
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+
+  return has_frame;
+}
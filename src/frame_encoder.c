@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "frame_encoder.h"
+
+// zlib stored blocks hold at most this many bytes
+#define MAX_STORED_BLOCK 65535
+
+static uint32_t crc_table[256];
+
+static void make_crc_table(void)
+{
+  for (uint32_t n = 0; n < 256; n++)
+  {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+    {
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[n] = c;
+  }
+}
+
+static uint32_t update_crc(uint32_t crc, const unsigned char * data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+static void put_u32(unsigned char * dest, uint32_t value)
+{
+  dest[0] = value >> 24;
+  dest[1] = value >> 16;
+  dest[2] = value >> 8;
+  dest[3] = value;
+}
+
+// Returns 0 if fwrite came up short, the disk is likely full
+static int write_bytes(FILE * file, const void * data, size_t length)
+{
+  return fwrite(data, 1, length, file) == length;
+}
+
+static int write_png_chunk(FILE * file, const char * type, const unsigned char * data, size_t length)
+{
+  unsigned char header[8];
+  put_u32(header, length);
+  memcpy(header + 4, type, 4);
+  int is_written = write_bytes(file, header, 8);
+  if (length > 0)
+  {
+    is_written = is_written && write_bytes(file, data, length);
+  }
+
+  unsigned char crc[4];
+  put_u32(crc, update_crc(update_crc(0xffffffffu, header + 4, 4), data, length) ^ 0xffffffffu);
+  return is_written && write_bytes(file, crc, 4);
+}
+
+// The image data is a zlib stream of stored blocks. That is larger than deflate would make it,
+// but it needs no library and is fast enough to keep up with the simulation.
+static int encode_png(FrameEncoder * encoder, const unsigned char * frame)
+{
+  char filename[1024];
+  snprintf(filename, sizeof(filename), "%s%06zu.png", encoder->path, encoder->frames_written);
+
+  FILE * file = fopen(filename, "wb");
+  if (!file)
+  {
+    perror("Failed to open frame file");
+    return 0;
+  }
+
+  static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  int is_written = write_bytes(file, signature, 8);
+
+  // 8 bit RGBA, no interlacing
+  unsigned char ihdr[13] = {0};
+  put_u32(ihdr, encoder->width);
+  put_u32(ihdr + 4, encoder->height);
+  ihdr[8] = 8;
+  ihdr[9] = 6;
+  is_written = is_written && write_png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+  // every row starts with filter type 0
+  size_t row_size = 4 * encoder->width + 1;
+  size_t raw_size = row_size * encoder->height;
+  unsigned char * raw = encoder->scratch;
+  for (size_t y = 0; y < encoder->height; y++)
+  {
+    raw[y * row_size] = 0;
+    memcpy(&raw[y * row_size + 1], &frame[4 * encoder->width * y], 4 * encoder->width);
+  }
+
+  size_t num_blocks = (raw_size + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK;
+  unsigned char * idat = raw + raw_size;
+  size_t idat_size = 0;
+
+  idat[idat_size++] = 0x78;
+  idat[idat_size++] = 0x01;
+
+  uint32_t adler_a = 1;
+  uint32_t adler_b = 0;
+  for (size_t i = 0; i < num_blocks; i++)
+  {
+    size_t offset = i * MAX_STORED_BLOCK;
+    size_t length = (raw_size - offset < MAX_STORED_BLOCK) ? raw_size - offset : MAX_STORED_BLOCK;
+
+    idat[idat_size++] = (i == num_blocks - 1) ? 1 : 0;
+    idat[idat_size++] = length & 0xff;
+    idat[idat_size++] = length >> 8;
+    idat[idat_size++] = ~length & 0xff;
+    idat[idat_size++] = (~length >> 8) & 0xff;
+    memcpy(&idat[idat_size], &raw[offset], length);
+    idat_size += length;
+
+    for (size_t j = offset; j < offset + length; j++)
+    {
+      adler_a = (adler_a + raw[j]) % 65521;
+      adler_b = (adler_b + adler_a) % 65521;
+    }
+  }
+  put_u32(&idat[idat_size], (adler_b << 16) | adler_a);
+  idat_size += 4;
+
+  is_written = is_written && write_png_chunk(file, "IDAT", idat, idat_size);
+  is_written = is_written && write_png_chunk(file, "IEND", NULL, 0);
+
+  // buffered bytes only fail to reach the disk here
+  is_written = (fclose(file) == 0) && is_written;
+  if (!is_written)
+  {
+    perror("Failed to write frame file");
+  }
+  return is_written;
+}
+
+// Full range BT.601 without chroma subsampling
+static int encode_y4m(FrameEncoder * encoder, const unsigned char * frame)
+{
+  size_t num_pixels = encoder->width * encoder->height;
+  unsigned char * y_plane = encoder->scratch;
+  unsigned char * u_plane = y_plane + num_pixels;
+  unsigned char * v_plane = u_plane + num_pixels;
+
+  for (size_t i = 0; i < num_pixels; i++)
+  {
+    float r = frame[4 * i];
+    float g = frame[4 * i + 1];
+    float b = frame[4 * i + 2];
+
+    y_plane[i] = fmin(fmax(0.299f * r + 0.587f * g + 0.114f * b, 0), 255);
+    u_plane[i] = fmin(fmax(128 - 0.168736f * r - 0.331264f * g + 0.5f * b, 0), 255);
+    v_plane[i] = fmin(fmax(128 + 0.5f * r - 0.418688f * g - 0.081312f * b, 0), 255);
+  }
+
+  return write_bytes(encoder->file, "FRAME\n", 6) && write_bytes(encoder->file, y_plane, 3 * num_pixels);
+}
+
+static void encode_frame(FrameEncoder * encoder, const unsigned char * frame)
+{
+  int is_written = 0;
+  switch (encoder->format)
+  {
+    case ENCODE_Y4M:
+      is_written = encode_y4m(encoder, frame);
+      break;
+    case ENCODE_PNG:
+      is_written = encode_png(encoder, frame);
+      break;
+    case ENCODE_RAW:
+      is_written = write_bytes(encoder->file, frame, 4 * encoder->width * encoder->height);
+      break;
+  }
+
+  // a stream with a partial frame in it cannot be read past that frame, so nothing more is written
+  if (!is_written)
+  {
+    if (encoder->format != ENCODE_PNG)
+    {
+      perror("Failed to write video file");
+    }
+    encoder->has_failed = 1;
+    return;
+  }
+  encoder->frames_written++;
+}
+
+static void * run_encoder(void * arg)
+{
+  FrameEncoder * encoder = (FrameEncoder *)arg;
+
+  pthread_mutex_lock(&encoder->lock);
+  while (1)
+  {
+    while (encoder->num_queued == 0 && !encoder->is_closing)
+    {
+      pthread_cond_wait(&encoder->changed, &encoder->lock);
+    }
+    if (encoder->num_queued == 0)
+    {
+      break;
+    }
+
+    size_t slot = encoder->first_slot;
+    pthread_mutex_unlock(&encoder->lock);
+
+    // err belongs to the simulation thread
+    cl_int status = clWaitForEvents(1, &encoder->slot_events[slot]);
+    clReleaseEvent(encoder->slot_events[slot]);
+    if (status == CL_SUCCESS && !encoder->has_failed)
+    {
+      encode_frame(encoder, encoder->slots[slot]);
+    }
+    else {
+      fprintf(stderr, "Frame readback failed with %d, skipping it\n", status);
+    }
+
+    pthread_mutex_lock(&encoder->lock);
+    encoder->first_slot = (slot + 1) % NUM_ENCODER_SLOTS;
+    encoder->num_queued--;
+    pthread_cond_broadcast(&encoder->changed);
+  }
+  pthread_mutex_unlock(&encoder->lock);
+
+  return NULL;
+}
+
+FrameEncoder * create_frame_encoder(const char * path, ENCODER_FORMAT format, size_t width, size_t height, int fps)
+{
+  FrameEncoder * encoder = (FrameEncoder *)calloc(1, sizeof(FrameEncoder));
+
+  encoder->format = format;
+  encoder->width = width;
+  encoder->height = height;
+  encoder->path = strdup(path);
+
+  if (format != ENCODE_PNG)
+  {
+    encoder->file = fopen(path, "wb");
+    if (!encoder->file)
+    {
+      perror("Failed to open video file");
+      free(encoder->path);
+      free(encoder);
+      return NULL;
+    }
+  }
+
+  // players assume limited range unless told otherwise
+  if (format == ENCODE_Y4M && fprintf(encoder->file, "YUV4MPEG2 W%zu H%zu F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", width, height, fps) < 0)
+  {
+    perror("Failed to write video file");
+    fclose(encoder->file);
+    free(encoder->path);
+    free(encoder);
+    return NULL;
+  }
+
+  make_crc_table();
+
+  for (size_t i = 0; i < NUM_ENCODER_SLOTS; i++)
+  {
+    encoder->slots[i] = (unsigned char *)malloc(4 * width * height);
+  }
+
+  // large enough for the filtered rows and the zlib stream of a PNG, or the three planes of a Y4M frame
+  size_t row_size = 4 * width + 1;
+  size_t raw_size = row_size * height;
+  encoder->scratch = (unsigned char *)malloc(2 * raw_size + 5 * (raw_size / MAX_STORED_BLOCK + 1) + 6);
+
+  pthread_mutex_init(&encoder->lock, NULL);
+  pthread_cond_init(&encoder->changed, NULL);
+  pthread_create(&encoder->thread, NULL, run_encoder, encoder);
+
+  return encoder;
+}
+
+int destroy_frame_encoder(FrameEncoder * encoder)
+{
+  pthread_mutex_lock(&encoder->lock);
+  encoder->is_closing = 1;
+  pthread_cond_broadcast(&encoder->changed);
+  pthread_mutex_unlock(&encoder->lock);
+
+  pthread_join(encoder->thread, NULL);
+
+  pthread_mutex_destroy(&encoder->lock);
+  pthread_cond_destroy(&encoder->changed);
+
+  if (encoder->file && fclose(encoder->file) != 0)
+  {
+    perror("Failed to write video file");
+    encoder->has_failed = 1;
+  }
+
+  for (size_t i = 0; i < NUM_ENCODER_SLOTS; i++)
+  {
+    free(encoder->slots[i]);
+  }
+  int is_written = !encoder->has_failed;
+  free(encoder->scratch);
+  free(encoder->path);
+  free(encoder);
+
+  return is_written;
+}
+
+unsigned char * acquire_frame_slot(FrameEncoder * encoder)
+{
+  pthread_mutex_lock(&encoder->lock);
+  while (encoder->num_queued == NUM_ENCODER_SLOTS)
+  {
+    pthread_cond_wait(&encoder->changed, &encoder->lock);
+  }
+  unsigned char * slot = encoder->slots[(encoder->first_slot + encoder->num_queued) % NUM_ENCODER_SLOTS];
+  pthread_mutex_unlock(&encoder->lock);
+
+  return slot;
+}
+
+void submit_frame(FrameEncoder * encoder, cl_event ready)
+{
+  pthread_mutex_lock(&encoder->lock);
+  encoder->slot_events[(encoder->first_slot + encoder->num_queued) % NUM_ENCODER_SLOTS] = ready;
+  encoder->num_queued++;
+  pthread_cond_broadcast(&encoder->changed);
+  pthread_mutex_unlock(&encoder->lock);
+}
@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics_exporter.h"
+
+// How long a connection has to send its request before it is answered without one
+#define REQUEST_TIMEOUT_MS 100
+
+static const char * stage_names[NUM_FRAME_STAGES] = {"velocity", "simulate", "present"};
+static const char * relaxation_names[NUM_RELAXATIONS] = {"velocity_diffuse", "pressure", "advected_pressure", "density_diffuse"};
+
+static double now_seconds(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Copies a snapshot a word at a time with relaxed atomics, since the other side of the sequence may be copying it at the same time.
+// A torn copy is thrown away by the sequence check, but plain loads and stores would still be a data race.
+static void copy_metrics(FluidMetrics * dest, const FluidMetrics * src)
+{
+  size_t * dest_words = (size_t *)dest;
+  const size_t * src_words = (const size_t *)src;
+  size_t num_words = sizeof(FluidMetrics) / sizeof(size_t);
+  for (size_t i = 0; i < num_words; i++)
+  {
+    __atomic_store_n(&dest_words[i], __atomic_load_n(&src_words[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  }
+
+  unsigned char * dest_bytes = (unsigned char *)dest;
+  const unsigned char * src_bytes = (const unsigned char *)src;
+  for (size_t i = num_words * sizeof(size_t); i < sizeof(FluidMetrics); i++)
+  {
+    __atomic_store_n(&dest_bytes[i], __atomic_load_n(&src_bytes[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  }
+}
+
+void publish_frame_metrics(MetricsExporter * exporter)
+{
+  FluidMetrics * metrics = &exporter->current;
+
+  double time = now_seconds();
+  if (exporter->last_present_time > 0)
+  {
+    metrics->frame_seconds = time - exporter->last_present_time;
+    metrics->frame_seconds_total += metrics->frame_seconds;
+  }
+  exporter->last_present_time = time;
+  metrics->frames++;
+
+  // odd while published is being written
+  __atomic_store_n(&exporter->sequence, exporter->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  copy_metrics(&exporter->published, metrics);
+  __atomic_store_n(&exporter->sequence, exporter->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void read_metrics(MetricsExporter * exporter, FluidMetrics * metrics)
+{
+  unsigned sequence;
+  do
+  {
+    sequence = __atomic_load_n(&exporter->sequence, __ATOMIC_ACQUIRE);
+    copy_metrics(metrics, &exporter->published);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((sequence & 1) || sequence != __atomic_load_n(&exporter->sequence, __ATOMIC_RELAXED));
+}
+
+// Appends to the text written so far, a full buffer cuts the snapshot short
+static size_t append_text(char * text, size_t text_size, size_t length, const char * format, ...)
+{
+  if (length + 1 >= text_size)
+  {
+    return length;
+  }
+
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(text + length, text_size - length, format, args);
+  va_end(args);
+
+  if (written < 0)
+  {
+    return length;
+  }
+  return (length + written < text_size) ? length + written : text_size - 1;
+}
+
+size_t format_metrics(const FluidMetrics * metrics, char * text, size_t text_size)
+{
+  size_t length = 0;
+
+  length = append_text(text, text_size, length, "# TYPE fluidsim_frames counter\n# HELP fluidsim_frames Frames presented.\n");
+  length = append_text(text, text_size, length, "fluidsim_frames_total %zu\n", metrics->frames);
+  length = append_text(text, text_size, length, "# TYPE fluidsim_substeps counter\n# HELP fluidsim_substeps Substeps simulated.\n");
+  length = append_text(text, text_size, length, "fluidsim_substeps_total %zu\n", metrics->substeps);
+
+  length = append_text(text, text_size, length, "# TYPE fluidsim_frame_seconds gauge\n# HELP fluidsim_frame_seconds Wallclock time of the last frame.\n");
+  length = append_text(text, text_size, length, "fluidsim_frame_seconds %.9g\n", metrics->frame_seconds);
+  length = append_text(text, text_size, length, "# TYPE fluidsim_frame_time_seconds counter\n# HELP fluidsim_frame_time_seconds Wallclock time of every frame after the first.\n");
+  length = append_text(text, text_size, length, "fluidsim_frame_time_seconds_total %.9g\n", metrics->frame_seconds_total);
+
+  length = append_text(text, text_size, length, "# TYPE fluidsim_stage_seconds gauge\n# HELP fluidsim_stage_seconds Device time of a stage in the last timed frame.\n");
+  for (int i = 0; i < NUM_FRAME_STAGES; i++)
+  {
+    if (metrics->stage_samples[i])
+    {
+      length = append_text(text, text_size, length, "fluidsim_stage_seconds{stage=\"%s\"} %.9g\n", stage_names[i], metrics->stage_seconds[i]);
+    }
+  }
+  length = append_text(text, text_size, length, "# TYPE fluidsim_stage_time_seconds counter\n# HELP fluidsim_stage_time_seconds Device time of a stage in every timed frame.\n");
+  for (int i = 0; i < NUM_FRAME_STAGES; i++)
+  {
+    length = append_text(text, text_size, length, "fluidsim_stage_time_seconds_total{stage=\"%s\"} %.9g\n", stage_names[i], metrics->stage_seconds_total[i]);
+  }
+  length = append_text(text, text_size, length, "# TYPE fluidsim_stage_samples counter\n# HELP fluidsim_stage_samples Frames a stage was timed in.\n");
+  for (int i = 0; i < NUM_FRAME_STAGES; i++)
+  {
+    length = append_text(text, text_size, length, "fluidsim_stage_samples_total{stage=\"%s\"} %zu\n", stage_names[i], metrics->stage_samples[i]);
+  }
+
+  length = append_text(text, text_size, length, "# TYPE fluidsim_relaxation_sweeps gauge\n# HELP fluidsim_relaxation_sweeps Sweeps the last finished relaxation took.\n");
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    length = append_text(text, text_size, length, "fluidsim_relaxation_sweeps{relaxation=\"%s\"} %d\n", relaxation_names[i], metrics->relaxation_sweeps[i]);
+  }
+  length = append_text(text, text_size, length, "# TYPE fluidsim_relaxation_converged gauge\n# HELP fluidsim_relaxation_converged 1 if the last finished relaxation got below its tolerance.\n");
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    length = append_text(text, text_size, length, "fluidsim_relaxation_converged{relaxation=\"%s\"} %d\n", relaxation_names[i], metrics->relaxation_converged[i]);
+  }
+  length = append_text(text, text_size, length, "# TYPE fluidsim_relaxation_residual gauge\n# HELP fluidsim_relaxation_residual Largest change of a cell in the last checked sweep.\n");
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    length = append_text(text, text_size, length, "fluidsim_relaxation_residual{relaxation=\"%s\"} %.9g\n", relaxation_names[i], metrics->relaxation_residuals[i]);
+  }
+  length = append_text(text, text_size, length, "# TYPE fluidsim_relaxation_sweeps_run counter\n# HELP fluidsim_relaxation_sweeps_run Sweeps of every finished relaxation.\n");
+  for (int i = 0; i < NUM_RELAXATIONS; i++)
+  {
+    length = append_text(text, text_size, length, "fluidsim_relaxation_sweeps_run_total{relaxation=\"%s\"} %zu\n", relaxation_names[i], metrics->relaxation_sweeps_total[i]);
+  }
+
+  length = append_text(text, text_size, length, "# TYPE fluidsim_uploaded_bytes counter\n# HELP fluidsim_uploaded_bytes Bytes written to the device for sources and obstacles.\n");
+  length = append_text(text, text_size, length, "fluidsim_uploaded_bytes_total %zu\n", metrics->bytes_uploaded);
+
+  length = append_text(text, text_size, length, "# TYPE fluidsim_events_injected counter\n# HELP fluidsim_events_injected Source events added to the fields.\n");
+  length = append_text(text, text_size, length, "fluidsim_events_injected_total{field=\"a_density\"} %zu\n", metrics->events_injected[IS_A_DENSITY]);
+  length = append_text(text, text_size, length, "fluidsim_events_injected_total{field=\"b_density\"} %zu\n", metrics->events_injected[IS_B_DENSITY]);
+  length = append_text(text, text_size, length, "fluidsim_events_injected_total{field=\"u_velocity\"} %zu\n", metrics->events_injected[IS_U_VELOCITY]);
+  length = append_text(text, text_size, length, "fluidsim_events_injected_total{field=\"v_velocity\"} %zu\n", metrics->events_injected[IS_V_VELOCITY]);
+
+  length = append_text(text, text_size, length, "# EOF\n");
+
+  return length;
+}
+
+static size_t format_snapshot(MetricsExporter * exporter)
+{
+  FluidMetrics metrics;
+  read_metrics(exporter, &metrics);
+  exporter->snapshots_written++;
+  return format_metrics(&metrics, exporter->text, METRICS_TEXT_SIZE);
+}
+
+// Written next to the file and renamed over it
+static void write_metrics_file(MetricsExporter * exporter)
+{
+  size_t length = format_snapshot(exporter);
+
+  char temp_path[MAX_METRICS_PATH + 4];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", exporter->path);
+
+  FILE * file = fopen(temp_path, "w");
+  if (!file)
+  {
+    perror("Failed to open metrics file");
+    return;
+  }
+  size_t written = fwrite(exporter->text, 1, length, file);
+  if (fclose(file) != 0 || written != length || rename(temp_path, exporter->path) != 0)
+  {
+    perror("Failed to write metrics file");
+    remove(temp_path);
+  }
+}
+
+static void send_all(int connection, const char * data, size_t length)
+{
+#ifdef MSG_NOSIGNAL
+  int send_flags = MSG_NOSIGNAL;
+#else
+  int send_flags = 0;
+#endif
+
+  while (length > 0)
+  {
+    ssize_t sent = send(connection, data, length, send_flags);
+    // a reader that goes away is not an error of the simulation
+    if (sent <= 0)
+    {
+      return;
+    }
+    data += sent;
+    length -= sent;
+  }
+}
+
+// Answers one connection if it arrives within the interval. An HTTP request, as curl --unix-socket sends,
+// gets an HTTP response, anything else only the text.
+static void serve_metrics(MetricsExporter * exporter)
+{
+  struct pollfd listener = {exporter->socket, POLLIN, 0};
+  if (poll(&listener, 1, (int)(1000 * exporter->interval)) <= 0)
+  {
+    return;
+  }
+
+  int connection = accept(exporter->socket, NULL, NULL);
+  if (connection < 0)
+  {
+    return;
+  }
+#ifdef SO_NOSIGPIPE
+  int no_sigpipe = 1;
+  setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+  char request[4] = {0};
+  struct pollfd reader = {connection, POLLIN, 0};
+  int is_http = 0;
+  if (poll(&reader, 1, REQUEST_TIMEOUT_MS) > 0)
+  {
+    is_http = recv(connection, request, sizeof(request), MSG_PEEK) == sizeof(request) && memcmp(request, "GET ", 4) == 0;
+  }
+
+  size_t length = format_snapshot(exporter);
+  if (is_http)
+  {
+    const char * header = "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n\r\n";
+    send_all(connection, header, strlen(header));
+  }
+  send_all(connection, exporter->text, length);
+
+  close(connection);
+}
+
+static void * run_exporter(void * arg)
+{
+  MetricsExporter * exporter = (MetricsExporter *)arg;
+
+  pthread_mutex_lock(&exporter->lock);
+  while (!exporter->is_closing)
+  {
+    if (exporter->output == METRICS_FILE)
+    {
+      // pthread_cond_timedwait takes a deadline on the realtime clock
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      double seconds = deadline.tv_nsec / 1e9 + exporter->interval;
+      deadline.tv_sec += (time_t)seconds;
+      deadline.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+      pthread_cond_timedwait(&exporter->changed, &exporter->lock, &deadline);
+
+      // also once more on the way out
+      pthread_mutex_unlock(&exporter->lock);
+      write_metrics_file(exporter);
+    }
+    else {
+      pthread_mutex_unlock(&exporter->lock);
+      serve_metrics(exporter);
+    }
+    pthread_mutex_lock(&exporter->lock);
+  }
+  pthread_mutex_unlock(&exporter->lock);
+
+  return NULL;
+}
+
+static int listen_on_socket(MetricsExporter * exporter)
+{
+  exporter->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (exporter->socket < 0)
+  {
+    perror("Failed to create metrics socket");
+    return 0;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, exporter->path, sizeof(address.sun_path) - 1);
+
+  // left behind by an exporter that did not shut down
+  unlink(exporter->path);
+
+  if (bind(exporter->socket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(exporter->socket, 4) != 0)
+  {
+    perror("Failed to listen on metrics socket");
+    close(exporter->socket);
+    return 0;
+  }
+  return 1;
+}
+
+MetricsExporter * create_metrics_exporter(const char * path, METRICS_OUTPUT output, double interval)
+{
+  if (strlen(path) >= MAX_METRICS_PATH || interval <= 0)
+  {
+    fprintf(stderr, "Invalid metrics path or interval\n");
+    return NULL;
+  }
+
+  MetricsExporter * exporter = (MetricsExporter *)calloc(1, sizeof(MetricsExporter));
+
+  exporter->output = output;
+  exporter->interval = interval;
+  exporter->socket = -1;
+  strcpy(exporter->path, path);
+
+  if (output == METRICS_SOCKET && !listen_on_socket(exporter))
+  {
+    free(exporter);
+    return NULL;
+  }
+
+  exporter->text = (char *)malloc(METRICS_TEXT_SIZE);
+
+  pthread_mutex_init(&exporter->lock, NULL);
+  pthread_cond_init(&exporter->changed, NULL);
+  pthread_create(&exporter->thread, NULL, run_exporter, exporter);
+
+  return exporter;
+}
+
+void destroy_metrics_exporter(MetricsExporter * exporter)
+{
+  pthread_mutex_lock(&exporter->lock);
+  exporter->is_closing = 1;
+  pthread_cond_broadcast(&exporter->changed);
+  pthread_mutex_unlock(&exporter->lock);
+
+  // a socket is polled for at most one more interval
+  pthread_join(exporter->thread, NULL);
+
+  pthread_mutex_destroy(&exporter->lock);
+  pthread_cond_destroy(&exporter->changed);
+
+  if (exporter->output == METRICS_SOCKET)
+  {
+    close(exporter->socket);
+    unlink(exporter->path);
+  }
+
+  free(exporter->text);
+  free(exporter);
+}
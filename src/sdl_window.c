@@ -46,7 +46,10 @@ window_t * create_window(size_t window_width, size_t window_height, size_t sim_s
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, sim_size, sim_size, 0, GL_RGBA, GL_FLOAT, NULL);
+  // start out black, the sparse simulation only draws the tiles that hold fluid
+  GLfloat * pixels = (GLfloat *)calloc(4 * sim_size * sim_size, sizeof(GLfloat));
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, sim_size, sim_size, 0, GL_RGBA, GL_FLOAT, pixels);
+  free(pixels);
 
   GLenum err = glGetError();
   if (err != GL_NO_ERROR)
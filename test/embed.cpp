@@ -0,0 +1,61 @@
+/*
+ * Drives a simulation through the C++ wrapper the way a service embedding fluidsim would,
+ * and prints the total density after each batch of frames.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "cl_fluid_sim.hpp"
+
+int main(int argc, char ** argv)
+{
+  size_t sim_size = (argc > 1) ? atoi(argv[1]) : 128;
+  int num_frames = (argc > 2) ? atoi(argv[2]) : 120;
+
+  clfluid::Context context = clfluid::Context::create(nullptr, F_USE_GPU);
+  if (!context)
+  {
+    return 1;
+  }
+
+  clfluid::Simulation fluid = clfluid::Simulation::create(context, sim_size, 0.00001f, 0.00001f, 20, 0);
+  if (!fluid)
+  {
+    return 1;
+  }
+
+  for (int frame = 0; frame < num_frames; frame++)
+  {
+    fluid.add_source(0.5f, 0.5f, 1.f, 0.1f, IS_A_DENSITY);
+    fluid.add_source(0.5f, 0.5f, 1.f, 0.1f, IS_V_VELOCITY);
+
+    if (fluid.step(1.f / 60) != CL_SUCCESS)
+    {
+      return 1;
+    }
+
+    if ((frame + 1) % 30 == 0)
+    {
+      // the view unmaps itself at the end of the block, before the next frame
+      clfluid::FieldView density = fluid.map(IS_DENSITY);
+      if (!density)
+      {
+        return 1;
+      }
+
+      double total = 0;
+      for (size_t y = 1; y <= fluid.size(); y++)
+      {
+        clfluid::Span<cl_float> row = density.row(y);
+        for (size_t x = 1; x <= fluid.size(); x++)
+        {
+          total += row[2 * x] + row[2 * x + 1];
+        }
+      }
+      printf("frame %d: total density %f\n", frame + 1, total);
+    }
+  }
+
+  return 0;
+}
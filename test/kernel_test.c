@@ -0,0 +1,1220 @@
+/*
+ * Runs each solver kernel on a small fixed field and checks it against the scalar reference below,
+ * then checks the checksums of whole frames against reference frames built from the same pieces.
+ * Defaults to the CPU device, so POCL runs it on machines without a GPU. ctest runs one test per kernel:
+ *
+ * kernel_test <add_source|set_bnd|boundaries|diffuse|advect|wrapped_advect|project_a|project_b|project_c|add_event_sources|particles|upsample_velocity|downsample_density|frame> [-t <CPU/GPU>]
+ */
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include "cl_fluid_sim.h"
+
+extern char * optarg;
+extern int optind;
+
+// ctest counts this exit code as skipped, for machines with no OpenCL device at all
+#define SKIP_TEST 77
+
+#define TEST_SIZE 16
+#define TEST_STRIDE (TEST_SIZE + 2)
+#define TEST_BUFFER_SIZE (2 * TEST_STRIDE * TEST_STRIDE)
+#define CELL(x, y, c) (2 * ((x) + TEST_STRIDE * (y)) + (c))
+// The velocity grid of F_HALF_VELOCITY
+#define COARSE_SIZE (TEST_SIZE / 2)
+#define COARSE_STRIDE (COARSE_SIZE + 2)
+#define COARSE_BUFFER_SIZE (2 * COARSE_STRIDE * COARSE_STRIDE)
+#define COARSE_CELL(x, y, c) (2 * ((x) + COARSE_STRIDE * (y)) + (c))
+
+// Differences allowed between a float kernel and the double reference, relative to the largest expected value.
+// Whole frames compound the rounding of every step.
+#define TOLERANCE 1e-4
+#define FRAME_TOLERANCE 1e-3
+// The relaxations run until they stop changing, so the order the work items sweep in does not matter
+#define CONVERGED_SWEEPS 2000
+#define NUM_TEST_FRAMES 8
+#define TEST_DIFFUSION 0.0001f
+#define TEST_VISCOSITY 0.0001f
+#define TEST_PARTICLES 64
+
+typedef struct kernel_test_t
+{
+  const char * name;
+  int (*run)(FluidSim * fluid);
+  // added to the flags the simulation is created with
+  FLAGS flags;
+} KernelTest;
+
+static float random_value(unsigned int * state)
+{
+  *state = *state * 1664525u + 1013904223u;
+  return (*state >> 8) / 16777216.f * 2 - 1;
+}
+
+// Fills the interior with values in [-scale, scale] and the border with zero
+static void random_field(double * field, unsigned int seed, double scale)
+{
+  memset(field, 0, TEST_BUFFER_SIZE * sizeof(double));
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      field[CELL(x, y, 0)] = scale * random_value(&seed);
+      field[CELL(x, y, 1)] = scale * random_value(&seed);
+    }
+  }
+}
+
+// Writes the first size values of field, which is a whole field unless it is the coarse velocity grid
+static int write_values(FluidSim * fluid, cl_mem mem, const double * field, int size)
+{
+  cl_float values[TEST_BUFFER_SIZE];
+  for (int i = 0; i < size; i++)
+  {
+    values[i] = field[i];
+  }
+
+  fluid->err = clEnqueueWriteBuffer(fluid->command_queue, mem, CL_TRUE, 0, size * sizeof(cl_float), values, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to write to buffer");
+  return fluid->status == CL_SUCCESS;
+}
+
+static int read_values(FluidSim * fluid, cl_mem mem, double * field, int size)
+{
+  fluid->err = clFinish(fluid->command_queue);
+  fluid->err |= clFinish(fluid->density_queue);
+  check_fluid_error(fluid, "Unable to finish queue");
+
+  cl_float values[TEST_BUFFER_SIZE];
+  fluid->err = clEnqueueReadBuffer(fluid->command_queue, mem, CL_TRUE, 0, size * sizeof(cl_float), values, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to read buffer");
+
+  for (int i = 0; i < size; i++)
+  {
+    field[i] = values[i];
+  }
+  return fluid->status == CL_SUCCESS;
+}
+
+static int write_field(FluidSim * fluid, cl_mem mem, const double * field)
+{
+  return write_values(fluid, mem, field, TEST_BUFFER_SIZE);
+}
+
+static int read_field(FluidSim * fluid, cl_mem mem, double * field)
+{
+  return read_values(fluid, mem, field, TEST_BUFFER_SIZE);
+}
+
+static int is_corner(int x, int y)
+{
+  return (x == 0 || x == TEST_SIZE + 1) && (y == 0 || y == TEST_SIZE + 1);
+}
+
+// The corners of set_bnd read the edges written in the same launch, so they are only compared when the edges were already settled
+static int compare_fields(const char * name, const double * result, const double * expected, int channels, int first, int last, int has_corners, double tolerance)
+{
+  double max_expected = 1;
+  for (int i = 0; i < TEST_BUFFER_SIZE; i++)
+  {
+    max_expected = fmax(max_expected, fabs(expected[i]));
+  }
+
+  int num_wrong = 0;
+  for (int y = first; y <= last; y++)
+  {
+    for (int x = first; x <= last; x++)
+    {
+      for (int c = 0; c < 2; c++)
+      {
+        if (!(channels & (1 << c)) || (!has_corners && is_corner(x, y)))
+        {
+          continue;
+        }
+
+        double error = fabs(result[CELL(x, y, c)] - expected[CELL(x, y, c)]);
+        if (error > tolerance * max_expected)
+        {
+          if (num_wrong == 0)
+          {
+            fprintf(stderr, "%s: cell (%d, %d) channel %d is %g, expected %g\n", name, x, y, c, result[CELL(x, y, c)], expected[CELL(x, y, c)]);
+          }
+          num_wrong++;
+        }
+      }
+    }
+  }
+
+  if (num_wrong)
+  {
+    fprintf(stderr, "%s: %d values out of tolerance\n", name, num_wrong);
+  }
+  return num_wrong == 0;
+}
+
+// The scalar reference of each kernel, in double precision on the host
+
+static void reference_add_source(double * dest, const double * src, double dt)
+{
+  for (int i = 0; i < TEST_BUFFER_SIZE; i++)
+  {
+    dest[i] += dt * src[i];
+  }
+}
+
+// Fills the wall cell from the interior cell next to it, or from the one at the opposite edge of a periodic edge.
+// normal is the channel a wall reflects the velocity in, and open edges hold the pressure at zero.
+static void reference_set_bnd_edge(double * dest, int wall, int inside, int opposite, int normal, int vec_type, BOUNDARY boundary)
+{
+  double sign = (boundary == BOUNDARY_WALL && vec_type == IS_VELOCITY) ? -1 : 1;
+  int from = (boundary == BOUNDARY_PERIODIC) ? opposite : inside;
+
+  dest[wall + normal] = sign * dest[from + normal];
+  dest[wall + 1 - normal] = dest[from + 1 - normal];
+  if (boundary == BOUNDARY_OUTFLOW && vec_type == IS_NONE)
+  {
+    dest[wall + 1] = 0;
+  }
+}
+
+static void reference_set_bnd_edges(double * dest, int vec_type, const BOUNDARY boundaries[NUM_EDGES])
+{
+  int n = TEST_SIZE;
+
+  for (int i = 1; i <= n; i++)
+  {
+    reference_set_bnd_edge(dest, CELL(0, i, 0), CELL(1, i, 0), CELL(n, i, 0), 0, vec_type, boundaries[EDGE_LEFT]);
+    reference_set_bnd_edge(dest, CELL(n + 1, i, 0), CELL(n, i, 0), CELL(1, i, 0), 0, vec_type, boundaries[EDGE_RIGHT]);
+    reference_set_bnd_edge(dest, CELL(i, 0, 0), CELL(i, 1, 0), CELL(i, n, 0), 1, vec_type, boundaries[EDGE_TOP]);
+    reference_set_bnd_edge(dest, CELL(i, n + 1, 0), CELL(i, n, 0), CELL(i, 1, 0), 1, vec_type, boundaries[EDGE_BOTTOM]);
+  }
+
+  // a corner averages the walls next to it, or repeats the wall past the far end of a periodic edge
+  int corners[2] = {0, n + 1};
+  for (int j = 0; j < 2; j++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      int x = corners[i];
+      int y = corners[j];
+      int inside_x = (x == 0) ? 1 : n;
+      int inside_y = (y == 0) ? 1 : n;
+
+      int row = CELL(inside_x, y, 0);
+      int column = CELL(x, inside_y, 0);
+      if (boundaries[EDGE_LEFT] == BOUNDARY_PERIODIC)
+      {
+        row = column = CELL(n + 1 - inside_x, y, 0);
+      }
+      else if (boundaries[EDGE_TOP] == BOUNDARY_PERIODIC)
+      {
+        row = column = CELL(x, n + 1 - inside_y, 0);
+      }
+
+      for (int c = 0; c < 2; c++)
+      {
+        dest[CELL(x, y, c)] = 0.5 * (dest[row + c] + dest[column + c]);
+      }
+    }
+  }
+}
+
+static void reference_set_bnd(double * dest, int vec_type)
+{
+  const BOUNDARY walls[NUM_EDGES] = {BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL};
+  reference_set_bnd_edges(dest, vec_type, walls);
+}
+
+// Gauss-Seidel until nothing changes, the kernel converges to the same fixed point in any order
+static void reference_diffuse(double * dest, const double * src, double a, int vec_type)
+{
+  double max_change = 1;
+  for (int sweep = 0; sweep < 100 * CONVERGED_SWEEPS && max_change > 1e-14; sweep++)
+  {
+    max_change = 0;
+    for (int y = 1; y <= TEST_SIZE; y++)
+    {
+      for (int x = 1; x <= TEST_SIZE; x++)
+      {
+        for (int c = 0; c < 2; c++)
+        {
+          double neighbours = dest[CELL(x - 1, y, c)] + dest[CELL(x + 1, y, c)] + dest[CELL(x, y - 1, c)] + dest[CELL(x, y + 1, c)];
+          double value = (src[CELL(x, y, c)] + a * neighbours) / (1 + 4 * a);
+          max_change = fmax(max_change, fabs(value - dest[CELL(x, y, c)]));
+          dest[CELL(x, y, c)] = value;
+        }
+      }
+    }
+    reference_set_bnd(dest, vec_type);
+  }
+}
+
+// Brings a position along one axis of an n cell grid back onto the interior, wrapping around if the axis is periodic
+static double reference_inside(double pos, int n, int wraps)
+{
+  return wraps ? pos - n * floor((pos - 0.5) / n) : fmin(fmax(pos, 0.5), n + 0.5);
+}
+
+// dt is the one the kernel takes, already scaled by the grid size and negated
+static void reference_advect_edges(double * dest, const double * src, const double * vel, double dt, int vec_type, const BOUNDARY boundaries[NUM_EDGES])
+{
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      double pos_x = reference_inside(x + dt * vel[CELL(x, y, 0)], TEST_SIZE, boundaries[EDGE_LEFT] == BOUNDARY_PERIODIC);
+      double pos_y = reference_inside(y + dt * vel[CELL(x, y, 1)], TEST_SIZE, boundaries[EDGE_TOP] == BOUNDARY_PERIODIC);
+
+      int left = (int)pos_x;
+      int up = (int)pos_y;
+
+      double s1 = pos_x - left;
+      double s0 = 1 - s1;
+      double t1 = pos_y - up;
+      double t0 = 1 - t1;
+
+      for (int c = 0; c < 2; c++)
+      {
+        dest[CELL(x, y, c)] = s0 * (t0 * src[CELL(left, up, c)] + t1 * src[CELL(left, up + 1, c)])
+                            + s1 * (t0 * src[CELL(left + 1, up, c)] + t1 * src[CELL(left + 1, up + 1, c)]);
+      }
+    }
+  }
+  reference_set_bnd_edges(dest, vec_type, boundaries);
+}
+
+static void reference_advect(double * dest, const double * src, const double * vel, double dt, int vec_type)
+{
+  const BOUNDARY walls[NUM_EDGES] = {BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL};
+  reference_advect_edges(dest, src, vel, dt, vec_type, walls);
+}
+
+// The divergence goes in channel 0 of tmp and the pressure in channel 1, zero to start with
+static void reference_project_a(double * tmp, const double * vel)
+{
+  double h = 0.5 / TEST_SIZE;
+
+  memset(tmp, 0, TEST_BUFFER_SIZE * sizeof(double));
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      tmp[CELL(x, y, 0)] = h * (vel[CELL(x - 1, y, 0)] - vel[CELL(x + 1, y, 0)] + vel[CELL(x, y - 1, 1)] - vel[CELL(x, y + 1, 1)]);
+    }
+  }
+}
+
+// The pressure is only fixed up to a constant, so project_B is checked by how well its result solves the relaxation
+static double pressure_residual(const double * tmp, int x, int y)
+{
+  double neighbours = tmp[CELL(x - 1, y, 1)] + tmp[CELL(x + 1, y, 1)] + tmp[CELL(x, y - 1, 1)] + tmp[CELL(x, y + 1, 1)];
+  return fabs(tmp[CELL(x, y, 1)] - 0.25 * (tmp[CELL(x, y, 0)] + neighbours));
+}
+
+static void reference_project_b(double * tmp)
+{
+  double max_change = 1;
+  for (int sweep = 0; sweep < 100 * CONVERGED_SWEEPS && max_change > 1e-14; sweep++)
+  {
+    max_change = 0;
+    for (int y = 1; y <= TEST_SIZE; y++)
+    {
+      for (int x = 1; x <= TEST_SIZE; x++)
+      {
+        double neighbours = tmp[CELL(x - 1, y, 1)] + tmp[CELL(x + 1, y, 1)] + tmp[CELL(x, y - 1, 1)] + tmp[CELL(x, y + 1, 1)];
+        double value = 0.25 * (tmp[CELL(x, y, 0)] + neighbours);
+        max_change = fmax(max_change, fabs(value - tmp[CELL(x, y, 1)]));
+        tmp[CELL(x, y, 1)] = value;
+      }
+    }
+    reference_set_bnd(tmp, IS_NONE);
+  }
+}
+
+// Subtracts the gradient of the pressure in tmp, the walls mirror the cell next to them and the corners are zero
+static void reference_project_c(double * vel, const double * tmp)
+{
+  double h = 0.5 * TEST_SIZE;
+  int n = TEST_SIZE;
+
+  for (int y = 1; y <= n; y++)
+  {
+    for (int x = 1; x <= n; x++)
+    {
+      vel[CELL(x, y, 0)] += h * (tmp[CELL(x - 1, y, 1)] - tmp[CELL(x + 1, y, 1)]);
+      vel[CELL(x, y, 1)] += h * (tmp[CELL(x, y - 1, 1)] - tmp[CELL(x, y + 1, 1)]);
+    }
+  }
+
+  for (int i = 1; i <= n; i++)
+  {
+    vel[CELL(0, i, 0)] = -vel[CELL(1, i, 0)];
+    vel[CELL(0, i, 1)] = vel[CELL(1, i, 1)];
+    vel[CELL(n + 1, i, 0)] = -vel[CELL(n, i, 0)];
+    vel[CELL(n + 1, i, 1)] = vel[CELL(n, i, 1)];
+    vel[CELL(i, 0, 0)] = vel[CELL(i, 1, 0)];
+    vel[CELL(i, 0, 1)] = -vel[CELL(i, 1, 1)];
+    vel[CELL(i, n + 1, 0)] = vel[CELL(i, n, 0)];
+    vel[CELL(i, n + 1, 1)] = -vel[CELL(i, n, 1)];
+  }
+  for (int c = 0; c < 2; c++)
+  {
+    vel[CELL(0, 0, c)] = 0;
+    vel[CELL(0, n + 1, c)] = 0;
+    vel[CELL(n + 1, 0, c)] = 0;
+    vel[CELL(n + 1, n + 1, c)] = 0;
+  }
+}
+
+static void reference_project(double * vel, double * tmp)
+{
+  reference_project_a(tmp, vel);
+  reference_project_b(tmp);
+  reference_project_c(vel, tmp);
+}
+
+static void reference_add_event_sources(double * dest, const SourceEventList * events, int vec_type, double dt)
+{
+  int channel = !(vec_type == IS_A_DENSITY || vec_type == IS_U_VELOCITY);
+
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      double result = 0;
+      for (int i = 0; i < events->num_events; i++)
+      {
+        int delta_x = x - events->x[i];
+        int delta_y = y - events->y[i];
+        int dist_sqrd = fmax(delta_x * delta_x + delta_y * delta_y, 1);
+
+        if (dist_sqrd < events->max_radius_sqrd[i])
+        {
+          result += events->strength[i] / sqrt(dist_sqrd);
+        }
+      }
+      dest[CELL(x, y, channel)] += dt * result;
+    }
+  }
+}
+
+// The tests, each returns 1 if the kernel matched the reference
+
+static int test_add_source(FluidSim * fluid)
+{
+  double dest[TEST_BUFFER_SIZE], src[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+  random_field(dest, 1, 1);
+  random_field(src, 2, 10);
+
+  if (!write_field(fluid, fluid->density_mem[CUR], dest) || !write_field(fluid, fluid->density_mem[PREV], src))
+  {
+    return 0;
+  }
+  add_source(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], 0.1f);
+  if (!read_field(fluid, fluid->density_mem[CUR], result))
+  {
+    return 0;
+  }
+
+  reference_add_source(dest, src, 0.1);
+  return compare_fields("add_source", result, dest, 0b11, 0, TEST_SIZE + 1, 1, TOLERANCE);
+}
+
+static int test_set_bnd(FluidSim * fluid)
+{
+  VEC_TYPE vec_types[] = {IS_DENSITY, IS_VELOCITY, IS_NONE};
+  const char * names[] = {"set_bnd(IS_DENSITY)", "set_bnd(IS_VELOCITY)", "set_bnd(IS_NONE)"};
+
+  int is_ok = 1;
+  for (int i = 0; i < 3; i++)
+  {
+    double field[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+    random_field(field, 3 + i, 1);
+
+    if (!write_field(fluid, fluid->density_mem[CUR], field))
+    {
+      return 0;
+    }
+    // the second launch sees the edges the first one wrote, so its corners are settled
+    set_bnd(fluid, &fluid->density_mem[CUR], vec_types[i]);
+    set_bnd(fluid, &fluid->density_mem[CUR], vec_types[i]);
+    if (!read_field(fluid, fluid->density_mem[CUR], result))
+    {
+      return 0;
+    }
+
+    reference_set_bnd(field, vec_types[i]);
+    is_ok &= compare_fields(names[i], result, field, 0b11, 0, TEST_SIZE + 1, 1, TOLERANCE);
+  }
+  return is_ok;
+}
+
+// Open edges left and right with periodic ones top and bottom, then every edge periodic
+static int test_boundaries(FluidSim * fluid)
+{
+  const BOUNDARY modes[2][NUM_EDGES] = {
+    {BOUNDARY_OUTFLOW, BOUNDARY_OUTFLOW, BOUNDARY_PERIODIC, BOUNDARY_PERIODIC},
+    {BOUNDARY_PERIODIC, BOUNDARY_PERIODIC, BOUNDARY_PERIODIC, BOUNDARY_PERIODIC},
+  };
+  VEC_TYPE vec_types[] = {IS_DENSITY, IS_VELOCITY, IS_NONE};
+  const char * names[] = {"boundaries(IS_DENSITY)", "boundaries(IS_VELOCITY)", "boundaries(IS_NONE)"};
+
+  // a periodic edge needs the one across from it to be periodic too
+  if (set_boundaries(fluid, BOUNDARY_PERIODIC, BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL) != CL_INVALID_VALUE)
+  {
+    fprintf(stderr, "boundaries: a lone periodic edge was accepted\n");
+    return 0;
+  }
+
+  int is_ok = 1;
+  for (int m = 0; m < 2; m++)
+  {
+    if (set_boundaries(fluid, modes[m][EDGE_LEFT], modes[m][EDGE_RIGHT], modes[m][EDGE_TOP], modes[m][EDGE_BOTTOM]) != CL_SUCCESS)
+    {
+      return 0;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+      double field[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+      random_field(field, 20 + 3 * m + i, 1);
+
+      if (!write_field(fluid, fluid->density_mem[CUR], field))
+      {
+        return 0;
+      }
+      set_bnd(fluid, &fluid->density_mem[CUR], vec_types[i]);
+      set_bnd(fluid, &fluid->density_mem[CUR], vec_types[i]);
+      if (!read_field(fluid, fluid->density_mem[CUR], result))
+      {
+        return 0;
+      }
+
+      reference_set_bnd_edges(field, vec_types[i], modes[m]);
+      is_ok &= compare_fields(names[i], result, field, 0b11, 0, TEST_SIZE + 1, 1, TOLERANCE);
+    }
+  }
+  return is_ok;
+}
+
+static int test_diffuse(FluidSim * fluid)
+{
+  VEC_TYPE vec_types[] = {IS_DENSITY, IS_VELOCITY};
+  const char * names[] = {"diffuse(IS_DENSITY)", "diffuse(IS_VELOCITY)"};
+  float a = 1;
+
+  set_relaxation(fluid, CONVERGED_SWEEPS, CONVERGED_SWEEPS, 0, 0);
+
+  int is_ok = 1;
+  for (int i = 0; i < 2; i++)
+  {
+    double dest[TEST_BUFFER_SIZE], src[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+    random_field(src, 5 + i, 1);
+    memcpy(dest, src, sizeof(dest));
+
+    if (!write_field(fluid, fluid->density_mem[CUR], dest) || !write_field(fluid, fluid->density_mem[PREV], src))
+    {
+      return 0;
+    }
+    diffuse(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], a, vec_types[i]);
+    if (!read_field(fluid, fluid->density_mem[CUR], result))
+    {
+      return 0;
+    }
+
+    reference_diffuse(dest, src, a, vec_types[i]);
+    is_ok &= compare_fields(names[i], result, dest, 0b11, 0, TEST_SIZE + 1, 0, TOLERANCE);
+  }
+  return is_ok;
+}
+
+static int test_advect(FluidSim * fluid)
+{
+  VEC_TYPE vec_types[] = {IS_DENSITY, IS_VELOCITY};
+  const char * names[] = {"advect(IS_DENSITY)", "advect(IS_VELOCITY)"};
+  float dt = 0.1f;
+
+  int is_ok = 1;
+  for (int i = 0; i < 2; i++)
+  {
+    double src[TEST_BUFFER_SIZE], vel[TEST_BUFFER_SIZE], expected[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+    random_field(src, 7 + i, 1);
+    reference_set_bnd(src, vec_types[i]);
+    random_field(vel, 9 + i, 1);
+
+    if (!write_field(fluid, fluid->density_mem[PREV], src) || !write_field(fluid, fluid->velocity_mem[CUR], vel))
+    {
+      return 0;
+    }
+    advect(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], &fluid->velocity_mem[CUR], dt, vec_types[i], ADVECT_SEMI_LAGRANGIAN);
+    if (!read_field(fluid, fluid->density_mem[CUR], result))
+    {
+      return 0;
+    }
+
+    reference_advect(expected, src, vel, -dt * TEST_SIZE, vec_types[i]);
+    is_ok &= compare_fields(names[i], result, expected, 0b11, 0, TEST_SIZE + 1, 0, TOLERANCE);
+  }
+  return is_ok;
+}
+
+// Advects across periodic edges along one axis, with walls along the other, from velocities that carry most cells over an edge
+static int test_wrapped_advect(FluidSim * fluid)
+{
+  const BOUNDARY modes[2][NUM_EDGES] = {
+    {BOUNDARY_PERIODIC, BOUNDARY_PERIODIC, BOUNDARY_WALL, BOUNDARY_WALL},
+    {BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_PERIODIC, BOUNDARY_PERIODIC},
+  };
+  VEC_TYPE vec_types[] = {IS_DENSITY, IS_VELOCITY};
+  const char * names[2][2] = {
+    {"wrapped_advect(periodic x, IS_DENSITY)", "wrapped_advect(periodic x, IS_VELOCITY)"},
+    {"wrapped_advect(periodic y, IS_DENSITY)", "wrapped_advect(periodic y, IS_VELOCITY)"},
+  };
+  float dt = 0.1f;
+
+  int is_ok = 1;
+  for (int m = 0; m < 2; m++)
+  {
+    if (set_boundaries(fluid, modes[m][EDGE_LEFT], modes[m][EDGE_RIGHT], modes[m][EDGE_TOP], modes[m][EDGE_BOTTOM]) != CL_SUCCESS)
+    {
+      return 0;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+      double src[TEST_BUFFER_SIZE], vel[TEST_BUFFER_SIZE], expected[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+      random_field(src, 40 + 2 * m + i, 1);
+      reference_set_bnd_edges(src, vec_types[i], modes[m]);
+      random_field(vel, 44 + 2 * m + i, 8);
+
+      if (!write_field(fluid, fluid->density_mem[PREV], src) || !write_field(fluid, fluid->velocity_mem[CUR], vel))
+      {
+        return 0;
+      }
+      advect(fluid, &fluid->density_mem[CUR], &fluid->density_mem[PREV], &fluid->velocity_mem[CUR], dt, vec_types[i], ADVECT_SEMI_LAGRANGIAN);
+      if (!read_field(fluid, fluid->density_mem[CUR], result))
+      {
+        return 0;
+      }
+
+      reference_advect_edges(expected, src, vel, -dt * TEST_SIZE, vec_types[i], modes[m]);
+      is_ok &= compare_fields(names[m][i], result, expected, 0b11, 0, TEST_SIZE + 1, 0, TOLERANCE);
+    }
+  }
+  return is_ok;
+}
+
+// Runs project on a velocity field with walls and reads back the velocity and the pressure field
+static int run_project(FluidSim * fluid, double * vel, double * result_vel, double * result_tmp)
+{
+  random_field(vel, 11, 1);
+  reference_set_bnd(vel, IS_VELOCITY);
+
+  set_relaxation(fluid, CONVERGED_SWEEPS, CONVERGED_SWEEPS, 0, 0);
+
+  if (!write_field(fluid, fluid->velocity_mem[CUR], vel))
+  {
+    return 0;
+  }
+  project(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_mem[PREV], RELAX_PRESSURE);
+  return read_field(fluid, fluid->velocity_mem[CUR], result_vel) && read_field(fluid, fluid->velocity_mem[PREV], result_tmp);
+}
+
+static int test_project_a(FluidSim * fluid)
+{
+  double vel[TEST_BUFFER_SIZE], tmp[TEST_BUFFER_SIZE], result_vel[TEST_BUFFER_SIZE], result_tmp[TEST_BUFFER_SIZE];
+  if (!run_project(fluid, vel, result_vel, result_tmp))
+  {
+    return 0;
+  }
+
+  // the relaxation mirrors the divergence onto the walls, so only the interior is project_A's
+  reference_project_a(tmp, vel);
+  return compare_fields("project_A", result_tmp, tmp, 0b01, 1, TEST_SIZE, 1, TOLERANCE);
+}
+
+static int test_project_b(FluidSim * fluid)
+{
+  double vel[TEST_BUFFER_SIZE], tmp[TEST_BUFFER_SIZE], result_vel[TEST_BUFFER_SIZE], result_tmp[TEST_BUFFER_SIZE];
+  if (!run_project(fluid, vel, result_vel, result_tmp))
+  {
+    return 0;
+  }
+
+  reference_project_a(tmp, vel);
+  reference_project_b(tmp);
+
+  double max_pressure = 0;
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      max_pressure = fmax(max_pressure, fabs(tmp[CELL(x, y, 1)]));
+    }
+  }
+
+  int num_wrong = 0;
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      double residual = pressure_residual(result_tmp, x, y);
+      if (residual > TOLERANCE * fmax(max_pressure, 1e-3))
+      {
+        if (num_wrong == 0)
+        {
+          fprintf(stderr, "project_B: cell (%d, %d) is off the relaxation by %g\n", x, y, residual);
+        }
+        num_wrong++;
+      }
+    }
+  }
+
+  // the walls take the pressure of the cell next to them
+  double walls[TEST_BUFFER_SIZE];
+  memcpy(walls, result_tmp, sizeof(walls));
+  reference_set_bnd(walls, IS_NONE);
+  int is_ok = compare_fields("project_B walls", result_tmp, walls, 0b10, 0, TEST_SIZE + 1, 0, TOLERANCE);
+
+  if (num_wrong)
+  {
+    fprintf(stderr, "project_B: %d cells out of tolerance\n", num_wrong);
+  }
+  return is_ok && num_wrong == 0;
+}
+
+static int test_project_c(FluidSim * fluid)
+{
+  double vel[TEST_BUFFER_SIZE], result_vel[TEST_BUFFER_SIZE], result_tmp[TEST_BUFFER_SIZE];
+  if (!run_project(fluid, vel, result_vel, result_tmp))
+  {
+    return 0;
+  }
+
+  // from the pressure the device found, so only project_C is checked here
+  reference_project_c(vel, result_tmp);
+  return compare_fields("project_C", result_vel, vel, 0b11, 0, TEST_SIZE + 1, 1, TOLERANCE);
+}
+
+static int test_add_event_sources(FluidSim * fluid)
+{
+  VEC_TYPE vec_types[] = {IS_A_DENSITY, IS_B_DENSITY, IS_U_VELOCITY, IS_V_VELOCITY};
+  const char * names[] = {"add_event_sources(IS_A_DENSITY)", "add_event_sources(IS_B_DENSITY)", "add_event_sources(IS_U_VELOCITY)", "add_event_sources(IS_V_VELOCITY)"};
+  SourceEventList * lists[] = {&fluid->a_density_events, &fluid->b_density_events, &fluid->u_velocity_events, &fluid->v_velocity_events};
+  float dt = 0.1f;
+
+  int is_ok = 1;
+  for (int i = 0; i < 4; i++)
+  {
+    double dest[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+    random_field(dest, 13 + i, 1);
+
+    // one event in the middle and one reaching past a corner of the grid
+    enqueue_event(fluid, 0.5f, 0.5f, 1.f, 0.25f, vec_types[i]);
+    enqueue_event(fluid, 0.1f * i, 0.9f, -2.f, 0.4f, vec_types[i]);
+    SourceEventList events = *lists[i];
+
+    if (!write_field(fluid, fluid->density_mem[CUR], dest))
+    {
+      return 0;
+    }
+    add_event_sources(fluid, &fluid->density_mem[CUR], lists[i], vec_types[i], dt);
+    if (!read_field(fluid, fluid->density_mem[CUR], result))
+    {
+      return 0;
+    }
+
+    reference_add_event_sources(dest, &events, vec_types[i], dt);
+    is_ok &= compare_fields(names[i], result, dest, 0b11, 0, TEST_SIZE + 1, 1, TOLERANCE);
+  }
+  return is_ok;
+}
+
+// Bilinear velocity at pos, in cells like the particles
+static void reference_particle_velocity(const double * vel, const double pos[2], double result[2])
+{
+  double x = fmin(fmax(pos[0], 0.5), TEST_SIZE + 0.5);
+  double y = fmin(fmax(pos[1], 0.5), TEST_SIZE + 0.5);
+  int left = (int)x;
+  int up = (int)y;
+
+  double s1 = x - left;
+  double s0 = 1 - s1;
+  double t1 = y - up;
+  double t0 = 1 - t1;
+
+  for (int c = 0; c < 2; c++)
+  {
+    result[c] = s0 * (t0 * vel[CELL(left, up, c)] + t1 * vel[CELL(left, up + 1, c)]) + s1 * (t0 * vel[CELL(left + 1, up, c)] + t1 * vel[CELL(left + 1, up + 1, c)]);
+  }
+}
+
+// One midpoint step of dt_cells
+static void reference_advect_particle(const double * vel, double pos[2], double dt_cells)
+{
+  double k1[2], mid[2], k2[2];
+  reference_particle_velocity(vel, pos, k1);
+  mid[0] = pos[0] + 0.5 * dt_cells * k1[0];
+  mid[1] = pos[1] + 0.5 * dt_cells * k1[1];
+  reference_particle_velocity(vel, mid, k2);
+
+  pos[0] = fmin(fmax(pos[0] + dt_cells * k2[0], 0.5), TEST_SIZE + 0.5);
+  pos[1] = fmin(fmax(pos[1] + dt_cells * k2[1], 0.5), TEST_SIZE + 0.5);
+}
+
+static int particle_cell(const cl_float4 * particle)
+{
+  int x = fmin(fmax((int)(particle->s[0] + 0.5f), 1), TEST_SIZE);
+  int y = fmin(fmax((int)(particle->s[1] + 0.5f), 1), TEST_SIZE);
+  return (y - 1) * TEST_SIZE + x - 1;
+}
+
+// advect_particles and the sort, which has to drop the dead particles and order the rest by cell.
+// The last component of each particle is its index here, so the sorted particles can be found again.
+static int test_particles(FluidSim * fluid)
+{
+  float dt = 0.1f;
+
+  if (set_particles(fluid, TEST_PARTICLES, 0, 1, INTEGRATE_RK2) != CL_SUCCESS)
+  {
+    return 0;
+  }
+
+  double vel[TEST_BUFFER_SIZE];
+  random_field(vel, 21, 1);
+  reference_set_bnd(vel, IS_VELOCITY);
+
+  // every fourth particle has less time left than the step
+  cl_float4 particles[TEST_PARTICLES];
+  unsigned int seed = 23;
+  int num_live = 0;
+  for (int i = 0; i < TEST_PARTICLES; i++)
+  {
+    particles[i].s[0] = 0.5f + 0.5f * TEST_SIZE * (random_value(&seed) + 1);
+    particles[i].s[1] = 0.5f + 0.5f * TEST_SIZE * (random_value(&seed) + 1);
+    particles[i].s[2] = (i % 4 == 0) ? 0.5f * dt : 1;
+    particles[i].s[3] = i;
+    num_live += (i % 4 != 0);
+  }
+
+  cl_uint num_particles = TEST_PARTICLES;
+  fluid->err = clEnqueueWriteBuffer(fluid->command_queue, fluid->particle_mem[CUR], CL_TRUE, 0, sizeof(particles), particles, 0, NULL, NULL);
+  fluid->err |= clEnqueueWriteBuffer(fluid->command_queue, fluid->num_particles_mem, CL_TRUE, 0, sizeof(cl_uint), &num_particles, 0, NULL, NULL);
+  check_fluid_error(fluid, "Unable to write to buffer");
+  fluid->particle_bound = TEST_PARTICLES;
+  if (!write_field(fluid, fluid->velocity_mem[CUR], vel))
+  {
+    return 0;
+  }
+
+  advect_particles(fluid, dt);
+  sort_particles(fluid);
+
+  cl_float4 result[TEST_PARTICLES];
+  size_t num_result = 0;
+  if (read_particles(fluid, result, TEST_PARTICLES, &num_result) != CL_SUCCESS)
+  {
+    return 0;
+  }
+
+  if ((int)num_result != num_live)
+  {
+    fprintf(stderr, "particles: %zu live, expected %d\n", num_result, num_live);
+    return 0;
+  }
+
+  int is_seen[TEST_PARTICLES] = {0};
+  int num_wrong = 0;
+  for (size_t i = 0; i < num_result; i++)
+  {
+    int index = (int)result[i].s[3];
+    if (index < 0 || index >= TEST_PARTICLES || index % 4 == 0 || is_seen[index])
+    {
+      fprintf(stderr, "particles: slot %zu holds particle %d, which should not be there\n", i, index);
+      return 0;
+    }
+    is_seen[index] = 1;
+
+    if (i > 0 && particle_cell(&result[i]) < particle_cell(&result[i - 1]))
+    {
+      fprintf(stderr, "particles: slot %zu is in cell %d after cell %d\n", i, particle_cell(&result[i]), particle_cell(&result[i - 1]));
+      num_wrong++;
+    }
+
+    double pos[2] = {particles[index].s[0], particles[index].s[1]};
+    reference_advect_particle(vel, pos, dt * TEST_SIZE);
+    double error = fmax(fabs(result[i].s[0] - pos[0]), fabs(result[i].s[1] - pos[1]));
+    if (error > TOLERANCE * TEST_SIZE || fabs(result[i].s[2] - (1 - dt)) > TOLERANCE)
+    {
+      fprintf(stderr, "particles: particle %d is at (%g, %g) with %g s left, expected (%g, %g) with %g s\n",
+              index, result[i].s[0], result[i].s[1], result[i].s[2], pos[0], pos[1], 1 - dt);
+      num_wrong++;
+    }
+  }
+  return num_wrong == 0;
+}
+
+// A coordinate of the coarse velocity grid, past the walls it repeats the walls or wraps around if the axis is periodic
+static int reference_coarse_cell(int x, int wraps)
+{
+  if (wraps)
+  {
+    x = (x + 2 * COARSE_SIZE - 1) % COARSE_SIZE + 1;
+  }
+  return x < 0 ? 0 : (x > COARSE_SIZE + 1 ? COARSE_SIZE + 1 : x);
+}
+
+static double reference_coarse_velocity(const double * coarse, int x, int y, int c, const BOUNDARY boundaries[NUM_EDGES])
+{
+  x = reference_coarse_cell(x, boundaries[EDGE_LEFT] == BOUNDARY_PERIODIC);
+  y = reference_coarse_cell(y, boundaries[EDGE_TOP] == BOUNDARY_PERIODIC);
+  return coarse[COARSE_CELL(x, y, c)];
+}
+
+static void reference_catmull_rom_weights(double t, double weights[4])
+{
+  weights[0] = t * (-0.5 + t * (1 - 0.5 * t));
+  weights[1] = 1 + t * t * (-2.5 + 1.5 * t);
+  weights[2] = t * (0.5 + t * (2 - 1.5 * t));
+  weights[3] = t * t * (-0.5 + 0.5 * t);
+}
+
+static void reference_upsample_velocity(double * vel, const double * coarse, int bicubic, const BOUNDARY boundaries[NUM_EDGES])
+{
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      double pos_x = (x - 0.5) / 2 + 0.5;
+      double pos_y = (y - 0.5) / 2 + 0.5;
+      int left = (int)pos_x;
+      int up = (int)pos_y;
+      double s = pos_x - left;
+      double t = pos_y - up;
+
+      for (int c = 0; c < 2; c++)
+      {
+        double result = 0;
+        if (bicubic)
+        {
+          double s_w[4], t_w[4];
+          reference_catmull_rom_weights(s, s_w);
+          reference_catmull_rom_weights(t, t_w);
+          for (int j = 0; j < 4; j++)
+          {
+            for (int i = 0; i < 4; i++)
+            {
+              result += t_w[j] * s_w[i] * reference_coarse_velocity(coarse, left - 1 + i, up - 1 + j, c, boundaries);
+            }
+          }
+        }
+        else {
+          result = (1 - s) * ((1 - t) * reference_coarse_velocity(coarse, left, up, c, boundaries) + t * reference_coarse_velocity(coarse, left, up + 1, c, boundaries))
+                 + s * ((1 - t) * reference_coarse_velocity(coarse, left + 1, up, c, boundaries) + t * reference_coarse_velocity(coarse, left + 1, up + 1, c, boundaries));
+        }
+        vel[CELL(x, y, c)] = result;
+      }
+    }
+  }
+}
+
+// Averages the four cells under each coarse cell, into the same cell of a whole field so compare_fields can read it
+static void reference_downsample_density(double * coarse, const double * dens)
+{
+  memset(coarse, 0, TEST_BUFFER_SIZE * sizeof(double));
+  for (int y = 1; y <= COARSE_SIZE; y++)
+  {
+    for (int x = 1; x <= COARSE_SIZE; x++)
+    {
+      for (int c = 0; c < 2; c++)
+      {
+        double sum = 0;
+        for (int j = 0; j < 2; j++)
+        {
+          for (int i = 0; i < 2; i++)
+          {
+            sum += dens[CELL(2 * x - 1 + i, 2 * y - 1 + j, c)];
+          }
+        }
+        coarse[CELL(x, y, c)] = sum / 4;
+      }
+    }
+  }
+}
+
+// Runs with F_HALF_VELOCITY, on a coarse grid with random walls as well, so the stencils reading past them are checked too.
+// The bicubic stencil reads two cells past the edge, which wraps around when the edge is periodic.
+static int test_upsample_velocity(FluidSim * fluid)
+{
+  const BOUNDARY modes[2][NUM_EDGES] = {
+    {BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL},
+    {BOUNDARY_PERIODIC, BOUNDARY_PERIODIC, BOUNDARY_WALL, BOUNDARY_WALL},
+  };
+  UPSAMPLING upsamplings[] = {UPSAMPLE_BILINEAR, UPSAMPLE_BICUBIC};
+  const char * names[2][2] = {
+    {"upsample_velocity(bilinear)", "upsample_velocity(bicubic)"},
+    {"upsample_velocity(bilinear, periodic x)", "upsample_velocity(bicubic, periodic x)"},
+  };
+
+  if (!fluid->velocity_sim)
+  {
+    fprintf(stderr, "upsample_velocity: no coarse velocity grid\n");
+    return 0;
+  }
+
+  int is_ok = 1;
+  for (int m = 0; m < 2; m++)
+  {
+    if (set_boundaries(fluid, modes[m][EDGE_LEFT], modes[m][EDGE_RIGHT], modes[m][EDGE_TOP], modes[m][EDGE_BOTTOM]) != CL_SUCCESS)
+    {
+      return 0;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+      double coarse[COARSE_BUFFER_SIZE], expected[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+      unsigned int seed = 30 + 2 * m + i;
+      for (int j = 0; j < COARSE_BUFFER_SIZE; j++)
+      {
+        coarse[j] = random_value(&seed);
+      }
+
+      if (set_velocity_upsampling(fluid, upsamplings[i]) != CL_SUCCESS
+          || !write_values(fluid, fluid->velocity_sim->velocity_mem[CUR], coarse, COARSE_BUFFER_SIZE))
+      {
+        return 0;
+      }
+      upsample_velocity(fluid, &fluid->velocity_mem[CUR], &fluid->velocity_sim->velocity_mem[CUR]);
+      if (!read_field(fluid, fluid->velocity_mem[CUR], result))
+      {
+        return 0;
+      }
+
+      reference_upsample_velocity(expected, coarse, i, modes[m]);
+      is_ok &= compare_fields(names[m][i], result, expected, 0b11, 1, TEST_SIZE, 1, TOLERANCE);
+    }
+  }
+  return is_ok;
+}
+
+static int test_downsample_density(FluidSim * fluid)
+{
+  if (!fluid->velocity_sim)
+  {
+    fprintf(stderr, "downsample_density: no coarse velocity grid\n");
+    return 0;
+  }
+
+  double dens[TEST_BUFFER_SIZE], coarse[COARSE_BUFFER_SIZE], expected[TEST_BUFFER_SIZE], result[TEST_BUFFER_SIZE];
+  random_field(dens, 32, 1);
+
+  if (!write_field(fluid, fluid->density_mem[CUR], dens))
+  {
+    return 0;
+  }
+  downsample_density(fluid, &fluid->velocity_sim->density_mem[CUR], &fluid->density_mem[CUR]);
+  if (!read_values(fluid, fluid->velocity_sim->density_mem[CUR], coarse, COARSE_BUFFER_SIZE))
+  {
+    return 0;
+  }
+
+  memset(result, 0, sizeof(result));
+  for (int y = 1; y <= COARSE_SIZE; y++)
+  {
+    for (int x = 1; x <= COARSE_SIZE; x++)
+    {
+      result[CELL(x, y, 0)] = coarse[COARSE_CELL(x, y, 0)];
+      result[CELL(x, y, 1)] = coarse[COARSE_CELL(x, y, 1)];
+    }
+  }
+
+  reference_downsample_density(expected, dens);
+  return compare_fields("downsample_density", result, expected, 0b11, 1, COARSE_SIZE, 1, TOLERANCE);
+}
+
+static void add_frame_events(FluidSim * fluid, int frame)
+{
+  enqueue_event(fluid, 0.25f, 0.5f, 1.f, 0.2f, IS_A_DENSITY);
+  enqueue_event(fluid, 0.75f, 0.5f, 1.f, 0.2f, IS_B_DENSITY);
+  enqueue_event(fluid, 0.5f, 0.25f + 0.05f * frame, 2.f, 0.3f, IS_U_VELOCITY);
+  enqueue_event(fluid, 0.5f, 0.5f, -1.f, 0.3f, IS_V_VELOCITY);
+}
+
+// Mass of both densities and the kinetic energy, summed over the interior
+static void frame_checksums(const double * dens, const double * vel, double checksums[3])
+{
+  checksums[0] = checksums[1] = checksums[2] = 0;
+  for (int y = 1; y <= TEST_SIZE; y++)
+  {
+    for (int x = 1; x <= TEST_SIZE; x++)
+    {
+      checksums[0] += dens[CELL(x, y, 0)];
+      checksums[1] += dens[CELL(x, y, 1)];
+      checksums[2] += 0.5 * (vel[CELL(x, y, 0)] * vel[CELL(x, y, 0)] + vel[CELL(x, y, 1)] * vel[CELL(x, y, 1)]);
+    }
+  }
+}
+
+// Whole frames through the scheduler of simulate_next_frame, against the same steps on the reference
+static int test_frame(FluidSim * fluid)
+{
+  float dt = 1.f / 60;
+
+  set_relaxation(fluid, CONVERGED_SWEEPS, CONVERGED_SWEEPS, 0, 0);
+
+  double dens[TEST_BUFFER_SIZE] = {0}, vel[TEST_BUFFER_SIZE] = {0}, tmp[TEST_BUFFER_SIZE], prev[TEST_BUFFER_SIZE];
+  double result_dens[TEST_BUFFER_SIZE], result_vel[TEST_BUFFER_SIZE];
+
+  int is_ok = 1;
+  for (int frame = 0; frame < NUM_TEST_FRAMES && is_ok; frame++)
+  {
+    add_frame_events(fluid, frame);
+    SourceEventList events[] = {fluid->a_density_events, fluid->b_density_events, fluid->u_velocity_events, fluid->v_velocity_events};
+
+    if (simulate_next_frame(fluid, dt) != CL_SUCCESS
+        || !read_field(fluid, fluid->density_mem[CUR], result_dens) || !read_field(fluid, fluid->velocity_mem[CUR], result_vel))
+    {
+      return 0;
+    }
+
+    reference_add_event_sources(vel, &events[2], IS_U_VELOCITY, dt);
+    reference_add_event_sources(vel, &events[3], IS_V_VELOCITY, dt);
+    reference_add_event_sources(dens, &events[0], IS_A_DENSITY, dt);
+    reference_add_event_sources(dens, &events[1], IS_B_DENSITY, dt);
+
+    // the velocity step
+    memcpy(prev, vel, sizeof(prev));
+    reference_diffuse(vel, prev, dt * TEST_VISCOSITY * TEST_SIZE * TEST_SIZE, IS_VELOCITY);
+    reference_project(vel, tmp);
+    memcpy(prev, vel, sizeof(prev));
+    reference_advect(vel, prev, prev, -dt * TEST_SIZE, IS_VELOCITY);
+    reference_project(vel, tmp);
+
+    // the density step
+    memcpy(prev, dens, sizeof(prev));
+    reference_diffuse(prev, dens, dt * TEST_DIFFUSION * TEST_SIZE * TEST_SIZE, IS_DENSITY);
+    reference_advect(dens, prev, vel, -dt * TEST_SIZE, IS_DENSITY);
+
+    double checksums[3], expected[3];
+    frame_checksums(result_dens, result_vel, checksums);
+    frame_checksums(dens, vel, expected);
+    fprintf(stdout, "frame %d: density %.6f %.6f energy %.6f, expected %.6f %.6f %.6f\n",
+            frame, checksums[0], checksums[1], checksums[2], expected[0], expected[1], expected[2]);
+
+    for (int i = 0; i < 3; i++)
+    {
+      if (fabs(checksums[i] - expected[i]) > FRAME_TOLERANCE * fmax(fabs(expected[i]), 1))
+      {
+        fprintf(stderr, "frame %d: checksum %d is %g, expected %g\n", frame, i, checksums[i], expected[i]);
+        is_ok = 0;
+      }
+    }
+
+    is_ok &= compare_fields("frame density", result_dens, dens, 0b11, 1, TEST_SIZE, 1, FRAME_TOLERANCE);
+    is_ok &= compare_fields("frame velocity", result_vel, vel, 0b11, 1, TEST_SIZE, 1, FRAME_TOLERANCE);
+  }
+  return is_ok;
+}
+
+static const KernelTest kernel_tests[] = {
+  {"add_source", test_add_source},
+  {"set_bnd", test_set_bnd},
+  {"boundaries", test_boundaries},
+  {"diffuse", test_diffuse},
+  {"advect", test_advect},
+  {"wrapped_advect", test_wrapped_advect},
+  {"project_a", test_project_a},
+  {"project_b", test_project_b},
+  {"project_c", test_project_c},
+  {"add_event_sources", test_add_event_sources},
+  {"particles", test_particles},
+  {"upsample_velocity", test_upsample_velocity, F_HALF_VELOCITY},
+  {"downsample_density", test_downsample_density, F_HALF_VELOCITY},
+  {"frame", test_frame},
+};
+
+int main(int argc, char ** argv)
+{
+  FLAGS flags = 0;
+  int has_chosen_type = 0;
+
+  int ch;
+  while ((ch = getopt(argc, argv, "t:")) != -1)
+  {
+    switch (ch)
+    {
+      case 't':
+        if (strcmp(optarg, "CPU") == 0)
+        {
+          flags |= F_USE_CPU;
+          has_chosen_type = 1;
+        }
+        else if (strcmp(optarg, "GPU") == 0)
+        {
+          flags |= F_USE_GPU;
+          has_chosen_type = 1;
+        }
+        else {
+          fprintf(stderr, "Invalid device type.\n");
+          return 1;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (!has_chosen_type)
+  { // POCL on build machines
+    flags |= F_USE_CPU;
+  }
+
+  if (optind >= argc)
+  {
+    fprintf(stderr, "Usage: %s <test> [-t <CPU/GPU>]\n", argv[0]);
+    return 1;
+  }
+
+  const KernelTest * test = NULL;
+  for (size_t i = 0; i < sizeof(kernel_tests) / sizeof(kernel_tests[0]); i++)
+  {
+    if (strcmp(argv[optind], kernel_tests[i].name) == 0)
+    {
+      test = &kernel_tests[i];
+    }
+  }
+  if (!test)
+  {
+    fprintf(stderr, "Unknown test %s.\n", argv[optind]);
+    return 1;
+  }
+
+  cl_platform_id platform;
+  if (!choose_device(flags, &platform))
+  {
+    fprintf(stderr, "No OpenCL device, skipping %s\n", test->name);
+    return SKIP_TEST;
+  }
+
+  FluidContext * shared = create_fluid_context(NULL, 0, flags);
+  if (!shared)
+  {
+    return 1;
+  }
+
+  FluidSim * fluid = create_fluid_sim_in_context(shared, 0, TEST_SIZE, TEST_DIFFUSION, TEST_VISCOSITY, CONVERGED_SWEEPS, flags | test->flags);
+  if (!fluid)
+  {
+    destroy_fluid_context(shared);
+    return 1;
+  }
+
+  int is_ok = test->run(fluid) && get_fluid_status(fluid) == CL_SUCCESS;
+  fprintf(stdout, "%s: %s\n", test->name, is_ok ? "passed" : "FAILED");
+
+  destroy_fluid_sim(fluid);
+  destroy_fluid_context(shared);
+
+  return is_ok ? 0 : 1;
+}
@@ -10,10 +10,13 @@
 
 #include "sdl_window.h"
 #include "cl_fluid_sim.h"
+#include "fluid_scheduler.h"
 
 #define WINDOW_WIDTH 600
 #define WINDOW_HEIGHT 600
 #define MAX_FPS 30
+#define STEP_DT (1.f / 60)
+#define MAX_SUBSTEPS 4
 
 extern char * optarg;
 
@@ -92,6 +95,54 @@ void add_stream(FluidSim * fluid, float x, float y, float u, float v, float dens
   }
 }
 
+void add_round_obstacle(FluidSim * fluid, float x, float y, float radius)
+{
+  size_t n = fluid->sim_size;
+  unsigned char * mask = (unsigned char *)calloc(n * n, 1);
+
+  for (size_t j = 0; j < n; j++)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      float dx = (i + 0.5f) / n - x;
+      float dy = (j + 0.5f) / n - y;
+      mask[j * n + i] = (dx * dx + dy * dy < radius * radius);
+    }
+  }
+
+  set_obstacles(fluid, mask);
+  free(mask);
+}
+
+int parse_view_field(const char * str, VIEW_FIELD * field)
+{
+  if (strcmp(str, "COLORS") == 0)
+  {
+    *field = VIEW_DENSITY_COLORS;
+  }
+  else if (strcmp(str, "DENSITY") == 0)
+  {
+    *field = VIEW_DENSITY;
+  }
+  else if (strcmp(str, "SPEED") == 0)
+  {
+    *field = VIEW_SPEED;
+  }
+  else if (strcmp(str, "VORTICITY") == 0)
+  {
+    *field = VIEW_VORTICITY;
+  }
+  else if (strcmp(str, "DIVERGENCE") == 0)
+  {
+    *field = VIEW_DIVERGENCE;
+  }
+  else {
+    fprintf(stderr, "Invalid view field.\n");
+    return 0;
+  }
+  return 1;
+}
+
 int main(int argc, char ** argv)
 {
 
@@ -100,11 +151,18 @@ int main(int argc, char ** argv)
   float diffusion_rate = 0.00001f;
   int num_r_steps = 20;
   size_t sim_size = 1024;
+  ADVECTION_SCHEME density_advection = ADVECT_SEMI_LAGRANGIAN;
+  ADVECTION_SCHEME velocity_advection = ADVECT_SEMI_LAGRANGIAN;
+  float vorticity_confinement = 0;
+  float buoyancy = 0;
+  float obstacle_radius = 0;
+  VIEW_FIELD view_field = VIEW_DENSITY_COLORS;
+  size_t max_particles = 0;
 
   int has_chosen_type = 0;
 
   int ch;
-  while ((ch = getopt(argc, argv, "bpv:d:n:t:r:")) != -1)
+  while ((ch = getopt(argc, argv, "bpsv:d:n:t:r:a:u:w:g:o:f:m:")) != -1)
   {
     switch (ch)
     {
@@ -114,6 +172,9 @@ int main(int argc, char ** argv)
       case 'p':
         flags |= F_PROFILE;
         break;
+      case 's':
+        flags |= F_SPARSE;
+        break;
       case 'v':
         viscosity = (float)atof(optarg);
         break;
@@ -142,6 +203,38 @@ int main(int argc, char ** argv)
       case 'r':
         num_r_steps = atoi(optarg);
         break;
+      case 'a':
+        if (!parse_advection_scheme(optarg, &density_advection))
+        {
+          fprintf(stderr, "Invalid advection scheme.\n");
+          return 1;
+        }
+        break;
+      case 'u':
+        if (!parse_advection_scheme(optarg, &velocity_advection))
+        {
+          fprintf(stderr, "Invalid advection scheme.\n");
+          return 1;
+        }
+        break;
+      case 'w':
+        vorticity_confinement = (float)atof(optarg);
+        break;
+      case 'g':
+        buoyancy = (float)atof(optarg);
+        break;
+      case 'o':
+        obstacle_radius = (float)atof(optarg);
+        break;
+      case 'f':
+        if (!parse_view_field(optarg, &view_field))
+        {
+          return 1;
+        }
+        break;
+      case 'm':
+        max_particles = atol(optarg);
+        break;
       default:
         break;
     }
@@ -160,7 +253,7 @@ int main(int argc, char ** argv)
     return 2;
   }
 
-  my_fluid_sim = create_fluid_sim(my_window->window_texture, "../src/fluid_kernel.cl", sim_size, diffusion_rate, viscosity, num_r_steps, flags);
+  my_fluid_sim = create_fluid_sim(my_window->window_texture, NULL, sim_size, diffusion_rate, viscosity, num_r_steps, flags);
 
   if (!my_fluid_sim)
   {
@@ -168,28 +261,73 @@ int main(int argc, char ** argv)
     return 3;
   }
 
-  Uint32 prev_time = SDL_GetTicks();
+  set_advection_scheme(my_fluid_sim, IS_DENSITY, density_advection);
+  set_advection_scheme(my_fluid_sim, IS_VELOCITY, velocity_advection);
+  set_forces(my_fluid_sim, vorticity_confinement, buoyancy);
+  if (max_particles > 0)
+  {
+    set_particles(my_fluid_sim, max_particles, 64, 8, INTEGRATE_RK2);
+  }
 
-  while (my_window->is_running)
+  if (obstacle_radius > 0)
+  {
+    add_round_obstacle(my_fluid_sim, 0.5f, 0.5f, obstacle_radius);
+  }
+
+  // black body colours for the magnitudes, blue to white to red for the signed fields
+  const cl_float heat_lut[] = {0, 0, 0, 1, 1, 0, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1};
+  const cl_float signed_lut[] = {0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1};
+  if (view_field == VIEW_DENSITY || view_field == VIEW_SPEED)
+  {
+    set_view(my_fluid_sim, view_field, heat_lut, 4, 0, (view_field == VIEW_DENSITY) ? 2 : 1);
+  }
+  else if (view_field != VIEW_DENSITY_COLORS)
   {
-    float dt = (SDL_GetTicks() - prev_time) / 1000.f;
-    prev_time = SDL_GetTicks();
+    set_view(my_fluid_sim, view_field, signed_lut, 3, -10, 10);
+  }
 
-    add_stream(my_fluid_sim, 0.5f, 0.75f, 0.f, -1.f, 10.f, 5.f, IS_B_DENSITY);
-    add_stream(my_fluid_sim, 0.25f, 0.25f, 1.f, 1.f, 10.f, 5.f, IS_A_DENSITY);
-    add_stream(my_fluid_sim, 0.75f, 0.25f, -1.f, 1.f, 10.f, 5.f, IS_A_DENSITY);
-    //add_stream(my_fluid_sim, 0.5f, 0.5f, -1.f, 1.f, 1.f, 1.f, IS_A_DENSITY);
-    //add_stream(my_fluid_sim, 0.5f, 0.25f, 0.f, -1.f, 1.f, 2.f, IS_B_DENSITY);
+  // the simulation runs on its own thread, this one owns the GL context and only draws
+  FluidScheduler * scheduler = create_fluid_scheduler(my_fluid_sim, STEP_DT, MAX_SUBSTEPS, 1.f / MAX_FPS);
+  if (!scheduler)
+  {
+    fprintf(stderr, "Invalid timestep.\n");
+    exit(1);
+  }
+  start_fluid_scheduler(scheduler);
 
-    simulate_next_frame(my_fluid_sim, dt);
+  Uint32 prev_time = SDL_GetTicks();
 
-    render_window(my_window, 1.f / dt);
+  while (my_window->is_running)
+  {
+    lock_fluid_scheduler(scheduler);
+    poll_events(my_window, on_clicked, toggle_source_color, on_release);
+    unlock_fluid_scheduler(scheduler);
 
-    do {
-      poll_events(my_window, on_clicked, toggle_source_color, on_release);
-    } while (SDL_GetTicks() - prev_time < 1000.f / MAX_FPS);
+    if (wait_for_fluid_frame(scheduler, 1.f / MAX_FPS))
+    {
+      // the sources for the next frame
+      lock_fluid_scheduler(scheduler);
+      add_stream(my_fluid_sim, 0.5f, 0.75f, 0.f, -1.f, 10.f, 5.f, IS_B_DENSITY);
+      add_stream(my_fluid_sim, 0.25f, 0.25f, 1.f, 1.f, 10.f, 5.f, IS_A_DENSITY);
+      add_stream(my_fluid_sim, 0.75f, 0.25f, -1.f, 1.f, 10.f, 5.f, IS_A_DENSITY);
+      //add_stream(my_fluid_sim, 0.5f, 0.5f, -1.f, 1.f, 1.f, 1.f, IS_A_DENSITY);
+      //add_stream(my_fluid_sim, 0.5f, 0.25f, 0.f, -1.f, 1.f, 2.f, IS_B_DENSITY);
+      unlock_fluid_scheduler(scheduler);
+
+      Uint32 frame_ms = SDL_GetTicks() - prev_time;
+      prev_time += frame_ms;
+      render_window(my_window, 1000.f / ((frame_ms > 0) ? frame_ms : 1));
+    }
+
+    // sleep out the rest of the frame instead of polling for it
+    Uint32 spent_ms = SDL_GetTicks() - prev_time;
+    if (spent_ms < 1000 / MAX_FPS)
+    {
+      SDL_Delay(1000 / MAX_FPS - spent_ms);
+    }
   }
 
+  destroy_fluid_scheduler(scheduler);
   destroy_fluid_sim(my_fluid_sim);
   destroy_window(my_window);
 
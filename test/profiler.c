@@ -6,12 +6,22 @@
 #include <getopt.h>
 #include <time.h>
 #include <signal.h>
+#include <float.h>
 
 #include "cl_fluid_sim.h"
+#include "cl_fluid_sim_3d.h"
+#include "frame_encoder.h"
+#include "metrics_exporter.h"
 
 extern char * optarg;
 
+FluidContext * my_fluid_context;
 FluidSim * my_fluid_sim;
+// the fp64 run with every sweep that -c compares the measures against
+FluidSim * my_reference_sim;
+FluidSim3D * my_fluid_sim_3d;
+FrameEncoder * my_frame_encoder;
+MetricsExporter * my_metrics_exporter;
 
 volatile int is_running = 1;
 
@@ -20,20 +30,136 @@ void quit()
   is_running = 0;
 }
 
+int parse_encoder_format(const char * str, ENCODER_FORMAT * format)
+{
+  if (strcmp(str, "Y4M") == 0)
+  {
+    *format = ENCODE_Y4M;
+  }
+  else if (strcmp(str, "PNG") == 0)
+  {
+    *format = ENCODE_PNG;
+  }
+  else if (strcmp(str, "RAW") == 0)
+  {
+    *format = ENCODE_RAW;
+  }
+  else {
+    fprintf(stderr, "Invalid frame format.\n");
+    return 0;
+  }
+  return 1;
+}
+
+// WALL keeps the default walls, PERIODIC wraps every edge with F_PERIODIC, OUTFLOW opens every edge
+// and TUNNEL opens the left and right edges of a wind tunnel between walls
+int parse_boundaries(const char * str, FLAGS * flags, BOUNDARY boundaries[NUM_EDGES])
+{
+  BOUNDARY sides = BOUNDARY_WALL;
+  BOUNDARY ends = BOUNDARY_WALL;
+
+  if (strcmp(str, "PERIODIC") == 0)
+  {
+    *flags |= F_PERIODIC;
+    sides = ends = BOUNDARY_PERIODIC;
+  }
+  else if (strcmp(str, "OUTFLOW") == 0)
+  {
+    sides = ends = BOUNDARY_OUTFLOW;
+  }
+  else if (strcmp(str, "TUNNEL") == 0)
+  {
+    sides = BOUNDARY_OUTFLOW;
+  }
+  else if (strcmp(str, "WALL") != 0)
+  {
+    fprintf(stderr, "Invalid boundaries.\n");
+    return 0;
+  }
+
+  boundaries[EDGE_LEFT] = boundaries[EDGE_RIGHT] = sides;
+  boundaries[EDGE_TOP] = boundaries[EDGE_BOTTOM] = ends;
+  return 1;
+}
+
+// Prints the measures of the last frame, and how far they drifted from the reference if there is one
+int print_measures(FluidSim * fluid, FluidSim * reference)
+{
+  cl_double measures[NUM_MEASURES];
+  if (get_fluid_measures(fluid, measures) != CL_SUCCESS)
+  {
+    return 0;
+  }
+  fprintf(stdout, "mass %.6e energy %.6e max divergence %.6e\n", measures[MEASURE_MASS], measures[MEASURE_ENERGY], measures[MEASURE_DIVERGENCE]);
+
+  if (reference)
+  {
+    cl_double expected[NUM_MEASURES];
+    if (get_fluid_measures(reference, expected) != CL_SUCCESS)
+    {
+      return 0;
+    }
+    fprintf(stdout, "drift: mass %+.3e energy %+.3e max divergence %.6e in fp64\n",
+            (measures[MEASURE_MASS] - expected[MEASURE_MASS]) / fmax(expected[MEASURE_MASS], DBL_MIN),
+            (measures[MEASURE_ENERGY] - expected[MEASURE_ENERGY]) / fmax(expected[MEASURE_ENERGY], DBL_MIN),
+            expected[MEASURE_DIVERGENCE]);
+  }
+  return 1;
+}
+
 int main(int argc, char ** argv)
 {
   signal(SIGINT, quit);
 
   size_t sim_size = 512;
   int num_r_steps = 20;
+  int num_project_steps = -1;
+  float diffuse_tolerance = DEFAULT_DIFFUSE_TOLERANCE;
+  float project_tolerance = DEFAULT_PROJECT_TOLERANCE;
   FLAGS flags = F_PROFILE;
   int has_chosen_type = 0;
+  int is_3d = 0;
+  ADVECTION_SCHEME density_advection = ADVECT_SEMI_LAGRANGIAN;
+  ADVECTION_SCHEME velocity_advection = ADVECT_SEMI_LAGRANGIAN;
+  const char * output_path = NULL;
+  // the kernels built into the library unless -k names a file
+  const char * kernel_filename = NULL;
+  ENCODER_FORMAT output_format = ENCODE_Y4M;
+  int is_comparing = 0;
+  UPSAMPLING velocity_upsampling = UPSAMPLE_BILINEAR;
+  size_t max_particles = 0;
+  PARTICLE_INTEGRATOR particle_integrator = INTEGRATE_RK2;
+  BOUNDARY boundaries[NUM_EDGES] = {BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL, BOUNDARY_WALL};
+  const char * metrics_path = NULL;
+  METRICS_OUTPUT metrics_output = METRICS_FILE;
 
   int ch;
-  while ((ch = getopt(argc, argv, "n:t:r:")) != -1)
+  while ((ch = getopt(argc, argv, "sm3xlcin:t:r:q:e:a:u:o:f:k:g:p:P:b:M:U:")) != -1)
   {
     switch (ch)
     {
+      case 's':
+        flags |= F_SPARSE;
+        break;
+      case 'm':
+        flags |= F_SINGLE_DISPATCH;
+        break;
+      case '3':
+        is_3d = 1;
+        break;
+      case 'x':
+        flags |= F_FP64;
+        break;
+      case 'l':
+        flags |= F_MEASURE;
+        break;
+      case 'c':
+        flags |= F_MEASURE;
+        is_comparing = 1;
+        break;
+      case 'i':
+        velocity_upsampling = UPSAMPLE_BICUBIC;
+        break;
       case 'n':
         sim_size = atoi(optarg);
         break;
@@ -56,6 +182,84 @@ int main(int argc, char ** argv)
       case 'r':
         num_r_steps = atoi(optarg);
         break;
+      case 'q':
+        num_project_steps = atoi(optarg);
+        break;
+      case 'e':
+        diffuse_tolerance = project_tolerance = (float)atof(optarg);
+        break;
+      case 'a':
+        if (!parse_advection_scheme(optarg, &density_advection))
+        {
+          fprintf(stderr, "Invalid advection scheme.\n");
+          return 1;
+        }
+        break;
+      case 'u':
+        if (!parse_advection_scheme(optarg, &velocity_advection))
+        {
+          fprintf(stderr, "Invalid advection scheme.\n");
+          return 1;
+        }
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'f':
+        if (!parse_encoder_format(optarg, &output_format))
+        {
+          return 1;
+        }
+        break;
+      case 'k':
+        kernel_filename = optarg;
+        break;
+      case 'p':
+        max_particles = atol(optarg);
+        break;
+      case 'P':
+        if (strcmp(optarg, "RK2") == 0)
+        {
+          particle_integrator = INTEGRATE_RK2;
+        }
+        else if (strcmp(optarg, "RK4") == 0)
+        {
+          particle_integrator = INTEGRATE_RK4;
+        }
+        else {
+          fprintf(stderr, "Invalid particle integrator.\n");
+          return 1;
+        }
+        break;
+      case 'b':
+        if (!parse_boundaries(optarg, &flags, boundaries))
+        {
+          return 1;
+        }
+        break;
+      case 'M':
+        metrics_path = optarg;
+        metrics_output = METRICS_FILE;
+        break;
+      case 'U':
+        metrics_path = optarg;
+        metrics_output = METRICS_SOCKET;
+        break;
+      case 'g':
+        if (strcmp(optarg, "2") == 0)
+        {
+          flags |= F_HALF_VELOCITY;
+        }
+        else if (strcmp(optarg, "4") == 0)
+        {
+          flags |= F_QUARTER_VELOCITY;
+        }
+        else if (strcmp(optarg, "1") != 0)
+        {
+          fprintf(stderr, "Invalid velocity grid scale.\n");
+          return 1;
+        }
+        break;
       default:
         break;
     }
@@ -66,8 +270,79 @@ int main(int argc, char ** argv)
     flags |= F_USE_GPU;
   }
 
-  // zero is never a valid texture
-  my_fluid_sim = create_fluid_sim(0, "../src/fluid_kernel.cl", sim_size, 0.00001f, 0.00001f, num_r_steps, flags);
+  if (is_3d)
+  {
+    my_fluid_sim_3d = create_fluid_sim_3d(kernel_filename, sim_size, 0.00001f, 0.00001f, num_r_steps, flags);
+    if (!my_fluid_sim_3d)
+    {
+      return 1;
+    }
+  }
+  else {
+    my_fluid_context = create_fluid_context(kernel_filename, 0, flags);
+    if (!my_fluid_context)
+    {
+      return 1;
+    }
+
+    // zero is never a valid texture
+    my_fluid_sim = create_fluid_sim_in_context(my_fluid_context, 0, sim_size, 0.00001f, 0.00001f, num_r_steps, flags);
+    if (!my_fluid_sim)
+    {
+      destroy_fluid_context(my_fluid_context);
+      return 1;
+    }
+
+    set_advection_scheme(my_fluid_sim, IS_DENSITY, density_advection);
+    set_advection_scheme(my_fluid_sim, IS_VELOCITY, velocity_advection);
+    set_relaxation(my_fluid_sim, num_r_steps, (num_project_steps < 0) ? num_r_steps : num_project_steps, diffuse_tolerance, project_tolerance);
+    set_velocity_upsampling(my_fluid_sim, velocity_upsampling);
+    set_boundaries(my_fluid_sim, boundaries[EDGE_LEFT], boundaries[EDGE_RIGHT], boundaries[EDGE_TOP], boundaries[EDGE_BOTTOM]);
+    if (max_particles > 0)
+    {
+      // the two density events fill the buffer in about four seconds of frames
+      int particles_per_event = fmax(max_particles / 480, 1);
+      set_particles(my_fluid_sim, max_particles, particles_per_event, 4, particle_integrator);
+    }
+
+    if (is_comparing)
+    {
+      // on the full grid with doubles and no early exit, so only the fast paths differ
+      FLAGS reference_flags = (flags & (F_USE_CPU | F_USE_GPU | F_PERIODIC)) | F_FP64 | F_MEASURE;
+      my_reference_sim = create_fluid_sim_in_context(my_fluid_context, 0, sim_size, 0.00001f, 0.00001f, num_r_steps, reference_flags);
+      if (!my_reference_sim)
+      {
+        destroy_fluid_sim(my_fluid_sim);
+        destroy_fluid_context(my_fluid_context);
+        return 1;
+      }
+
+      set_advection_scheme(my_reference_sim, IS_DENSITY, density_advection);
+      set_advection_scheme(my_reference_sim, IS_VELOCITY, velocity_advection);
+      set_relaxation(my_reference_sim, num_r_steps, (num_project_steps < 0) ? num_r_steps : num_project_steps, 0, 0);
+      set_boundaries(my_reference_sim, boundaries[EDGE_LEFT], boundaries[EDGE_RIGHT], boundaries[EDGE_TOP], boundaries[EDGE_BOTTOM]);
+    }
+
+    if (output_path)
+    {
+      my_frame_encoder = create_frame_encoder(output_path, output_format, sim_size, sim_size, 60);
+      if (!my_frame_encoder)
+      {
+        return 1;
+      }
+      set_frame_encoder(my_fluid_sim, my_frame_encoder);
+    }
+
+    if (metrics_path)
+    {
+      my_metrics_exporter = create_metrics_exporter(metrics_path, metrics_output, 1);
+      if (!my_metrics_exporter)
+      {
+        return 1;
+      }
+      set_metrics_exporter(my_fluid_sim, my_metrics_exporter);
+    }
+  }
 
 #ifdef __APPLE__
   struct timespec start, end;
@@ -85,15 +360,73 @@ int main(int argc, char ** argv)
     clock_gettime(CLOCK_REALTIME, &start);
 #endif
 
-    enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_A_DENSITY);
-    enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_B_DENSITY);
-    enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_U_VELOCITY);
-    enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_V_VELOCITY);
+    if (is_3d)
+    {
+      enqueue_event_3d(my_fluid_sim_3d, 0.5, 0.5, 0.5, 1, 1.f, IS_DENSITY);
+      enqueue_event_3d(my_fluid_sim_3d, 0.5, 0.5, 0.5, 1, 1.f, IS_U_VELOCITY);
+      enqueue_event_3d(my_fluid_sim_3d, 0.5, 0.5, 0.5, 1, 1.f, IS_V_VELOCITY);
+      enqueue_event_3d(my_fluid_sim_3d, 0.5, 0.5, 0.5, 1, 1.f, IS_W_VELOCITY);
+
+      simulate_next_frame_3d(my_fluid_sim_3d, seconds);
+    }
+    else {
+      enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_A_DENSITY);
+      enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_B_DENSITY);
+      enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_U_VELOCITY);
+      enqueue_event(my_fluid_sim, 0.5, 0.5, 1, 1.f, IS_V_VELOCITY);
+
+      if (simulate_next_frame(my_fluid_sim, seconds) != CL_SUCCESS)
+      {
+        is_running = 0;
+      }
+
+      if (my_reference_sim)
+      {
+        enqueue_event(my_reference_sim, 0.5, 0.5, 1, 1.f, IS_A_DENSITY);
+        enqueue_event(my_reference_sim, 0.5, 0.5, 1, 1.f, IS_B_DENSITY);
+        enqueue_event(my_reference_sim, 0.5, 0.5, 1, 1.f, IS_U_VELOCITY);
+        enqueue_event(my_reference_sim, 0.5, 0.5, 1, 1.f, IS_V_VELOCITY);
 
-    simulate_next_frame(my_fluid_sim, seconds);
+        if (simulate_next_frame(my_reference_sim, seconds) != CL_SUCCESS)
+        {
+          is_running = 0;
+        }
+      }
+
+      if (is_running && (flags & F_MEASURE) && !print_measures(my_fluid_sim, my_reference_sim))
+      {
+        is_running = 0;
+      }
+    }
   }
 
-  destroy_fluid_sim(my_fluid_sim);
+  if (is_3d)
+  {
+    destroy_fluid_sim_3d(my_fluid_sim_3d);
+  }
+  else {
+    destroy_fluid_sim(my_fluid_sim);
+    if (my_reference_sim)
+    {
+      destroy_fluid_sim(my_reference_sim);
+    }
+
+    if (my_frame_encoder)
+    {
+      // waits for the frames still being encoded
+      if (!destroy_frame_encoder(my_frame_encoder))
+      {
+        fprintf(stderr, "Not every frame could be written to %s\n", output_path);
+      }
+    }
+    if (my_metrics_exporter)
+    {
+      destroy_metrics_exporter(my_metrics_exporter);
+    }
+
+    print_buffer_pool_stats(my_fluid_context);
+    destroy_fluid_context(my_fluid_context);
+  }
 
   return 0;
 }
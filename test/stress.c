@@ -0,0 +1,277 @@
+/*
+ * Runs many simulations on a pool of threads, one set of queues per simulation,
+ * and prints how the frames simulated per second scale with the number of threads.
+ * With -d the same threads also run spread over one context per NUMA domain of the device.
+ */
+
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cl_fluid_sim.h"
+
+extern char * optarg;
+
+typedef struct stress_thread_t
+{
+  FluidSim ** sims;
+  int num_sims;
+  int num_frames;
+  pthread_barrier_t * start;
+  pthread_t thread;
+  cl_int status;
+} StressThread;
+
+static double now_seconds(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void * run_stress_thread(void * arg)
+{
+  StressThread * stress = (StressThread *)arg;
+
+  pthread_barrier_wait(stress->start);
+
+  stress->status = CL_SUCCESS;
+  for (int frame = 0; frame < stress->num_frames && stress->status == CL_SUCCESS; frame++)
+  {
+    for (int i = 0; i < stress->num_sims && stress->status == CL_SUCCESS; i++)
+    {
+      FluidSim * fluid = stress->sims[i];
+
+      enqueue_event(fluid, 0.5, 0.5, 1, 1.f, IS_A_DENSITY);
+      enqueue_event(fluid, 0.5, 0.5, 1, 1.f, IS_U_VELOCITY);
+      enqueue_event(fluid, 0.5, 0.5, 1, 1.f, IS_V_VELOCITY);
+
+      stress->status = simulate_next_frame(fluid, 1.f / 60);
+    }
+  }
+
+  // the frames only count once the device has run them
+  for (int i = 0; i < stress->num_sims; i++)
+  {
+    clFinish(stress->sims[i]->command_queue);
+    clFinish(stress->sims[i]->density_queue);
+  }
+
+  return NULL;
+}
+
+// Returns the frames simulated per second with num_threads threads, or 0 if a simulation failed.
+// Thread t creates its simulations in contexts[t % num_contexts].
+static double run_stress(FluidContext ** contexts, int num_contexts, int num_threads, int sims_per_thread, int num_frames, size_t sim_size, int num_r_steps, FLAGS flags)
+{
+  StressThread * threads = (StressThread *)calloc(num_threads, sizeof(StressThread));
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, num_threads + 1);
+
+  int is_created = 1;
+  for (int t = 0; t < num_threads; t++)
+  {
+    threads[t].sims = (FluidSim **)calloc(sims_per_thread, sizeof(FluidSim *));
+    threads[t].num_sims = sims_per_thread;
+    threads[t].num_frames = num_frames;
+    threads[t].start = &start;
+
+    for (int i = 0; i < sims_per_thread; i++)
+    {
+      threads[t].sims[i] = create_fluid_sim_in_context(contexts[t % num_contexts], 0, sim_size, 0.00001f, 0.00001f, num_r_steps, flags | F_OWN_QUEUES);
+      is_created &= (threads[t].sims[i] != NULL);
+    }
+  }
+
+  double frames_per_second = 0;
+  if (is_created)
+  {
+    for (int t = 0; t < num_threads; t++)
+    {
+      pthread_create(&threads[t].thread, NULL, run_stress_thread, &threads[t]);
+    }
+
+    pthread_barrier_wait(&start);
+    double start_time = now_seconds();
+
+    cl_int status = CL_SUCCESS;
+    for (int t = 0; t < num_threads; t++)
+    {
+      pthread_join(threads[t].thread, NULL);
+      if (status == CL_SUCCESS)
+      {
+        status = threads[t].status;
+      }
+    }
+
+    double seconds = now_seconds() - start_time;
+    if (status == CL_SUCCESS)
+    {
+      frames_per_second = (double)num_threads * sims_per_thread * num_frames / seconds;
+    }
+    else {
+      fprintf(stderr, "Simulation failed: %d\n", (int)status);
+    }
+  }
+
+  for (int t = 0; t < num_threads; t++)
+  {
+    for (int i = 0; i < sims_per_thread; i++)
+    {
+      if (threads[t].sims[i])
+      {
+        destroy_fluid_sim(threads[t].sims[i]);
+      }
+    }
+    free(threads[t].sims);
+  }
+  pthread_barrier_destroy(&start);
+  free(threads);
+
+  return frames_per_second;
+}
+
+int main(int argc, char ** argv)
+{
+  size_t sim_size = 128;
+  int num_r_steps = 20;
+  int max_threads = 8;
+  int sims_per_thread = 1;
+  int num_frames = 200;
+  FLAGS flags = 0;
+  int has_chosen_type = 0;
+  int use_domains = 0;
+
+  int ch;
+  while ((ch = getopt(argc, argv, "dn:t:r:j:p:f:")) != -1)
+  {
+    switch (ch)
+    {
+      case 'd':
+        use_domains = 1;
+        break;
+      case 'n':
+        sim_size = atoi(optarg);
+        break;
+      case 't':
+        if (strcmp(optarg, "CPU") == 0)
+        {
+          flags |= F_USE_CPU;
+          has_chosen_type = 1;
+        }
+        else if (strcmp(optarg, "GPU") == 0)
+        {
+          flags |= F_USE_GPU;
+          has_chosen_type = 1;
+        }
+        else {
+          fprintf(stderr, "Invalid device type.\n");
+          return 1;
+        }
+        break;
+      case 'r':
+        num_r_steps = atoi(optarg);
+        break;
+      case 'j':
+        max_threads = atoi(optarg);
+        break;
+      case 'p':
+        sims_per_thread = atoi(optarg);
+        break;
+      case 'f':
+        num_frames = atoi(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (!has_chosen_type)
+  { //set defualt value
+    flags |= F_USE_GPU;
+  }
+
+  if (max_threads < 1 || sims_per_thread < 1 || num_frames < 1)
+  {
+    fprintf(stderr, "Invalid thread, simulation or frame count.\n");
+    return 1;
+  }
+
+  cl_uint num_domains = 0;
+  if (use_domains)
+  {
+    num_domains = count_fluid_domains(flags);
+    if (num_domains < 2)
+    {
+      fprintf(stderr, "The device does not split into NUMA domains.\n");
+      return 1;
+    }
+  }
+
+  // the whole device first, then one context per domain
+  int num_contexts = 1 + num_domains;
+  FluidContext ** contexts = (FluidContext **)calloc(num_contexts, sizeof(FluidContext *));
+  int is_ok = 1;
+  for (int i = 0; i < num_contexts && is_ok; i++)
+  {
+    contexts[i] = (i == 0) ? create_fluid_context(NULL, 0, flags) : create_fluid_context_in_domain(NULL, flags, i - 1);
+    is_ok = (contexts[i] != NULL);
+
+    // builds the program once so the first run does not pay for it
+    is_ok = is_ok && run_stress(&contexts[i], 1, 1, 1, 1, sim_size, num_r_steps, flags) != 0;
+  }
+
+  if (is_ok)
+  {
+    if (use_domains)
+    {
+      printf("%8s %12s %8s %16s %8s\n", "threads", "frames/s", "speedup", "domain frames/s", "gain");
+    }
+    else {
+      printf("%8s %12s %8s\n", "threads", "frames/s", "speedup");
+    }
+  }
+
+  double base_frames_per_second = 0;
+  for (int num_threads = 1; num_threads <= max_threads && is_ok; num_threads *= 2)
+  {
+    double frames_per_second = run_stress(contexts, 1, num_threads, sims_per_thread, num_frames, sim_size, num_r_steps, flags);
+    is_ok = (frames_per_second != 0);
+    if (num_threads == 1)
+    {
+      base_frames_per_second = frames_per_second;
+    }
+
+    if (is_ok && !use_domains)
+    {
+      printf("%8d %12.1f %7.2fx\n", num_threads, frames_per_second, frames_per_second / base_frames_per_second);
+    }
+    else if (is_ok)
+    {
+      // the threads take turns over the domains, so every domain is busy once there are as many threads
+      double domain_frames_per_second = run_stress(&contexts[1], num_domains, num_threads, sims_per_thread, num_frames, sim_size, num_r_steps, flags);
+      is_ok = (domain_frames_per_second != 0);
+      if (is_ok)
+      {
+        printf("%8d %12.1f %7.2fx %16.1f %7.2fx\n", num_threads, frames_per_second, frames_per_second / base_frames_per_second,
+               domain_frames_per_second, domain_frames_per_second / frames_per_second);
+      }
+    }
+  }
+
+  if (is_ok)
+  {
+    print_buffer_pool_stats(contexts[0]);
+  }
+  for (int i = 0; i < num_contexts; i++)
+  {
+    if (contexts[i])
+    {
+      destroy_fluid_context(contexts[i]);
+    }
+  }
+  free(contexts);
+
+  return is_ok ? 0 : 1;
+}